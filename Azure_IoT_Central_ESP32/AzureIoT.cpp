@@ -4,6 +4,8 @@
 #include "AzureIoT.h"
 #include <stdarg.h>
 
+#include "./src/flightRecorder.h"
+
 #include <az_precondition_internal.h>
 
 /* --- Function Returns --- */
@@ -28,7 +30,19 @@ log_function_t default_logging_function = NULL;
 #define PLAIN_SAS_SIGNATURE_BUFFER_SIZE 256
 #define SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE 32
 #define SAS_SIGNATURE_BUFFER_SIZE 64
-#define MQTT_PASSWORD_BUFFER_SIZE 512
+#define MQTT_PASSWORD_BUFFER_SIZE SAS_TOKEN_BUFFER_SIZE
+
+static_assert(
+    SAS_TOKEN_SCRATCH_BUFFER_SIZE
+        == PLAIN_SAS_SIGNATURE_BUFFER_SIZE + SAS_SIGNATURE_BUFFER_SIZE
+            + DECODED_SAS_KEY_BUFFER_SIZE + SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE,
+    "SAS_TOKEN_SCRATCH_BUFFER_SIZE must fit what generate_sas_token_for_iot_hub needs.");
+#define PROVISIONING_RESULT_FIELD_MAX_SIZE 128
+// Responses to properties document requests are told apart by message type, not request ID.
+#define PROPERTIES_DOCUMENT_REQUEST_ID "get"
+// Request ID the reported properties topic prefix is generated with, and how that topic must end.
+#define REPORTED_PROPERTIES_REQUEST_ID_PLACEHOLDER "0"
+#define REPORTED_PROPERTIES_TOPIC_END "?$rid=" REPORTED_PROPERTIES_REQUEST_ID_PLACEHOLDER
 
 #define DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN "{\"modelId\":\""
 #define DPS_REGISTER_CUSTOM_PAYLOAD_END "\"}"
@@ -48,9 +62,18 @@ log_function_t default_logging_function = NULL;
 #define EXIT_IF_AZ_FAILED(azresult, retcode, message, ...) \
   EXIT_IF_TRUE(az_result_failed(azresult), retcode, message, ##__VA_ARGS__)
 
+// State transitions are recorded in the flight recorder along with the line that made them.
+#define set_azure_iot_state(azure_iot, new_state) \
+  set_azure_iot_state_from_line(azure_iot, new_state, __LINE__)
+
 /* --- Internal function prototypes --- */
 static uint32_t get_current_unix_time();
 
+static void set_azure_iot_state_from_line(
+    azure_iot_t* azure_iot,
+    azure_iot_client_state_t new_state,
+    int line);
+
 static int generate_sas_token_for_dps(
     az_iot_provisioning_client* provisioning_client,
     az_span device_key,
@@ -82,6 +105,13 @@ static az_span generate_dps_register_custom_property(
     az_span data_buffer,
     az_span* remainder);
 
+static void precompute_sas_token(azure_iot_t* azure_iot);
+static int build_topic_prefixes(azure_iot_t* azure_iot);
+static int request_properties_document(azure_iot_t* azure_iot);
+
+static int load_provisioning_result(azure_iot_t* azure_iot);
+static void save_provisioning_result(azure_iot_t* azure_iot);
+
 #define is_device_provisioned(azure_iot)                                     \
   (!az_span_is_content_equal(azure_iot->config->iot_hub_fqdn, AZ_SPAN_EMPTY) \
    && !az_span_is_content_equal(azure_iot->config->device_id, AZ_SPAN_EMPTY))
@@ -133,7 +163,7 @@ void azure_iot_init(azure_iot_t* azure_iot, azure_iot_config_t* azure_iot_config
   (void)memset(azure_iot, 0, sizeof(azure_iot_t));
   azure_iot->config = azure_iot_config;
   azure_iot->data_buffer = azure_iot->config->data_buffer;
-  azure_iot->state = azure_iot_state_initialized;
+  set_azure_iot_state(azure_iot, azure_iot_state_initialized);
   azure_iot->dps_operation_id = AZ_SPAN_EMPTY;
 
   if (azure_iot->config->sas_token_lifetime_in_minutes == 0)
@@ -161,7 +191,9 @@ int azure_iot_start(azure_iot_t* azure_iot)
   else
   {
     // TODO: should only go to started if stopped or in error?
-    azure_iot->state = azure_iot_state_started;
+    azure_iot->is_refreshing_sas_token = false;
+    azure_iot->next_sas_token_length = 0; // The hub might not be the same.
+    set_azure_iot_state(azure_iot, azure_iot_state_started);
     result = RESULT_OK;
   }
 
@@ -186,13 +218,13 @@ int azure_iot_stop(azure_iot_t* azure_iot)
       if (azure_iot->config->mqtt_client_interface.mqtt_client_deinit(azure_iot->mqtt_client_handle)
           != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed deinitializing MQTT client.");
         result = RESULT_ERROR;
       }
       else
       {
-        azure_iot->state = azure_iot_state_initialized;
+        set_azure_iot_state(azure_iot, azure_iot_state_initialized);
         result = RESULT_OK;
       }
 
@@ -200,7 +232,7 @@ int azure_iot_stop(azure_iot_t* azure_iot)
     }
     else
     {
-      azure_iot->state = azure_iot_state_initialized;
+      set_azure_iot_state(azure_iot, azure_iot_state_initialized);
       result = RESULT_OK;
     }
   }
@@ -236,7 +268,7 @@ azure_iot_status_t azure_iot_get_status(azure_iot_t* azure_iot)
     case azure_iot_state_subscribed_to_pnp_props:
     case azure_iot_state_subscribing_to_pnp_writable_props:
     case azure_iot_state_refreshing_sas:
-      status = azure_iot_connecting;
+      status = azure_iot->is_refreshing_sas_token ? azure_iot_connected : azure_iot_connecting;
       break;
     case azure_iot_state_ready:
       status = azure_iot_connected;
@@ -290,13 +322,25 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
         // reserved for IoT Hub FQDN and Device ID previously provisioned.
         azure_iot->data_buffer = azure_iot->config->data_buffer;
 
-        result = get_mqtt_client_config_for_dps(azure_iot, &mqtt_client_config);
-        azure_iot->state = azure_iot_state_connecting_to_dps;
+        if (load_provisioning_result(azure_iot) == RESULT_OK)
+        {
+          LogInfo(
+              "Skipping device-provisioning, using %.*s provisioned before.",
+              az_span_size(azure_iot->config->iot_hub_fqdn),
+              az_span_ptr(azure_iot->config->iot_hub_fqdn));
+          result = get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config);
+          set_azure_iot_state(azure_iot, azure_iot_state_connecting_to_hub);
+        }
+        else
+        {
+          result = get_mqtt_client_config_for_dps(azure_iot, &mqtt_client_config);
+          set_azure_iot_state(azure_iot, azure_iot_state_connecting_to_dps);
+        }
       }
       else
       {
         result = get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config);
-        azure_iot->state = azure_iot_state_connecting_to_hub;
+        set_azure_iot_state(azure_iot, azure_iot_state_connecting_to_hub);
       }
 
       if (result != 0
@@ -304,7 +348,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
                  &mqtt_client_config, &azure_iot->mqtt_client_handle)
               != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed initializing MQTT client.");
         return;
       }
@@ -314,7 +358,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       break;
     case azure_iot_state_connected_to_dps:
       // Subscribe to DPS topic.
-      azure_iot->state = azure_iot_state_subscribing_to_dps;
+      set_azure_iot_state(azure_iot, azure_iot_state_subscribing_to_dps);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
           azure_iot->mqtt_client_handle,
@@ -323,7 +367,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed subscribing to Azure Device Provisioning respose topic.");
         return;
       }
@@ -342,7 +386,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed getting the DPS register topic: az_result return code 0x%08x.", azrc);
         return;
       }
@@ -352,7 +396,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       if (az_span_is_content_equal(mqtt_message.topic, AZ_SPAN_EMPTY)
           || az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed reserving memory for DPS register payload.");
         return;
       }
@@ -362,7 +406,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_span_is_content_equal(dps_register_custom_property, AZ_SPAN_EMPTY))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed generating DPS register custom property payload.");
         return;
       }
@@ -377,22 +421,23 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("az_iot_provisioning_client_get_request_payload failed (0x%08x).", azrc);
         return;
       }
 
       mqtt_message.payload = az_span_slice(mqtt_message.payload, 0, length);
       mqtt_message.qos = mqtt_qos_at_most_once;
+      mqtt_message.priority = mqtt_priority_high;
 
-      azure_iot->state = azure_iot_state_provisioning_waiting;
+      set_azure_iot_state(azure_iot, azure_iot_state_provisioning_waiting);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
           azure_iot->mqtt_client_handle, &mqtt_message);
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed publishing to DPS registration topic");
         return;
       }
@@ -403,7 +448,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (now == 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed getting current time for DPS query throttling");
         return;
       }
@@ -423,7 +468,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError(
             "Unable to get provisioning query status publish topic: az_result return code 0x%08x.",
             azrc);
@@ -433,8 +478,9 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       mqtt_message.topic = az_span_slice(azure_iot->data_buffer, 0, length + 1);
       mqtt_message.payload = AZ_SPAN_EMPTY;
       mqtt_message.qos = mqtt_qos_at_most_once;
+      mqtt_message.priority = mqtt_priority_high;
 
-      azure_iot->state = azure_iot_state_provisioning_waiting;
+      set_azure_iot_state(azure_iot, azure_iot_state_provisioning_waiting);
       azure_iot->dps_last_query_time = now;
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
@@ -442,7 +488,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed publishing to DPS status query topic");
         return;
       }
@@ -457,7 +503,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
                  azure_iot->mqtt_client_handle)
               != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed de-initializing MQTT client.");
         return;
       }
@@ -469,18 +515,18 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (result != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed getting MQTT client configuration for connecting to IoT Hub.");
         return;
       }
 
-      azure_iot->state = azure_iot_state_connecting_to_hub;
+      set_azure_iot_state(azure_iot, azure_iot_state_connecting_to_hub);
 
       if (azure_iot->config->mqtt_client_interface.mqtt_client_init(
               &mqtt_client_config, &azure_iot->mqtt_client_handle)
           != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed initializing MQTT client for IoT Hub connection.");
         return;
       }
@@ -489,7 +535,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
     case azure_iot_state_connecting_to_hub:
       break;
     case azure_iot_state_connected_to_hub:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_cmds;
+      set_azure_iot_state(azure_iot, azure_iot_state_subscribing_to_pnp_cmds);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
           azure_iot->mqtt_client_handle,
@@ -498,7 +544,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed subscribing to IoT Plug and Play commands topic.");
         return;
       }
@@ -507,7 +553,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
     case azure_iot_state_subscribing_to_pnp_cmds:
       break;
     case azure_iot_state_subscribed_to_pnp_cmds:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_props;
+      set_azure_iot_state(azure_iot, azure_iot_state_subscribing_to_pnp_props);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
           azure_iot->mqtt_client_handle,
@@ -516,7 +562,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed subscribing to IoT Plug and Play properties topic.");
         return;
       }
@@ -525,7 +571,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
     case azure_iot_state_subscribing_to_pnp_props:
       break;
     case azure_iot_state_subscribed_to_pnp_props:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_writable_props;
+      set_azure_iot_state(azure_iot, azure_iot_state_subscribing_to_pnp_writable_props);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
           azure_iot->mqtt_client_handle,
@@ -534,7 +580,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed subscribing to IoT Plug and Play writable properties topic.");
         return;
       }
@@ -548,24 +594,31 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (now == 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Failed getting current time for checking SAS token expiration.");
         return;
       }
       else if ((azure_iot->sas_token_expiration_time - now) < SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS)
       {
-        azure_iot->state = azure_iot_state_refreshing_sas;
+        azure_iot->is_refreshing_sas_token = true;
+        set_azure_iot_state(azure_iot, azure_iot_state_refreshing_sas);
         if (azure_iot->config->mqtt_client_interface.mqtt_client_deinit(
                 azure_iot->mqtt_client_handle)
             != 0)
         {
-          azure_iot->state = azure_iot_state_error;
+          set_azure_iot_state(azure_iot, azure_iot_state_error);
           LogError("Failed de-initializing MQTT client.");
           return;
         }
 
         azure_iot->mqtt_client_handle = NULL;
       }
+      else if (
+          (azure_iot->sas_token_expiration_time - now) < SAS_TOKEN_PRECOMPUTE_THRESHOLD_IN_SECS
+          && azure_iot->next_sas_token_expiration_time <= azure_iot->sas_token_expiration_time)
+      {
+        precompute_sas_token(azure_iot);
+      }
       break;
     case azure_iot_state_refreshing_sas:
       break;
@@ -576,30 +629,120 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 }
 
 int azure_iot_send_telemetry(azure_iot_t* azure_iot, az_span message)
+{
+  return azure_iot_send_telemetry_with_properties(azure_iot, message, NULL);
+}
+
+int azure_iot_message_properties_init(
+    azure_iot_message_properties_t* properties,
+    az_span buffer,
+    int32_t written_length)
+{
+  EXIT_IF_TRUE(
+      written_length < 0 || written_length > az_span_size(buffer),
+      RESULT_ERROR,
+      "Invalid length of message properties (%d).",
+      written_length);
+
+  properties->buffer = buffer;
+  properties->length = written_length;
+
+  return RESULT_OK;
+}
+
+int azure_iot_message_properties_append(
+    azure_iot_message_properties_t* properties,
+    az_span name,
+    az_span value)
+{
+  int32_t separator_length = properties->length > 0 ? 1 : 0;
+  int32_t required = separator_length + az_span_size(name) + 1 + az_span_size(value);
+  az_span remainder;
+
+  EXIT_IF_TRUE(
+      az_span_size(name) == 0 || required > az_span_size(properties->buffer) - properties->length,
+      RESULT_ERROR,
+      "Message property %.*s does not fit.",
+      az_span_size(name),
+      az_span_ptr(name));
+
+  remainder = az_span_slice_to_end(properties->buffer, properties->length);
+
+  if (separator_length > 0)
+  {
+    remainder = az_span_copy_u8(remainder, '&');
+  }
+
+  remainder = az_span_copy(remainder, name);
+  remainder = az_span_copy_u8(remainder, '=');
+  (void)az_span_copy(remainder, value);
+  properties->length += required;
+
+  return RESULT_OK;
+}
+
+az_span azure_iot_message_properties_get_span(const azure_iot_message_properties_t* properties)
+{
+  return az_span_slice(properties->buffer, 0, properties->length);
+}
+
+int azure_iot_send_telemetry_with_properties(
+    azure_iot_t* azure_iot,
+    az_span message,
+    const azure_iot_message_properties_t* properties)
+{
+  return azure_iot_send_telemetry_with_qos(
+      azure_iot, message, properties, mqtt_qos_at_most_once, mqtt_priority_normal, NULL);
+}
+
+int azure_iot_send_telemetry_with_qos(
+    azure_iot_t* azure_iot,
+    az_span message,
+    const azure_iot_message_properties_t* properties,
+    mqtt_qos_t qos,
+    mqtt_priority_t priority,
+    int* out_packet_id)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
   _az_PRECONDITION_VALID_SPAN(message, 1, false);
 
-  az_result azr;
-  size_t topic_length;
+  uint8_t topic[MQTT_TOPIC_BUFFER_SIZE];
+  az_span topic_remainder;
+  az_span properties_span = AZ_SPAN_EMPTY;
   mqtt_message_t mqtt_message;
 
-  azr = az_iot_hub_client_telemetry_get_publish_topic(
-      &azure_iot->iot_hub_client,
-      NULL,
-      (char*)az_span_ptr(azure_iot->data_buffer),
-      az_span_size(azure_iot->data_buffer),
-      &topic_length);
-  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the telemetry topic");
+  if (properties != NULL)
+  {
+    // Appended as az_iot_hub_client_telemetry_get_publish_topic does.
+    properties_span = azure_iot_message_properties_get_span(properties);
+  }
 
-  mqtt_message.topic = az_span_slice(azure_iot->data_buffer, 0, topic_length + 1);
+  EXIT_IF_TRUE(
+      azure_iot->telemetry_topic_prefix_length + az_span_size(properties_span) >= sizeof(topic),
+      RESULT_ERROR,
+      "Telemetry topic does not fit in buffer.");
+
+  topic_remainder = az_span_copy(
+      AZ_SPAN_FROM_BUFFER(topic),
+      az_span_create(
+          (uint8_t*)azure_iot->telemetry_topic_prefix, azure_iot->telemetry_topic_prefix_length));
+  topic_remainder = az_span_copy(topic_remainder, properties_span);
+  topic_remainder = az_span_copy_u8(topic_remainder, '\0');
+
+  mqtt_message.topic = az_span_create(topic, sizeof(topic) - az_span_size(topic_remainder));
   mqtt_message.payload = message;
-  mqtt_message.qos = mqtt_qos_at_most_once;
+  mqtt_message.qos = qos;
+  mqtt_message.priority = priority;
 
   int packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
       azure_iot->mqtt_client_handle, &mqtt_message);
   EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to telemetry topic");
 
+  if (out_packet_id != NULL)
+  {
+    *out_packet_id = packet_id;
+  }
+
   return RESULT_OK;
 }
 
@@ -609,27 +752,28 @@ int azure_iot_send_properties_update(azure_iot_t* azure_iot, uint32_t request_id
   _az_PRECONDITION_VALID_SPAN(message, 1, false);
 
   az_result azr;
-  size_t topic_length;
+  uint8_t topic[MQTT_TOPIC_BUFFER_SIZE];
+  az_span topic_remainder;
   mqtt_message_t mqtt_message;
-  az_span data_buffer = azure_iot->data_buffer;
-  az_span request_id_span = data_buffer;
 
-  azr = az_span_u32toa(request_id_span, request_id, &data_buffer);
-  EXIT_IF_TRUE(az_result_failed(azr), RESULT_ERROR, "Failed generating Twin request id.");
-  request_id_span = az_span_slice(
-      request_id_span, 0, az_span_size(request_id_span) - az_span_size(data_buffer));
+  // The request ID is the only part of the topic that changes.
+  topic_remainder = az_span_copy(
+      AZ_SPAN_FROM_BUFFER(topic),
+      az_span_create(
+          (uint8_t*)azure_iot->reported_properties_topic_prefix,
+          azure_iot->reported_properties_topic_prefix_length));
 
-  azr = az_iot_hub_client_properties_get_reported_publish_topic(
-      &azure_iot->iot_hub_client,
-      request_id_span,
-      (char*)az_span_ptr(data_buffer),
-      az_span_size(data_buffer),
-      &topic_length);
-  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the reported properties publish topic");
+  azr = az_span_u32toa(topic_remainder, request_id, &topic_remainder);
+  EXIT_IF_TRUE(
+      az_result_failed(azr) || az_span_size(topic_remainder) == 0,
+      RESULT_ERROR,
+      "Failed generating Twin request id.");
+  topic_remainder = az_span_copy_u8(topic_remainder, '\0');
 
-  mqtt_message.topic = az_span_slice(data_buffer, 0, topic_length);
+  mqtt_message.topic = az_span_create(topic, sizeof(topic) - az_span_size(topic_remainder));
   mqtt_message.payload = message;
   mqtt_message.qos = mqtt_qos_at_most_once;
+  mqtt_message.priority = mqtt_priority_high;
 
   int packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
       azure_iot->mqtt_client_handle, &mqtt_message);
@@ -648,48 +792,75 @@ int azure_iot_mqtt_client_connected(azure_iot_t* azure_iot)
   {
     if (!azure_iot->config->use_device_provisioning)
     {
-      azure_iot->state = azure_iot_state_error;
+      set_azure_iot_state(azure_iot, azure_iot_state_error);
       LogError("Invalid state, provisioning disabled in config.");
       result = RESULT_ERROR;
     }
     else
     {
-      azure_iot->state = azure_iot_state_connected_to_dps;
+      set_azure_iot_state(azure_iot, azure_iot_state_connected_to_dps);
       result = RESULT_OK;
     }
   }
   else if (azure_iot->state == azure_iot_state_connecting_to_hub)
   {
-    azure_iot->state = azure_iot_state_connected_to_hub;
+    azure_iot->is_provisioning_result_loaded = false; // Proven right.
+    set_azure_iot_state(azure_iot, azure_iot_state_connected_to_hub);
     result = RESULT_OK;
   }
   else
   {
     LogError("Unexpected mqtt client connection (%d).", azure_iot->state);
-    azure_iot->state = azure_iot_state_error;
+    set_azure_iot_state(azure_iot, azure_iot_state_error);
     result = RESULT_ERROR;
   }
 
   return result;
 }
 
+void azure_iot_mqtt_client_not_authorized(azure_iot_t* azure_iot)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  azure_iot->is_not_authorized = true;
+}
+
 int azure_iot_mqtt_client_disconnected(azure_iot_t* azure_iot)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
   int result;
+  bool is_not_authorized = azure_iot->is_not_authorized;
+
+  azure_iot->is_not_authorized = false;
 
   if (azure_iot->state == azure_iot_state_refreshing_sas)
   {
     // Moving the state to azure_iot_state_provisioned will cause this client to move
     // on to trying to connect to the Azure IoT Hub again.
-    azure_iot->state = azure_iot_state_provisioned;
+    set_azure_iot_state(azure_iot, azure_iot_state_provisioned);
+    result = RESULT_OK;
+  }
+  else if (
+      azure_iot->state == azure_iot_state_connecting_to_hub
+      && azure_iot->is_provisioning_result_loaded && is_not_authorized)
+  {
+    // The hub provisioned before refused the device, so device-provisioning is done again on the
+    // next start, in case the device was assigned elsewhere. Other failures (e.g., the network or
+    // the hub being down) are retried with the same hub.
+    LogError("The Azure IoT Hub provisioned before refused the device, erasing it.");
+    azure_iot->config->iot_hub_fqdn = AZ_SPAN_EMPTY;
+    azure_iot->config->device_id = AZ_SPAN_EMPTY;
+    azure_iot->is_provisioning_result_loaded = false;
+    save_provisioning_result(azure_iot);
+    set_azure_iot_state(azure_iot, azure_iot_state_initialized);
     result = RESULT_OK;
   }
   else
   {
     // MQTT client could disconnect at any time for any reason, it is an expected situation.
-    azure_iot->state = azure_iot_state_initialized;
+    azure_iot->is_refreshing_sas_token = false;
+    set_azure_iot_state(azure_iot, azure_iot_state_initialized);
     result = RESULT_OK;
   }
 
@@ -705,23 +876,30 @@ int azure_iot_mqtt_client_subscribe_completed(azure_iot_t* azure_iot, int packet
 
   if (azure_iot->state == azure_iot_state_subscribing_to_dps)
   {
-    azure_iot->state = azure_iot_state_subscribed_to_dps;
+    set_azure_iot_state(azure_iot, azure_iot_state_subscribed_to_dps);
     result = RESULT_OK;
   }
   else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_cmds)
   {
-    azure_iot->state = azure_iot_state_subscribed_to_pnp_cmds;
+    set_azure_iot_state(azure_iot, azure_iot_state_subscribed_to_pnp_cmds);
     result = RESULT_OK;
   }
   else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_props)
   {
-    azure_iot->state = azure_iot_state_subscribed_to_pnp_props;
+    set_azure_iot_state(azure_iot, azure_iot_state_subscribed_to_pnp_props);
     result = RESULT_OK;
   }
   else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_writable_props)
   {
-    azure_iot->state = azure_iot_state_ready;
+    azure_iot->is_refreshing_sas_token = false;
+    set_azure_iot_state(azure_iot, azure_iot_state_ready);
     result = RESULT_OK;
+
+    if (azure_iot->config->on_properties_document_received != NULL
+        && request_properties_document(azure_iot) != RESULT_OK)
+    {
+      LogError("Failed requesting the properties document, only updates will be received.");
+    }
   }
   else
   {
@@ -732,14 +910,14 @@ int azure_iot_mqtt_client_subscribe_completed(azure_iot_t* azure_iot, int packet
   return result;
 }
 
-/*
- * Currently unused.
- */
 int azure_iot_mqtt_client_publish_completed(azure_iot_t* azure_iot, int packet_id)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
-  (void)packet_id;
+  if (azure_iot->config->on_publish_completed != NULL)
+  {
+    azure_iot->config->on_publish_completed(packet_id);
+  }
 
   return RESULT_OK;
 }
@@ -770,7 +948,11 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
       {
         // A response from a property GET publish message with the property document as a payload.
         case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE:
-          result = RESULT_ERROR; // TODO: change to RESULT_OK once implemented.
+          if (azure_iot->config->on_properties_document_received != NULL)
+          {
+            azure_iot->config->on_properties_document_received(mqtt_message->payload);
+          }
+          result = RESULT_OK;
           break;
 
         // An update to the desired properties with the properties as a payload.
@@ -870,7 +1052,7 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
 
           if (az_span_is_content_equal(azure_iot->dps_operation_id, AZ_SPAN_EMPTY))
           {
-            azure_iot->state = azure_iot_state_error;
+            set_azure_iot_state(azure_iot, azure_iot_state_error);
             LogError("Failed reserving memory for DPS operation id.");
             result = RESULT_ERROR;
           }
@@ -879,7 +1061,7 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
         if (result == RESULT_OK)
         {
           azure_iot->dps_retry_after_seconds = register_response.retry_after_seconds;
-          azure_iot->state = azure_iot_state_provisioning_querying;
+          set_azure_iot_state(azure_iot, azure_iot_state_provisioning_querying);
         }
       }
       else if (register_response.operation_status == AZ_IOT_PROVISIONING_STATUS_ASSIGNED)
@@ -892,7 +1074,7 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
 
         if (az_span_is_content_equal(azure_iot->config->iot_hub_fqdn, AZ_SPAN_EMPTY))
         {
-          azure_iot->state = azure_iot_state_error;
+          set_azure_iot_state(azure_iot, azure_iot_state_error);
           LogError("Failed saving IoT Hub fqdn from provisioning.");
           result = RESULT_ERROR;
         }
@@ -903,21 +1085,22 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
 
           if (az_span_is_content_equal(azure_iot->config->device_id, AZ_SPAN_EMPTY))
           {
-            azure_iot->state = azure_iot_state_error;
+            set_azure_iot_state(azure_iot, azure_iot_state_error);
             LogError("Failed saving device id from provisioning.");
             result = RESULT_ERROR;
           }
           else
           {
             azure_iot->data_buffer = data_buffer;
-            azure_iot->state = azure_iot_state_provisioned;
+            save_provisioning_result(azure_iot);
+            set_azure_iot_state(azure_iot, azure_iot_state_provisioned);
             result = RESULT_OK;
           }
         }
       }
       else
       {
-        azure_iot->state = azure_iot_state_error;
+        set_azure_iot_state(azure_iot, azure_iot_state_error);
         LogError("Device provisisioning failed.");
         result = RESULT_OK;
       }
@@ -960,13 +1143,14 @@ int azure_iot_send_command_response(
   mqtt_message.topic = az_span_slice(mqtt_message.topic, 0, topic_length + 1);
   mqtt_message.payload = payload;
   mqtt_message.qos = mqtt_qos_at_most_once;
+  mqtt_message.priority = mqtt_priority_high;
 
   packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
       azure_iot->mqtt_client_handle, &mqtt_message);
 
   if (packet_id < 0)
   {
-    azure_iot->state = azure_iot_state_error;
+    set_azure_iot_state(azure_iot, azure_iot_state_error);
     LogError(
         "Failed publishing command response (%.*s).",
         az_span_size(request_id),
@@ -991,6 +1175,202 @@ static uint32_t get_current_unix_time()
   return (now == INDEFINITE_TIME ? 0 : (uint32_t)(now));
 }
 
+static void set_azure_iot_state_from_line(
+    azure_iot_t* azure_iot,
+    azure_iot_client_state_t new_state,
+    int line)
+{
+  if (azure_iot->state != new_state)
+  {
+    flight_recorder_record(
+        flight_recorder_event_azure_iot_state,
+        (uint8_t)azure_iot->state,
+        (uint16_t)new_state,
+        line);
+  }
+
+  azure_iot->state = new_state;
+}
+
+/*
+ * @brief           Requests the properties document from Azure IoT Hub, which comes back as a
+ *                  `AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE` message.
+ * @param[in]       azure_iot          A pointer to an instance of azure_iot_t connected to Azure
+ *                                     IoT Hub.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int request_properties_document(azure_iot_t* azure_iot)
+{
+  az_result azrc;
+  char topic[MQTT_TOPIC_BUFFER_SIZE];
+  size_t topic_length;
+  mqtt_message_t mqtt_message;
+
+  azrc = az_iot_hub_client_properties_document_get_publish_topic(
+      &azure_iot->iot_hub_client,
+      AZ_SPAN_FROM_STR(PROPERTIES_DOCUMENT_REQUEST_ID),
+      topic,
+      sizeof(topic),
+      &topic_length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get the properties document topic");
+
+  mqtt_message.topic = az_span_create((uint8_t*)topic, topic_length + 1);
+  mqtt_message.payload = AZ_SPAN_EMPTY;
+  mqtt_message.qos = mqtt_qos_at_most_once;
+  mqtt_message.priority = mqtt_priority_high;
+
+  int packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
+      azure_iot->mqtt_client_handle, &mqtt_message);
+  EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to properties document topic.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Generates the SAS token for the next connection to Azure IoT Hub, while the
+ *                  current one is still valid, so reconnecting does not wait for the HMAC and
+ *                  base64 computations.
+ * @remark          Tried once per SAS token. On failure the token is generated when reconnecting.
+ *                  Works in `next_sas_token_scratch`, as the MQTT client task is using
+ *                  `data_buffer` meanwhile.
+ *
+ * @param[in]       azure_iot          A pointer to an instance of azure_iot_t connected to Azure
+ *                                     IoT Hub.
+ */
+static void precompute_sas_token(azure_iot_t* azure_iot)
+{
+  int length;
+
+  // Marks the attempt even if the unix time can not be read below.
+  azure_iot->next_sas_token_expiration_time = azure_iot->sas_token_expiration_time + 1;
+
+  length = generate_sas_token_for_iot_hub(
+      &azure_iot->iot_hub_client,
+      azure_iot->config->device_key,
+      azure_iot->config->sas_token_lifetime_in_minutes,
+      AZ_SPAN_FROM_BUFFER(azure_iot->next_sas_token_scratch),
+      azure_iot->config->data_manipulation_functions,
+      AZ_SPAN_FROM_BUFFER(azure_iot->next_sas_token),
+      &azure_iot->next_sas_token_expiration_time);
+
+  if (length == 0)
+  {
+    LogError("Failed precomputing the next SAS token.");
+    azure_iot->next_sas_token_length = 0;
+  }
+  else
+  {
+    azure_iot->next_sas_token_length = length;
+  }
+}
+
+/*
+ * @brief           Builds the parts of the telemetry and reported properties topics that do not
+ *                  change while connected, so publishing only appends the message properties or
+ *                  the request ID.
+ * @param[in]       azure_iot          A pointer to an instance of azure_iot_t with the Azure IoT
+ *                                     Hub client initialized.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int build_topic_prefixes(azure_iot_t* azure_iot)
+{
+  az_result azrc;
+  size_t length;
+
+  azrc = az_iot_hub_client_telemetry_get_publish_topic(
+      &azure_iot->iot_hub_client,
+      NULL,
+      azure_iot->telemetry_topic_prefix,
+      sizeof(azure_iot->telemetry_topic_prefix),
+      &length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get the telemetry topic");
+  azure_iot->telemetry_topic_prefix_length = length;
+
+  // Generated with a placeholder request ID, which is then left out.
+  azrc = az_iot_hub_client_properties_get_reported_publish_topic(
+      &azure_iot->iot_hub_client,
+      AZ_SPAN_FROM_STR(REPORTED_PROPERTIES_REQUEST_ID_PLACEHOLDER),
+      azure_iot->reported_properties_topic_prefix,
+      sizeof(azure_iot->reported_properties_topic_prefix),
+      &length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get the reported properties publish topic");
+
+  // Publishing appends the request ID to the prefix, so the topic must end with it.
+  EXIT_IF_TRUE(
+      length < sizeof(REPORTED_PROPERTIES_TOPIC_END) - 1
+          || memcmp(
+                 azure_iot->reported_properties_topic_prefix + length
+                     - (sizeof(REPORTED_PROPERTIES_TOPIC_END) - 1),
+                 REPORTED_PROPERTIES_TOPIC_END,
+                 sizeof(REPORTED_PROPERTIES_TOPIC_END) - 1)
+              != 0,
+      RESULT_ERROR,
+      "Reported properties topic does not end with its request ID: %s",
+      azure_iot->reported_properties_topic_prefix);
+  azure_iot->reported_properties_topic_prefix_length
+      = length - (sizeof(REPORTED_PROPERTIES_REQUEST_ID_PLACEHOLDER) - 1);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Loads the Azure IoT Hub FQDN and device ID saved after a previous
+ * device-provisioning into the data buffer, reserving their space as device-provisioning does.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if there is no result saved or it does not fit.
+ */
+static int load_provisioning_result(azure_iot_t* azure_iot)
+{
+  uint8_t iot_hub_fqdn_buffer[PROVISIONING_RESULT_FIELD_MAX_SIZE];
+  uint8_t device_id_buffer[PROVISIONING_RESULT_FIELD_MAX_SIZE];
+  az_span iot_hub_fqdn = AZ_SPAN_FROM_BUFFER(iot_hub_fqdn_buffer);
+  az_span device_id = AZ_SPAN_FROM_BUFFER(device_id_buffer);
+  az_span data_buffer = azure_iot->config->data_buffer;
+
+  if (azure_iot->config->provisioning_result_interface.load == NULL
+      || azure_iot->config->provisioning_result_interface.load(&iot_hub_fqdn, &device_id) != 0
+      || az_span_size(iot_hub_fqdn) == 0 || az_span_size(device_id) == 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  azure_iot->config->iot_hub_fqdn = slice_and_copy_az_span(data_buffer, iot_hub_fqdn, &data_buffer);
+  azure_iot->config->device_id = slice_and_copy_az_span(data_buffer, device_id, &data_buffer);
+
+  if (az_span_is_content_equal(azure_iot->config->iot_hub_fqdn, AZ_SPAN_EMPTY)
+      || az_span_is_content_equal(azure_iot->config->device_id, AZ_SPAN_EMPTY))
+  {
+    azure_iot->config->iot_hub_fqdn = AZ_SPAN_EMPTY;
+    azure_iot->config->device_id = AZ_SPAN_EMPTY;
+    LogError("Failed reserving memory for the provisioning result saved.");
+    return RESULT_ERROR;
+  }
+
+  azure_iot->data_buffer = data_buffer;
+  azure_iot->is_provisioning_result_loaded = true;
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Saves the Azure IoT Hub FQDN and device ID in the config (erasing the saved ones
+ * if empty), if the user application provided a function for it.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ */
+static void save_provisioning_result(azure_iot_t* azure_iot)
+{
+  if (azure_iot->config->provisioning_result_interface.save != NULL
+      && azure_iot->config->provisioning_result_interface.save(
+             azure_iot->config->iot_hub_fqdn, azure_iot->config->device_id)
+          != 0)
+  {
+    LogError("Failed saving the provisioning result.");
+  }
+}
+
 /*
  * @brief           Initializes the Device Provisioning client and generates the config for an MQTT
  * client.
@@ -1113,6 +1493,11 @@ static int get_mqtt_client_config_for_iot_hub(
       &azure_iot->iot_hub_client_options);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to initialize Azure IoT Hub client.");
 
+  EXIT_IF_TRUE(
+      build_topic_prefixes(azure_iot) != RESULT_OK,
+      RESULT_ERROR,
+      "Failed building the topics for IoT Hub connection.");
+
   data_buffer_span = azure_iot->data_buffer;
 
   password_span = split_az_span(data_buffer_span, MQTT_PASSWORD_BUFFER_SIZE, &data_buffer_span);
@@ -1121,14 +1506,32 @@ static int get_mqtt_client_config_for_iot_hub(
       RESULT_ERROR,
       "Failed reserving buffer for password_span.");
 
-  password_length = generate_sas_token_for_iot_hub(
-      &azure_iot->iot_hub_client,
-      azure_iot->config->device_key,
-      azure_iot->config->sas_token_lifetime_in_minutes,
-      data_buffer_span,
-      azure_iot->config->data_manipulation_functions,
-      password_span,
-      &azure_iot->sas_token_expiration_time);
+  if (azure_iot->next_sas_token_length > 0
+      && ((int64_t)azure_iot->next_sas_token_expiration_time - get_current_unix_time())
+          > SAS_TOKEN_PRECOMPUTE_THRESHOLD_IN_SECS)
+  {
+    // Includes the null-terminator.
+    (void)memcpy(
+        az_span_ptr(password_span),
+        azure_iot->next_sas_token,
+        azure_iot->next_sas_token_length + 1);
+    password_length = azure_iot->next_sas_token_length;
+    azure_iot->sas_token_expiration_time = azure_iot->next_sas_token_expiration_time;
+  }
+  else
+  {
+    password_length = generate_sas_token_for_iot_hub(
+        &azure_iot->iot_hub_client,
+        azure_iot->config->device_key,
+        azure_iot->config->sas_token_lifetime_in_minutes,
+        data_buffer_span,
+        azure_iot->config->data_manipulation_functions,
+        password_span,
+        &azure_iot->sas_token_expiration_time);
+  }
+
+  azure_iot->next_sas_token_length = 0;
+
   EXIT_IF_TRUE(
       password_length == 0, RESULT_ERROR, "Failed creating mqtt password for IoT Hub connection.");
 
@@ -64,6 +64,13 @@ extern log_function_t default_logging_function;
 
 #define DEFAULT_SAS_TOKEN_LIFETIME_IN_MINUTES 60
 #define SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS 30
+// The next SAS token is generated this long before expiring, while still connected.
+#define SAS_TOKEN_PRECOMPUTE_THRESHOLD_IN_SECS (2 * SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS)
+#define SAS_TOKEN_BUFFER_SIZE 512
+// Working space for generating a SAS token: plain signature, signature, decoded key and HMAC.
+#define SAS_TOKEN_SCRATCH_BUFFER_SIZE (256 + 64 + 64 + 32)
+// Topics published to, including their variable part (message properties, request ID).
+#define MQTT_TOPIC_BUFFER_SIZE 256
 
 /*
  * The structures below define a generic interface to abstract the interaction of this module,
@@ -81,6 +88,17 @@ typedef enum mqtt_qos_t_enum
   mqtt_qos_exactly_once = MQTT_QOS_EXACTLY_ONCE
 } mqtt_qos_t;
 
+/*
+ * @brief     How urgently a message is to be published, for MQTT clients that hold messages
+ *            before publishing them (highest priority first).
+ */
+typedef enum mqtt_priority_t_enum
+{
+  mqtt_priority_high,
+  mqtt_priority_normal,
+  mqtt_priority_low
+} mqtt_priority_t;
+
 /*
  * @brief     Defines a generic MQTT message to be exchanged between the AzureIoT layer
  *            and the user application.
@@ -95,8 +113,21 @@ typedef struct mqtt_message_t_struct
   az_span topic;
   az_span payload;
   mqtt_qos_t qos;
+  mqtt_priority_t priority;
 } mqtt_message_t;
 
+/*
+ * @brief     Message properties of a telemetry message, serialized as they are appended to the
+ *            telemetry topic ("name=value&name=value", names and values already URL-encoded).
+ * @remark    Same format as `az_iot_message_properties`, whose serialized length is internal to
+ *            azure-sdk-for-c, so it is kept here instead.
+ */
+typedef struct azure_iot_message_properties_t_struct
+{
+  az_span buffer;
+  int32_t length;
+} azure_iot_message_properties_t;
+
 /*
  * @brief    Configuration structure passed by `mqtt_client_init_function_t` to the user
  *           application for initializing the actual MQTT client.
@@ -173,17 +204,19 @@ typedef int (*mqtt_client_deinit_function_t)(mqtt_client_handle_t mqtt_client_ha
  * @brief        Function to send an MQTT PUBLISH.
  * @remark       When this function is invoked, the caller expects the actual MQTT client
  * (referenced by `mqtt_client_handle`) to invoke the appropriate function in the MQTT client API to
- * publish an MQTT message.
+ * publish an MQTT message. The message may also be copied and published later (e.g., by another
+ * task, in the order of `priority`), in which case any ID the PUBACK is later reported with can be
+ * returned instead of the packet ID.
  *
  * @param[in]    mqtt_client_handle    A pointer to the instance of the MQTT client previously
  * created with `mqtt_client_init_function_t` function.
- * @param[in]    mqtt_message          A structure containing the topic name, payload and QoS to be
- * used to publish an actual MQTT message.
+ * @param[in]    mqtt_message          A structure containing the topic name, payload, QoS and
+ * priority to be used to publish an actual MQTT message.
  *
  * @return       int                   The packet ID on success, or NEGATIVE if any failure occurs.
  *                                     If the QoS in `mqtt_message` is:
  *                                     - AT LEAST ONCE, the Azure IoT client expects
- * `azure_iot_mqtt_client_connected` to be called once the MQTT client receives a PUBACK.
+ * `azure_iot_mqtt_client_publish_completed` to be called once the MQTT client receives a PUBACK.
  *                                     - AT MOST ONCE, there should be no PUBACK, so no further
  * action is needed for this PUBLISH.
  */
@@ -294,6 +327,36 @@ typedef struct data_manipulation_functions_t_struct
   hmac_sha256_encryption_function_t hmac_sha256_encrypt;
 } data_manipulation_functions_t;
 
+/*
+ * @brief        Function to load the Azure IoT Hub FQDN and device ID saved after a previous
+ *               device-provisioning (e.g., from non-volatile storage).
+ *
+ * @param[in,out]    iot_hub_fqdn    Buffer where to copy the Azure IoT Hub FQDN into. Set to the
+ * part of the buffer used.
+ * @param[in,out]    device_id       Buffer where to copy the device ID into. Set to the part of the
+ * buffer used.
+ *
+ * @return       int                 0 on success, or non-zero if there is no result saved.
+ */
+typedef int (*provisioning_result_load_function_t)(az_span* iot_hub_fqdn, az_span* device_id);
+
+/*
+ * @brief        Function to save the Azure IoT Hub FQDN and device ID given by device-provisioning,
+ *               to be loaded on the next start. Empty spans mean the saved result is to be erased.
+ *
+ * @return       int    0 on success, or non-zero if any failure occurs.
+ */
+typedef int (*provisioning_result_save_function_t)(az_span iot_hub_fqdn, az_span device_id);
+
+/*
+ * @brief    Structure that consolidates the functions keeping the device-provisioning result.
+ */
+typedef struct provisioning_result_interface_t_struct
+{
+  provisioning_result_load_function_t load;
+  provisioning_result_save_function_t save;
+} provisioning_result_interface_t;
+
 /*
  * @brief        Defines the callback for notifying the completion of a reported properties update.
  *
@@ -318,6 +381,17 @@ typedef void (*properties_update_completed_t)(uint32_t request_id, az_iot_status
  */
 typedef void (*properties_received_t)(az_span properties);
 
+/*
+ * @brief        Defines the callback for the completion of a QoS 1 (AT LEAST ONCE) publish.
+ * @remark       It is invoked from `azure_iot_mqtt_client_publish_completed`, so on whichever task
+ *               the MQTT client reports PUBACKs.
+ *
+ * @param[in]    packet_id      The packet ID returned when the message was published.
+ *
+ * @return                      Nothing.
+ */
+typedef void (*publish_completed_t)(int packet_id);
+
 /*
  * @brief    Structure containing all the details of a IoT Plug and Play Command.
  */
@@ -368,13 +442,15 @@ typedef enum azure_iot_status_t_struct
   azure_iot_disconnected,
   /*
    * @brief     The client is in an intermediate state between disconnected and connected.
-   * @remark    When using SAS-based authentication (default for Azure IoT Central), the client
-   *            will automatically perform a reconnection with a new SAS token after the previous
-   *            one expires, going back into `azure_iot_connecting` state briefly.
    */
   azure_iot_connecting,
   /*
-   * @brief    In this state the Azure IoT client is ready to be used for messaging.
+   * @brief     In this state the Azure IoT client is ready to be used for messaging.
+   * @remark    When using SAS-based authentication (default for Azure IoT Central), the client
+   *            automatically reconnects with a new SAS token before the previous one expires.
+   *            The status stays `azure_iot_connected` meanwhile, as messages sent then are for the
+   *            same Azure IoT Hub: the MQTT client is expected to hold them (see
+   *            `mqtt_client_publish_function_t`) until it is connected again.
    */
   azure_iot_connected,
   /*
@@ -567,6 +643,18 @@ typedef struct azure_iot_config_t_struct
    */
   data_manipulation_functions_t data_manipulation_functions;
 
+  /*
+   * @brief    Set of functions to keep the device-provisioning result across restarts.
+   * @remark   Optional, both can be NULL. If set, the Azure IoT Hub FQDN and device ID given by
+   *           device-provisioning are saved, and on the next start Azure IoT client connects to
+   *           that Azure IoT Hub right away, skipping device-provisioning. If that hub refuses
+   *           the device (`azure_iot_mqtt_client_not_authorized`, e.g., the device was moved to
+   *           another hub), the saved result is erased and device-provisioning is done again.
+   *           Other connection failures (e.g., the network or the hub being down) retry the same
+   *           hub.
+   */
+  provisioning_result_interface_t provisioning_result_interface;
+
   /*
    * @brief    Amount of minutes for which the MQTT password should be valid.
    * @remark   If set to zero, Azure IoT client sets it to the default value of 60 minutes.
@@ -592,6 +680,16 @@ typedef struct azure_iot_config_t_struct
    */
   properties_received_t on_properties_received;
 
+  /*
+   * @brief     Callback handler used by Azure IoT client to inform the user application of
+   *            the properties document (desired and reported properties) received from Azure IoT
+   *            Hub, which is requested every time the client connects so writable properties
+   *            changed while the device was offline (or before it booted) are handled as well.
+   * @remark    Optional. If NULL, the properties document is not requested. If IoT Plug and Play
+   *            is used, a response must be sent back for the writable properties applied.
+   */
+  properties_received_t on_properties_document_received;
+
   /*
    * @brief     Callback handler used by Azure IoT client to inform the user application of
    *            a device command received from Azure IoT Hub.
@@ -599,6 +697,13 @@ typedef struct azure_iot_config_t_struct
    *            `azure_iot_send_command_response`.
    */
   command_request_received_t on_command_request_received;
+
+  /*
+   * @brief     Callback handler used by Azure IoT client to inform the user application that a
+   *            message published with QoS 1 was acknowledged (PUBACK) by Azure IoT Hub.
+   * @remark    Optional, it can be NULL.
+   */
+  publish_completed_t on_publish_completed;
 } azure_iot_config_t;
 
 /*
@@ -621,6 +726,19 @@ typedef struct azure_iot_t_struct
   uint32_t dps_retry_after_seconds;
   uint32_t dps_last_query_time;
   az_span dps_operation_id;
+  bool is_provisioning_result_loaded;
+  bool is_not_authorized; // Set by azure_iot_mqtt_client_not_authorized.
+  bool is_refreshing_sas_token;
+  uint8_t next_sas_token[SAS_TOKEN_BUFFER_SIZE];
+  // Not `data_buffer`, which the MQTT client task uses meanwhile (e.g., for command responses).
+  uint8_t next_sas_token_scratch[SAS_TOKEN_SCRATCH_BUFFER_SIZE];
+  size_t next_sas_token_length; // Zero if not precomputed.
+  uint32_t next_sas_token_expiration_time;
+  // Built once per connection to Azure IoT Hub, without the part that varies per message.
+  char telemetry_topic_prefix[MQTT_TOPIC_BUFFER_SIZE];
+  size_t telemetry_topic_prefix_length;
+  char reported_properties_topic_prefix[MQTT_TOPIC_BUFFER_SIZE];
+  size_t reported_properties_topic_prefix_length;
 } azure_iot_t;
 
 /*
@@ -702,6 +820,39 @@ azure_iot_status_t azure_iot_get_status(azure_iot_t* azure_iot);
  */
 void azure_iot_do_work(azure_iot_t* azure_iot);
 
+/*
+ * @brief        Initializes message properties in `buffer`, which may already hold some.
+ *
+ * @param[out]   properties        The message properties to initialize.
+ * @param[in]    buffer            Where the properties are serialized. It must outlive them.
+ * @param[in]    written_length    Length of the properties already serialized in `buffer`.
+ *
+ * @return       int               0 on success, non-zero if `written_length` is out of `buffer`.
+ */
+int azure_iot_message_properties_init(
+    azure_iot_message_properties_t* properties,
+    az_span buffer,
+    int32_t written_length);
+
+/*
+ * @brief        Appends a property to message properties.
+ *
+ * @param[in]    properties    The message properties to append to.
+ * @param[in]    name          Name of the property, URL-encoded.
+ * @param[in]    value         Value of the property, URL-encoded.
+ *
+ * @return       int           0 on success, non-zero if the property does not fit.
+ */
+int azure_iot_message_properties_append(
+    azure_iot_message_properties_t* properties,
+    az_span name,
+    az_span value);
+
+/*
+ * @brief        Gets the serialized message properties.
+ */
+az_span azure_iot_message_properties_get_span(const azure_iot_message_properties_t* properties);
+
 /*
  * @brief        Sends a telemetry payload to the Azure IoT Hub.
  *
@@ -714,6 +865,52 @@ void azure_iot_do_work(azure_iot_t* azure_iot);
  */
 int azure_iot_send_telemetry(azure_iot_t* azure_iot, az_span message);
 
+/*
+ * @brief        Sends a telemetry payload to the Azure IoT Hub, along with message properties.
+ * @remark       Message properties are how system properties like the content type (`$.ct`) and
+ *               content encoding (`$.ce`) of the message, as well as any application properties,
+ *               are passed on to Azure IoT Hub.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[in]    message       An az_span instance containing the buffer and size of the actual
+ * message to be sent.
+ * @param[in]    properties    The properties of the message (see
+ * `azure_iot_message_properties_t`), or NULL if the message has no properties.
+ *
+ * @return       int           0 on success, or non-zero if any failure occurs.
+ */
+int azure_iot_send_telemetry_with_properties(
+    azure_iot_t* azure_iot,
+    az_span message,
+    const azure_iot_message_properties_t* properties);
+
+/*
+ * @brief        Sends a telemetry payload to the Azure IoT Hub, with message properties and the
+ *               given QoS and priority.
+ * @remark       With QoS 1 (AT LEAST ONCE), `on_publish_completed` (set in azure_iot_config_t) is
+ *               invoked with `out_packet_id` once Azure IoT Hub acknowledges the message.
+ *
+ * @param[in]    azure_iot        A pointer to the instance of `azure_iot_t` previously initialized
+ * by the caller.
+ * @param[in]    message          An az_span instance containing the buffer and size of the actual
+ * message to be sent.
+ * @param[in]    properties       The properties of the message (see
+ * `azure_iot_message_properties_t`), or NULL if the message has no properties.
+ * @param[in]    qos              MQTT QoS to publish the message with.
+ * @param[in]    priority         Priority of the message against others waiting to be published.
+ * @param[out]   out_packet_id    The packet ID of the PUBLISH, or NULL if not needed.
+ *
+ * @return       int              0 on success, or non-zero if any failure occurs.
+ */
+int azure_iot_send_telemetry_with_qos(
+    azure_iot_t* azure_iot,
+    az_span message,
+    const azure_iot_message_properties_t* properties,
+    mqtt_qos_t qos,
+    mqtt_priority_t priority,
+    int* out_packet_id);
+
 /**
  * @brief        Sends a property update message to Azure IoT Hub.
  *
@@ -779,6 +976,19 @@ int azure_iot_mqtt_client_connected(azure_iot_t* azure_iot);
  */
 int azure_iot_mqtt_client_disconnected(azure_iot_t* azure_iot);
 
+/*
+ * @brief        Informs the Azure IoT client that the service refused the MQTT connection for its
+ *               credentials (CONNACK with "bad user name or password" or "not authorized").
+ * @remark       This must be called before `azure_iot_mqtt_client_disconnected` for the same
+ * connection attempt. Only then is an IoT Hub provisioned before (see
+ * `azure_iot_config_t.use_device_provisioning`) taken as no longer assigned to the device, and
+ * device-provisioning done again; any other failure connecting to it is retried as is.
+ *
+ * @param[in]    azure_iot    A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ */
+void azure_iot_mqtt_client_not_authorized(azure_iot_t* azure_iot);
+
 /*
  * @brief        Informs the Azure IoT client that the MQTT client has subscribed to a topic.
  * @remark       This must be called after Azure IoT client invokes the `mqtt_client_subscribe`
@@ -46,10 +46,13 @@
 #include "./src/weidosTasks.h"
 #include <Ethernet.h>
 
-#include <SDLoggerAzure.h>
-char mainDirectory[] = "sysLog/modules/main";
-char mainFilename[]= "main.txt";
-SDLoggerClass mainLogger(mainDirectory,mainFilename);
+#include "./src/asyncLog.h"
+#include "./src/tokenizedLog.h"
+#include "./src/flightRecorder.h"
+#include "./src/outbox.h"
+#include "./src/reconnectBackoff.h"
+static async_log_file_t mainLogFile = ASYNC_LOG_FILE("sysLog/modules/main", "main.txt");
+static async_log_file_t mainTokenizedLogFile = ASYNC_LOG_FILE("sysLog/modules/main", "main.bin");
 
 // C99 libraries
 #include <cstdarg>
@@ -66,6 +69,13 @@ SDLoggerClass mainLogger(mainDirectory,mainFilename);
 #include <WiFi.h>
 #include <mqtt_client.h>
 
+// Event groups and timers, for waking the main loop.
+#include <freertos/event_groups.h>
+#include <freertos/timers.h>
+
+// Non-volatile storage, for the device-provisioning result.
+#include <Preferences.h>
+
 // Azure IoT SDK for C includes
 #include <az_core.h>
 #include <az_iot.h>
@@ -92,6 +102,29 @@ SDLoggerClass mainLogger(mainDirectory,mainFilename);
 #define UNIX_TIME_NOV_13_2017 1510592825
 #define UNIX_EPOCH_START_YEAR 1900
 
+/* --- Main Loop Settings --- */
+// Events `loop()` waits for, instead of polling.
+#define LOOP_EVENT_MQTT (1 << 0) // Any MQTT client event (connection, data, PUBACK, ...).
+#define LOOP_EVENT_LINK (1 << 1) // Any WiFi or Ethernet event (link up or down, IP, ...).
+#define LOOP_EVENT_TICK (1 << 2) // Periodic deadline (telemetry period, DPS retries, ...).
+#define LOOP_EVENT_OUTBOX (1 << 3) // A message left the outbox, so there is room for another.
+#define LOOP_EVENT_WORK (1 << 4) // The Azure IoT client changed state, so it has more to do.
+#define LOOP_EVENT_ALL \
+  (LOOP_EVENT_MQTT | LOOP_EVENT_LINK | LOOP_EVENT_TICK | LOOP_EVENT_OUTBOX | LOOP_EVENT_WORK)
+
+// Telemetry period and the other deadlines are in seconds.
+#define LOOP_TICK_PERIOD_IN_MS 1000
+#define LOOP_STATISTICS_PERIOD_IN_MS (5 * 60 * 1000)
+
+/* --- Reconnection Settings --- */
+// Delays between attempts grow from the base one up to the max one (see src/reconnectBackoff.h).
+#define WIFI_RECONNECT_BASE_DELAY_IN_MS 5000
+#define WIFI_RECONNECT_MAX_DELAY_IN_MS (2 * 60 * 1000)
+#define AZURE_IOT_RECONNECT_BASE_DELAY_IN_MS 2000
+#define AZURE_IOT_RECONNECT_MAX_DELAY_IN_MS (5 * 60 * 1000)
+// A connection must stay up this long for the delays to start over from the base one once lost.
+#define RECONNECT_STABLE_TIME_IN_MS (60 * 1000)
+
 /* --- Function Returns --- */
 #define RESULT_OK 0
 #define RESULT_ERROR __LINE__
@@ -103,7 +136,14 @@ static const char* wifi_password = IOT_CONFIG_WIFI_PASSWORD;
 /* --- Function Declarations --- */
 static void sync_device_clock_with_ntp_server();
 static void connect_to_wifi();
+static void on_wifi_connected();
 static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event);
+static void log_mqtt_connect_measurement();
+static void wake_main_loop(EventBits_t events);
+static void on_loop_tick(TimerHandle_t timer);
+static void on_network_event(WiFiEvent_t event);
+static void wait_for_loop_events();
+static void log_loop_statistics();
 
 // This is a logging function used by Azure IoT client.
 static void logging_function(log_level_t log_level, char const* const format, ...);
@@ -115,15 +155,41 @@ static esp_mqtt_client_handle_t mqtt_client;
 
 static char mqtt_broker_uri[128];
 
+// Start of the MQTT connection in progress (TCP, TLS handshake and MQTT CONNECT), for measuring
+// its time and heap use. Every connection after the first to the same hub (e.g. each SAS token
+// refresh) does a full TLS handshake again, as the ESP32 core gives no way to resume TLS sessions.
+static unsigned long mqtt_connect_start_time = 0;
+static uint32_t mqtt_connect_start_free_heap = 0;
+static uint32_t mqtt_connect_start_minimum_free_heap = 0;
+static uint32_t mqtt_connect_count = 0;
+
+static EventGroupHandle_t loop_events = NULL;
+static TimerHandle_t loop_tick_timer = NULL;
+
+// Time `loop()` spent working rather than waiting, since `loop_statistics_start_time`.
+static unsigned long loop_statistics_start_time = 0;
+static unsigned long loop_busy_time_in_us = 0;
+static uint32_t loop_wake_count = 0;
+
 #define AZ_IOT_DATA_BUFFER_SIZE 1500
 static uint8_t az_iot_data_buffer[AZ_IOT_DATA_BUFFER_SIZE];
 
 #define MQTT_PROTOCOL_PREFIX "mqtts://"
 
+#define PROVISIONING_RESULT_NAMESPACE "provisioning"
+#define PROVISIONING_RESULT_KEY_ID_SCOPE "idScope"
+#define PROVISIONING_RESULT_KEY_REGISTRATION_ID "registrationId"
+#define PROVISIONING_RESULT_KEY_IOT_HUB_FQDN "iotHubFqdn"
+#define PROVISIONING_RESULT_KEY_DEVICE_ID "deviceId"
+
 static uint32_t properties_request_id = 0;
 static bool send_device_info = true;
 static bool azure_initial_connect = false; //Turns true when ESP32 successfully connects to Azure IoT Central for the first time
 
+static reconnect_backoff_t wifi_backoff;
+static reconnect_backoff_t azure_iot_backoff; // Connecting to DPS and IoT Hub.
+static bool is_wifi_connected = false;
+
 /* --- MQTT Interface Functions --- */
 /*
  * These functions are used by Azure IoT to interact with whatever MQTT client used by the sample
@@ -162,7 +228,8 @@ static int mqtt_client_init_function(
 
   mqtt_config.keepalive = 30;
   mqtt_config.disable_clean_session = 0;
-  mqtt_config.disable_auto_reconnect = false;
+  // Reconnecting is left to `azure_iot_backoff`, rather than retried at a fixed interval.
+  mqtt_config.disable_auto_reconnect = true;
   mqtt_config.event_handle = esp_mqtt_event_handler;
   mqtt_config.user_context = NULL;
   mqtt_config.cert_pem = (const char*)ca_pem;
@@ -205,6 +272,17 @@ static int mqtt_client_deinit_function(mqtt_client_handle_t mqtt_client_handle)
 
   LogInfo("MQTT client being disconnected.");
 
+  outbox_set_connected(false);
+  outbox_release_client();
+
+  // Messages not published yet were meant for this connection (e.g., DPS rather than IoT Hub),
+  // except when only reconnecting to the same hub with a new SAS token. Telemetry is kept either
+  // way, handed back to be stored in the telemetry queue (see azure_pnp_send_telemetry).
+  if (azure_iot.state != azure_iot_state_refreshing_sas)
+  {
+    outbox_clear();
+  }
+
   if (esp_mqtt_client_stop(esp_mqtt_client_handle) != ESP_OK)
   {
     LogError("Failed stopping MQTT client.");
@@ -244,28 +322,75 @@ static int mqtt_client_subscribe_function(
 
 /*
  * See the documentation of `mqtt_client_publish_function_t` in AzureIoT.h for details.
+ * Messages are copied to the outbox (see src/outbox.h), and published by its task with
+ * `outbox_publish_function`, so the caller does not wait for the MQTT client.
  */
 static int mqtt_client_publish_function(
     mqtt_client_handle_t mqtt_client_handle,
     mqtt_message_t* mqtt_message)
 {
-  LogInfo("MQTT client publishing to '%s'", az_span_ptr(mqtt_message->topic));
-
-  int mqtt_result = esp_mqtt_client_publish(
-      (esp_mqtt_client_handle_t)mqtt_client_handle,
-      (const char*)az_span_ptr(mqtt_message->topic), // topic is always null-terminated.
-      (const char*)az_span_ptr(mqtt_message->payload),
-      az_span_size(mqtt_message->payload),
-      (int)mqtt_message->qos,
-      MQTT_DO_NOT_RETAIN_MSG);
+  outbox_class_t message_class;
 
-  if (mqtt_result == -1)
+  (void)mqtt_client_handle; // The outbox publishes with `mqtt_client`.
+
+  switch (mqtt_message->priority)
   {
-    return RESULT_ERROR;
+    case mqtt_priority_high:
+      message_class = outbox_class_alarm;
+      break;
+    case mqtt_priority_low:
+      message_class = outbox_class_diagnostics;
+      break;
+    default:
+      message_class = outbox_class_telemetry;
+      break;
   }
-  else
+
+  // The outbox message id is what the PUBACK is reported with (see on_outbox_message_completed).
+  int message_id = outbox_post(
+      message_class, mqtt_message->topic, mqtt_message->payload, (int)mqtt_message->qos);
+
+  if (message_id < 0)
   {
-    return RESULT_OK;
+    LogError(
+        "No room in the outbox for a message to '%.*s'.",
+        az_span_size(mqtt_message->topic),
+        az_span_ptr(mqtt_message->topic));
+  }
+
+  return message_id;
+}
+
+/*
+ * See the documentation of `outbox_publish_t` in src/outbox.h for details.
+ */
+static int outbox_publish_function(const char* topic, az_span payload, int qos)
+{
+  LogInfo("MQTT client publishing to '%s'", topic);
+
+  // The message id is the packet id (zero for QoS 0), or -1 on failure.
+  int message_id = esp_mqtt_client_publish(
+      mqtt_client,
+      topic,
+      az_span_size(payload) > 0 ? (const char*)az_span_ptr(payload) : NULL,
+      az_span_size(payload),
+      qos,
+      MQTT_DO_NOT_RETAIN_MSG);
+
+  // Producers waiting for room (e.g., forwarding queued telemetry) can post the next message.
+  wake_main_loop(LOOP_EVENT_OUTBOX);
+
+  return message_id;
+}
+
+/*
+ * See the documentation of `outbox_completed_t` in src/outbox.h for details.
+ */
+static void on_outbox_message_completed(int message_id)
+{
+  if (azure_iot_mqtt_client_publish_completed(&azure_iot, message_id) != 0)
+  {
+    LogError("azure_iot_mqtt_client_publish_completed failed (message id=%d).", message_id);
   }
 }
 
@@ -322,6 +447,80 @@ static int base64_encode(
   return mbedtls_base64_encode(encoded, encoded_size, encoded_length, data, data_length);
 }
 
+/*
+ * See the documentation of `provisioning_result_load_function_t` in AzureIoT.h for details.
+ * The result is kept in NVS, along with the ID scope and registration ID it was provisioned with,
+ * so it is not used once those change.
+ */
+static int load_provisioning_result(az_span* iot_hub_fqdn, az_span* device_id)
+{
+  Preferences preferences;
+  size_t iot_hub_fqdn_length = 0;
+  size_t device_id_length = 0;
+
+  if (!preferences.begin(PROVISIONING_RESULT_NAMESPACE, true))
+  {
+    return RESULT_ERROR;
+  }
+
+  if (preferences.getString(PROVISIONING_RESULT_KEY_ID_SCOPE, "") == DPS_ID_SCOPE
+      && preferences.getString(PROVISIONING_RESULT_KEY_REGISTRATION_ID, "") == IOT_CONFIG_DEVICE_ID)
+  {
+    iot_hub_fqdn_length = preferences.getBytes(
+        PROVISIONING_RESULT_KEY_IOT_HUB_FQDN, az_span_ptr(*iot_hub_fqdn), az_span_size(*iot_hub_fqdn));
+    device_id_length = preferences.getBytes(
+        PROVISIONING_RESULT_KEY_DEVICE_ID, az_span_ptr(*device_id), az_span_size(*device_id));
+  }
+
+  preferences.end();
+
+  if (iot_hub_fqdn_length == 0 || device_id_length == 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  *iot_hub_fqdn = az_span_slice(*iot_hub_fqdn, 0, iot_hub_fqdn_length);
+  *device_id = az_span_slice(*device_id, 0, device_id_length);
+
+  return RESULT_OK;
+}
+
+/*
+ * See the documentation of `provisioning_result_save_function_t` in AzureIoT.h for details.
+ */
+static int save_provisioning_result(az_span iot_hub_fqdn, az_span device_id)
+{
+  Preferences preferences;
+  bool is_saved;
+
+  if (!preferences.begin(PROVISIONING_RESULT_NAMESPACE, false))
+  {
+    return RESULT_ERROR;
+  }
+
+  if (az_span_size(iot_hub_fqdn) == 0 || az_span_size(device_id) == 0)
+  {
+    is_saved = preferences.clear();
+  }
+  else
+  {
+    is_saved = preferences.putString(PROVISIONING_RESULT_KEY_ID_SCOPE, DPS_ID_SCOPE) > 0
+        && preferences.putString(PROVISIONING_RESULT_KEY_REGISTRATION_ID, IOT_CONFIG_DEVICE_ID) > 0
+        && preferences.putBytes(
+               PROVISIONING_RESULT_KEY_IOT_HUB_FQDN,
+               az_span_ptr(iot_hub_fqdn),
+               az_span_size(iot_hub_fqdn))
+            > 0
+        && preferences.putBytes(
+               PROVISIONING_RESULT_KEY_DEVICE_ID, az_span_ptr(device_id), az_span_size(device_id))
+            > 0;
+  }
+
+  preferences.end();
+
+  return is_saved ? RESULT_OK : RESULT_ERROR;
+}
+
 /*
  * See the documentation of `properties_update_completed_t` in AzureIoT.h for details.
  */
@@ -345,6 +544,21 @@ void on_properties_received(az_span properties)
   }
 }
 
+/*
+ * See the documentation of `properties_received_t` in AzureIoT.h for details.
+ */
+static void on_properties_document_received(az_span properties_document)
+{
+  LogInfo("Properties document received (%d bytes).", az_span_size(properties_document));
+
+  if (azure_pnp_handle_properties_document(
+          &azure_iot, properties_document, properties_request_id++)
+      != 0)
+  {
+    LogError("Failed handling properties document.");
+  }
+}
+
 /*
  * See the documentation of `command_request_received_t` in AzureIoT.h for details.
  */
@@ -406,9 +620,18 @@ static void configure_azure_iot(){
   azure_iot_config.data_manipulation_functions.hmac_sha256_encrypt = mbedtls_hmac_sha256;
   azure_iot_config.data_manipulation_functions.base64_decode = base64_decode;
   azure_iot_config.data_manipulation_functions.base64_encode = base64_encode;
+#ifdef PROVISIONING_RESULT_CACHE_ENABLED
+  azure_iot_config.provisioning_result_interface.load = load_provisioning_result;
+  azure_iot_config.provisioning_result_interface.save = save_provisioning_result;
+#else
+  azure_iot_config.provisioning_result_interface.load = NULL;
+  azure_iot_config.provisioning_result_interface.save = NULL;
+#endif // PROVISIONING_RESULT_CACHE_ENABLED
   azure_iot_config.on_properties_update_completed = on_properties_update_completed;
   azure_iot_config.on_properties_received = on_properties_received;
+  azure_iot_config.on_properties_document_received = on_properties_document_received;
   azure_iot_config.on_command_request_received = on_command_request_received;
+  azure_iot_config.on_publish_completed = azure_pnp_handle_publish_completed;
 
   azure_iot_init(&azure_iot, &azure_iot_config);
 
@@ -419,42 +642,125 @@ static void configure_azure_iot(){
 void setup()
 {
   Serial.begin(SERIAL_LOGGER_BAUD_RATE);
+
+  if (async_log_init() != 0)
+  {
+    Serial.println("Log files will not be written to the SD card.");
+  }
+
+  // Before anything else is recorded, so the trace of the previous run is kept.
+  flight_recorder_init();
+
   set_logging_function(logging_function);
   LogInfo("Starting the setup code for %s", DEVICE_NAME);
   weidosSetup();
-  connect_to_wifi();
+
+  reconnect_backoff_init(
+      &wifi_backoff,
+      "WiFi",
+      WIFI_RECONNECT_BASE_DELAY_IN_MS,
+      WIFI_RECONNECT_MAX_DELAY_IN_MS,
+      RECONNECT_STABLE_TIME_IN_MS);
+  reconnect_backoff_init(
+      &azure_iot_backoff,
+      "Azure IoT",
+      AZURE_IOT_RECONNECT_BASE_DELAY_IN_MS,
+      AZURE_IOT_RECONNECT_MAX_DELAY_IN_MS,
+      RECONNECT_STABLE_TIME_IN_MS);
+
+  // The clock can only be set once connected.
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    connect_to_wifi();
+    delay(500);
+    Serial.print(":");
+  }
+
+  Serial.println("");
+  on_wifi_connected();
   sync_device_clock_with_ntp_server();
 
+  if (outbox_init(outbox_publish_function, on_outbox_message_completed) != 0)
+  {
+    LogError("Failed starting the outbox, no messages will be published.");
+  }
+
   azure_pnp_init();
 
+  // Started by `loop()`, after the phase offset of the device (see src/reconnectBackoff.h), so a
+  // fleet powered up at once does not connect at once.
   configure_azure_iot();
-  azure_iot_start(&azure_iot);
 
   LogInfo("Azure IoT client initialized (state=%d)", azure_iot.state);
-}
 
+  loop_events = xEventGroupCreate();
+  loop_tick_timer = xTimerCreate(
+      "loopTick", pdMS_TO_TICKS(LOOP_TICK_PERIOD_IN_MS), pdTRUE, NULL, on_loop_tick);
 
+  if (loop_events == NULL || loop_tick_timer == NULL
+      || xTimerStart(loop_tick_timer, portMAX_DELAY) != pdPASS)
+  {
+    LogError("Failed creating the main loop events, the main loop polls instead.");
+  }
+  else
+  {
+    WiFi.onEvent(on_network_event);
+    loop_statistics_start_time = millis();
+  }
+
+  // Runs the first pass right away.
+  wake_main_loop(LOOP_EVENT_ALL);
+}
 
 void loop()
 {
+  azure_iot_client_state_t initial_state;
+  unsigned long wake_time;
+
+  wait_for_loop_events();
+  wake_time = micros();
+  initial_state = azure_iot.state;
+
   Ethernet.maintain();
-  
-  if (WiFi.status() != WL_CONNECTED)
+
+  // Samples keep being taken while offline, to be stored and forwarded once connected again.
+  if (azure_iot_get_status(&azure_iot) != azure_iot_connected
+      && azure_pnp_send_telemetry(&azure_iot) != 0)
   {
-    if (azure_iot.state != azure_iot_state_not_initialized) azure_iot_stop(&azure_iot);
+    LogError("Failed storing telemetry while offline.");
+  }
 
-    connect_to_wifi();
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    is_wifi_connected = false;
 
-    if (!azure_initial_connect) configure_azure_iot();
+    if (azure_iot_get_status(&azure_iot) != azure_iot_disconnected)
+    {
+      azure_iot_stop(&azure_iot);
+    }
 
-    azure_iot_start(&azure_iot);
+    connect_to_wifi();
   }
   else
   {
+    if (!is_wifi_connected)
+    {
+      on_wifi_connected();
+
+      if (!azure_initial_connect) configure_azure_iot();
+    }
+
     switch (azure_iot_get_status(&azure_iot))
     {
       case azure_iot_connected:
-        if (!azure_initial_connect) azure_initial_connect = true;
+        // Counts from the first pass, delays only start over once the connection is stable.
+        reconnect_backoff_set_connected(&azure_iot_backoff);
+
+        if (!azure_initial_connect)
+        {
+          azure_initial_connect = true;
+          LogInfo("Connected to Azure IoT Hub %lu ms after boot.", millis());
+        }
         
         if (send_device_info)
         {
@@ -472,8 +778,14 @@ void loop()
         azure_iot_stop(&azure_iot);
         break;
       case azure_iot_disconnected:
-        //azure_iot_start(&azure_iot);
-        WiFi.disconnect();
+        // Not started yet, stopped on an error or the MQTT client disconnected.
+        if (reconnect_backoff_is_due(&azure_iot_backoff))
+        {
+          reconnect_backoff_attempted(&azure_iot_backoff);
+          (void)azure_iot_stop(&azure_iot); // Releases the MQTT client of the last connection.
+          azure_iot_start(&azure_iot);
+        }
+
         break;
       default:
         break;
@@ -481,6 +793,15 @@ void loop()
 
     azure_iot_do_work(&azure_iot);
   }
+
+  if (azure_iot.state != initial_state)
+  {
+    // Steps like initializing the MQTT client right after starting do not wait for any event.
+    wake_main_loop(LOOP_EVENT_WORK);
+  }
+
+  loop_busy_time_in_us += micros() - wake_time;
+  log_loop_statistics();
 }
 
 /* === Function Implementations === */
@@ -491,6 +812,73 @@ void loop()
  * and logging.
  */
 
+/* --- Main Loop Events --- */
+static void wake_main_loop(EventBits_t events)
+{
+  if (loop_events != NULL)
+  {
+    (void)xEventGroupSetBits(loop_events, events);
+  }
+}
+
+static void on_loop_tick(TimerHandle_t timer)
+{
+  (void)timer;
+  wake_main_loop(LOOP_EVENT_TICK);
+}
+
+static void on_network_event(WiFiEvent_t event)
+{
+  (void)event;
+  wake_main_loop(LOOP_EVENT_LINK);
+}
+
+/*
+ * @brief    Blocks until an MQTT event, a network event or the next tick, so `loop()` does not
+ *           spin checking for work that is not there.
+ */
+static void wait_for_loop_events()
+{
+  if (loop_events == NULL)
+  {
+    delay(LOOP_TICK_PERIOD_IN_MS / 10);
+    return;
+  }
+
+  (void)xEventGroupWaitBits(loop_events, LOOP_EVENT_ALL, pdTRUE, pdFALSE, portMAX_DELAY);
+  loop_wake_count++;
+}
+
+/*
+ * @brief    Logs how busy `loop()` was (the rest of the time its core is idle, as far as this task
+ *           is concerned) every LOOP_STATISTICS_PERIOD_IN_MS.
+ */
+static void log_loop_statistics()
+{
+  unsigned long elapsed_time = millis() - loop_statistics_start_time;
+
+  if (elapsed_time < LOOP_STATISTICS_PERIOD_IN_MS)
+  {
+    return;
+  }
+
+  // In tenths of a percent.
+  unsigned long busy_permille = min(loop_busy_time_in_us / elapsed_time, 1000UL);
+
+  LogInfo(
+      "Main loop busy %lu.%lu%% of the last %lu s (%u wake-ups), idle %lu.%lu%%.",
+      busy_permille / 10,
+      busy_permille % 10,
+      elapsed_time / 1000,
+      loop_wake_count,
+      (1000 - busy_permille) / 10,
+      (1000 - busy_permille) % 10);
+
+  loop_statistics_start_time = millis();
+  loop_busy_time_in_us = 0;
+  loop_wake_count = 0;
+}
+
 /* --- System and Platform Functions --- */
 static void sync_device_clock_with_ntp_server()
 {
@@ -508,27 +896,68 @@ static void sync_device_clock_with_ntp_server()
   LogInfo("Time initialized!");
 }
 
-int connectionTimeout = 15000;
+/*
+ * @brief    Starts connecting to the WiFi access point if `wifi_backoff` says it is time, without
+ *           waiting for the connection.
+ */
 static void connect_to_wifi()
 {
+  if (!reconnect_backoff_is_due(&wifi_backoff))
+  {
+    return;
+  }
+
   LogInfo("Connecting to WIFI wifi_ssid %s", wifi_ssid);
-  unsigned long startTime = millis();
+  reconnect_backoff_attempted(&wifi_backoff);
   WiFi.mode(WIFI_STA);
-  WiFi.begin(wifi_ssid, wifi_password);
-  WiFi.setAutoReconnect(true);
+  // Reconnecting is left to `wifi_backoff`, rather than retried right away by the WiFi driver.
+  WiFi.setAutoReconnect(false);
   WiFi.persistent(true);
-  while (WiFi.status() != WL_CONNECTED)
+  WiFi.begin(wifi_ssid, wifi_password);
+}
+
+static void on_wifi_connected()
+{
+  is_wifi_connected = true;
+  reconnect_backoff_set_connected(&wifi_backoff);
+  LogInfo("WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
+}
+
+/*
+ * @brief    Logs how long the MQTT connection took since MQTT_EVENT_BEFORE_CONNECT (mostly the TLS
+ *           handshake), and the heap it used.
+ * @remark   The peak heap use of the handshake only shows as a new lowest free heap since boot, so
+ *           it is logged as unknown if the heap had already been lower before.
+ */
+static void log_mqtt_connect_measurement()
+{
+  uint32_t minimum_free_heap = esp_get_minimum_free_heap_size();
+
+  mqtt_connect_count++;
+
+  if (minimum_free_heap < mqtt_connect_start_minimum_free_heap)
   {
-    unsigned long actualTime = millis();
-   if(actualTime-startTime >= connectionTimeout){
-      WiFi.begin(wifi_ssid, wifi_password);
-      startTime = millis();
-    }
-    delay(500);
-    Serial.print(":");
+    LogInfo(
+        "MQTT connection %u to %s took %lu ms, free heap %u bytes before, %u after, %u at least.",
+        mqtt_connect_count,
+        mqtt_broker_uri,
+        millis() - mqtt_connect_start_time,
+        mqtt_connect_start_free_heap,
+        esp_get_free_heap_size(),
+        minimum_free_heap);
+  }
+  else
+  {
+    LogInfo(
+        "MQTT connection %u to %s took %lu ms, free heap %u bytes before, %u after, lowest not "
+        "known (above the %u lowest since boot).",
+        mqtt_connect_count,
+        mqtt_broker_uri,
+        millis() - mqtt_connect_start_time,
+        mqtt_connect_start_free_heap,
+        esp_get_free_heap_size(),
+        minimum_free_heap);
   }
-    Serial.println("");
-    LogInfo("WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
 }
 
 static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
@@ -583,9 +1012,20 @@ static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
           break;
       };
 
+      // Reported before the disconnection, which then decides whether the hub is kept.
+      if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED
+          && (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_BAD_USERNAME
+              || event->error_handle->connect_return_code
+                  == MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED))
+      {
+        azure_iot_mqtt_client_not_authorized(&azure_iot);
+      }
+
       break;
     case MQTT_EVENT_CONNECTED:
       LogInfo("MQTT client connected (session_present=%d).", event->session_present);
+      log_mqtt_connect_measurement();
+      outbox_set_connected(true);
 
       if (azure_iot_mqtt_client_connected(&azure_iot) != 0)
       {
@@ -595,6 +1035,7 @@ static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
       break;
     case MQTT_EVENT_DISCONNECTED:
       LogInfo("MQTT client disconnected.");
+      outbox_set_connected(false);
       //Serial.println("Reseting ESP32!");
       //ESP.restart();
 
@@ -619,10 +1060,8 @@ static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
     case MQTT_EVENT_PUBLISHED:
       LogInfo("MQTT event MQTT_EVENT_PUBLISHED");
 
-      if (azure_iot_mqtt_client_publish_completed(&azure_iot, event->msg_id) != 0)
-      {
-        LogError("azure_iot_mqtt_client_publish_completed failed (message id=%d).", event->msg_id);
-      }
+      // Reported by the outbox task, with the outbox message id.
+      outbox_acknowledge(event->msg_id);
 
       break;
     case MQTT_EVENT_DATA:
@@ -645,17 +1084,28 @@ static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
       break;
     case MQTT_EVENT_BEFORE_CONNECT:
       LogInfo("MQTT client connecting.");
+      mqtt_connect_start_time = millis();
+      mqtt_connect_start_free_heap = esp_get_free_heap_size();
+      mqtt_connect_start_minimum_free_heap = esp_get_minimum_free_heap_size();
       break;
     default:
       LogError("MQTT event UNKNOWN.");
       break;
   }
 
+  wake_main_loop(LOOP_EVENT_MQTT);
+
   return ESP_OK;
 }
 
 static void logging_function(log_level_t log_level, char const* const format, ...)
 {
+#ifdef LOG_TOKENIZED
+  va_list tokenized_ap;
+  va_start(tokenized_ap, format);
+  (void)tokenized_log_v(&mainTokenizedLogFile, (uint8_t)log_level, format, tokenized_ap);
+  va_end(tokenized_ap);
+#else
   struct tm* ptm;
   time_t now = time(NULL);
 
@@ -697,14 +1147,6 @@ static void logging_function(log_level_t log_level, char const* const format, ..
   va_list ap;
   va_start(ap, format);
   int message_length = vsnprintf(message, 256, format, ap);
-
-  if(log_level == log_level_info){
-    mainLogger.log(sd_log_level_info,format,ap);
-  }
-  else{
-    mainLogger.log(sd_log_level_error,format,ap);
-  }
-
   va_end(ap);
 
   if (message_length < 0)
@@ -714,5 +1156,13 @@ static void logging_function(log_level_t log_level, char const* const format, ..
   else
   {
     Serial.println(message);
+
+    // Only queued here; the SD card is written by the asyncLog task.
+    async_log(
+        &mainLogFile,
+        log_level == log_level_info ? async_log_level_info : async_log_level_error,
+        "%s",
+        message);
   }
+#endif // LOG_TOKENIZED
 }
@@ -6,16 +6,31 @@
 #include "./src/weidosTasks.h"
 #include "./src/propertiesDefinitions.h"
 #include "./src/propertiesGlobalVariables.h"
-#include <RTClib.h>
-
+#include "./src/telemetryPacker.h"
+#include "./src/telemetryDeflate.h"
+#include "./src/telemetryFields.h"
+#include "./src/telemetryPayload.h"
+#include "./src/telemetryQueue.h"
+#include "./src/publishWindow.h"
+#include "./src/outbox.h"
+#include "./src/sampleLog.h"
+#include "./src/historian.h"
+#include "./src/archive.h"
+#include "./src/flightRecorder.h"
+#include "./src/writableProperties.h"
+
+#include <math.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <az_core.h>
 #include <az_iot.h>
 
 #include "AzureIoT.h"
 #include "Azure_IoT_PnP_Template.h"
+#include "iot_configs.h"
 
 #include <az_precondition_internal.h>
 
@@ -32,14 +47,19 @@
 static az_span COMMAND_NAME_TOGGLE_LED_1 = AZ_SPAN_FROM_STR("ToggleLed1");
 static az_span COMMAND_NAME_TOGGLE_LED_2 = AZ_SPAN_FROM_STR("ToggleLed2");
 static az_span COMMAND_NAME_DISPLAY_TEXT = AZ_SPAN_FROM_STR("DisplayText");
+static az_span COMMAND_NAME_QUERY_HISTORY = AZ_SPAN_FROM_STR("QueryHistory");
+#define COMMAND_RESPONSE_CODE_OK 200
 #define COMMAND_RESPONSE_CODE_ACCEPTED 202
+#define COMMAND_RESPONSE_CODE_BAD_REQUEST 400
 #define COMMAND_RESPONSE_CODE_REJECTED 404
+#define COMMAND_RESPONSE_CODE_ERROR 500
+#define COMMAND_RESPONSE_CODE_BUSY 503
 
 #define WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS "telemetryFrequencySecs"
+#define WRITABLE_PROPERTY_TELEMETRY_FIELD_GROUPS "telemetryFieldGroups"
 #define WRITABLE_PROPERTY_RESPONSE_SUCCESS "success"
-
-#define DOUBLE_DECIMAL_PLACE_DIGITS 2
-#define TRIPLE_DECIMAL_PLACE_DIGITS 3
+#define WRITABLE_PROPERTY_RESPONSE_INVALID_VALUE "invalid value"
+#define WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS_MAX 86400 // Once a day.
 
 /* --- Function Checks and Returns --- */
 #define RESULT_OK 0
@@ -61,21 +81,232 @@ static az_span COMMAND_NAME_DISPLAY_TEXT = AZ_SPAN_FROM_STR("DisplayText");
 /* --- Data --- */
 #define DATA_BUFFER_SIZE 4096
 
+// Used on the main loop only (telemetry samples, queued telemetry read back, history responses).
 static uint8_t data_buffer[DATA_BUFFER_SIZE];
+
+// Writable properties are handled on the MQTT client task, so their ack is written in a buffer of
+// its own.
+#define PROPERTIES_RESPONSE_BUFFER_SIZE 1024
+
+static uint8_t properties_response_buffer[PROPERTIES_RESPONSE_BUFFER_SIZE];
+
+/*
+ * Telemetry samples larger than this are split in several parts. It can be made smaller than a
+ * message unit (down to TELEMETRY_PART_MIN_SIZE) to exercise the splitting.
+ */
+#ifndef TELEMETRY_PART_MAX_SIZE
+#define TELEMETRY_PART_MAX_SIZE (IOT_HUB_MESSAGE_UNIT_SIZE - IOT_HUB_MESSAGE_UNIT_OVERHEAD)
+#endif
+
+#if TELEMETRY_PART_MAX_SIZE > DATA_BUFFER_SIZE || TELEMETRY_PART_MAX_SIZE < TELEMETRY_PART_MIN_SIZE
+#error TELEMETRY_PART_MAX_SIZE must be between TELEMETRY_PART_MIN_SIZE and DATA_BUFFER_SIZE.
+#endif
 static uint32_t telemetry_send_count = 0;
 
+/*
+ * Largest telemetry message sent, so that it, its topic and its properties fit in a message unit.
+ * With TELEMETRY_COMPRESSION_ENABLED that is its compressed size: samples are then packed into a
+ * larger buffer for as long as the packed message still compresses to this (see
+ * `is_packed_telemetry_within_unit`).
+ */
+#define TELEMETRY_MESSAGE_MAX_SIZE (IOT_HUB_MESSAGE_UNIT_SIZE - IOT_HUB_MESSAGE_UNIT_OVERHEAD)
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+#define TELEMETRY_PACKER_BUFFER_SIZE (3 * IOT_HUB_MESSAGE_UNIT_SIZE)
+#else
+#define TELEMETRY_PACKER_BUFFER_SIZE IOT_HUB_MESSAGE_UNIT_SIZE
+#endif
+
+static uint8_t telemetry_packer_buffer[TELEMETRY_PACKER_BUFFER_SIZE];
+static telemetry_packer_t telemetry_packer;
+
+/*
+ * Every telemetry message has, as message properties, the time its (first) sample was taken, which
+ * Azure IoT Central then uses instead of the time the message arrived (so telemetry stored while
+ * offline is charted when it was taken), and a message sequence number (starting from zero at
+ * boot). The latter counts messages, unlike the "seq" in the payload, which counts frames.
+ */
+#define TELEMETRY_PROPERTY_CREATION_TIME "iothub-creation-time-utc"
+#define TELEMETRY_PROPERTY_SEQUENCE_NUMBER "msgSeq"
+#define TELEMETRY_CREATION_TIME_FORMAT "%Y-%m-%dT%H%%3A%M%%3A%S.000Z" // URL-encoded.
+#define TELEMETRY_CREATION_TIME_MAX_SIZE 32
+#define MESSAGE_PROPERTIES_BUFFER_SIZE 160
+
+static uint8_t message_properties_buffer[MESSAGE_PROPERTIES_BUFFER_SIZE];
+static uint32_t next_telemetry_sequence_number = 0;
+
+/*
+ * Telemetry messages are stored in the telemetry queue after this marker and their metadata, so
+ * they keep their message properties when forwarded. JSON never starts with the marker, so
+ * messages stored without it (by older versions) are still forwarded, just without properties.
+ * Messages stored already compressed have the other marker, so they are forwarded with the content
+ * encoding even if compression has since been disabled.
+ */
+#define TELEMETRY_RECORD_METADATA_MARKER 0x01
+#define TELEMETRY_RECORD_COMPRESSED_MARKER 0x03
+
+typedef struct telemetry_metadata_t_struct
+{
+  uint32_t creation_time;
+  uint32_t sequence_number;
+} telemetry_metadata_t;
+
+/*
+ * Telemetry messages the outbox returns (see `outbox_take_returned`) are already compressed (if
+ * so) and have their message properties encoded, so they are stored after this other marker with
+ * their properties as is (their length, then the properties), and forwarded verbatim.
+ */
+#define TELEMETRY_RECORD_RETURNED_MARKER 0x02
+#define TELEMETRY_TOPIC_PROPERTIES_START "/messages/events/"
+
+#define COMPRESSION_PROPERTIES_BUFFER_SIZE 64
+#define CONTENT_TYPE_JSON "application%2Fjson"
+
+// The same for every compressed message, so built once (see azure_pnp_init) and copied in front of
+// the properties of each one. Built even without TELEMETRY_COMPRESSION_ENABLED, for the compressed
+// messages left in the telemetry queue.
+static uint8_t compression_properties_buffer[COMPRESSION_PROPERTIES_BUFFER_SIZE];
+static az_span compression_properties = AZ_SPAN_EMPTY;
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+static uint8_t compression_buffer[TELEMETRY_MESSAGE_MAX_SIZE];
+#endif // TELEMETRY_COMPRESSION_ENABLED
+
+#ifdef TELEMETRY_QOS_AT_LEAST_ONCE
+#define TELEMETRY_QOS mqtt_qos_at_least_once
+#else
+#define TELEMETRY_QOS mqtt_qos_at_most_once
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+
+#if TELEMETRY_KEYFRAME_INTERVAL < 1
+#error TELEMETRY_KEYFRAME_INTERVAL must be at least 1.
+#endif
+
+#if TELEMETRY_FIELD_COUNT > 64
+#error The fields in a telemetry frame are a 64-bit mask.
+#endif
+
+/*
+ * Telemetry frames are numbered (starting from zero at boot) so the backend can spot missing ones.
+ * Between keyframes, which have every field, frames only have the fields that differ from the
+ * reference: the last frame generated when every frame before it was known delivered (handed to
+ * the MQTT client with QoS 0, acknowledged with QoS 1). A field that changed since the reference is
+ * in every frame until the reference moves, so a frame lost meanwhile leaves nothing missing from
+ * the ones after it. Frames that are lost for sure, or arrive after newer ones (stored in the
+ * telemetry queue meanwhile), are followed by a keyframe.
+ */
+static uint32_t telemetry_frame_sequence = 0;
+static uint32_t telemetry_frames_until_keyframe = 0;
+static bool telemetry_keyframe_required = true;
+static float telemetry_frame_reference[TELEMETRY_FIELD_COUNT];
+static float telemetry_frame_latest[TELEMETRY_FIELD_COUNT];
+static uint64_t telemetry_fields_changed = 0; // Since the reference, a bit per field.
+
 static size_t telemetry_frequency_in_seconds = 60; // With default frequency of once in 10 seconds.
+static uint8_t telemetry_field_groups = TELEMETRY_FIELD_GROUP_ALL;
+/*
+ * The writable properties applied are kept in NVS with the version of the desired properties they
+ * came with, so they are applied again right at boot, and the properties document received on
+ * connecting is only processed if its version is a different one.
+ */
+static int32_t desired_properties_version = WRITABLE_PROPERTIES_VERSION_NONE;
 static time_t last_telemetry_send_time = INDEFINITE_TIME;
+static unsigned long last_queue_forward_time = 0;
 
 static bool led1_on = false;
 static bool led2_on = false;
 
+#if defined(ARCHIVE_ENABLED) && !defined(HISTORIAN_ENABLED)
+#error ARCHIVE_ENABLED needs HISTORIAN_ENABLED, whose history queries read the archive.
+#endif
+
+#ifdef HISTORIAN_ENABLED
+/*
+ * A QueryHistory command asks for the history of some fields between two times, aggregated in
+ * buckets of `resolution` seconds. Each response holds as many points as fit in `data_buffer` and,
+ * if more are left, a "next" object to be added to the request to get the following ones.
+ */
+#define HISTORY_REQUEST_ID_MAX_SIZE 64
+#define HISTORY_POINT_MAX_SIZE 112 // ,[2147483647,-9007199254740991.000,...,4294967295]
+#define HISTORY_RESPONSE_CLOSING_MAX_SIZE 160 // ],"<name>":[]},"next":{"field":"<name>",...}}
+
+typedef struct history_request_t_struct
+{
+  uint8_t fields[TELEMETRY_FIELD_COUNT];
+  uint8_t field_count;
+  uint32_t from;
+  uint32_t to;
+  uint32_t resolution;
+  uint8_t next_field; // Index in `fields` of the field to resume with, from `next_from`.
+  uint32_t next_from;
+} history_request_t;
+
+// Requests are answered from the main loop, which also feeds the historian.
+static history_request_t history_request;
+static uint8_t history_request_id_buffer[HISTORY_REQUEST_ID_MAX_SIZE];
+static az_span history_request_id = AZ_SPAN_EMPTY;
+static volatile bool is_history_request_pending = false;
+#endif
+
 /* --- Function Prototypes --- */
 /* Please find the function implementations at the bottom of this file */
 static int generate_telemetry_payload(
+    azure_iot_t* azure_iot,
+    time_t now,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size);
+static int write_telemetry_frame(
+    azure_iot_t* azure_iot,
+    time_t now,
     uint8_t* payload_buffer,
     size_t payload_buffer_size,
-    size_t* payload_buffer_length);
+    bool is_keyframe,
+    uint64_t fields);
+static void update_telemetry_frame_reference();
+static int pack_telemetry_sample(azure_iot_t* azure_iot, az_span sample, time_t now);
+static int send_packed_telemetry(azure_iot_t* azure_iot, time_t now);
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+static bool compress_telemetry_message(az_span* message);
+static bool is_packed_telemetry_within_unit();
+#endif // TELEMETRY_COMPRESSION_ENABLED
+static int build_telemetry_properties(
+    azure_iot_message_properties_t* properties,
+    az_span fixed_properties,
+    const telemetry_metadata_t* metadata);
+static const telemetry_metadata_t* take_telemetry_record_metadata(
+    az_span* message,
+    telemetry_metadata_t* metadata,
+    bool* out_is_compressed);
+static int send_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    bool is_compressed,
+    const telemetry_metadata_t* metadata,
+    time_t now,
+    int* out_packet_id);
+static int publish_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    azure_iot_message_properties_t* properties,
+    time_t now,
+    int* out_packet_id);
+static int send_queued_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span record,
+    time_t now,
+    int* out_packet_id);
+static void on_telemetry_returned(const char* topic, az_span payload, int qos);
+static int deliver_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    time_t creation_time,
+    time_t now);
+static int forward_queued_telemetry(azure_iot_t* azure_iot, time_t now);
+static int send_flight_recorder_report(azure_iot_t* azure_iot);
+#ifdef HISTORIAN_ENABLED
+static int parse_history_request(az_span payload, history_request_t* request);
+static int send_history_response(azure_iot_t* azure_iot);
+#endif
 static int generate_device_info_payload(
     az_iot_hub_client const* hub_client,
     uint8_t* payload_buffer,
@@ -84,12 +315,134 @@ static int generate_device_info_payload(
 static int consume_properties_and_generate_response(
     azure_iot_t* azure_iot,
     az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
     uint8_t* buffer,
     size_t buffer_size,
     size_t* response_length);
+static int handle_properties(
+    azure_iot_t* azure_iot,
+    az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
+    uint32_t request_id);
+static int append_properties_update_response(
+    azure_iot_t* azure_iot,
+    az_json_writer* jw,
+    az_span property_name,
+    az_span property_value_json,
+    int32_t status,
+    az_span description,
+    int32_t version);
+static void apply_telemetry_frequency(int32_t frequency_in_seconds);
+static int32_t get_telemetry_frequency();
+static void apply_telemetry_field_groups(int32_t field_groups);
+static int32_t get_telemetry_field_groups();
+static int parse_telemetry_field_groups(az_span names, int32_t* field_groups);
+static int format_telemetry_field_groups(int32_t field_groups, az_span buffer, az_span* out_names);
+
+/*
+ * The writable properties of the device (see src/writableProperties.h).
+ */
+static constexpr writable_property_t writable_properties[] = {
+  WRITABLE_PROPERTY_INT32(
+      WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS,
+      1,
+      WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS_MAX,
+      apply_telemetry_frequency,
+      get_telemetry_frequency,
+      "telemetryFreq"),
+  WRITABLE_PROPERTY_STRING(
+      WRITABLE_PROPERTY_TELEMETRY_FIELD_GROUPS,
+      parse_telemetry_field_groups,
+      format_telemetry_field_groups,
+      apply_telemetry_field_groups,
+      get_telemetry_field_groups,
+      "fieldGroups"),
+};
+
+#define WRITABLE_PROPERTY_COUNT (sizeof(writable_properties) / sizeof(writable_properties[0]))
+
+static_assert(
+    writable_properties_are_perfectly_hashed(writable_properties, WRITABLE_PROPERTY_COUNT),
+    "Writable properties share a lookup slot, increase WRITABLE_PROPERTY_SLOT_COUNT.");
 
 /* --- Public Functions --- */
-void azure_pnp_init() {}
+void azure_pnp_init()
+{
+  if (writable_properties_init(writable_properties, WRITABLE_PROPERTY_COUNT) == 0)
+  {
+    desired_properties_version = writable_properties_restore();
+
+    if (desired_properties_version != WRITABLE_PROPERTIES_VERSION_NONE)
+    {
+      LogInfo("Writable properties restored (version %d).", desired_properties_version);
+    }
+  }
+  else
+  {
+    LogError("Failed registering the writable properties.");
+  }
+
+  telemetry_packer_init(
+      &telemetry_packer, AZ_SPAN_FROM_BUFFER(telemetry_packer_buffer), TELEMETRY_MESSAGE_MAX_SIZE);
+  message_units_set_daily_quota(DAILY_MESSAGE_UNIT_QUOTA);
+
+  if (telemetry_queue_init() != 0)
+  {
+    LogError("Failed initializing telemetry queue, telemetry will be lost while offline.");
+  }
+
+#ifdef SAMPLE_LOG_ENABLED
+  if (sample_log_init() != 0)
+  {
+    LogError("Failed initializing sample log.");
+  }
+#endif
+
+#ifdef HISTORIAN_ENABLED
+  if (historian_init() != 0)
+  {
+    LogError("Failed initializing historian.");
+  }
+#endif
+
+#ifdef ARCHIVE_ENABLED
+  if (archive_init() != 0)
+  {
+    LogError("Failed initializing archive.");
+  }
+#endif
+
+  azure_iot_message_properties_t properties;
+
+  if (azure_iot_message_properties_init(
+          &properties, AZ_SPAN_FROM_BUFFER(compression_properties_buffer), 0)
+          == 0
+      && azure_iot_message_properties_append(
+             &properties,
+             AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+             AZ_SPAN_FROM_STR(CONTENT_TYPE_JSON))
+          == 0
+      && azure_iot_message_properties_append(
+             &properties,
+             AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING),
+             AZ_SPAN_FROM_STR(TELEMETRY_DEFLATE_CONTENT_ENCODING))
+          == 0)
+  {
+    compression_properties = azure_iot_message_properties_get_span(&properties);
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+    // Packed messages can now be larger than a message unit, as long as they compress to one.
+    telemetry_packer_init(
+        &telemetry_packer,
+        AZ_SPAN_FROM_BUFFER(telemetry_packer_buffer),
+        sizeof(telemetry_packer_buffer) - 1);
+#endif // TELEMETRY_COMPRESSION_ENABLED
+  }
+  else
+  {
+    LogError("Failed building the compressed telemetry message properties, sent uncompressed.");
+  }
+}
 
 const az_span azure_pnp_get_model_id() { return AZ_SPAN_FROM_STR(AZURE_PNP_MODEL_ID); }
 
@@ -99,6 +452,18 @@ void azure_pnp_set_telemetry_frequency(size_t frequency_in_seconds)
   LogInfo("Telemetry frequency set to once every %d seconds.", telemetry_frequency_in_seconds);
 }
 
+void azure_pnp_set_telemetry_field_groups(uint8_t field_groups)
+{
+  if (field_groups != telemetry_field_groups)
+  {
+    telemetry_field_groups = field_groups;
+    // Fields that were not being sent have no previous value to be compared with.
+    telemetry_keyframe_required = true;
+  }
+
+  LogInfo("Telemetry field groups set to 0x%02x.", telemetry_field_groups);
+}
+
 /* Application-specific data section */
 
 int azure_pnp_send_telemetry(azure_iot_t* azure_iot)
@@ -106,6 +471,7 @@ int azure_pnp_send_telemetry(azure_iot_t* azure_iot)
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
   time_t now = time(NULL);
+  int result = RESULT_OK;
 
   if (now == INDEFINITE_TIME)
   {
@@ -116,26 +482,1073 @@ int azure_pnp_send_telemetry(azure_iot_t* azure_iot)
       last_telemetry_send_time == INDEFINITE_TIME
       || difftime(now, last_telemetry_send_time) >= telemetry_frequency_in_seconds)
   {
-    size_t payload_size;
+    last_telemetry_send_time = now;
+
+    if (generate_telemetry_payload(azure_iot, now, data_buffer, TELEMETRY_PART_MAX_SIZE)
+        != RESULT_OK)
+    {
+      LogError("Failed generating telemetry payload.");
+      return RESULT_ERROR;
+    }
+  }
+
+  if (telemetry_packer_is_due(&telemetry_packer, now, TELEMETRY_PACKER_MAX_AGE_IN_SECONDS))
+  {
+    result = send_packed_telemetry(azure_iot, now);
+  }
+
+  // Telemetry the outbox could not publish (e.g., disconnected meanwhile) is taken back.
+  (void)outbox_take_returned(on_telemetry_returned);
+
+#ifdef TELEMETRY_QOS_AT_LEAST_ONCE
+  if (azure_iot_get_status(azure_iot) != azure_iot_connected && publish_window_get_count() > 0)
+  {
+    // PUBACKs of the previous connection never come, so the messages in flight are sent again.
+    publish_window_reset();
+    telemetry_queue_rewind();
+  }
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+
+  if (azure_iot_get_status(azure_iot) == azure_iot_connected)
+  {
+    (void)forward_queued_telemetry(azure_iot, now);
+
+    if (flight_recorder_get_report() != NULL && outbox_has_room(outbox_class_diagnostics))
+    {
+      (void)send_flight_recorder_report(azure_iot);
+    }
+
+#ifdef HISTORIAN_ENABLED
+    if (is_history_request_pending && outbox_has_room(outbox_class_alarm))
+    {
+      (void)send_history_response(azure_iot);
+    }
+#endif
+  }
+
+  return result;
+}
+
+/*
+ * @brief    Adds a telemetry sample (or a part of one) to the telemetry packer, sending the samples
+ *           already held first if the new one does not fit with them.
+ */
+static int pack_telemetry_sample(azure_iot_t* azure_iot, az_span sample, time_t now)
+{
+  if (!telemetry_packer_fits(&telemetry_packer, sample))
+  {
+    // Makes room for the new sample, which must be packed even if this send fails.
+    (void)send_packed_telemetry(azure_iot, now);
+  }
+
+  if (telemetry_packer_add(&telemetry_packer, sample, now) != 0)
+  {
+    // The sample alone is larger than a message unit, so there is nothing to pack it with.
+    return deliver_telemetry_message(azure_iot, sample, now, now);
+  }
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+  if (telemetry_packer_get_sample_count(&telemetry_packer) > 1
+      && !is_packed_telemetry_within_unit())
+  {
+    // The samples held fit in a message unit without the new one, so they go out first.
+    telemetry_packer_remove_last(&telemetry_packer);
+    (void)send_packed_telemetry(azure_iot, now);
+    (void)telemetry_packer_add(&telemetry_packer, sample, now);
+  }
+#endif // TELEMETRY_COMPRESSION_ENABLED
+
+  return RESULT_OK;
+}
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+/*
+ * @brief    Compresses a telemetry message into `compression_buffer`, if that makes it smaller and
+ *           it then fits in a message unit.
+ *
+ * @return   true if `*message` was replaced by its compressed version.
+ */
+static bool compress_telemetry_message(az_span* message)
+{
+  size_t compressed_length;
+  unsigned long compression_start = micros();
+
+  if (az_span_size(compression_properties) == 0
+      || telemetry_deflate(*message, AZ_SPAN_FROM_BUFFER(compression_buffer), &compressed_length)
+          != 0
+      || compressed_length >= (size_t)az_span_size(*message))
+  {
+    return false;
+  }
+
+  LogInfo(
+      "Telemetry compressed from %d to %d bytes (%d%%) in %lu us.",
+      az_span_size(*message),
+      compressed_length,
+      (int)(compressed_length * 100 / az_span_size(*message)),
+      micros() - compression_start);
+
+  *message = az_span_create(compression_buffer, compressed_length);
+
+  return true;
+}
+
+/*
+ * @brief    Checks if the packed telemetry message, as it would be sent, fits in a message unit.
+ * @remark   Past the size of a message unit it is compressed to find out, so it costs a compression
+ *           for each sample added from then on.
+ */
+static bool is_packed_telemetry_within_unit()
+{
+  az_span message = telemetry_packer_get_message(&telemetry_packer);
+  size_t compressed_length;
+
+  if (az_span_size(message) <= TELEMETRY_MESSAGE_MAX_SIZE)
+  {
+    return true;
+  }
+
+  return telemetry_deflate(message, AZ_SPAN_FROM_BUFFER(compression_buffer), &compressed_length)
+      == 0;
+}
+#endif // TELEMETRY_COMPRESSION_ENABLED
+
+/*
+ * @brief    Sends the samples held by the telemetry packer as a single message, created at the
+ *           time of its first sample (see TELEMETRY_PACKER_MAX_AGE_IN_SECONDS in iot_configs.h).
+ * @remark   The packer is reset even if sending fails, as the message is then stored in the
+ *           telemetry queue.
+ */
+static int send_packed_telemetry(azure_iot_t* azure_iot, time_t now)
+{
+  az_span message = telemetry_packer_get_message(&telemetry_packer);
+  uint32_t sample_count = telemetry_packer_get_sample_count(&telemetry_packer);
+  int result = RESULT_OK;
+
+  if (az_span_size(message) > 0)
+  {
+    LogInfo("Sending %d telemetry samples packed in %d bytes.", sample_count, az_span_size(message));
+    result = deliver_telemetry_message(
+        azure_iot, message, telemetry_packer_get_first_sample_time(&telemetry_packer), now);
+  }
+
+  telemetry_packer_reset(&telemetry_packer);
+
+  return result;
+}
+
+void azure_pnp_handle_publish_completed(int packet_id)
+{
+#ifdef TELEMETRY_QOS_AT_LEAST_ONCE
+  publish_window_acknowledge(packet_id);
+#else
+  (void)packet_id;
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+}
+
+/*
+ * @brief    Builds the message properties of a telemetry message: `fixed_properties` (already
+ *           encoded), then the creation time and sequence number in `metadata`, if any.
+ */
+static int build_telemetry_properties(
+    azure_iot_message_properties_t* properties,
+    az_span fixed_properties,
+    const telemetry_metadata_t* metadata)
+{
+  char creation_time[TELEMETRY_CREATION_TIME_MAX_SIZE];
+  uint8_t sequence_number[10];
+  az_span sequence_number_span = AZ_SPAN_FROM_BUFFER(sequence_number);
+  az_span remainder;
+  time_t creation_unix_time;
+  struct tm tm;
+
+  (void)az_span_copy(AZ_SPAN_FROM_BUFFER(message_properties_buffer), fixed_properties);
+
+  EXIT_IF_TRUE(
+      azure_iot_message_properties_init(
+          properties,
+          AZ_SPAN_FROM_BUFFER(message_properties_buffer),
+          az_span_size(fixed_properties))
+          != 0,
+      RESULT_ERROR,
+      "Failed initializing telemetry message properties.");
+
+  if (metadata == NULL)
+  {
+    return RESULT_OK;
+  }
+
+  creation_unix_time = (time_t)metadata->creation_time;
+  EXIT_IF_TRUE(
+      gmtime_r(&creation_unix_time, &tm) == NULL
+          || strftime(creation_time, sizeof(creation_time), TELEMETRY_CREATION_TIME_FORMAT, &tm)
+              == 0,
+      RESULT_ERROR,
+      "Failed formatting telemetry creation time.");
+
+  EXIT_IF_TRUE(
+      azure_iot_message_properties_append(
+          properties,
+          AZ_SPAN_FROM_STR(TELEMETRY_PROPERTY_CREATION_TIME),
+          az_span_create_from_str(creation_time))
+          != 0,
+      RESULT_ERROR,
+      "Failed adding creation time to telemetry message properties.");
+
+  EXIT_IF_AZ_FAILED(
+      az_span_u32toa(sequence_number_span, metadata->sequence_number, &remainder),
+      RESULT_ERROR,
+      "Failed formatting telemetry sequence number.");
+  sequence_number_span = az_span_slice(
+      sequence_number_span, 0, az_span_size(sequence_number_span) - az_span_size(remainder));
+
+  EXIT_IF_TRUE(
+      azure_iot_message_properties_append(
+          properties, AZ_SPAN_FROM_STR(TELEMETRY_PROPERTY_SEQUENCE_NUMBER), sequence_number_span)
+          != 0,
+      RESULT_ERROR,
+      "Failed adding sequence number to telemetry message properties.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Takes the metadata off a message read from the telemetry queue.
+ *
+ * @param[out]   out_is_compressed    Whether the message was stored already compressed.
+ *
+ * @return   `metadata` with the metadata of the message, or NULL if it was stored without.
+ */
+static const telemetry_metadata_t* take_telemetry_record_metadata(
+    az_span* message,
+    telemetry_metadata_t* metadata,
+    bool* out_is_compressed)
+{
+  *out_is_compressed = false;
+
+  if (az_span_size(*message) <= (int32_t)sizeof(*metadata)
+      || (az_span_ptr(*message)[0] != TELEMETRY_RECORD_METADATA_MARKER
+          && az_span_ptr(*message)[0] != TELEMETRY_RECORD_COMPRESSED_MARKER))
+  {
+    return NULL;
+  }
+
+  *out_is_compressed = az_span_ptr(*message)[0] == TELEMETRY_RECORD_COMPRESSED_MARKER;
+
+  (void)memcpy(metadata, az_span_ptr(*message) + 1, sizeof(*metadata));
+  *message = az_span_slice_to_end(*message, 1 + sizeof(*metadata));
+
+  return metadata;
+}
+
+/*
+ * @brief    Sends a telemetry message and accounts for the message units it uses.
+ *
+ * @param[in]    is_compressed    Whether `message` is compressed, so it is sent with the content
+ *                                encoding.
+ * @param[in]    metadata         Creation time and sequence number of the message, or NULL if it
+ *                                has none.
+ * @param[out]   out_packet_id    The packet ID the message was published with.
+ */
+static int send_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    bool is_compressed,
+    const telemetry_metadata_t* metadata,
+    time_t now,
+    int* out_packet_id)
+{
+  azure_iot_message_properties_t properties;
+  az_span fixed_properties = is_compressed ? compression_properties : AZ_SPAN_EMPTY;
+
+  if (build_telemetry_properties(&properties, fixed_properties, metadata) != RESULT_OK)
+  {
+    return RESULT_ERROR;
+  }
+
+  return publish_telemetry_message(azure_iot, message, &properties, now, out_packet_id);
+}
+
+/*
+ * @brief    Publishes a telemetry message as is, and accounts for the message units it uses.
+ */
+static int publish_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    azure_iot_message_properties_t* properties,
+    time_t now,
+    int* out_packet_id)
+{
+  if (azure_iot_send_telemetry_with_qos(
+          azure_iot, message, properties, TELEMETRY_QOS, mqtt_priority_normal, out_packet_id)
+      != 0)
+  {
+    LogError("Failed sending telemetry.");
+    flight_recorder_record(
+        flight_recorder_event_telemetry_publish, 0, (uint16_t)az_span_size(message), 0);
+    telemetry_keyframe_required = true;
+    return RESULT_ERROR;
+  }
+
+  flight_recorder_record(
+      flight_recorder_event_telemetry_publish,
+      1,
+      (uint16_t)az_span_size(message),
+      (int32_t)message_units_record(az_span_size(message), now));
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Sends a telemetry message if connected to Azure IoT Central, or stores it in the
+ *           telemetry queue (on the SD card) to be forwarded later otherwise or if sending fails.
+ *           With TELEMETRY_COMPRESSION_ENABLED it is compressed first, so it is stored compressed.
+ * @remark   With TELEMETRY_QOS_AT_LEAST_ONCE every message is stored in the queue, and published
+ *           from it by `forward_queued_telemetry`, in order.
+ */
+static int deliver_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span message,
+    time_t creation_time,
+    time_t now)
+{
+  uint8_t record_prefix[1 + sizeof(telemetry_metadata_t)];
+  telemetry_metadata_t metadata;
+  bool is_compressed = false;
+
+#ifdef TELEMETRY_COMPRESSION_ENABLED
+  is_compressed = compress_telemetry_message(&message);
+#endif // TELEMETRY_COMPRESSION_ENABLED
+
+  metadata.creation_time = (uint32_t)creation_time;
+  metadata.sequence_number = next_telemetry_sequence_number++;
+
+#ifndef TELEMETRY_QOS_AT_LEAST_ONCE
+  int packet_id;
+
+  // Stored as well while the outbox has no room for it, so the message is not lost.
+  if (azure_iot_get_status(azure_iot) == azure_iot_connected
+      && outbox_has_room(outbox_class_telemetry)
+      && send_telemetry_message(azure_iot, message, is_compressed, &metadata, now, &packet_id)
+          == RESULT_OK)
+  {
+    return RESULT_OK;
+  }
+
+  // The frames after a stored one arrive before it, so they must not depend on it.
+  telemetry_keyframe_required = true;
+#else
+  (void)azure_iot;
+  (void)now;
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+
+  record_prefix[0]
+      = is_compressed ? TELEMETRY_RECORD_COMPRESSED_MARKER : TELEMETRY_RECORD_METADATA_MARKER;
+  (void)memcpy(&record_prefix[1], &metadata, sizeof(metadata));
+
+  if (telemetry_queue_push_with_prefix(AZ_SPAN_FROM_BUFFER(record_prefix), message) != 0)
+  {
+    LogError("Failed storing telemetry in the queue, %d bytes lost.", az_span_size(message));
+    telemetry_keyframe_required = true;
+    return RESULT_ERROR;
+  }
+
+  flight_recorder_record(
+      flight_recorder_event_telemetry_publish, 2, (uint16_t)az_span_size(message), 0);
+
+  LogInfo(
+      "Telemetry stored in the queue (%u bytes pending).", telemetry_queue_get_pending_size());
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Sends a message read from the telemetry queue, with the properties stored with it.
+ */
+static int send_queued_telemetry_message(
+    azure_iot_t* azure_iot,
+    az_span record,
+    time_t now,
+    int* out_packet_id)
+{
+  telemetry_metadata_t metadata;
+  const telemetry_metadata_t* metadata_pointer;
+  azure_iot_message_properties_t properties;
+  uint16_t properties_length;
+  bool is_compressed;
+
+  if (az_span_size(record) < 1 + (int32_t)sizeof(properties_length)
+      || az_span_ptr(record)[0] != TELEMETRY_RECORD_RETURNED_MARKER)
+  {
+    metadata_pointer = take_telemetry_record_metadata(&record, &metadata, &is_compressed);
+    return send_telemetry_message(
+        azure_iot, record, is_compressed, metadata_pointer, now, out_packet_id);
+  }
+
+  (void)memcpy(&properties_length, az_span_ptr(record) + 1, sizeof(properties_length));
+  record = az_span_slice_to_end(record, 1 + sizeof(properties_length));
+
+  EXIT_IF_TRUE(
+      properties_length > az_span_size(record)
+          || properties_length > MESSAGE_PROPERTIES_BUFFER_SIZE,
+      RESULT_ERROR,
+      "Invalid telemetry record in the queue (properties of %u bytes).",
+      properties_length);
+
+  (void)az_span_copy(
+      AZ_SPAN_FROM_BUFFER(message_properties_buffer), az_span_slice(record, 0, properties_length));
+
+  EXIT_IF_TRUE(
+      azure_iot_message_properties_init(
+          &properties, AZ_SPAN_FROM_BUFFER(message_properties_buffer), properties_length)
+          != 0,
+      RESULT_ERROR,
+      "Failed initializing telemetry message properties.");
+
+  return publish_telemetry_message(
+      azure_iot, az_span_slice_to_end(record, properties_length), &properties, now, out_packet_id);
+}
+
+/*
+ * @brief    Takes back a telemetry message the outbox did not publish (see `outbox_returned_t`).
+ * @remark   With TELEMETRY_QOS_AT_LEAST_ONCE the message is still in the telemetry queue, so the
+ *           messages in flight are just published again. Otherwise it is stored in the queue.
+ */
+static void on_telemetry_returned(const char* topic, az_span payload, int qos)
+{
+#ifdef TELEMETRY_QOS_AT_LEAST_ONCE
+  (void)topic;
+  (void)payload;
+  (void)qos;
+
+  if (publish_window_get_count() > 0)
+  {
+    LogError("Telemetry not published, sending the messages in flight again.");
+    publish_window_reset();
+    telemetry_queue_rewind();
+  }
+#else
+  uint8_t record_prefix[1 + sizeof(uint16_t) + MESSAGE_PROPERTIES_BUFFER_SIZE];
+  const char* properties_start = strstr(topic, TELEMETRY_TOPIC_PROPERTIES_START);
+  uint16_t properties_length;
+
+  (void)qos;
+
+  if (properties_start == NULL)
+  {
+    LogError("Telemetry to unexpected topic '%s' not published, lost.", topic);
+    return;
+  }
+
+  properties_start += sizeof(TELEMETRY_TOPIC_PROPERTIES_START) - 1;
+  properties_length = (uint16_t)strlen(properties_start);
+
+  if (properties_length > MESSAGE_PROPERTIES_BUFFER_SIZE)
+  {
+    LogError("Telemetry not published, with properties too long to store, lost.");
+    return;
+  }
+
+  record_prefix[0] = TELEMETRY_RECORD_RETURNED_MARKER;
+  (void)memcpy(&record_prefix[1], &properties_length, sizeof(properties_length));
+  (void)memcpy(&record_prefix[1 + sizeof(properties_length)], properties_start, properties_length);
+
+  // The frames after it now arrive before it, so they must not depend on it.
+  telemetry_keyframe_required = true;
+
+  if (telemetry_queue_push_with_prefix(
+          az_span_create(record_prefix, 1 + sizeof(properties_length) + properties_length), payload)
+      != 0)
+  {
+    LogError("Failed storing telemetry in the queue, %d bytes lost.", az_span_size(payload));
+    return;
+  }
+
+  LogInfo("Telemetry not published stored in the queue, %d bytes.", az_span_size(payload));
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+}
+
+#ifdef TELEMETRY_QOS_AT_LEAST_ONCE
+/*
+ * @brief    Publishes the messages in the telemetry queue with QoS 1, keeping up to
+ *           PUBLISH_WINDOW_SIZE of them waiting for their PUBACK at a time.
+ * @remark   Messages are only removed from the queue once they (and every message before them)
+ *           are acknowledged. If a PUBACK takes longer than TELEMETRY_PUBACK_TIMEOUT_IN_MS, or
+ *           publishing fails, every message in flight is published again.
+ */
+static int forward_queued_telemetry(azure_iot_t* azure_iot, time_t now)
+{
+  az_span message;
+  int packet_id;
+  uint32_t queue_end;
+
+  if (publish_window_release(&queue_end) == 0 && telemetry_queue_release(queue_end) != 0)
+  {
+    LogError("Failed releasing acknowledged telemetry from the queue.");
+    return RESULT_ERROR;
+  }
+
+  if (publish_window_get_oldest_age() > TELEMETRY_PUBACK_TIMEOUT_IN_MS)
+  {
+    LogError("No PUBACK for %u telemetry messages, sending them again.", publish_window_get_count());
+    publish_window_reset();
+    telemetry_queue_rewind();
+  }
+
+  while (!publish_window_is_full() && outbox_has_room(outbox_class_telemetry)
+         && telemetry_queue_has_unread())
+  {
+    // Read into data_buffer, free again once the sample generated (if any) was packed.
+    if (telemetry_queue_read(AZ_SPAN_FROM_BUFFER(data_buffer), &message) != 0)
+    {
+      // Corrupted records are skipped by the read, so this is the card failing; tried again later.
+      return RESULT_ERROR;
+    }
+
+    if (send_queued_telemetry_message(azure_iot, message, now, &packet_id) != RESULT_OK)
+    {
+      publish_window_reset();
+      telemetry_queue_rewind();
+      return RESULT_ERROR;
+    }
+
+    (void)publish_window_add(packet_id, telemetry_queue_get_read_offset());
+  }
+
+  return RESULT_OK;
+}
+#else
+
+/*
+ * @brief    Forwards the oldest message in the telemetry queue, no more often than once every
+ *           TELEMETRY_QUEUE_CATCH_UP_INTERVAL_IN_MS so live telemetry keeps flowing meanwhile.
+ * @remark   A message is only removed from the queue once it has been sent (and is stored in it
+ *           again if the outbox then returns it, see `on_telemetry_returned`).
+ */
+static int forward_queued_telemetry(azure_iot_t* azure_iot, time_t now)
+{
+  az_span message;
+  int packet_id;
+
+  if (telemetry_queue_is_empty() || !outbox_has_room(outbox_class_telemetry)
+      || millis() - last_queue_forward_time < TELEMETRY_QUEUE_CATCH_UP_INTERVAL_IN_MS)
+  {
+    return RESULT_OK;
+  }
+
+  last_queue_forward_time = millis();
+
+  // Read into data_buffer, free again once the sample generated (if any) was packed.
+  if (telemetry_queue_peek(AZ_SPAN_FROM_BUFFER(data_buffer), &message) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (send_queued_telemetry_message(azure_iot, message, now, &packet_id) != RESULT_OK)
+  {
+    return RESULT_ERROR;
+  }
+
+  return telemetry_queue_pop();
+}
+#endif // TELEMETRY_QOS_AT_LEAST_ONCE
+
+/*
+ * @brief    Sends the flight recorder trace of the previous run as a telemetry message, as
+ *           {"flightRecorder":{"resetReason":..,"bootCount":..,"events":[[time,event,a,b,value],..]}}
+ *           (see src/flightRecorder.h for the meaning of each event).
+ */
+static int send_flight_recorder_report(azure_iot_t* azure_iot)
+{
+  const flight_recorder_report_t* report = flight_recorder_get_report();
+  az_json_writer jw;
+  az_result rc;
+
+  rc = az_json_writer_init(&jw, AZ_SPAN_FROM_BUFFER(data_buffer), NULL);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for flight recorder.");
+
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting flight recorder json root.");
+
+  rc = az_json_writer_append_property_name(
+      &jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_FLIGHT_RECORDER));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder property name.");
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder object.");
+
+  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_RESET_REASON));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reset reason property name.");
+  rc = az_json_writer_append_int32(&jw, report->reset_reason);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reset reason value.");
+
+  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_BOOT_COUNT));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding boot count property name.");
+  rc = az_json_writer_append_int32(&jw, (int32_t)report->boot_count);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding boot count value.");
+
+  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_EVENTS));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding events property name.");
+  rc = az_json_writer_append_begin_array(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding events array.");
+
+  for (uint32_t i = 0; i < report->entry_count; i++)
+  {
+    const flight_recorder_entry_t* entry = &report->entries[i];
+
+    rc = az_json_writer_append_begin_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event.");
+    rc = az_json_writer_append_int32(&jw, (int32_t)entry->time);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event time.");
+    rc = az_json_writer_append_int32(&jw, entry->event);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event type.");
+    rc = az_json_writer_append_int32(&jw, entry->a);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event value a.");
+    rc = az_json_writer_append_int32(&jw, entry->b);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event value b.");
+    rc = az_json_writer_append_int32(&jw, entry->value);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding flight recorder event value.");
+    rc = az_json_writer_append_end_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing flight recorder event.");
+  }
+
+  rc = az_json_writer_append_end_array(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing events array.");
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing flight recorder object.");
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing flight recorder json root.");
+
+  // Diagnostics are not stored for later, they are sent when connected or not at all.
+  EXIT_IF_TRUE(
+      azure_iot_send_telemetry_with_qos(
+          azure_iot,
+          az_json_writer_get_bytes_used_in_destination(&jw),
+          NULL,
+          mqtt_qos_at_most_once,
+          mqtt_priority_low,
+          NULL)
+          != 0,
+      RESULT_ERROR,
+      "Failed sending flight recorder report.");
+
+  LogInfo("Flight recorder report of boot %u sent.", report->boot_count);
+  flight_recorder_clear_report();
+
+  return RESULT_OK;
+}
+
+#ifdef HISTORIAN_ENABLED
+/*
+ * @brief    Reads a field name from a JSON string token.
+ */
+static int get_history_field(az_json_reader* jr, uint8_t* field)
+{
+  char name[TELEMETRY_FIELD_NAME_MAX_SIZE];
+  int32_t name_length;
+
+  EXIT_IF_TRUE(
+      jr->token.kind != AZ_JSON_TOKEN_STRING
+          || az_result_failed(az_json_token_get_string(&jr->token, name, sizeof(name), &name_length))
+          || telemetry_field_find(az_span_create((uint8_t*)name, name_length), field) != 0,
+      RESULT_ERROR,
+      "Unknown field in history query.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Parses a QueryHistory payload, like {"fields":["voltageL1N","currentL1"],
+ *           "from":1700000000,"to":1700086400,"resolution":900}, plus the "next" object of the
+ *           previous response when getting the following points.
+ */
+static int parse_history_request(az_span payload, history_request_t* request)
+{
+  az_json_reader jr;
+  az_result rc;
+  bool has_next_field = false;
+  uint8_t next_field = 0;
+
+  (void)memset(request, 0, sizeof(*request));
+
+  rc = az_json_reader_init(&jr, payload, NULL);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json reader for history query.");
+  rc = az_json_reader_next_token(&jr);
+  EXIT_IF_TRUE(
+      az_result_failed(rc) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT,
+      RESULT_ERROR,
+      "History query is not a json object.");
+
+  while (az_result_succeeded(rc = az_json_reader_next_token(&jr))
+         && jr.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME)
+  {
+    if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("fields")))
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_TRUE(
+          az_result_failed(rc) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_ARRAY,
+          RESULT_ERROR,
+          "History query fields are not an array.");
+
+      while (az_result_succeeded(rc = az_json_reader_next_token(&jr))
+             && jr.token.kind != AZ_JSON_TOKEN_END_ARRAY)
+      {
+        EXIT_IF_TRUE(
+            request->field_count == TELEMETRY_FIELD_COUNT,
+            RESULT_ERROR,
+            "Too many fields in history query.");
+        EXIT_IF_TRUE(
+            get_history_field(&jr, &request->fields[request->field_count]) != RESULT_OK,
+            RESULT_ERROR,
+            "Failed reading history query fields.");
+        request->field_count++;
+      }
+
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed reading history query fields.");
+    }
+    else if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("from")))
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query from.");
+      rc = az_json_token_get_uint32(&jr.token, &request->from);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query from value.");
+    }
+    else if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("to")))
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query to.");
+      rc = az_json_token_get_uint32(&jr.token, &request->to);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query to value.");
+    }
+    else if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("resolution")))
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query resolution.");
+      rc = az_json_token_get_uint32(&jr.token, &request->resolution);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query resolution value.");
+    }
+    else if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("next")))
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_TRUE(
+          az_result_failed(rc) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT,
+          RESULT_ERROR,
+          "History query next is not a json object.");
+
+      while (az_result_succeeded(rc = az_json_reader_next_token(&jr))
+             && jr.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME)
+      {
+        if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("field")))
+        {
+          rc = az_json_reader_next_token(&jr);
+          EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query next field.");
+          EXIT_IF_TRUE(
+              get_history_field(&jr, &next_field) != RESULT_OK,
+              RESULT_ERROR,
+              "Failed reading history query next field.");
+          has_next_field = true;
+        }
+        else if (az_json_token_is_text_equal(&jr.token, AZ_SPAN_FROM_STR("from")))
+        {
+          rc = az_json_reader_next_token(&jr);
+          EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query next from.");
+          rc = az_json_token_get_uint32(&jr.token, &request->next_from);
+          EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed getting history query next from value.");
+        }
+        else
+        {
+          rc = az_json_reader_next_token(&jr);
+          EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed skipping history query next property.");
+          rc = az_json_reader_skip_children(&jr);
+          EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed skipping history query next property.");
+        }
+      }
+
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed reading history query next.");
+    }
+    else
+    {
+      rc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed skipping history query property.");
+      rc = az_json_reader_skip_children(&jr);
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed skipping history query property.");
+    }
+  }
+
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed reading history query.");
+  EXIT_IF_TRUE(
+      request->field_count == 0 || request->resolution == 0 || request->from > request->to,
+      RESULT_ERROR,
+      "History query needs fields, a resolution and a valid time range.");
+
+  if (!has_next_field)
+  {
+    request->next_from = request->from;
+    return RESULT_OK;
+  }
+
+  while (request->next_field < request->field_count
+         && request->fields[request->next_field] != next_field)
+  {
+    request->next_field++;
+  }
+
+  EXIT_IF_TRUE(
+      request->next_field == request->field_count,
+      RESULT_ERROR,
+      "History query next field is not in the query fields.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Writes a number of a history point, or null if it is not a number.
+ */
+static az_result append_history_value(az_json_writer* jw, float value, int8_t decimal_places)
+{
+  return isfinite(value) ? az_json_writer_append_double(jw, value, decimal_places)
+                         : az_json_writer_append_null(jw);
+}
+
+/*
+ * @brief    Writes a history bucket as [start,min,max,mean,count].
+ */
+static int append_history_point(
+    az_json_writer* jw,
+    uint8_t field,
+    const historian_point_t* bucket,
+    uint32_t resolution)
+{
+  int8_t decimal_places = telemetry_fields[field].decimal_places;
+  az_result rc;
+
+  rc = az_json_writer_append_begin_array(jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point.");
+  rc = az_json_writer_append_int32(
+      jw, (int32_t)(bucket->first_timestamp - bucket->first_timestamp % resolution));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point time.");
+  rc = append_history_value(jw, bucket->min, decimal_places);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point min.");
+  rc = append_history_value(jw, bucket->max, decimal_places);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point max.");
+  rc = append_history_value(jw, bucket->sum / bucket->count, decimal_places);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point mean.");
+  rc = az_json_writer_append_int32(jw, (int32_t)bucket->count);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history point count.");
+  rc = az_json_writer_append_end_array(jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing history point.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Where the points of a history query come from: the coarsest archive tier that can
+ *           answer it (-1 if none), or else the historian.
+ */
+typedef struct history_source_t_struct
+{
+  int tier;
+  historian_query_t historian_query;
+#ifdef ARCHIVE_ENABLED
+  archive_query_t archive_query;
+#endif
+} history_source_t;
+
+static int history_source_begin(history_source_t* source, uint8_t field, uint32_t from)
+{
+  history_request_t* request = &history_request;
+
+#ifdef ARCHIVE_ENABLED
+  source->tier = archive_select_tier(request->from, request->resolution, (uint32_t)time(NULL));
+
+  if (source->tier >= 0)
+  {
+    return archive_query_begin(&source->archive_query, source->tier, field, from, request->to);
+  }
+#else
+  source->tier = -1;
+#endif
+
+  return historian_query_begin(
+      &source->historian_query, field, from, request->to, request->resolution);
+}
+
+static int history_source_next(history_source_t* source, historian_point_t* point)
+{
+#ifdef ARCHIVE_ENABLED
+  if (source->tier >= 0)
+  {
+    return archive_query_next(&source->archive_query, point);
+  }
+#endif
+
+  return historian_query_next(&source->historian_query, point);
+}
+
+static void history_source_end(history_source_t* source)
+{
+  if (source->tier < 0)
+  {
+    historian_query_end(&source->historian_query);
+  }
+}
+
+/*
+ * @brief    Generates the response to the pending history query, as
+ *           {"points":{"<field>":[[start,min,max,mean,count],..],..},"next":{"field":..,"from":..}},
+ *           reading one field at a time and stopping when the buffer is full.
+ */
+static int generate_history_response(uint8_t* buffer, size_t buffer_size, size_t* length)
+{
+  history_request_t* request = &history_request;
+  history_source_t source;
+  historian_point_t point;
+  historian_point_t bucket;
+  az_json_writer jw;
+  az_result rc;
+  bool is_truncated = false;
+  uint8_t next_field = request->next_field;
+  uint32_t next_from = request->next_from;
+
+  rc = az_json_writer_init(&jw, az_span_create(buffer, (int32_t)buffer_size), NULL);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for history response.");
+
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting history response json root.");
+  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR("points"));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history points property name.");
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history points object.");
+
+  for (uint8_t i = request->next_field; i < request->field_count && !is_truncated; i++)
+  {
+    uint8_t field = request->fields[i];
 
-    last_telemetry_send_time = now;
+    rc = az_json_writer_append_property_name(&jw, telemetry_fields[field].name);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history field property name.");
+    rc = az_json_writer_append_begin_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history field array.");
 
-    if (generate_telemetry_payload(data_buffer, DATA_BUFFER_SIZE, &payload_size) != RESULT_OK)
-    {
-      LogError("Failed generating telemetry payload.");
-      return RESULT_ERROR;
-    }
+    EXIT_IF_TRUE(
+        history_source_begin(
+            &source, field, i == request->next_field ? request->next_from : request->from)
+            != 0,
+        RESULT_ERROR,
+        "Failed starting history query.");
+
+    bucket.count = 0;
 
-    if (azure_iot_send_telemetry(azure_iot, az_span_create(data_buffer, payload_size)) != 0)
+    while (true)
     {
-      LogError("Failed sending telemetry.");
-      return RESULT_ERROR;
+      bool is_done = history_source_next(&source, &point) != 0;
+
+      // Points come in time order, so a bucket is complete once a point of another one comes.
+      if (bucket.count > 0
+          && (is_done
+              || point.first_timestamp / request->resolution
+                  != bucket.first_timestamp / request->resolution))
+      {
+        if (buffer_size - az_span_size(az_json_writer_get_bytes_used_in_destination(&jw))
+            < HISTORY_POINT_MAX_SIZE + HISTORY_RESPONSE_CLOSING_MAX_SIZE)
+        {
+          is_truncated = true;
+          next_field = i;
+          next_from = bucket.first_timestamp - bucket.first_timestamp % request->resolution;
+          history_source_end(&source);
+          break;
+        }
+
+        if (append_history_point(&jw, field, &bucket, request->resolution) != RESULT_OK)
+        {
+          // Releases the historian's query file before giving up.
+          history_source_end(&source);
+          LogError("Failed adding history point.");
+          return RESULT_ERROR;
+        }
+
+        bucket.count = 0;
+      }
+
+      if (is_done)
+      {
+        break;
+      }
+
+      if (bucket.count == 0)
+      {
+        bucket = point;
+      }
+      else
+      {
+        bucket.last_timestamp = point.last_timestamp;
+        bucket.count += point.count;
+        bucket.sum += point.sum;
+        bucket.min = point.min < bucket.min ? point.min : bucket.min;
+        bucket.max = point.max > bucket.max ? point.max : bucket.max;
+      }
     }
+
+    rc = az_json_writer_append_end_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing history field array.");
   }
 
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing history points object.");
+
+  if (is_truncated)
+  {
+    rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR("next"));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next property name.");
+    rc = az_json_writer_append_begin_object(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next object.");
+    rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR("field"));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next field property name.");
+    rc = az_json_writer_append_string(&jw, telemetry_fields[request->fields[next_field]].name);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next field value.");
+    rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR("from"));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next from property name.");
+    rc = az_json_writer_append_int32(&jw, (int32_t)next_from);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding history next from value.");
+    rc = az_json_writer_append_end_object(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing history next object.");
+  }
+
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing history response json root.");
+
+  *length = az_span_size(az_json_writer_get_bytes_used_in_destination(&jw));
+
   return RESULT_OK;
 }
 
+/*
+ * @brief    Answers the pending history query.
+ */
+static int send_history_response(azure_iot_t* azure_iot)
+{
+  size_t length;
+  int result;
+
+  if (generate_history_response(data_buffer, DATA_BUFFER_SIZE, &length) == RESULT_OK)
+  {
+    LogInfo("History query answered with %u bytes.", length);
+    result = azure_iot_send_command_response(
+        azure_iot,
+        history_request_id,
+        COMMAND_RESPONSE_CODE_OK,
+        az_span_create(data_buffer, length));
+  }
+  else
+  {
+    result = azure_iot_send_command_response(
+        azure_iot, history_request_id, COMMAND_RESPONSE_CODE_ERROR, AZ_SPAN_EMPTY);
+  }
+
+  is_history_request_pending = false;
+
+  return result;
+}
+#endif // HISTORIAN_ENABLED
+
 int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
@@ -180,6 +1593,35 @@ int azure_pnp_handle_command_request(azure_iot_t* azure_iot, command_request_t c
         "OLED display: %.*s", az_span_size(command.payload) - 2, az_span_ptr(command.payload) + 1);
     response_code = COMMAND_RESPONSE_CODE_ACCEPTED;
   }
+#ifdef HISTORIAN_ENABLED
+  else if (az_span_is_content_equal(command.command_name, COMMAND_NAME_QUERY_HISTORY))
+  {
+    if (is_history_request_pending)
+    {
+      LogError("History query rejected, another one is running.");
+      response_code = COMMAND_RESPONSE_CODE_BUSY;
+    }
+    else if (
+        az_span_size(command.request_id) > HISTORY_REQUEST_ID_MAX_SIZE
+        || parse_history_request(command.payload, &history_request) != RESULT_OK)
+    {
+      LogError(
+          "Invalid history query (%.*s).",
+          az_span_size(command.payload),
+          az_span_ptr(command.payload));
+      response_code = COMMAND_RESPONSE_CODE_BAD_REQUEST;
+    }
+    else
+    {
+      // The response is sent by `azure_pnp_send_telemetry`.
+      history_request_id = az_span_create(
+          history_request_id_buffer, az_span_size(command.request_id));
+      az_span_copy(history_request_id, command.request_id);
+      is_history_request_pending = true;
+      return RESULT_OK;
+    }
+  }
+#endif
   else
   {
     LogError(
@@ -201,21 +1643,94 @@ int azure_pnp_handle_properties_update(
   _az_PRECONDITION_NOT_NULL(azure_iot);
   _az_PRECONDITION_VALID_SPAN(properties, 1, false);
 
+  return handle_properties(
+      azure_iot, properties, AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED, request_id);
+}
+
+int azure_pnp_handle_properties_document(
+    azure_iot_t* azure_iot,
+    az_span properties_document,
+    uint32_t request_id)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_VALID_SPAN(properties_document, 1, false);
+
+  return handle_properties(
+      azure_iot,
+      properties_document,
+      AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE,
+      request_id);
+}
+
+/*
+ * @brief    Applies the writable properties in a writable-properties update or a properties
+ *           document, and sends back the response (if there is anything to respond).
+ * @remark   Called on the MQTT client task, so it must not use `data_buffer`.
+ */
+static int handle_properties(
+    azure_iot_t* azure_iot,
+    az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
+    uint32_t request_id)
+{
   int result;
   size_t length;
 
   result = consume_properties_and_generate_response(
-      azure_iot, properties, data_buffer, DATA_BUFFER_SIZE, &length);
+      azure_iot,
+      properties,
+      message_type,
+      properties_response_buffer,
+      PROPERTIES_RESPONSE_BUFFER_SIZE,
+      &length);
   EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed generating properties ack payload.");
 
+  if (length == 0)
+  {
+    return RESULT_OK;
+  }
+
   result = azure_iot_send_properties_update(
-      azure_iot, request_id, az_span_create(data_buffer, length));
+      azure_iot, request_id, az_span_create(properties_response_buffer, length));
   EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed sending reported properties update.");
 
   return RESULT_OK;
 }
 
 /* --- Internal Functions --- */
+static void apply_telemetry_frequency(int32_t frequency_in_seconds)
+{
+  azure_pnp_set_telemetry_frequency((size_t)frequency_in_seconds);
+}
+
+static int32_t get_telemetry_frequency() { return (int32_t)telemetry_frequency_in_seconds; }
+
+static void apply_telemetry_field_groups(int32_t field_groups)
+{
+  azure_pnp_set_telemetry_field_groups((uint8_t)field_groups);
+}
+
+static int32_t get_telemetry_field_groups() { return telemetry_field_groups; }
+
+static int parse_telemetry_field_groups(az_span names, int32_t* field_groups)
+{
+  uint8_t groups;
+
+  if (telemetry_field_groups_parse(names, &groups) != 0)
+  {
+    return 1;
+  }
+
+  *field_groups = groups;
+
+  return 0;
+}
+
+static int format_telemetry_field_groups(int32_t field_groups, az_span buffer, az_span* out_names)
+{
+  return telemetry_field_groups_to_string((uint8_t)field_groups, buffer, out_names);
+}
+
 static float simulated_get_temperature() { return 21.0; }
 
 static float simulated_get_humidity() { return 88.0; }
@@ -252,389 +1767,190 @@ static void simulated_get_pitch_roll_accel(
   *accelerationZ = 55;
 }
 
-static int generate_telemetry_payload(
-    uint8_t* payload_buffer,
-    size_t payload_buffer_size,
-    size_t* payload_buffer_length)
+/*
+ * @brief    Rounds a telemetry value the same way it is written in the payload, so values only
+ *           count as changed when the change is visible in the payload.
+ */
+static float round_telemetry_value(float value, int8_t decimal_places)
 {
-  az_json_writer jw;
-  az_result rc;
-  az_span payload_buffer_span = az_span_create(payload_buffer, payload_buffer_size);
-  az_span json_span;
-
-  clearData();
-  getData();
-  computeData();
-  
-  rc = az_json_writer_init(&jw, payload_buffer_span, NULL);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for telemetry.");
-
-  rc = az_json_writer_append_begin_object(&jw);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting telemetry json root.");
-
-
-  //########################              ENERGY METER TELEMETRY           #########################
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL3N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_VOLTAGE_LN));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgVoltageLN property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgVoltageLN, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgVoltageLN property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L1L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1L2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL1L2, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1L2 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L2L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL2L3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL2L3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL2L3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_VOLTAGE_L1L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1L3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, voltageL1L3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding voltageL1L3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_VOLTAGE_LL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgVoltageLL property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgVoltageLL, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgVoltageLL property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_CURRENT_L1));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL1 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, currentL1, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL1 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_CURRENT_L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, currentL2, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL2 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_CURRENT_L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, currentL3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentL3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_CURRENT_NEUTRAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentNeutral property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, currentNeutral, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentNeutral property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_CURRENTL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgCurrentL property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgCurrentL, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgCurrentL property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_CURRENT_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, currentTotal, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding currentTotal property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_POWER_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realPowerL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_POWER_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realPowerL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_POWER_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realPowerL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerL3N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_POWER_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realPowerTotal, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realPowerTotal property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_POWER_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentPowerL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_POWER_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentPowerL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_POWER_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentPowerL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerL3N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_POWER_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentPowerTotal, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentPowerTotal property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_POWER_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactivePowerL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_POWER_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactivePowerL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_POWER_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactivePowerL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerL3N property value to telemetry payload. ");
+  double scale = pow(10, decimal_places);
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_POWER_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactivePowerTotal, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactivePowerTotal property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COS_PHI_L1));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL1 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, cosPhiL1, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL1 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COS_PHI_L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, cosPhiL2, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL2 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COS_PHI_L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, cosPhiL3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding cosPhiL3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_COS_PHI));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgCosPhi property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgCosPhi, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgCosPhi property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_FREQUENCY));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding frequency property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, frequency, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding frequency property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_ROT_FIELD));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding rotField property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, rotField, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding rotField property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_ENERGY_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realEnergyL1N, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_ENERGY_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realEnergyL2N, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_ENERGY_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realEnergyL3N, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyL3N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REAL_ENERGY_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, realEnergyTotal, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding realEnergyTotal property value to telemetry payload. ");
-
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L1));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL1 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentEnergyL1, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL1 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentEnergyL2, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL2 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentEnergyL3, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyL3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_APPARENT_ENERGY_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, apparentEnergyTotal, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding apparentEnergyTotal property value to telemetry payload. ");
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L1));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL1 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactiveEnergyL1, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL1 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactiveEnergyL2, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL2 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactiveEnergyL3, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyL3 property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, reactiveEnergyTotal, TRIPLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding reactiveEnergyTotal property value to telemetry payload. ");
-
-
-
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL2N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL3N property value to telemetry payload. ");
-
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_THD_VOLTS_LN));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgTHDVoltsLN, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgTHDVoltsLN property value to telemetry payload. ");
+  return isfinite(value) ? (float)(round(value * scale) / scale) : value;
+}
 
+#ifdef SAMPLE_LOG_ENABLED
+/*
+ * @brief    Appends the sample just read (all the fields, even the ones not sent) to the sample log.
+ */
+static void log_telemetry_sample()
+{
+  static sample_log_record_t record;
 
+  record.timestamp = (uint32_t)timestamp;
+  record.sequence = telemetry_frame_sequence;
+  record.com_status = (uint8_t)comStatus;
+  record.field_groups = telemetry_field_groups;
+  record.reserved = 0;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_CURRENT_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDCurrentL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL1N property value to telemetry payload. ");
+  for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    record.values[i] = *telemetry_fields[i].value;
+  }
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_CURRENT_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDCurrentL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL2N property value to telemetry payload. ");
+  if (sample_log_append(&record) != 0)
+  {
+    LogError("Failed appending telemetry sample %u to the sample log.", telemetry_frame_sequence);
+  }
+}
+#endif
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_CURRENT_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDCurrentL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDCurrentL3N property value to telemetry payload. ");
+/*
+ * @brief    Reads a telemetry sample and hands it to the packer.
+ * @remark   A sample that does not fit in `payload_buffer` is split in several parts (JSON
+ *           objects with the same "seq") instead of being dropped.
+ */
+static int generate_telemetry_payload(
+    azure_iot_t* azure_iot,
+    time_t now,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size)
+{
+  bool is_keyframe;
+  uint64_t fields = 0;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_THD_CURRENT_LN));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgTHDCurrentLN property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgTHDCurrentLN, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgTHDCurrentLN property value to telemetry payload. ");
+  clearData();
+  getData(telemetry_field_groups);
+  computeData();
 
+#ifdef SAMPLE_LOG_ENABLED
+  log_telemetry_sample();
+#endif
 
+#ifdef HISTORIAN_ENABLED
+  if (historian_append((uint32_t)timestamp, telemetry_field_groups) != 0)
+  {
+    LogError("Failed adding telemetry sample %u to the historian.", telemetry_frame_sequence);
+  }
+#endif
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L1L2));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1L2 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL1L2, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1L2 property value to telemetry payload. ");
+#ifdef ARCHIVE_ENABLED
+  if (archive_append((uint32_t)timestamp, telemetry_field_groups) != 0)
+  {
+    LogError("Failed adding telemetry sample %u to the archive.", telemetry_frame_sequence);
+  }
+#endif
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L2L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL2L3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL2L3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL2L3 property value to telemetry payload. ");
+  update_telemetry_frame_reference();
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_THD_VOLTS_L1L3));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1L3 property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, THDVoltsL1L3, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding THDVoltsL1L3 property value to telemetry payload. ");
+  is_keyframe = telemetry_keyframe_required || telemetry_frames_until_keyframe == 0;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_AVG_THD_VOLTS_LL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgTHDVoltsLL property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, avgTHDVoltsLL, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding avgTHDVoltsLL property value to telemetry payload. ");
+  for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    const telemetry_field_t* field = &telemetry_fields[i];
+    float value;
 
+    if ((field->group & telemetry_field_groups) == 0)
+    {
+      continue;
+    }
 
+    value = round_telemetry_value(*field->value, field->decimal_places);
+    telemetry_frame_latest[i] = value;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_POWER_FACTOR_L1N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL1N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, powerFactorL1N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL1N property value to telemetry payload. ");
+    // Bitwise comparison, so a NaN that stays NaN does not count as a change.
+    if (is_keyframe || (telemetry_fields_changed & (1ULL << i)) != 0
+        || memcmp(&value, &telemetry_frame_reference[i], sizeof(value)) != 0)
+    {
+      fields |= 1ULL << i;
+    }
+  }
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_POWER_FACTOR_L2N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL2N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, powerFactorL2N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL2N property value to telemetry payload. ");
+  telemetry_fields_changed |= fields;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_POWER_FACTOR_L3N));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL3N property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, powerFactorL3N, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorL3N property value to telemetry payload. ");
+  // Cleared before the frame is packed, which can find that the next one must be a keyframe.
+  telemetry_keyframe_required = false;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_POWER_FACTOR_TOTAL));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorTotal property name to telemetry payload.");
-  rc = az_json_writer_append_double(&jw, powerFactorTotal, DOUBLE_DECIMAL_PLACE_DIGITS);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding powerFactorTotal property value to telemetry payload. ");
+  if (write_telemetry_frame(
+          azure_iot, now, payload_buffer, payload_buffer_size, is_keyframe, fields)
+      != RESULT_OK)
+  {
+    // Only some parts of the frame might have been packed.
+    telemetry_keyframe_required = true;
+    return RESULT_ERROR;
+  }
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COM_STATUS));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding comStatus property name to telemetry payload.");
-  rc = az_json_writer_append_int32(&jw, comStatus);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding comStatus property value to telemetry payload. ");
+  telemetry_frame_sequence++;
+  telemetry_frames_until_keyframe
+      = is_keyframe ? TELEMETRY_KEYFRAME_INTERVAL - 1 : telemetry_frames_until_keyframe - 1;
 
-  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_TIMESTAMP));
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp property name to telemetry payload.");
-  //rc = az_json_writer_append_int32(&jw, unixTimestamp);
-  DateTime date = DateTime(timestamp);
-  char dateFormat[] = "YYYY-MM-DDThh:mm:ss.000Z";
-  date.toString(dateFormat);
-  rc = az_json_writer_append_string(&jw, az_span_create_from_str(dateFormat));
+  return RESULT_OK;
+}
 
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp property value to telemetry payload. ");
+/*
+ * @brief    Writes a telemetry frame with the `fields` given (a bit per field), in as many parts as
+ *           needed, and hands the parts to the packer.
+ */
+static int write_telemetry_frame(
+    azure_iot_t* azure_iot,
+    time_t now,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    bool is_keyframe,
+    uint64_t fields)
+{
+  telemetry_frame_t frame;
+  telemetry_payload_writer_t writer;
+  az_span part;
 
+  frame.sequence = telemetry_frame_sequence;
+  frame.is_keyframe = is_keyframe;
+  frame.fields = fields;
+  frame.com_status = comStatus;
+  frame.message_units_today = (int32_t)message_units_get_today(now);
+  frame.timestamp = timestamp;
 
+  telemetry_payload_writer_init(&writer, &frame);
 
+  while (!telemetry_payload_is_done(&writer))
+  {
+    EXIT_IF_TRUE(
+        telemetry_payload_write_part(
+            &writer, az_span_create(payload_buffer, payload_buffer_size), &part)
+            != 0,
+        RESULT_ERROR,
+        "Failed writing telemetry payload.");
+
+    if (!telemetry_payload_is_done(&writer))
+    {
+      LogInfo(
+          "Telemetry sample %u split, part %d is %d bytes.",
+          telemetry_frame_sequence,
+          writer.part - 1,
+          az_span_size(part));
+    }
 
-  rc = az_json_writer_append_end_object(&jw);
-  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing telemetry json payload.");
+    (void)pack_telemetry_sample(azure_iot, part, now);
+  }
 
-  payload_buffer_span = az_json_writer_get_bytes_used_in_destination(&jw);
+  return RESULT_OK;
+}
 
-  if ((payload_buffer_size - az_span_size(payload_buffer_span)) < 1)
+/*
+ * @brief    Moves the reference of the telemetry frames to the last frame generated, once every
+ *           frame is known delivered: none is left in the packer, the outbox or the telemetry queue
+ *           (with QoS 1, messages only leave the queue once acknowledged).
+ */
+static void update_telemetry_frame_reference()
+{
+  if (telemetry_packer_get_sample_count(&telemetry_packer) > 0
+      || outbox_get_count(outbox_class_telemetry) > 0 || !telemetry_queue_is_empty())
   {
-    LogError("Insufficient space for telemetry payload null terminator.");
-    return RESULT_ERROR;
+    return;
   }
 
-  payload_buffer[az_span_size(payload_buffer_span)] = null_terminator;
-  *payload_buffer_length = az_span_size(payload_buffer_span);
-
-  return RESULT_OK;
+  (void)memcpy(
+      telemetry_frame_reference, telemetry_frame_latest, sizeof(telemetry_frame_reference));
+  telemetry_fields_changed = 0;
 }
 
 static int generate_device_info_payload(
@@ -798,83 +2114,95 @@ static int generate_device_info_payload(
   return RESULT_OK;
 }
 
-static int generate_properties_update_response(
+/*
+ * @brief    Appends the response to a writable property to the properties update response being
+ *           written by `jw`.
+ */
+static int append_properties_update_response(
     azure_iot_t* azure_iot,
-    az_span component_name,
-    int32_t frequency,
-    int32_t version,
-    uint8_t* buffer,
-    size_t buffer_size,
-    size_t* response_length)
+    az_json_writer* jw,
+    az_span property_name,
+    az_span property_value_json,
+    int32_t status,
+    az_span description,
+    int32_t version)
 {
   az_result azrc;
-  az_json_writer jw;
-  az_span response = az_span_create(buffer, buffer_size);
-
-  azrc = az_json_writer_init(&jw, response, NULL);
-  EXIT_IF_AZ_FAILED(
-      azrc, RESULT_ERROR, "Failed initializing json writer for properties update response.");
-
-  azrc = az_json_writer_append_begin_object(&jw);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed opening json in properties update response.");
 
   // This Azure PnP Template does not have a named component,
   // so az_iot_hub_client_properties_writer_begin_component is not needed.
 
   azrc = az_iot_hub_client_properties_writer_begin_response_status(
       &azure_iot->iot_hub_client,
-      &jw,
-      AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS),
-      (int32_t)AZ_IOT_STATUS_OK,
+      jw,
+      property_name,
+      status,
       version,
-      AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_RESPONSE_SUCCESS));
+      description);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed appending status to properties update response.");
 
-  azrc = az_json_writer_append_int32(&jw, frequency);
+  azrc = az_json_writer_append_json_text(jw, property_value_json);
   EXIT_IF_AZ_FAILED(
-      azrc, RESULT_ERROR, "Failed appending frequency value to properties update response.");
+      azrc, RESULT_ERROR, "Failed appending property value to properties update response.");
 
-  azrc = az_iot_hub_client_properties_writer_end_response_status(&azure_iot->iot_hub_client, &jw);
+  azrc = az_iot_hub_client_properties_writer_end_response_status(&azure_iot->iot_hub_client, jw);
   EXIT_IF_AZ_FAILED(
       azrc, RESULT_ERROR, "Failed closing status section in properties update response.");
 
   // This Azure PnP Template does not have a named component,
   // so az_iot_hub_client_properties_writer_end_component is not needed.
 
-  azrc = az_json_writer_append_end_object(&jw);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed closing json in properties update response.");
-
-  *response_length = az_span_size(az_json_writer_get_bytes_used_in_destination(&jw));
-
   return RESULT_OK;
 }
 
+/*
+ * @brief    Applies the writable properties received, and generates a single properties update
+ *           response with the ack of all of them (or none if there is nothing to respond).
+ */
 static int consume_properties_and_generate_response(
     azure_iot_t* azure_iot,
     az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
     uint8_t* buffer,
     size_t buffer_size,
     size_t* response_length)
 {
   int result;
   az_json_reader jr;
+  az_json_writer jw;
   az_span component_name;
   int32_t version = 0;
+  int32_t response_count = 0;
+  // Values are echoed back as JSON, so strings with quotes around them.
+  uint8_t value_json_buffer[WRITABLE_PROPERTY_STRING_MAX_SIZE + 2];
+
+  *response_length = 0;
 
   az_result azrc = az_json_reader_init(&jr, properties, NULL);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed initializing json reader for properties update.");
 
-  const az_iot_hub_client_properties_message_type message_type
-      = AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED;
-
   azrc = az_iot_hub_client_properties_get_properties_version(
       &azure_iot->iot_hub_client, &jr, message_type, &version);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed writable properties version.");
 
+  if (message_type == AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE
+      && version == desired_properties_version)
+  {
+    LogInfo("Writable properties unchanged since applied (version %d).", version);
+    return RESULT_OK;
+  }
+
   azrc = az_json_reader_init(&jr, properties, NULL);
   EXIT_IF_AZ_FAILED(
       azrc, RESULT_ERROR, "Failed re-initializing json reader for properties update.");
 
+  azrc = az_json_writer_init(&jw, az_span_create(buffer, buffer_size), NULL);
+  EXIT_IF_AZ_FAILED(
+      azrc, RESULT_ERROR, "Failed initializing json writer for properties update response.");
+
+  azrc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed opening json in properties update response.");
+
   while (az_result_succeeded(
       azrc = az_iot_hub_client_properties_get_next_component_property(
           &azure_iot->iot_hub_client,
@@ -883,24 +2211,9 @@ static int consume_properties_and_generate_response(
           AZ_IOT_HUB_CLIENT_PROPERTY_WRITABLE,
           &component_name)))
   {
-    if (az_json_token_is_text_equal(
-            &jr.token, AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS)))
-    {
-      int32_t value;
-      azrc = az_json_reader_next_token(&jr);
-      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties next token.");
+    const writable_property_t* property = writable_properties_find(&jr.token);
 
-      azrc = az_json_token_get_int32(&jr.token, &value);
-      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties int32_t value.");
-
-      azure_pnp_set_telemetry_frequency((size_t)value);
-
-      result = generate_properties_update_response(
-          azure_iot, component_name, value, version, buffer, buffer_size, response_length);
-      EXIT_IF_TRUE(
-          result != RESULT_OK, RESULT_ERROR, "generate_properties_update_response failed.");
-    }
-    else
+    if (property == NULL)
     {
       LogError(
           "Unexpected property received (%.*s).",
@@ -909,15 +2222,53 @@ static int consume_properties_and_generate_response(
     }
 
     azrc = az_json_reader_next_token(&jr);
-    EXIT_IF_AZ_FAILED(
-        azrc, RESULT_ERROR, "Failed moving to next json token of writable properties.");
+    EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties next token.");
+
+    if (property != NULL)
+    {
+      bool is_valid = writable_property_apply(property, &jr.token);
+      az_span value_json;
+
+      EXIT_IF_TRUE(
+          writable_property_get_json(
+              property, AZ_SPAN_FROM_BUFFER(value_json_buffer), &value_json)
+              != 0,
+          RESULT_ERROR,
+          "Failed writing writable property value.");
+
+      result = append_properties_update_response(
+          azure_iot,
+          &jw,
+          az_span_create_from_str((char*)property->name),
+          value_json,
+          is_valid ? (int32_t)AZ_IOT_STATUS_OK : (int32_t)AZ_IOT_STATUS_BAD_REQUEST,
+          is_valid ? AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_RESPONSE_SUCCESS)
+                   : AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_RESPONSE_INVALID_VALUE),
+          version);
+      EXIT_IF_TRUE(
+          result != RESULT_OK, RESULT_ERROR, "append_properties_update_response failed.");
 
+      response_count++;
+    }
+
+    // Past the value (and its children, if any), where the next property is looked for from.
     azrc = az_json_reader_skip_children(&jr);
     EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed skipping children of writable properties.");
 
     azrc = az_json_reader_next_token(&jr);
     EXIT_IF_AZ_FAILED(
-        azrc, RESULT_ERROR, "Failed moving to next json token of writable properties (again).");
+        azrc, RESULT_ERROR, "Failed moving to next json token of writable properties.");
+  }
+
+  desired_properties_version = version;
+  (void)writable_properties_save(version);
+
+  if (response_count > 0)
+  {
+    azrc = az_json_writer_append_end_object(&jw);
+    EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed closing json in properties update response.");
+
+    *response_length = az_span_size(az_json_writer_get_bytes_used_in_destination(&jw));
   }
 
   return RESULT_OK;
@@ -54,9 +54,21 @@ int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id);
  */
 void azure_pnp_set_telemetry_frequency(size_t frequency_in_seconds);
 
+/*
+ * @brief     Sets which groups of telemetry fields are read from the energy meter and sent.
+ * @remark    All the groups are sent by default. Changing the groups makes the next telemetry
+ *            frame a keyframe.
+ *
+ * @param[in]    field_groups    `TELEMETRY_FIELD_GROUP_*` flags (see src/telemetryFields.h).
+ */
+void azure_pnp_set_telemetry_field_groups(uint8_t field_groups);
+
 /*
  * @brief     Sends telemetry implemented by this IoT Plug and Play application to Azure IoT
  * Central.
+ * @remark    It should also be called while not connected to Azure IoT Central: samples are still
+ *            taken and stored in the telemetry queue on the SD card, and forwarded once connected
+ *            again.
  * @remark    The IoT Plug and Play template implemented by this device is specific to the
  *            Espressif ESP32 Azure IoT Kit board, which contains several sensors.
  *            The template defines telemetry data points for temperature, humidity,
@@ -91,7 +103,7 @@ int azure_pnp_handle_command_request(azure_iot_t* azure_iot, command_request_t c
 /*
  * @brief     Handles a payload with writable properties received from Azure IoT Central.
  * @remark    This function will consume the writable properties update received
- *            and send back a response to Azure IoT Central.
+ *            and send back a single response to Azure IoT Central, acknowledging all of them.
  *
  * @param[in]    azure_iot     A pointer to a azure_iot_t instance, previously initialized
  *                             with `azure_iot_init`.
@@ -108,4 +120,33 @@ int azure_pnp_handle_properties_update(
     az_span properties,
     uint32_t request_id);
 
+/*
+ * @brief     Handles the properties document received from Azure IoT Central on connecting.
+ * @remark    The writable properties in it are only applied (and responded to) if their version
+ *            is not the one last applied, which is kept in NVS along with the properties, and
+ *            then only those whose value changed are applied again.
+ *
+ * @param[in]    azure_iot              A pointer to a azure_iot_t instance, previously initialized
+ *                                      with `azure_iot_init`.
+ * @param[in]    properties_document    Raw properties document payload received from Azure.
+ * @param[in]    request_id             The request ID of the response that is sent to the Azure
+ *                                      IoT Central (see `azure_pnp_handle_properties_update`).
+ *
+ * return        int                    0 on success, non-zero if any failure occurs.
+ */
+int azure_pnp_handle_properties_document(
+    azure_iot_t* azure_iot,
+    az_span properties_document,
+    uint32_t request_id);
+
+/*
+ * @brief     Handles the PUBACK of a telemetry message published with QoS 1, so the message can be
+ *            released from the telemetry queue.
+ * @remark    It can be called from the MQTT client task; the message is released the next time
+ *            `azure_pnp_send_telemetry` is called.
+ *
+ * @param[in]    packet_id    The packet ID the message was published with.
+ */
+void azure_pnp_handle_publish_completed(int packet_id);
+
 #endif // AZURE_IOT_PNP_TEMPLATE_H
@@ -82,6 +82,11 @@
 
 #endif // IOT_CONFIG_USE_X509_CERT
 
+// The Azure IoT Hub and device ID assigned by the Device Provisioning Service are kept in NVS, so
+// later boots connect to the hub right away (device-provisioning is only done again if that
+// fails). Comment out to provision on every boot.
+#define PROVISIONING_RESULT_CACHE_ENABLED
+
 // User-agent (url-encoded) provided by the MQTT client to Azure IoT Services.
 // When developing for your own Arduino-based platform,
 // please update the suffix with the format '(ard;<platform>)' as an url-encoded string.
@@ -90,6 +95,64 @@
 // Publish 1 message every 2 seconds.
 #define TELEMETRY_FREQUENCY_IN_SECONDS 2
 
+// Telemetry samples are packed into messages as close as possible to the 4 KB IoT Hub message unit.
+// A sample is never held for longer than this before its message is sent.
+// A message has a single creation time (iothub-creation-time-utc), that of its first sample, so
+// IoT Central charts the other samples packed with it up to this many seconds early (each sample
+// still has its own "timestamp" field). Set it to 0 to send every sample in a message of its own,
+// charted at its own time, at the cost of a message unit per sample.
+#define TELEMETRY_PACKER_MAX_AGE_IN_SECONDS 300
+
+// Enable macro TELEMETRY_COMPRESSION_ENABLED to deflate-compress telemetry messages (sent with
+// content encoding "deflate"). Messages are only sent compressed if that makes them smaller.
+// Samples are then packed for as long as the message still compresses into a message unit, in a
+// packer buffer of 12 KB instead of 4 KB.
+// #define TELEMETRY_COMPRESSION_ENABLED
+
+// Daily quota of IoT Hub message units for this device (e.g., 30000 messages a month in IoT Central
+// Standard tier 2). Set it to 0 to disable the check.
+#define DAILY_MESSAGE_UNIT_QUOTA 1000
+
+// Every this many telemetry frames a keyframe (with all the fields) is sent. The frames in between
+// only have the fields that changed since the last frame known delivered, plus a "seq" number so
+// the backend can rebuild the full state. Set it to 1 for every frame to have all the fields.
+#define TELEMETRY_KEYFRAME_INTERVAL 1
+
+// Telemetry that can not be sent (uplink down or publish failure) is stored in a queue on the SD
+// card. Once connected again, one stored message is forwarded every this many milliseconds, along
+// with live telemetry.
+#define TELEMETRY_QUEUE_CATCH_UP_INTERVAL_IN_MS 2000
+
+// Enable macro TELEMETRY_QOS_AT_LEAST_ONCE to publish telemetry with QoS 1. Every message then goes
+// through the queue above, and is only removed from it once Azure IoT Hub acknowledges it (PUBACK),
+// with up to PUBLISH_WINDOW_SIZE (see src/publishWindow.h) messages in flight at a time. Messages
+// are sent again after a reconnection, or if their PUBACK takes longer than the timeout below.
+// #define TELEMETRY_QOS_AT_LEAST_ONCE
+#define TELEMETRY_PUBACK_TIMEOUT_IN_MS 30000
+
+// The SD card stores below are written as each sample is read, on the main loop, so they add the
+// SD card write time to every telemetry pass. They are all off unless enabled here.
+
+// Enable macro SAMPLE_LOG_ENABLED to also keep every telemetry sample on the SD card as a binary
+// record (see src/sampleLog.h), so past samples can be replayed.
+// #define SAMPLE_LOG_ENABLED
+
+// Enable macro HISTORIAN_ENABLED to also keep every telemetry field compressed on the SD card, per
+// month, for a few months (see src/historian.h), so its history can be queried on the device.
+// #define HISTORIAN_ENABLED
+
+// Enable macro ARCHIVE_ENABLED (along with HISTORIAN_ENABLED, which answers the history queries) to
+// also keep every telemetry field downsampled (min, max and mean) in round-robin tiers of 1 s,
+// 1 min and 15 min buckets on the SD card (see src/archive.h), which answer long history queries
+// without going through every sample. They take about 230 MB.
+// #define ARCHIVE_ENABLED
+
+// Enable macro LOG_TOKENIZED to log messages as binary records (see src/tokenizedLog.h) in
+// sysLog/modules/main/main.bin instead of formatting them, which is much cheaper. Nothing is printed
+// to the serial port in this mode; decode the file with tools/decode_tokenized_log.py and the ELF
+// file of the same build.
+// #define LOG_TOKENIZED
+
 // For how long the MQTT password (SAS token) is valid, in minutes.
 // After that, the sample automatically generates a new password and re-connects.
 #define MQTT_PASSWORD_LIFETIME_IN_MINUTES 60
@@ -0,0 +1,295 @@
+#include "archive.h"
+
+#include <Arduino.h>
+#include <SD.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+#include "crc32.h"
+#include "validTime.h"
+
+#define ARCHIVE_DIRECTORY "/archive"
+#define ARCHIVE_PATH_SIZE 32
+
+const archive_tier_t archive_tiers[ARCHIVE_TIER_COUNT] = {
+  { 1, 86400 }, // A day.
+  { 60, 43200 }, // 30 days.
+  { 900, 140256 }, // 4 years.
+};
+
+/*
+ * @brief    A bucket of a tier. While open (in RAM), `mean` holds the sum of the values.
+ */
+typedef struct archive_slot_t_struct
+{
+  uint32_t bucket_start;
+  uint32_t crc; // CRC-32 of the slot, with this field set to zero.
+  uint16_t counts[TELEMETRY_FIELD_COUNT];
+  float min[TELEMETRY_FIELD_COUNT];
+  float max[TELEMETRY_FIELD_COUNT];
+  float mean[TELEMETRY_FIELD_COUNT];
+} archive_slot_t;
+
+static bool is_initialized = false;
+static File tier_files[ARCHIVE_TIER_COUNT];
+static archive_slot_t open_slots[ARCHIVE_TIER_COUNT];
+
+// Slot read by queries.
+static archive_slot_t query_slot;
+
+static uint32_t get_slot_crc(archive_slot_t* slot)
+{
+  uint32_t crc = slot->crc;
+  uint32_t result;
+
+  slot->crc = 0;
+  result = crc32_update(CRC32_INITIAL_VALUE, (const uint8_t*)slot, sizeof(*slot));
+  slot->crc = crc;
+
+  return result;
+}
+
+static uint32_t get_slot_offset(uint8_t tier, uint32_t bucket_start)
+{
+  return (bucket_start / archive_tiers[tier].resolution % archive_tiers[tier].slot_count)
+      * sizeof(archive_slot_t);
+}
+
+/*
+ * @brief    Opens the file of a tier, extending it to its full size so the space is taken up front.
+ */
+static int open_tier(uint8_t tier)
+{
+  char path[ARCHIVE_PATH_SIZE];
+  uint32_t size = archive_tiers[tier].slot_count * sizeof(archive_slot_t);
+  uint8_t zero = 0;
+
+  snprintf(path, sizeof(path), ARCHIVE_DIRECTORY "/t%u.bin", tier);
+
+  if (!SD.exists(path))
+  {
+    // Created first, as slots are both read and written.
+    tier_files[tier] = SD.open(path, FILE_WRITE);
+    tier_files[tier].close();
+  }
+
+  tier_files[tier] = SD.open(path, "r+");
+
+  if (!tier_files[tier])
+  {
+    LogError("Failed opening %s.", path);
+    return 1;
+  }
+
+  if (tier_files[tier].size() < size)
+  {
+    // Writing the last byte allocates the whole file, without writing the rest of it.
+    if (!tier_files[tier].seek(size - 1) || tier_files[tier].write(&zero, 1) != 1)
+    {
+      LogError("Failed extending %s to %u bytes.", path, size);
+      tier_files[tier].close();
+      return 1;
+    }
+
+    tier_files[tier].flush();
+    LogInfo("Archive tier %u created (%u bytes).", tier, size);
+  }
+
+  return 0;
+}
+
+static int write_slot(uint8_t tier)
+{
+  archive_slot_t* slot = &open_slots[tier];
+  File* file = &tier_files[tier];
+
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+  {
+    slot->mean[field] = slot->counts[field] > 0 ? slot->mean[field] / slot->counts[field] : NAN;
+  }
+
+  slot->crc = get_slot_crc(slot);
+
+  if (!file->seek(get_slot_offset(tier, slot->bucket_start))
+      || file->write((const uint8_t*)slot, sizeof(*slot)) != sizeof(*slot))
+  {
+    LogError("Failed writing archive tier %u bucket %u.", tier, slot->bucket_start);
+    return 1;
+  }
+
+  file->flush();
+
+  return 0;
+}
+
+int archive_init()
+{
+  int result = 0;
+
+  if (SD.cardType() == CARD_NONE)
+  {
+    LogError("No SD card for the archive.");
+    return 1;
+  }
+
+  if (!SD.exists(ARCHIVE_DIRECTORY) && !SD.mkdir(ARCHIVE_DIRECTORY))
+  {
+    LogError("Failed creating %s.", ARCHIVE_DIRECTORY);
+    return 1;
+  }
+
+  for (uint8_t tier = 0; tier < ARCHIVE_TIER_COUNT; tier++)
+  {
+    result |= open_tier(tier);
+  }
+
+  is_initialized = result == 0;
+
+  return result;
+}
+
+int archive_append(uint32_t timestamp, uint8_t field_groups)
+{
+  int result = 0;
+
+  if (!is_initialized)
+  {
+    return 1;
+  }
+
+  if (timestamp < MIN_VALID_TIME)
+  {
+    return 0;
+  }
+
+  for (uint8_t tier = 0; tier < ARCHIVE_TIER_COUNT; tier++)
+  {
+    archive_slot_t* slot = &open_slots[tier];
+    uint32_t bucket_start = timestamp - timestamp % archive_tiers[tier].resolution;
+
+    if (bucket_start < slot->bucket_start)
+    {
+      continue;
+    }
+
+    if (bucket_start != slot->bucket_start)
+    {
+      if (slot->bucket_start != 0)
+      {
+        result |= write_slot(tier);
+      }
+
+      (void)memset(slot, 0, sizeof(*slot));
+      slot->bucket_start = bucket_start;
+    }
+
+    for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+    {
+      float value = *telemetry_fields[field].value;
+
+      if ((telemetry_fields[field].group & field_groups) == 0)
+      {
+        continue;
+      }
+
+      if (slot->counts[field] == 0)
+      {
+        slot->min[field] = value;
+        slot->max[field] = value;
+        slot->mean[field] = value;
+      }
+      else
+      {
+        slot->min[field] = value < slot->min[field] ? value : slot->min[field];
+        slot->max[field] = value > slot->max[field] ? value : slot->max[field];
+        slot->mean[field] += value;
+      }
+
+      if (slot->counts[field] < UINT16_MAX)
+      {
+        slot->counts[field]++;
+      }
+    }
+  }
+
+  return result;
+}
+
+int archive_select_tier(uint32_t from, uint32_t resolution, uint32_t now)
+{
+  for (int tier = ARCHIVE_TIER_COUNT - 1; tier >= 0; tier--)
+  {
+    uint32_t retention = archive_tiers[tier].resolution * archive_tiers[tier].slot_count;
+
+    if (resolution % archive_tiers[tier].resolution == 0 && now - from < retention)
+    {
+      return is_initialized ? tier : -1;
+    }
+  }
+
+  return -1;
+}
+
+int archive_query_begin(archive_query_t* query, uint8_t tier, uint8_t field, time_t from, time_t to)
+{
+  if (tier >= ARCHIVE_TIER_COUNT || field >= TELEMETRY_FIELD_COUNT || !is_initialized)
+  {
+    return 1;
+  }
+
+  query->tier = tier;
+  query->field = field;
+  query->bucket_start = (uint32_t)from - (uint32_t)from % archive_tiers[tier].resolution;
+  query->to = (uint32_t)to;
+
+  return 0;
+}
+
+int archive_query_next(archive_query_t* query, historian_point_t* point)
+{
+  uint32_t resolution = archive_tiers[query->tier].resolution;
+  File* file = &tier_files[query->tier];
+
+  while (query->bucket_start <= query->to && query->bucket_start >= resolution)
+  {
+    uint32_t bucket_start = query->bucket_start;
+    const archive_slot_t* slot = &open_slots[query->tier];
+    float sum;
+
+    query->bucket_start += resolution;
+
+    if (bucket_start != slot->bucket_start)
+    {
+      if (!file->seek(get_slot_offset(query->tier, bucket_start))
+          || file->read((uint8_t*)&query_slot, sizeof(query_slot)) != sizeof(query_slot)
+          || query_slot.bucket_start != bucket_start || query_slot.crc != get_slot_crc(&query_slot))
+      {
+        continue;
+      }
+
+      slot = &query_slot;
+      sum = slot->mean[query->field] * slot->counts[query->field];
+    }
+    else
+    {
+      sum = slot->mean[query->field];
+    }
+
+    if (slot->counts[query->field] == 0)
+    {
+      continue;
+    }
+
+    point->first_timestamp = bucket_start;
+    point->last_timestamp = bucket_start + resolution - 1;
+    point->count = slot->counts[query->field];
+    point->min = slot->min[query->field];
+    point->max = slot->max[query->field];
+    point->sum = sum;
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * archive keeps round-robin tiers of downsampled telemetry on the SD card, so long time ranges can
+ * be queried without going through every sample.
+ *
+ * Each tier is a file of a fixed number of slots, one per bucket of the tier's resolution, holding
+ * the min, max, mean and sample count of every telemetry field in the bucket. The bucket starting
+ * at time t goes to slot (t / resolution) % slot_count, so finding a bucket is a single seek, and
+ * older buckets are overwritten as newer ones come in. Tiers are updated as samples arrive, with
+ * the open bucket of each tier kept in RAM until a sample of the next bucket comes, so a reset
+ * loses at most one bucket per tier.
+ *
+ * The default tiers are 1 s buckets for a day, 1 min buckets for 30 days and 15 min buckets for 4
+ * years, about 230 MB in total. Files are extended to their full size when created, so the space
+ * used is fixed from the start. Slots not written yet hold whatever was on the card and are told
+ * apart by their CRC. Buckets can never be finer than the telemetry frequency, so with the default
+ * of a sample a minute most slots of the 1 s tier stay empty.
+ *
+ * The SD card must be mounted before `archive_init` is called.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "historian.h"
+#include "telemetryFields.h"
+
+#define ARCHIVE_TIER_COUNT 3
+
+/*
+ * @brief    A tier, keeping `slot_count` buckets of `resolution` seconds.
+ */
+typedef struct archive_tier_t_struct
+{
+  uint32_t resolution;
+  uint32_t slot_count;
+} archive_tier_t;
+
+extern const archive_tier_t archive_tiers[ARCHIVE_TIER_COUNT];
+
+/*
+ * @brief    State of a query of a tier.
+ */
+typedef struct archive_query_t_struct
+{
+  uint8_t tier;
+  uint8_t field;
+  uint32_t bucket_start; // Next bucket to read.
+  uint32_t to;
+} archive_query_t;
+
+/*
+ * @brief        Opens (creating them if needed) the files of the tiers.
+ *
+ * @return       int       0 on success, non-zero if the SD card can not be used.
+ */
+int archive_init();
+
+/*
+ * @brief        Adds a sample of the telemetry fields in `field_groups` to the buckets of every
+ *               tier.
+ * @remark       Samples must come in time order. Nothing is stored until the clock is set.
+ *
+ * @return       int       0 on success, non-zero if a bucket could not be written.
+ */
+int archive_append(uint32_t timestamp, uint8_t field_groups);
+
+/*
+ * @brief        Chooses the tier to answer a query with: the coarsest one whose resolution
+ *               divides `resolution` and which still keeps the buckets from `from` on.
+ *
+ * @param[in]    from          Start of the time range of the query.
+ * @param[in]    resolution    Buckets (in seconds) in which the query aggregates points.
+ * @param[in]    now           Current time.
+ *
+ * @return       int           The index of the tier, or -1 if no tier can answer the query.
+ */
+int archive_select_tier(uint32_t from, uint32_t resolution, uint32_t now);
+
+/*
+ * @brief        Starts a query of the buckets of a field in a tier between `from` and `to`
+ *               (inclusive).
+ *
+ * @return       int       0 on success, non-zero if the tier or field does not exist.
+ */
+int archive_query_begin(archive_query_t* query, uint8_t tier, uint8_t field, time_t from, time_t to);
+
+/*
+ * @brief        Gets the next bucket with samples of the field, as a point from the bucket start
+ *               to its end. Buckets are read in time order, with one seek each.
+ *
+ * @return       int       0 on success, non-zero when there are no more buckets.
+ */
+int archive_query_next(archive_query_t* query, historian_point_t* point);
+
+#endif // ARCHIVE_H
@@ -0,0 +1,624 @@
+#include "asyncLog.h"
+
+#include <Arduino.h>
+#include <SD.h>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "validTime.h"
+
+#define FLUSH_TASK_STACK_SIZE 4096
+#define FLUSH_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+
+#define SLOT_INDEX_MASK (ASYNC_LOG_SLOT_COUNT - 1)
+
+// "YYYY/MM/DD hh:mm:ss [ERROR] " plus the line end.
+#define LINE_OVERHEAD_MAX_SIZE 32
+
+#define SECTOR_SIZE 512
+#define SEGMENT_STATE_MARKER 0x4C4F4753
+
+#if (ASYNC_LOG_SLOT_COUNT & SLOT_INDEX_MASK) != 0
+#error "ASYNC_LOG_SLOT_COUNT must be a power of two."
+#endif
+
+#if ASYNC_LOG_SEGMENT_SIZE % SECTOR_SIZE != 0
+#error "ASYNC_LOG_SEGMENT_SIZE must be a multiple of 512."
+#endif
+
+typedef struct segment_state_t_struct
+{
+  uint32_t marker;
+  uint32_t segment;
+  uint32_t start_time;
+} segment_state_t;
+
+/*
+ * The state of a slot tells whether it is free (2 * lap) or holds a message (2 * lap + 1) for the
+ * lap of the ring the writers and the reader are in, so the ring needs no initialization and
+ * neither side ever waits for the other.
+ */
+typedef struct log_slot_t_struct
+{
+  std::atomic<uint32_t> state;
+  async_log_file_t* file;
+  time_t time;
+  async_log_level_t level;
+  size_t record_size; // Zero for text messages.
+  char message[ASYNC_LOG_MESSAGE_MAX_SIZE];
+} log_slot_t;
+
+static log_slot_t slots[ASYNC_LOG_SLOT_COUNT];
+static std::atomic<uint32_t> write_position(0);
+static std::atomic<uint32_t> read_position(0);
+static std::atomic<uint32_t> overflow_count(0);
+
+static TaskHandle_t flush_task_handle = NULL;
+
+// Used by the flushing task only.
+static uint32_t reported_overflow_count = 0;
+static async_log_file_t* pending_files = NULL;
+static uint8_t sector_buffer[SECTOR_SIZE];
+static const uint8_t zero_sector[SECTOR_SIZE] = { 0 };
+
+static uint32_t get_lap(uint32_t position) { return position / ASYNC_LOG_SLOT_COUNT; }
+
+void async_log(async_log_file_t* file, async_log_level_t level, const char* format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  async_log_v(file, level, format, args);
+  va_end(args);
+}
+
+/*
+ * @brief    Takes the next free slot of the ring, or returns NULL (counting the overflow) if the
+ *           ring is full. The slot must be given back with `commit_slot`.
+ */
+static log_slot_t* claim_slot(uint32_t* claimed_position)
+{
+  uint32_t position = write_position.load(std::memory_order_relaxed);
+  log_slot_t* slot;
+
+  while (true)
+  {
+    uint32_t free_state = 2 * get_lap(position);
+    uint32_t state;
+
+    slot = &slots[position & SLOT_INDEX_MASK];
+    state = slot->state.load(std::memory_order_acquire);
+
+    if (state == free_state)
+    {
+      if (write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if ((int32_t)(state - free_state) < 0)
+    {
+      // Still holding a message from the previous lap, so the ring is full.
+      overflow_count.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+    else
+    {
+      // Taken by another writer.
+      position = write_position.load(std::memory_order_relaxed);
+    }
+  }
+
+  *claimed_position = position;
+
+  return slot;
+}
+
+static void commit_slot(log_slot_t* slot, uint32_t position)
+{
+  slot->state.store(2 * get_lap(position) + 1, std::memory_order_release);
+
+  if (flush_task_handle != NULL
+      && position + 1 - read_position.load(std::memory_order_relaxed) == ASYNC_LOG_SLOT_COUNT / 2)
+  {
+    xTaskNotifyGive(flush_task_handle);
+  }
+}
+
+void async_log_v(async_log_file_t* file, async_log_level_t level, const char* format, va_list args)
+{
+  uint32_t position;
+  log_slot_t* slot = claim_slot(&position);
+
+  if (slot == NULL)
+  {
+    return;
+  }
+
+  slot->file = file;
+  slot->time = time(NULL);
+  slot->level = level;
+  slot->record_size = 0;
+  (void)vsnprintf(slot->message, sizeof(slot->message), format, args);
+  commit_slot(slot, position);
+}
+
+int async_log_record(async_log_file_t* file, const void* record, size_t size)
+{
+  uint32_t position;
+  log_slot_t* slot;
+
+  if (size == 0 || size > ASYNC_LOG_MESSAGE_MAX_SIZE || (slot = claim_slot(&position)) == NULL)
+  {
+    return 1;
+  }
+
+  slot->file = file;
+  slot->record_size = size;
+  (void)memcpy(slot->message, record, size);
+  commit_slot(slot, position);
+
+  return 0;
+}
+
+uint32_t async_log_get_overflow_count() { return overflow_count.load(std::memory_order_relaxed); }
+
+static void create_directories(const char* directory)
+{
+  char path[ASYNC_LOG_PATH_MAX_SIZE];
+  size_t length = 0;
+
+  path[length++] = '/';
+
+  // Each level of the path is created in turn, as SD.mkdir does not create parents.
+  for (const char* c = directory; length < sizeof(path) - 1; c++)
+  {
+    if ((*c == '/' || *c == '\0') && length > 1)
+    {
+      path[length] = '\0';
+
+      if (!SD.exists(path))
+      {
+        (void)SD.mkdir(path);
+      }
+    }
+
+    if (*c == '\0')
+    {
+      break;
+    }
+
+    path[length++] = *c;
+  }
+}
+
+static void get_segment_path(async_log_file_t* file, uint32_t segment, char* path)
+{
+  const char* extension = strrchr(file->filename, '.');
+  int stem_length = extension != NULL ? (int)(extension - file->filename) : strlen(file->filename);
+
+  snprintf(
+      path,
+      ASYNC_LOG_PATH_MAX_SIZE,
+      "/%s/%.*s.%u%s",
+      file->directory,
+      stem_length,
+      file->filename,
+      segment,
+      extension != NULL ? extension : "");
+}
+
+static void get_state_path(async_log_file_t* file, char* path)
+{
+  snprintf(path, ASYNC_LOG_PATH_MAX_SIZE, "/%s/%s.idx", file->directory, file->filename);
+}
+
+/*
+ * @brief    Fills a segment file with zeros from `from` (rounded down to a sector) to its full
+ *           size, so its clusters are allocated once rather than on every append.
+ */
+static int preallocate_segment(File* sd_file, uint32_t from)
+{
+  from -= from % SECTOR_SIZE;
+
+  if (!sd_file->seek(from))
+  {
+    return 1;
+  }
+
+  for (uint32_t offset = from; offset < ASYNC_LOG_SEGMENT_SIZE; offset += SECTOR_SIZE)
+  {
+    if (sd_file->write(zero_sector, SECTOR_SIZE) != SECTOR_SIZE)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Finds where the data of a segment ends: the first sector that is all zeros. Data never
+ *           has a whole sector of zeros, as records are shorter than a sector and start with a
+ *           non-zero marker (and text has no zeros at all).
+ */
+static uint32_t find_segment_end(File* sd_file)
+{
+  uint32_t low = 0;
+  uint32_t high = sd_file->size() / SECTOR_SIZE;
+
+  while (low < high)
+  {
+    uint32_t middle = low + (high - low) / 2;
+    bool is_empty = true;
+
+    if (sd_file->seek(middle * SECTOR_SIZE)
+        && sd_file->read(sector_buffer, SECTOR_SIZE) == SECTOR_SIZE)
+    {
+      for (size_t i = 0; i < SECTOR_SIZE && is_empty; i++)
+      {
+        is_empty = sector_buffer[i] == 0;
+      }
+    }
+
+    if (is_empty)
+    {
+      high = middle;
+    }
+    else
+    {
+      low = middle + 1;
+    }
+  }
+
+  return low * SECTOR_SIZE;
+}
+
+static int start_segment(async_log_file_t* file, uint32_t segment)
+{
+  char path[ASYNC_LOG_PATH_MAX_SIZE];
+  segment_state_t state;
+  File sd_file;
+  int result;
+
+  // An existing segment is overwritten in place, keeping its clusters.
+  get_segment_path(file, segment, path);
+  sd_file = SD.open(path, SD.exists(path) ? "r+" : FILE_WRITE);
+
+  if (!sd_file)
+  {
+    return 1;
+  }
+
+  result = preallocate_segment(&sd_file, 0);
+  sd_file.close();
+
+  if (result != 0)
+  {
+    return 1;
+  }
+
+  file->segment = segment;
+  file->segment_offset = 0;
+  file->segment_start_time = (uint32_t)time(NULL);
+  file->write_count = 0;
+  file->write_total_time_us = 0;
+  file->write_max_time_us = 0;
+
+  state.marker = SEGMENT_STATE_MARKER;
+  state.segment = file->segment;
+  state.start_time = file->segment_start_time;
+
+  get_state_path(file, path);
+  sd_file = SD.open(path, FILE_WRITE);
+
+  if (!sd_file)
+  {
+    return 1;
+  }
+
+  result = sd_file.write((const uint8_t*)&state, sizeof(state)) == sizeof(state) ? 0 : 1;
+  sd_file.close();
+
+  return result;
+}
+
+/*
+ * @brief    Finds the current segment of a log and where its data ends, or starts the log if it
+ *           has no segments yet.
+ */
+static int recover_file(async_log_file_t* file)
+{
+  char path[ASYNC_LOG_PATH_MAX_SIZE];
+  segment_state_t state;
+  File sd_file;
+
+  create_directories(file->directory);
+
+  get_state_path(file, path);
+  sd_file = SD.open(path, FILE_READ);
+
+  if (!sd_file)
+  {
+    return start_segment(file, 0);
+  }
+
+  bool is_valid = sd_file.read((uint8_t*)&state, sizeof(state)) == sizeof(state)
+      && state.marker == SEGMENT_STATE_MARKER && state.segment < ASYNC_LOG_SEGMENT_COUNT;
+  sd_file.close();
+
+  get_segment_path(file, state.segment, path);
+
+  if (!is_valid || !(sd_file = SD.open(path, "r+")))
+  {
+    return start_segment(file, 0);
+  }
+
+  file->segment = state.segment;
+  file->segment_start_time = state.start_time;
+  file->segment_offset = find_segment_end(&sd_file);
+
+  // Preallocation cut short by a reset.
+  if (sd_file.size() < ASYNC_LOG_SEGMENT_SIZE)
+  {
+    (void)preallocate_segment(&sd_file, sd_file.size());
+  }
+
+  sd_file.close();
+
+  return 0;
+}
+
+static bool is_segment_due(async_log_file_t* file)
+{
+  uint32_t now = (uint32_t)time(NULL);
+
+  if (file->segment_offset + file->length > ASYNC_LOG_SEGMENT_SIZE)
+  {
+    return true;
+  }
+
+  // Ages only count once the clock is set.
+  if (now < MIN_VALID_TIME)
+  {
+    return false;
+  }
+
+  if (file->segment_start_time < MIN_VALID_TIME)
+  {
+    file->segment_start_time = now;
+  }
+
+  return now - file->segment_start_time >= ASYNC_LOG_SEGMENT_MAX_AGE_IN_SECONDS;
+}
+
+static void write_file(async_log_file_t* file)
+{
+  char path[ASYNC_LOG_PATH_MAX_SIZE];
+  unsigned long start_time, elapsed_time;
+  File sd_file;
+  bool written;
+
+  if (!file->is_recovered)
+  {
+    file->is_recovered = recover_file(file) == 0;
+  }
+
+  if (file->is_recovered && is_segment_due(file))
+  {
+    if (file->write_count > 0)
+    {
+      Serial.printf(
+          "Log %s segment %u done: %u writes, avg %lu us, max %lu us.\r\n",
+          file->filename,
+          file->segment,
+          file->write_count,
+          file->write_total_time_us / file->write_count,
+          file->write_max_time_us);
+    }
+
+    file->is_recovered = start_segment(file, (file->segment + 1) % ASYNC_LOG_SEGMENT_COUNT) == 0;
+  }
+
+  if (!file->is_recovered)
+  {
+    Serial.print("Failed preparing log segment for ");
+    Serial.println(file->filename);
+    file->length = 0;
+    return;
+  }
+
+  start_time = micros();
+
+  get_segment_path(file, file->segment, path);
+  sd_file = SD.open(path, "r+");
+  written = sd_file && sd_file.seek(file->segment_offset)
+      && sd_file.write((const uint8_t*)file->buffer, file->length) == file->length;
+
+  if (sd_file)
+  {
+    sd_file.close();
+  }
+
+  if (!written)
+  {
+    Serial.print("Failed writing log file ");
+    Serial.println(path);
+  }
+
+  elapsed_time = micros() - start_time;
+  file->write_count++;
+  file->write_total_time_us += elapsed_time;
+
+  if (elapsed_time > file->write_max_time_us)
+  {
+    file->write_max_time_us = elapsed_time;
+  }
+
+  // Even if the write failed, so a bad spot is not retried forever.
+  file->segment_offset += file->length;
+  file->length = 0;
+}
+
+static void mark_file_pending(async_log_file_t* file)
+{
+  if (!file->is_pending)
+  {
+    file->is_pending = true;
+    file->next_pending = pending_files;
+    pending_files = file;
+  }
+}
+
+static void append_record(async_log_file_t* file, const char* record, size_t size)
+{
+  if (file->length + size > sizeof(file->buffer))
+  {
+    write_file(file);
+  }
+
+  mark_file_pending(file);
+  (void)memcpy(file->buffer + file->length, record, size);
+  file->length += size;
+}
+
+static void append_line(
+    async_log_file_t* file,
+    time_t time,
+    async_log_level_t level,
+    const char* message)
+{
+  struct tm tm;
+  int length;
+
+  if (file->length + LINE_OVERHEAD_MAX_SIZE + strlen(message) > sizeof(file->buffer))
+  {
+    write_file(file);
+  }
+
+  mark_file_pending(file);
+
+  (void)gmtime_r(&time, &tm);
+  length = snprintf(
+      file->buffer + file->length,
+      sizeof(file->buffer) - file->length,
+      "%04d/%02d/%02d %02d:%02d:%02d %s %s\r\n",
+      tm.tm_year + 1900,
+      tm.tm_mon + 1,
+      tm.tm_mday,
+      tm.tm_hour,
+      tm.tm_min,
+      tm.tm_sec,
+      level == async_log_level_info ? "[INFO]" : "[ERROR]",
+      message);
+
+  if (length > 0)
+  {
+    file->length += (size_t)length;
+
+    if (file->length > sizeof(file->buffer) - 1)
+    {
+      file->length = sizeof(file->buffer) - 1;
+    }
+  }
+}
+
+/*
+ * @brief    Moves all the messages in the ring to the buffers of their files, then writes each
+ *           file buffer with a single SD write.
+ */
+static void flush_ring()
+{
+  uint32_t position = read_position.load(std::memory_order_relaxed);
+
+  while (true)
+  {
+    log_slot_t* slot = &slots[position & SLOT_INDEX_MASK];
+    uint32_t lap = get_lap(position);
+    uint32_t current_overflow_count;
+
+    if (slot->state.load(std::memory_order_acquire) != 2 * lap + 1)
+    {
+      break;
+    }
+
+    current_overflow_count = overflow_count.load(std::memory_order_relaxed);
+
+    if (current_overflow_count != reported_overflow_count && slot->record_size == 0)
+    {
+      char message[48];
+
+      snprintf(
+          message,
+          sizeof(message),
+          "%u log messages dropped, ring full.",
+          current_overflow_count - reported_overflow_count);
+      append_line(slot->file, slot->time, async_log_level_error, message);
+      reported_overflow_count = current_overflow_count;
+    }
+
+    if (slot->record_size > 0)
+    {
+      append_record(slot->file, slot->message, slot->record_size);
+    }
+    else
+    {
+      append_line(slot->file, slot->time, slot->level, slot->message);
+    }
+
+    slot->state.store(2 * lap + 2, std::memory_order_release);
+    position++;
+    read_position.store(position, std::memory_order_relaxed);
+  }
+
+  while (pending_files != NULL)
+  {
+    async_log_file_t* file = pending_files;
+
+    pending_files = file->next_pending;
+    file->next_pending = NULL;
+    file->is_pending = false;
+
+    if (file->length > 0)
+    {
+      write_file(file);
+    }
+  }
+}
+
+static void flush_task(void* parameters)
+{
+  (void)parameters;
+
+  while (true)
+  {
+    (void)ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ASYNC_LOG_FLUSH_INTERVAL_IN_MS));
+    flush_ring();
+  }
+}
+
+int async_log_init()
+{
+  if (SD.cardType() == CARD_NONE && !SD.begin())
+  {
+    Serial.println("No SD card for the log files.");
+    return 1;
+  }
+
+  if (xTaskCreate(
+          flush_task,
+          "asyncLog",
+          FLUSH_TASK_STACK_SIZE,
+          NULL,
+          FLUSH_TASK_PRIORITY,
+          &flush_task_handle)
+      != pdPASS)
+  {
+    Serial.println("Failed creating the log flushing task.");
+    return 1;
+  }
+
+  return 0;
+}
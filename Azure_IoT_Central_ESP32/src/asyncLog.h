@@ -0,0 +1,138 @@
+/*
+ * asyncLog writes log messages to files on the SD card without making the caller wait for the SD
+ * card.
+ *
+ * Logging a message only formats it into a slot of a lock-free ring in RAM, which any task can do
+ * concurrently. A low-priority task empties the ring at least every ASYNC_LOG_FLUSH_INTERVAL_IN_MS
+ * (or sooner, once the ring is half full), collecting the messages of each file in a buffer and
+ * appending each buffer to its file in a single write. Messages logged while the ring is full are
+ * dropped and counted, and the count is written to the log once there is room again.
+ *
+ * Messages longer than ASYNC_LOG_MESSAGE_MAX_SIZE are truncated. Binary records (see
+ * src/tokenizedLog.h) of up to that size can be logged as well, and are written as-is.
+ *
+ * Each log is a ring of ASYNC_LOG_SEGMENT_COUNT segment files (named like "main.3.txt" for
+ * "main.txt") of ASYNC_LOG_SEGMENT_SIZE bytes, so a log never takes more than their total size.
+ * Segments are preallocated (filled with zeros) when started and then written in place, so appends
+ * never grow a file or walk its cluster chain, and the end of the data is where the zeros start.
+ * Logging moves on to the next segment, overwriting the oldest one, when the current segment is
+ * full or older than ASYNC_LOG_SEGMENT_MAX_AGE_IN_SECONDS. The current segment and its start time
+ * are kept in a small state file ("main.txt.idx"), only written when a segment is started.
+ */
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Number of messages the ring holds. Must be a power of two. */
+#ifndef ASYNC_LOG_SLOT_COUNT
+#define ASYNC_LOG_SLOT_COUNT 64
+#endif
+
+#define ASYNC_LOG_MESSAGE_MAX_SIZE 144
+
+/* Longest a logged message is held in RAM before being written to the SD card. */
+#ifndef ASYNC_LOG_FLUSH_INTERVAL_IN_MS
+#define ASYNC_LOG_FLUSH_INTERVAL_IN_MS 1000
+#endif
+
+/* Size of the buffer where the messages of each file are collected before being written. */
+#define ASYNC_LOG_FILE_BUFFER_SIZE 2048
+
+#define ASYNC_LOG_PATH_MAX_SIZE 64
+
+/* Retention: a log keeps at most ASYNC_LOG_SEGMENT_COUNT * ASYNC_LOG_SEGMENT_SIZE bytes. */
+#ifndef ASYNC_LOG_SEGMENT_COUNT
+#define ASYNC_LOG_SEGMENT_COUNT 8
+#endif
+
+/* Must be a multiple of 512 bytes (the SD sector size). */
+#ifndef ASYNC_LOG_SEGMENT_SIZE
+#define ASYNC_LOG_SEGMENT_SIZE (256 * 1024)
+#endif
+
+#ifndef ASYNC_LOG_SEGMENT_MAX_AGE_IN_SECONDS
+#define ASYNC_LOG_SEGMENT_MAX_AGE_IN_SECONDS 86400
+#endif
+
+typedef enum async_log_level_t_enum
+{
+  async_log_level_info,
+  async_log_level_error
+} async_log_level_t;
+
+/*
+ * @brief    A log file. Only its directory and name are to be set by users, with
+ *           `ASYNC_LOG_FILE`; the rest is used by the flushing task.
+ */
+typedef struct async_log_file_t_struct
+{
+  const char* directory;
+  const char* filename;
+  bool is_pending;
+  size_t length;
+  struct async_log_file_t_struct* next_pending;
+  char buffer[ASYNC_LOG_FILE_BUFFER_SIZE];
+
+  // Current segment, recovered from the SD card on the first write.
+  bool is_recovered;
+  uint32_t segment;
+  uint32_t segment_offset;
+  uint32_t segment_start_time;
+
+  // Write latency in the current segment.
+  uint32_t write_count;
+  unsigned long write_total_time_us;
+  unsigned long write_max_time_us;
+} async_log_file_t;
+
+#define ASYNC_LOG_FILE(directory, filename) \
+  {                                         \
+    directory, filename                     \
+  }
+
+/*
+ * @brief        Starts the task that writes the logged messages to the SD card.
+ * @remark       Messages can be logged before this is called; they are held in the ring (or
+ *               dropped once it is full) until then.
+ *
+ * @return       int       0 on success, non-zero if the SD card can not be used or the task can
+ *                         not be created.
+ */
+int async_log_init();
+
+/*
+ * @brief        Logs a message to `file`, with the current time and `level`.
+ *
+ * @param[in]    file       The file to log to, declared with `ASYNC_LOG_FILE`. It must not be
+ *                          destroyed while the program runs.
+ * @param[in]    level      The level of the message.
+ * @param[in]    format     printf-like format of the message.
+ */
+void async_log(async_log_file_t* file, async_log_level_t level, const char* format, ...);
+
+/*
+ * @brief        Same as `async_log`, taking the format arguments as a `va_list`.
+ */
+void async_log_v(async_log_file_t* file, async_log_level_t level, const char* format, va_list args);
+
+/*
+ * @brief        Logs a binary record to `file`, written to it unchanged.
+ *
+ * @param[in]    file       The file to log to, declared with `ASYNC_LOG_FILE`.
+ * @param[in]    record     The record.
+ * @param[in]    size       Size of the record, at most ASYNC_LOG_MESSAGE_MAX_SIZE bytes.
+ *
+ * @return       int        0 on success, non-zero if the record is too large or the ring is full.
+ */
+int async_log_record(async_log_file_t* file, const void* record, size_t size);
+
+/*
+ * @brief        Gets the number of messages dropped so far because the ring was full.
+ */
+uint32_t async_log_get_overflow_count();
+
+#endif // ASYNC_LOG_H
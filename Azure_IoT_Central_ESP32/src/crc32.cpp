@@ -0,0 +1,20 @@
+#include "crc32.h"
+
+// Half-byte lookup table, small enough to not matter in flash and still fast enough for SD records.
+static const uint32_t crc32_table[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size)
+{
+  crc = ~crc;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    crc = crc32_table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = crc32_table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+
+  return ~crc;
+}
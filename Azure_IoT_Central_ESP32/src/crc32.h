@@ -0,0 +1,21 @@
+/*
+ * crc32 computes the CRC-32 (IEEE 802.3, as in zlib and Ethernet) used for detecting records torn
+ * or corrupted on the SD card.
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CRC32_INITIAL_VALUE 0
+
+/*
+ * @brief        Updates a CRC-32 with more data.
+ * @remark       Start with `CRC32_INITIAL_VALUE`; the result after the last update is the CRC-32 of
+ *               all the data.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size);
+
+#endif // CRC32_H
@@ -0,0 +1,205 @@
+#include "flightRecorder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+#else
+#include <chrono>
+#endif
+
+#define RETAINED_MARKER 0x46524543
+
+/*
+ * @brief    The retained trace. `next` only ever grows, the entry it points to being
+ *           `next % FLIGHT_RECORDER_ENTRY_COUNT`.
+ */
+typedef struct retained_trace_t_struct
+{
+  uint32_t marker;
+  uint32_t boot_count;
+  uint32_t next;
+  flight_recorder_entry_t entries[FLIGHT_RECORDER_ENTRY_COUNT];
+} retained_trace_t;
+
+#ifdef ARDUINO
+RTC_NOINIT_ATTR static retained_trace_t retained_trace;
+#else
+static retained_trace_t retained_trace;
+
+static unsigned long millis()
+{
+  static auto start = std::chrono::steady_clock::now();
+
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static void save_host_retained_trace()
+{
+  FILE* file = fopen(FLIGHT_RECORDER_HOST_FILE, "wb");
+
+  if (file != NULL)
+  {
+    (void)fwrite(&retained_trace, sizeof(retained_trace), 1, file);
+    (void)fclose(file);
+  }
+}
+#endif
+
+// Trace of the previous run, until reported.
+static flight_recorder_report_t report;
+static bool has_report = false;
+
+static const char* const event_names[] = { "none", "boot", "azureIotState", "modbusRead", "publish" };
+
+static uint32_t get_reset_reason()
+{
+#ifdef ARDUINO
+  return (uint32_t)esp_reset_reason();
+#else
+  return 0;
+#endif
+}
+
+/*
+ * @brief    Copies the retained trace, oldest event first, into the report.
+ */
+static void take_report()
+{
+  uint32_t count = retained_trace.next < FLIGHT_RECORDER_ENTRY_COUNT
+      ? retained_trace.next
+      : FLIGHT_RECORDER_ENTRY_COUNT;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    report.entries[i]
+        = retained_trace.entries[(retained_trace.next - count + i) % FLIGHT_RECORDER_ENTRY_COUNT];
+  }
+
+  report.entry_count = count;
+  report.boot_count = retained_trace.boot_count;
+  report.reset_reason = (int)get_reset_reason();
+  has_report = count > 0;
+}
+
+static void save_report()
+{
+  char line[96];
+
+#ifdef ARDUINO
+  File file = SD.open(FLIGHT_RECORDER_FILE, FILE_APPEND);
+
+  if (!file)
+  {
+    return;
+  }
+#endif
+
+  snprintf(
+      line,
+      sizeof(line),
+      "Boot %u ended with reset reason %d, last %u events:\r\n",
+      report.boot_count,
+      report.reset_reason,
+      report.entry_count);
+#ifdef ARDUINO
+  file.print(line);
+#else
+  fputs(line, stdout);
+#endif
+
+  for (uint32_t i = 0; i < report.entry_count; i++)
+  {
+    flight_recorder_entry_t* entry = &report.entries[i];
+
+    snprintf(
+        line,
+        sizeof(line),
+        "  %10u ms %s %u %u %d\r\n",
+        entry->time,
+        entry->event < sizeof(event_names) / sizeof(event_names[0]) ? event_names[entry->event]
+                                                                     : "unknown",
+        entry->a,
+        entry->b,
+        entry->value);
+#ifdef ARDUINO
+    file.print(line);
+#else
+    fputs(line, stdout);
+#endif
+  }
+
+#ifdef ARDUINO
+  file.close();
+#endif
+}
+
+void flight_recorder_init()
+{
+#ifndef ARDUINO
+  FILE* file = fopen(FLIGHT_RECORDER_HOST_FILE, "rb");
+
+  if (file == NULL || fread(&retained_trace, sizeof(retained_trace), 1, file) != 1)
+  {
+    retained_trace.marker = 0;
+  }
+
+  if (file != NULL)
+  {
+    (void)fclose(file);
+  }
+#endif
+
+  // After a power cut the retained memory has random contents.
+  if (retained_trace.marker != RETAINED_MARKER)
+  {
+    (void)memset(&retained_trace, 0, sizeof(retained_trace));
+    retained_trace.marker = RETAINED_MARKER;
+  }
+  else
+  {
+    take_report();
+
+    if (has_report)
+    {
+      save_report();
+    }
+  }
+
+  retained_trace.boot_count++;
+  retained_trace.next = 0;
+
+  flight_recorder_record(
+      flight_recorder_event_boot,
+      (uint8_t)get_reset_reason(),
+      0,
+      (int32_t)retained_trace.boot_count);
+}
+
+void flight_recorder_record(flight_recorder_event_t event, uint8_t a, uint16_t b, int32_t value)
+{
+  // Events can come from several tasks (the MQTT client calls back from its own).
+  uint32_t index
+      = __atomic_fetch_add(&retained_trace.next, 1, __ATOMIC_RELAXED) % FLIGHT_RECORDER_ENTRY_COUNT;
+  flight_recorder_entry_t* entry = &retained_trace.entries[index];
+
+  entry->time = (uint32_t)millis();
+  entry->event = (uint8_t)event;
+  entry->a = a;
+  entry->b = b;
+  entry->value = value;
+
+#ifndef ARDUINO
+  save_host_retained_trace();
+#endif
+}
+
+const flight_recorder_report_t* flight_recorder_get_report() { return has_report ? &report : NULL; }
+
+void flight_recorder_clear_report() { has_report = false; }
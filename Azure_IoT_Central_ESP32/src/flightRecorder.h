@@ -0,0 +1,85 @@
+/*
+ * flightRecorder keeps a trace of the last things the gateway did (Azure IoT client state
+ * transitions, Modbus reads and telemetry publishing) in memory that survives resets, so that
+ * after a crash, watchdog reset or hang the events leading to it are not lost.
+ *
+ * The trace is a ring of FLIGHT_RECORDER_ENTRY_COUNT fixed-size entries in RTC slow memory, which
+ * keeps its contents through software and watchdog resets (but not power cuts, detected with a
+ * marker). Recording an event is a few stores, safe from any task. On boot, the trace of the
+ * previous run is appended to FLIGHT_RECORDER_FILE on the SD card and kept as a report, to be sent
+ * as a diagnostic telemetry message once connected.
+ *
+ * Built for a host (no ARDUINO defined), the retained memory is emulated with the file
+ * FLIGHT_RECORDER_HOST_FILE, written on every event, and the trace is printed instead.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define FLIGHT_RECORDER_ENTRY_COUNT 64
+
+#define FLIGHT_RECORDER_FILE "/sysLog/flightRecorder.txt"
+#define FLIGHT_RECORDER_HOST_FILE "flightRecorder.bin"
+
+/*
+ * Events, with the meaning of the values recorded with them.
+ */
+typedef enum flight_recorder_event_t_enum
+{
+  flight_recorder_event_none = 0,
+  flight_recorder_event_boot, // a: reset reason, value: boot count.
+  flight_recorder_event_azure_iot_state, // a: previous state, b: new state, value: source line.
+  flight_recorder_event_modbus_read, // a: 1 if read, 0 if failed, b: registers, value: address.
+  flight_recorder_event_telemetry_publish, // a: 1 if sent, 0 if failed, 2 if queued, b: size.
+} flight_recorder_event_t;
+
+typedef struct flight_recorder_entry_t_struct
+{
+  uint32_t time; // Milliseconds since boot.
+  uint8_t event;
+  uint8_t a;
+  uint16_t b;
+  int32_t value;
+} flight_recorder_entry_t;
+
+/*
+ * @brief        Saves the trace of the previous run (to the SD card and as a report) and starts a
+ *               new one.
+ * @remark       It must be called once on boot, after the SD card is mounted and before any event
+ *               is recorded.
+ */
+void flight_recorder_init();
+
+/*
+ * @brief        Records an event in the trace, overwriting the oldest one once the ring is full.
+ */
+void flight_recorder_record(flight_recorder_event_t event, uint8_t a, uint16_t b, int32_t value);
+
+/*
+ * @brief    Trace of the previous run, oldest event first.
+ */
+typedef struct flight_recorder_report_t_struct
+{
+  int reset_reason; // esp_reset_reason_t of the reset that ended the run.
+  uint32_t boot_count;
+  uint32_t entry_count;
+  flight_recorder_entry_t entries[FLIGHT_RECORDER_ENTRY_COUNT];
+} flight_recorder_report_t;
+
+/*
+ * @brief        Gets the report of the previous run, if not sent yet.
+ *
+ * @return       The report, or NULL if there is none (first boot after a power cut, or already
+ *               sent).
+ */
+const flight_recorder_report_t* flight_recorder_get_report();
+
+/*
+ * @brief        Discards the report of the previous run, once sent.
+ */
+void flight_recorder_clear_report();
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,779 @@
+#include "historian.h"
+
+#include <Arduino.h>
+#include <SD.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+#include "crc32.h"
+#include "validTime.h"
+
+#define HISTORIAN_DIRECTORY "/historian"
+#define HISTORIAN_PATH_SIZE 32
+
+#define BLOCK_MARKER 0x4853
+
+#define PAYLOAD_BIT_COUNT (HISTORIAN_BLOCK_PAYLOAD_SIZE * 8)
+
+// Worst case of a sample: a 36-bit timestamp plus a 44-bit value.
+#define SAMPLE_MAX_BIT_COUNT 80
+
+// A leading zeros count no XOR can have, so the first changed value never reuses the window.
+#define NO_LEADING_ZEROS 32
+
+// Blocks written between two logs of the compression and ingest statistics.
+#define STATS_BLOCK_INTERVAL 1024
+
+#define QUERY_CHUNK_SIZE 16
+
+typedef struct historian_block_t_struct
+{
+  historian_block_header_t header;
+  uint8_t payload[HISTORIAN_BLOCK_PAYLOAD_SIZE];
+} historian_block_t;
+
+static_assert(sizeof(historian_block_t) == HISTORIAN_BLOCK_SIZE, "Unexpected block size.");
+
+/*
+ * @brief    The block being filled for a field, and the state of its encoder.
+ */
+typedef struct field_stream_t_struct
+{
+  historian_block_t block;
+  uint32_t timestamp;
+  int32_t delta;
+  uint32_t value_bits;
+  uint8_t leading_zeros;
+  uint8_t trailing_zeros;
+} field_stream_t;
+
+static bool is_initialized = false;
+static field_stream_t streams[TELEMETRY_FIELD_COUNT];
+static uint32_t current_month = 0;
+
+static uint32_t stats_sample_count = 0;
+static uint32_t stats_block_count = 0;
+static unsigned long stats_ingest_total_time_us = 0;
+static unsigned long stats_ingest_max_time_us = 0;
+
+// The single running query reads through this file, a small chunk at a time.
+static File query_file;
+static bool is_query_file_open = false;
+static uint8_t query_chunk[QUERY_CHUNK_SIZE];
+static int32_t query_chunk_offset = -1;
+
+static uint32_t float_to_bits(float value)
+{
+  uint32_t bits;
+  (void)memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static float bits_to_float(uint32_t bits)
+{
+  float value;
+  (void)memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint32_t get_month(uint32_t timestamp)
+{
+  time_t time = (time_t)timestamp;
+  struct tm tm;
+
+  (void)gmtime_r(&time, &tm);
+
+  return (tm.tm_year + 1900) * 100 + tm.tm_mon + 1;
+}
+
+static uint32_t add_months(uint32_t month, int32_t count)
+{
+  int32_t index = (month / 100) * 12 + (month % 100 - 1) + count;
+
+  return (index / 12) * 100 + index % 12 + 1;
+}
+
+static void get_month_path(uint32_t month, char* path)
+{
+  snprintf(path, HISTORIAN_PATH_SIZE, HISTORIAN_DIRECTORY "/%06u", month);
+}
+
+static void get_field_path(uint32_t month, uint8_t field, char* path)
+{
+  snprintf(path, HISTORIAN_PATH_SIZE, HISTORIAN_DIRECTORY "/%06u/f%02u.bin", month, field);
+}
+
+static uint32_t get_block_crc(historian_block_t* block)
+{
+  uint32_t crc = block->header.crc;
+  uint32_t result;
+
+  block->header.crc = 0;
+  result = crc32_update(CRC32_INITIAL_VALUE, (const uint8_t*)block, sizeof(*block));
+  block->header.crc = crc;
+
+  return result;
+}
+
+/* --- Encoding --- */
+
+static void write_bits(historian_block_t* block, uint32_t value, uint8_t count)
+{
+  for (uint8_t i = count; i > 0; i--)
+  {
+    if ((value >> (i - 1)) & 1)
+    {
+      block->payload[block->header.bit_count >> 3] |= 0x80 >> (block->header.bit_count & 7);
+    }
+
+    block->header.bit_count++;
+  }
+}
+
+static void encode_timestamp(field_stream_t* stream, uint32_t timestamp)
+{
+  int32_t delta = (int32_t)(timestamp - stream->timestamp);
+  int32_t delta_of_delta = delta - stream->delta;
+
+  if (delta_of_delta == 0)
+  {
+    write_bits(&stream->block, 0x0, 1);
+  }
+  else if (delta_of_delta >= -63 && delta_of_delta <= 64)
+  {
+    write_bits(&stream->block, 0x2, 2);
+    write_bits(&stream->block, (uint32_t)(delta_of_delta + 63), 7);
+  }
+  else if (delta_of_delta >= -255 && delta_of_delta <= 256)
+  {
+    write_bits(&stream->block, 0x6, 3);
+    write_bits(&stream->block, (uint32_t)(delta_of_delta + 255), 9);
+  }
+  else if (delta_of_delta >= -2047 && delta_of_delta <= 2048)
+  {
+    write_bits(&stream->block, 0xE, 4);
+    write_bits(&stream->block, (uint32_t)(delta_of_delta + 2047), 12);
+  }
+  else
+  {
+    write_bits(&stream->block, 0xF, 4);
+    write_bits(&stream->block, (uint32_t)delta_of_delta, 32);
+  }
+
+  stream->timestamp = timestamp;
+  stream->delta = delta;
+}
+
+static void encode_value(field_stream_t* stream, uint32_t value_bits)
+{
+  uint32_t xor_bits = value_bits ^ stream->value_bits;
+  uint8_t leading_zeros, trailing_zeros;
+
+  stream->value_bits = value_bits;
+
+  if (xor_bits == 0)
+  {
+    write_bits(&stream->block, 0x0, 1);
+    return;
+  }
+
+  leading_zeros = __builtin_clz(xor_bits);
+  trailing_zeros = __builtin_ctz(xor_bits);
+
+  if (leading_zeros >= stream->leading_zeros && trailing_zeros >= stream->trailing_zeros)
+  {
+    // The changed bits fit in the window of the previous value.
+    write_bits(&stream->block, 0x2, 2);
+    write_bits(
+        &stream->block,
+        xor_bits >> stream->trailing_zeros,
+        32 - stream->leading_zeros - stream->trailing_zeros);
+  }
+  else
+  {
+    uint8_t meaningful_bits = 32 - leading_zeros - trailing_zeros;
+
+    write_bits(&stream->block, 0x3, 2);
+    write_bits(&stream->block, leading_zeros, 5);
+    write_bits(&stream->block, meaningful_bits - 1, 5);
+    write_bits(&stream->block, xor_bits >> trailing_zeros, meaningful_bits);
+
+    stream->leading_zeros = leading_zeros;
+    stream->trailing_zeros = trailing_zeros;
+  }
+}
+
+static void start_block(field_stream_t* stream, uint8_t field, uint32_t timestamp, float value)
+{
+  historian_block_header_t* header = &stream->block.header;
+
+  (void)memset(&stream->block, 0, sizeof(stream->block));
+  header->marker = BLOCK_MARKER;
+  header->field = field;
+  header->sample_count = 1;
+  header->first_timestamp = timestamp;
+  header->last_timestamp = timestamp;
+  header->min = value;
+  header->max = value;
+  header->sum = value;
+
+  stream->timestamp = timestamp;
+  stream->delta = 0;
+  stream->value_bits = float_to_bits(value);
+  stream->leading_zeros = NO_LEADING_ZEROS;
+  stream->trailing_zeros = 0;
+
+  write_bits(&stream->block, stream->value_bits, 32);
+}
+
+static int write_block(field_stream_t* stream)
+{
+  char path[HISTORIAN_PATH_SIZE];
+  File file;
+  bool written;
+
+  stream->block.header.crc = get_block_crc(&stream->block);
+
+  get_field_path(current_month, stream->block.header.field, path);
+  file = SD.open(path, FILE_APPEND);
+
+  if (!file)
+  {
+    LogError("Failed opening %s.", path);
+    return 1;
+  }
+
+  written = file.write((const uint8_t*)&stream->block, sizeof(stream->block))
+      == sizeof(stream->block);
+  file.close();
+
+  stats_block_count++;
+  stats_sample_count += stream->block.header.sample_count;
+
+  if (stats_block_count == STATS_BLOCK_INTERVAL)
+  {
+    LogInfo(
+        "Historian stored %u samples in %u bytes (%u.%02u bytes per sample), ingest avg %lu us, "
+        "max %lu us.",
+        stats_sample_count,
+        stats_block_count * HISTORIAN_BLOCK_SIZE,
+        stats_block_count * HISTORIAN_BLOCK_SIZE / stats_sample_count,
+        stats_block_count * HISTORIAN_BLOCK_SIZE * 100 / stats_sample_count % 100,
+        stats_ingest_total_time_us / stats_sample_count,
+        stats_ingest_max_time_us);
+
+    stats_block_count = 0;
+    stats_sample_count = 0;
+    stats_ingest_total_time_us = 0;
+    stats_ingest_max_time_us = 0;
+  }
+
+  return written ? 0 : 1;
+}
+
+static int append_sample(field_stream_t* stream, uint8_t field, uint32_t timestamp, float value)
+{
+  historian_block_header_t* header = &stream->block.header;
+  int result = 0;
+
+  if (header->sample_count == 0)
+  {
+    start_block(stream, field, timestamp, value);
+    return 0;
+  }
+
+  if (timestamp <= header->last_timestamp)
+  {
+    return 0;
+  }
+
+  if ((uint32_t)header->bit_count + SAMPLE_MAX_BIT_COUNT > (uint32_t)PAYLOAD_BIT_COUNT
+      || header->sample_count == UINT16_MAX)
+  {
+    result = write_block(stream);
+    start_block(stream, field, timestamp, value);
+    return result;
+  }
+
+  encode_timestamp(stream, timestamp);
+  encode_value(stream, float_to_bits(value));
+
+  header->sample_count++;
+  header->last_timestamp = timestamp;
+  header->sum += value;
+
+  if (value < header->min)
+  {
+    header->min = value;
+  }
+
+  if (value > header->max)
+  {
+    header->max = value;
+  }
+
+  return 0;
+}
+
+static void delete_month(uint32_t month)
+{
+  char path[HISTORIAN_PATH_SIZE];
+
+  get_month_path(month, path);
+
+  if (!SD.exists(path))
+  {
+    return;
+  }
+
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+  {
+    get_field_path(month, field, path);
+    (void)SD.remove(path);
+  }
+
+  get_month_path(month, path);
+  (void)SD.rmdir(path);
+  LogInfo("Historian month %06u deleted.", month);
+}
+
+/*
+ * @brief    Writes the blocks of the previous month, so no block spans two months, and moves on to
+ *           `month`.
+ */
+static int start_month(uint32_t month)
+{
+  char path[HISTORIAN_PATH_SIZE];
+  int result = 0;
+
+  if (current_month != 0)
+  {
+    for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+    {
+      if (streams[field].block.header.sample_count > 0)
+      {
+        result |= write_block(&streams[field]);
+        streams[field].block.header.sample_count = 0;
+      }
+    }
+  }
+
+  current_month = month;
+  get_month_path(month, path);
+
+  if (!SD.exists(path) && !SD.mkdir(path))
+  {
+    LogError("Failed creating %s.", path);
+    return 1;
+  }
+
+  delete_month(add_months(month, -HISTORIAN_RETENTION_MONTHS));
+
+  return result;
+}
+
+int historian_init()
+{
+  if (SD.cardType() == CARD_NONE)
+  {
+    LogError("No SD card for the historian.");
+    return 1;
+  }
+
+  if (!SD.exists(HISTORIAN_DIRECTORY) && !SD.mkdir(HISTORIAN_DIRECTORY))
+  {
+    LogError("Failed creating %s.", HISTORIAN_DIRECTORY);
+    return 1;
+  }
+
+  is_initialized = true;
+
+  return 0;
+}
+
+int historian_append(uint32_t timestamp, uint8_t field_groups)
+{
+  unsigned long start_time = micros();
+  unsigned long elapsed_time;
+  int result = 0;
+
+  if (!is_initialized)
+  {
+    return 1;
+  }
+
+  if (timestamp < MIN_VALID_TIME)
+  {
+    return 0;
+  }
+
+  if (get_month(timestamp) != current_month)
+  {
+    result |= start_month(get_month(timestamp));
+  }
+
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+  {
+    if ((telemetry_fields[field].group & field_groups) != 0)
+    {
+      result |= append_sample(&streams[field], field, timestamp, *telemetry_fields[field].value);
+    }
+  }
+
+  elapsed_time = micros() - start_time;
+  stats_ingest_total_time_us += elapsed_time;
+
+  if (elapsed_time > stats_ingest_max_time_us)
+  {
+    stats_ingest_max_time_us = elapsed_time;
+  }
+
+  return result;
+}
+
+/* --- Queries --- */
+
+static void close_query_file()
+{
+  if (is_query_file_open)
+  {
+    query_file.close();
+    is_query_file_open = false;
+  }
+
+  query_chunk_offset = -1;
+}
+
+static int read_block_header(uint32_t block_index, historian_block_header_t* header)
+{
+  return query_file.seek(block_index * HISTORIAN_BLOCK_SIZE)
+          && query_file.read((uint8_t*)header, sizeof(*header)) == sizeof(*header)
+      ? 0
+      : 1;
+}
+
+/*
+ * @brief    Opens the file of the query's field and month, and finds (with a binary search) its
+ *           first block that ends at or after the start of the query.
+ */
+static void open_query_month(historian_query_t* query)
+{
+  char path[HISTORIAN_PATH_SIZE];
+  historian_block_header_t header;
+  uint32_t low = 0;
+
+  close_query_file();
+  query->block_index = 0;
+  query->block_count = 0;
+
+  get_field_path(query->month, query->field, path);
+  query_file = SD.open(path, FILE_READ);
+
+  if (!query_file)
+  {
+    return;
+  }
+
+  is_query_file_open = true;
+  query->block_count = query_file.size() / HISTORIAN_BLOCK_SIZE;
+
+  for (uint32_t high = query->block_count; low < high;)
+  {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (read_block_header(middle, &header) == 0 && header.last_timestamp < query->from)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  query->block_index = low;
+}
+
+/*
+ * @brief    Checks the CRC of the block being decoded, reading it in chunks.
+ */
+static bool is_query_block_valid(historian_query_t* query)
+{
+  historian_block_header_t header = query->header;
+  uint32_t offset = (query->block_index - 1) * HISTORIAN_BLOCK_SIZE + sizeof(header);
+  uint32_t crc;
+
+  header.crc = 0;
+  crc = crc32_update(CRC32_INITIAL_VALUE, (const uint8_t*)&header, sizeof(header));
+
+  if (!query_file.seek(offset))
+  {
+    return false;
+  }
+
+  for (size_t read = 0; read < HISTORIAN_BLOCK_PAYLOAD_SIZE; read += QUERY_CHUNK_SIZE)
+  {
+    if (query_file.read(query_chunk, QUERY_CHUNK_SIZE) != QUERY_CHUNK_SIZE)
+    {
+      return false;
+    }
+
+    crc = crc32_update(crc, query_chunk, QUERY_CHUNK_SIZE);
+  }
+
+  query_chunk_offset = -1;
+
+  return crc == query->header.crc;
+}
+
+static uint32_t read_bits(historian_query_t* query, uint8_t count)
+{
+  uint32_t value = 0;
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    uint32_t byte_index = query->bit_position >> 3;
+    uint8_t byte;
+
+    if (query->is_reading_memory)
+    {
+      byte = streams[query->field].block.payload[byte_index];
+    }
+    else
+    {
+      if (query_chunk_offset < 0 || byte_index < (uint32_t)query_chunk_offset
+          || byte_index >= (uint32_t)query_chunk_offset + QUERY_CHUNK_SIZE)
+      {
+        query_chunk_offset = byte_index - byte_index % QUERY_CHUNK_SIZE;
+
+        if (!query_file.seek(
+                (query->block_index - 1) * HISTORIAN_BLOCK_SIZE + sizeof(historian_block_header_t)
+                + query_chunk_offset)
+            || query_file.read(query_chunk, QUERY_CHUNK_SIZE) != QUERY_CHUNK_SIZE)
+        {
+          (void)memset(query_chunk, 0, sizeof(query_chunk));
+        }
+      }
+
+      byte = query_chunk[byte_index - query_chunk_offset];
+    }
+
+    value = (value << 1) | ((byte >> (7 - (query->bit_position & 7))) & 1);
+    query->bit_position++;
+  }
+
+  return value;
+}
+
+static void decode_timestamp(historian_query_t* query)
+{
+  int32_t delta_of_delta;
+
+  if (read_bits(query, 1) == 0)
+  {
+    delta_of_delta = 0;
+  }
+  else if (read_bits(query, 1) == 0)
+  {
+    delta_of_delta = (int32_t)read_bits(query, 7) - 63;
+  }
+  else if (read_bits(query, 1) == 0)
+  {
+    delta_of_delta = (int32_t)read_bits(query, 9) - 255;
+  }
+  else if (read_bits(query, 1) == 0)
+  {
+    delta_of_delta = (int32_t)read_bits(query, 12) - 2047;
+  }
+  else
+  {
+    delta_of_delta = (int32_t)read_bits(query, 32);
+  }
+
+  query->delta += delta_of_delta;
+  query->timestamp += query->delta;
+}
+
+static void decode_value(historian_query_t* query)
+{
+  if (read_bits(query, 1) == 0)
+  {
+    return;
+  }
+
+  if (read_bits(query, 1) == 1)
+  {
+    query->leading_zeros = read_bits(query, 5);
+    query->trailing_zeros = 32 - query->leading_zeros - (read_bits(query, 5) + 1);
+  }
+
+  query->value_bits
+      ^= read_bits(query, 32 - query->leading_zeros - query->trailing_zeros) << query->trailing_zeros;
+}
+
+/*
+ * @brief    Moves the query to its next block overlapping the time range, from the files and
+ *           then from RAM.
+ *
+ * @return   int    0 on success, non-zero when there are no more blocks.
+ */
+static int next_query_block(historian_query_t* query)
+{
+  while (!query->is_done)
+  {
+    historian_block_header_t* header = &query->header;
+
+    if (query->is_reading_memory)
+    {
+      query->is_done = true;
+      *header = streams[query->field].block.header;
+      query->block_index = 0;
+    }
+    else if (query->block_index < query->block_count)
+    {
+      if (read_block_header(query->block_index++, header) != 0)
+      {
+        query->block_count = 0;
+        continue;
+      }
+    }
+    else if (query->month < current_month && query->month < get_month(query->to))
+    {
+      query->month = add_months(query->month, 1);
+      open_query_month(query);
+      continue;
+    }
+    else
+    {
+      close_query_file();
+      query->is_reading_memory = true;
+      continue;
+    }
+
+    if (header->marker != BLOCK_MARKER || header->field != query->field
+        || header->sample_count == 0 || header->bit_count > PAYLOAD_BIT_COUNT)
+    {
+      continue;
+    }
+
+    if (header->first_timestamp > query->to)
+    {
+      // Blocks are in time order, so nothing after this one is in the range either.
+      query->is_done = true;
+      close_query_file();
+      break;
+    }
+
+    if (header->last_timestamp >= query->from)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int historian_query_begin(
+    historian_query_t* query,
+    uint8_t field,
+    time_t from,
+    time_t to,
+    uint32_t resolution)
+{
+  if (field >= TELEMETRY_FIELD_COUNT || !is_initialized)
+  {
+    return 1;
+  }
+
+  (void)memset(query, 0, sizeof(*query));
+  query->field = field;
+  query->from = (uint32_t)(from < MIN_VALID_TIME ? MIN_VALID_TIME : from);
+  query->to = (uint32_t)to;
+  query->resolution = resolution;
+  query->month = get_month(query->from);
+
+  open_query_month(query);
+
+  return 0;
+}
+
+int historian_query_next(historian_query_t* query, historian_point_t* point)
+{
+  while (true)
+  {
+    if (query->samples_left == 0)
+    {
+      historian_block_header_t* header = &query->header;
+
+      if (next_query_block(query) != 0)
+      {
+        return 1;
+      }
+
+      // A block in the range and in a single bucket is summarized by its header alone.
+      if (query->resolution > 0 && header->first_timestamp >= query->from
+          && header->last_timestamp <= query->to
+          && header->first_timestamp / query->resolution
+              == header->last_timestamp / query->resolution)
+      {
+        point->first_timestamp = header->first_timestamp;
+        point->last_timestamp = header->last_timestamp;
+        point->count = header->sample_count;
+        point->min = header->min;
+        point->max = header->max;
+        point->sum = header->sum;
+        return 0;
+      }
+
+      if (!query->is_reading_memory && !is_query_block_valid(query))
+      {
+        LogError("Skipping corrupted historian block of field %u.", query->field);
+        continue;
+      }
+
+      query->samples_left = header->sample_count;
+      query->bit_position = 0;
+      query->timestamp = header->first_timestamp;
+      query->delta = 0;
+      query->value_bits = read_bits(query, 32);
+      query->leading_zeros = NO_LEADING_ZEROS;
+      query->trailing_zeros = 0;
+    }
+    else
+    {
+      decode_timestamp(query);
+      decode_value(query);
+    }
+
+    query->samples_left--;
+
+    if (query->timestamp > query->to)
+    {
+      query->samples_left = 0;
+      query->is_done = true;
+      close_query_file();
+      return 1;
+    }
+
+    if (query->timestamp >= query->from)
+    {
+      float value = bits_to_float(query->value_bits);
+
+      point->first_timestamp = query->timestamp;
+      point->last_timestamp = query->timestamp;
+      point->count = 1;
+      point->min = value;
+      point->max = value;
+      point->sum = value;
+      return 0;
+    }
+  }
+}
+
+void historian_query_end(historian_query_t* query)
+{
+  query->samples_left = 0;
+  query->is_done = true;
+  close_query_file();
+}
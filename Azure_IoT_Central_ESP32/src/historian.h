@@ -0,0 +1,144 @@
+/*
+ * historian keeps a compressed history of every telemetry field on the SD card, for local
+ * troubleshooting over months.
+ *
+ * Each field is a separate stream of (timestamp, value) samples compressed as in Facebook's
+ * Gorilla: timestamps as the delta of their delta to the previous one (a single bit when samples
+ * are evenly spaced) and values as the XOR with the previous value (a single bit when unchanged,
+ * only the changed bits otherwise). Streams are cut in fixed-size blocks of HISTORIAN_BLOCK_SIZE
+ * bytes, each with a header holding its time range, sample count, min, max and sum, so a range
+ * scan can skip or summarize whole blocks without decoding them.
+ *
+ * Blocks are appended, in time order, to one file per field and month
+ * ("/historian/YYYYMM/fNN.bin"), so a time range is found with a binary search over the blocks of
+ * a file. Months older than HISTORIAN_RETENTION_MONTHS are deleted. The block being filled for each
+ * field is kept in RAM, so a reset loses at most one block per field.
+ *
+ * The SD card must be mounted before `historian_init` is called.
+ */
+
+#ifndef HISTORIAN_H
+#define HISTORIAN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "telemetryFields.h"
+
+#define HISTORIAN_BLOCK_SIZE 256
+
+#ifndef HISTORIAN_RETENTION_MONTHS
+#define HISTORIAN_RETENTION_MONTHS 6
+#endif
+
+/*
+ * @brief    Header of a block, followed by the compressed samples up to HISTORIAN_BLOCK_SIZE.
+ * @remark   The first sample is stored as `first_timestamp` plus its raw value (32 bits) at the
+ *           start of the compressed samples.
+ */
+typedef struct historian_block_header_t_struct
+{
+  uint16_t marker;
+  uint8_t field; // Index in `telemetry_fields`.
+  uint8_t reserved;
+  uint16_t sample_count;
+  uint16_t bit_count; // Bits of compressed samples.
+  uint32_t first_timestamp;
+  uint32_t last_timestamp;
+  float min;
+  float max;
+  float sum;
+  uint32_t crc; // CRC-32 of the block, with this field set to zero.
+} historian_block_header_t;
+
+#define HISTORIAN_BLOCK_PAYLOAD_SIZE (HISTORIAN_BLOCK_SIZE - sizeof(historian_block_header_t))
+
+/*
+ * @brief    A sample, or a summary of several consecutive samples of a field.
+ */
+typedef struct historian_point_t_struct
+{
+  uint32_t first_timestamp;
+  uint32_t last_timestamp;
+  uint32_t count;
+  float min;
+  float max;
+  float sum;
+} historian_point_t;
+
+/*
+ * @brief    State of a query. Only one query can be running at a time.
+ */
+typedef struct historian_query_t_struct
+{
+  uint8_t field;
+  uint32_t from;
+  uint32_t to;
+  uint32_t resolution;
+  uint32_t month; // YYYYMM of the file being read.
+  uint32_t block_index;
+  uint32_t block_count;
+  bool is_reading_memory; // Reading the block in RAM, after all the files.
+  bool is_done;
+
+  // Decoding of the current block.
+  historian_block_header_t header;
+  uint16_t samples_left;
+  uint16_t bit_position;
+  uint32_t timestamp;
+  int32_t delta;
+  uint32_t value_bits;
+  uint8_t leading_zeros;
+  uint8_t trailing_zeros;
+} historian_query_t;
+
+/*
+ * @brief        Prepares the historian and deletes the months past retention.
+ *
+ * @return       int       0 on success, non-zero if the SD card can not be used.
+ */
+int historian_init();
+
+/*
+ * @brief        Adds a sample of the telemetry fields in `field_groups` to their streams.
+ * @remark       Samples must come in time order. Nothing is stored until the clock is set.
+ *
+ * @return       int       0 on success, non-zero if a block could not be written.
+ */
+int historian_append(uint32_t timestamp, uint8_t field_groups);
+
+/*
+ * @brief        Starts a query of the samples of a field between `from` and `to` (inclusive).
+ *
+ * @param[in]    query         The query state.
+ * @param[in]    field         Index of the field in `telemetry_fields`.
+ * @param[in]    from          Start of the time range.
+ * @param[in]    to            End of the time range.
+ * @param[in]    resolution    Buckets (aligned to multiples of it, in seconds) in which the samples
+ *                             are going to be aggregated, or 0. A block entirely in the time range
+ *                             and in one bucket is returned as a single summary point.
+ *
+ * @return       int           0 on success, non-zero if the field does not exist.
+ */
+int historian_query_begin(
+    historian_query_t* query,
+    uint8_t field,
+    time_t from,
+    time_t to,
+    uint32_t resolution);
+
+/*
+ * @brief        Gets the next point of a query, in time order. Samples are decoded from the SD
+ *               card a few bytes at a time, never loading a whole block in RAM.
+ *
+ * @return       int       0 on success, non-zero when there are no more points.
+ */
+int historian_query_next(historian_query_t* query, historian_point_t* point);
+
+/*
+ * @brief        Ends a query before all its points are read, releasing its file.
+ */
+void historian_query_end(historian_query_t* query);
+
+#endif // HISTORIAN_H
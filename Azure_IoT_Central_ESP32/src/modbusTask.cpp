@@ -1,13 +1,15 @@
 #include "weidosTasks.h"
 #include "telemetryGlobalVariables.h"
+#include "telemetryFields.h"
 
 #include <Arduino.h>
 #include <Ethernet.h>
 #include <ArduinoModbus.h>
 #include <time.h>
 
-#include <SDLoggerAzure.h>
-SDLoggerClass modbusLogger("sysLog/modules/modbus","modbus.txt");
+#include "asyncLog.h"
+#include "flightRecorder.h"
+static async_log_file_t modbusLogFile = ASYNC_LOG_FILE("sysLog/modules/modbus", "modbus.txt");
 
 #define ETHERNET_TIMEOUT            60000
 #define ETHERNET_RESPONSE_TIMEOUT   4000
@@ -17,17 +19,7 @@ SDLoggerClass modbusLogger("sysLog/modules/modbus","modbus.txt");
 
 #define MODBUS_ADDRESS      1
 #define MODBUS_TIMEOUT      5000
-#define REG_ADDRESS         19000
-#define NUM_REGISTERS       122
-#define NUM_DATA            NUM_REGISTERS/2
-
-#define REG_ADDRESS2         828
-#define NUM_REGISTERS2       20
-#define NUM_DATA2            NUM_REGISTERS2/2
-
-#define REG_ADDRESS3         10085
-#define NUM_REGISTERS3       2
-#define NUM_DATA3            NUM_REGISTERS3/2
+#define MODBUS_MAX_REGISTERS_PER_REQUEST    125
 
 
 EthernetClient ethClient;
@@ -60,14 +52,14 @@ void weidosSetup(){
     Serial.begin(115200);
     //while(!Serial){}
     delay(5000);
-    modbusLogger.logInfo("Initializing modbusTask");
+    async_log(&modbusLogFile, async_log_level_info, "Initializing modbusTask");
 
     Serial.println("Welcome");
     Ethernet.init(ETHERNET_CS);
     while(!Ethernet.begin(mac, ETHERNET_TIMEOUT, ETHERNET_RESPONSE_TIMEOUT)){
     Serial.print("e");
     }
-    modbusLogger.logInfo("Ethernet connected successfully");
+    async_log(&modbusLogFile, async_log_level_info, "Ethernet connected successfully");
 
     Serial.println();
     Serial.print("Local IP: ");
@@ -81,97 +73,119 @@ void weidosSetup(){
         if(!modbusTCPClient.connected())
         {
             modbusTCPClient.begin(serverIP);
-            modbusLogger.logInfo("Modbus Client reconnect!");
+            async_log(&modbusLogFile, async_log_level_info, "Modbus Client reconnect!");
             Serial.print("m");
             delay(1000);
         }else break;
     }
 
-    modbusLogger.logInfo("Modbus Client connected successfully");
-    modbusLogger.logInfo("End of modbusTask setup");
+    async_log(&modbusLogFile, async_log_level_info, "Modbus Client connected successfully");
+    async_log(&modbusLogFile, async_log_level_info, "End of modbusTask setup");
     
     Serial.println("Modbus Client connected");
     Serial.println("End of set up");
 };
 
 
-void getData(){
-    modbusTCPClient.begin(serverIP);
-    
-    for(int i=0; i<MODBUS_BEGIN_TRIES; i++)
-    {
-        if(!modbusTCPClient.connected())
-        {
-            modbusTCPClient.begin(serverIP);
-        }else break;
-    }
+/*
+ * Register blocks of the energy meter, in the order they are read. Consecutive blocks that are
+ * contiguous in the meter and needed for the requested field groups are read in a single request,
+ * so with all the groups requested the reads are the same three requests as always.
+ */
+struct ModbusBlock {
+    int address;
+    int numRegisters;
+    uint8_t fieldGroups;
+    void (*assignData)();
+};
+
+static const ModbusBlock modbusBlocks[] = {
+    { 19000, 54, TELEMETRY_FIELD_GROUP_BASIC,         assignInstantaneousData },
+    { 19054, 56, TELEMETRY_FIELD_GROUP_ENERGY,        assignEnergyData },
+    { 19110, 12, TELEMETRY_FIELD_GROUP_POWER_QUALITY, assignTHDLNData },
+    { 828,    8, TELEMETRY_FIELD_GROUP_BASIC,         assignPowerFactorData },
+    { 836,    6, TELEMETRY_FIELD_GROUP_POWER_QUALITY, assignTHDLLData },
+    { 10085,  2, TELEMETRY_FIELD_GROUP_BASIC,         assignNeutralCurrentData },
+};
+
+#define NUM_MODBUS_BLOCKS   (sizeof(modbusBlocks) / sizeof(modbusBlocks[0]))
+
+
+static bool requestRegisters(int address, int numRegisters){
+    char message[64];
 
     for(int i=0; i<MODBUS_REQUEST_TRIES; i++)
     {
-        int response = modbusTCPClient.requestFrom(MODBUS_ADDRESS, INPUT_REGISTERS, REG_ADDRESS, NUM_REGISTERS);    
-        timestamp = time(NULL);
+        int response = modbusTCPClient.requestFrom(MODBUS_ADDRESS, INPUT_REGISTERS, address, numRegisters);    
         if(!response)
         {
-            modbusLogger.logError("No response for modbus batch 1. Last error: ");
-            modbusLogger.logError(modbusTCPClient.lastError());
-            
-            Serial.println("No response");
-            Serial.print("Last error: ");
+            snprintf(message, sizeof(message), "No response for modbus registers %d-%d. Last error: ", address, address + numRegisters - 1);
+            async_log(&modbusLogFile, async_log_level_error, "%s", message);
+            async_log(&modbusLogFile, async_log_level_error, "%s", modbusTCPClient.lastError());
+
+            Serial.println(message);
             Serial.println(modbusTCPClient.lastError());
             modbusTCPClient.begin(serverIP);
             comStatus = 0;
+            flight_recorder_record(flight_recorder_event_modbus_read, 0, numRegisters, address);
             continue;
         }
-        assignDataToGlobalVariables();
         comStatus = 1;
-        //timestamp = time(NULL);
-        modbusLogger.logInfo("modbus batch 1 successfull read!");
-        break;
+        flight_recorder_record(flight_recorder_event_modbus_read, 1, numRegisters, address);
+        snprintf(message, sizeof(message), "modbus registers %d-%d successfull read!", address, address + numRegisters - 1);
+        async_log(&modbusLogFile, async_log_level_info, "%s", message);
+        return true;
     }
 
-    for(int i=0; i<MODBUS_REQUEST_TRIES; i++)
+    return false;
+}
+
+void getData(uint8_t fieldGroups){
+    bool timestampTaken = false;
+
+    modbusTCPClient.begin(serverIP);
+    
+    for(int i=0; i<MODBUS_BEGIN_TRIES; i++)
     {
-        int response = modbusTCPClient.requestFrom(MODBUS_ADDRESS, INPUT_REGISTERS, REG_ADDRESS2, NUM_REGISTERS2);    
-        if(!response)
+        if(!modbusTCPClient.connected())
         {
-            modbusLogger.logError("No response for modbus batch 2. Last error: ");
-            modbusLogger.logError(modbusTCPClient.lastError());
-
-            Serial.println("No response for batch 2");
-            Serial.print("Last error: ");
-            Serial.println(modbusTCPClient.lastError());
             modbusTCPClient.begin(serverIP);
-            comStatus = 0;
-            continue;
-        }
-        assignDataToGlobalVariables2();
-        comStatus = 1;
-        modbusLogger.logInfo("modbus batch 2 successfull read!");
-        break;
+        }else break;
     }
 
-    for(int i=0; i<MODBUS_REQUEST_TRIES; i++)
+    size_t first = 0;
+    while(first < NUM_MODBUS_BLOCKS)
     {
-        int response = modbusTCPClient.requestFrom(MODBUS_ADDRESS, INPUT_REGISTERS, REG_ADDRESS3, NUM_REGISTERS3);    
-        if(!response)
+        if(!(modbusBlocks[first].fieldGroups & fieldGroups))
         {
-            modbusLogger.logError("No response for modbus batch 3. Last error: ");
-            modbusLogger.logError(modbusTCPClient.lastError());
-
-            Serial.println("No response for batch 3");
-            Serial.print("Last error: ");
-            Serial.println(modbusTCPClient.lastError());
-            modbusTCPClient.begin(serverIP);
-            comStatus = 0;
+            first++;
             continue;
         }
-        assignDataToGlobalVariables3();
-        comStatus = 1;
-        modbusLogger.logInfo("modbus batch 3 successfull read!");
-        break;
-    }
 
-    time_t now = time(NULL);
+        size_t last = first;
+        int numRegisters = modbusBlocks[first].numRegisters;
+        while(last + 1 < NUM_MODBUS_BLOCKS
+              && (modbusBlocks[last + 1].fieldGroups & fieldGroups)
+              && modbusBlocks[last + 1].address == modbusBlocks[last].address + modbusBlocks[last].numRegisters
+              && numRegisters + modbusBlocks[last + 1].numRegisters <= MODBUS_MAX_REGISTERS_PER_REQUEST)
+        {
+            last++;
+            numRegisters += modbusBlocks[last].numRegisters;
+        }
+
+        bool read = requestRegisters(modbusBlocks[first].address, numRegisters);
+        if(!timestampTaken)
+        {
+            timestamp = time(NULL);
+            timestampTaken = true;
+        }
+        if(read)
+        {
+            for(size_t block = first; block <= last; block++) modbusBlocks[block].assignData();
+        }
+
+        first = last + 1;
+    }
 
     return;
 }
@@ -180,7 +194,7 @@ void getData(){
 
 
 
-void assignDataToGlobalVariables(){
+void assignInstantaneousData(){
     voltageL1N = getNextData();
     voltageL2N = getNextData();
     voltageL3N = getNextData();
@@ -208,6 +222,9 @@ void assignDataToGlobalVariables(){
     cosPhiL3 = getNextData();
     frequency = getNextData();
     rotField = getNextData();
+}
+
+void assignEnergyData(){
     realEnergyL1N = getNextData()/1000.0f;
     realEnergyL2N = getNextData()/1000.0f;
     realEnergyL3N = getNextData()/1000.0f;
@@ -236,6 +253,9 @@ void assignDataToGlobalVariables(){
     getNextData();      //reactiveEnergyCapL2 deleted variable
     getNextData();      //reactiveEnergyCapL3 deleted variable
     getNextData();      //reactiveEnergyCapTotal deleted variable
+}
+
+void assignTHDLNData(){
     THDVoltsL1N = getNextData();
     THDVoltsL2N = getNextData();
     THDVoltsL3N = getNextData();
@@ -244,17 +264,20 @@ void assignDataToGlobalVariables(){
     THDCurrentL3N = getNextData();
 }
 
-void assignDataToGlobalVariables2(){
+void assignPowerFactorData(){
     powerFactorL1N = getNextData();
     powerFactorL2N = getNextData();
     powerFactorL3N = getNextData();
     powerFactorTotal = getNextData();
+}
+
+void assignTHDLLData(){
     THDVoltsL1L2 = getNextData();
     THDVoltsL2L3 = getNextData();
     THDVoltsL1L3 = getNextData();
 }
 
-void assignDataToGlobalVariables3(){
+void assignNeutralCurrentData(){
     currentNeutral = getNextData();
 }
 
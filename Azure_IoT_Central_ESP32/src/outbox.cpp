@@ -0,0 +1,458 @@
+#include "outbox.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <limits.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+
+#define PUBLISH_TASK_STACK_SIZE 6144
+#define PUBLISH_TASK_PRIORITY (tskIDLE_PRIORITY + 2)
+
+// PUBACKs received and not yet reported. Must be a power of two.
+#define ACK_RING_SIZE 32
+#define ACK_RING_INDEX_MASK (ACK_RING_SIZE - 1)
+
+// QoS 1 messages published whose PUBACK can still come.
+#define PUBLISHED_MESSAGE_COUNT 32
+
+typedef enum slot_state_t_enum
+{
+  slot_state_free,
+  slot_state_filling,
+  slot_state_ready,
+  slot_state_publishing,
+  slot_state_returned // Telemetry not published, until `outbox_take_returned`.
+} slot_state_t;
+
+typedef struct outbox_slot_t_struct
+{
+  slot_state_t state;
+  outbox_class_t message_class;
+  uint32_t sequence; // Posting order.
+  int message_id;
+  int qos;
+  size_t payload_length;
+  char topic[OUTBOX_TOPIC_MAX_SIZE];
+  uint8_t payload[OUTBOX_PAYLOAD_MAX_SIZE];
+} outbox_slot_t;
+
+typedef struct published_message_t_struct
+{
+  int packet_id;
+  int message_id; // Zero once reported.
+} published_message_t;
+
+// Slots that only a higher class can take, per class.
+static const uint8_t reserved_slot_counts[] = { 0, 1, 2 };
+
+// The state of the slots is only changed with the lock taken.
+static outbox_slot_t slots[OUTBOX_SLOT_COUNT];
+static uint8_t used_slot_count = 0;
+static uint32_t next_sequence = 0;
+static int next_message_id = 1;
+static portMUX_TYPE slots_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static std::atomic<bool> is_client_connected(false);
+static TaskHandle_t publish_task_handle = NULL;
+static outbox_publish_t publish_function = NULL;
+static outbox_completed_t completed_function = NULL;
+
+// Held by the publishing task while it uses the MQTT client, and by `outbox_release_client`.
+static SemaphoreHandle_t client_mutex = NULL;
+
+// Written by the MQTT client task only, read with `client_mutex` taken.
+static int acknowledged_packet_ids[ACK_RING_SIZE];
+static std::atomic<uint32_t> ack_write_position(0);
+static std::atomic<uint32_t> ack_read_position(0);
+
+// Used with `client_mutex` taken only.
+static published_message_t published_messages[PUBLISHED_MESSAGE_COUNT];
+static uint8_t next_published_message = 0;
+
+static void notify_publish_task()
+{
+  if (publish_task_handle != NULL)
+  {
+    xTaskNotifyGive(publish_task_handle);
+  }
+}
+
+int outbox_post(outbox_class_t message_class, az_span topic, az_span payload, int qos)
+{
+  outbox_slot_t* slot = NULL;
+  int message_id = -1;
+
+  if (az_span_size(topic) >= OUTBOX_TOPIC_MAX_SIZE
+      || az_span_size(payload) > OUTBOX_PAYLOAD_MAX_SIZE)
+  {
+    return -1;
+  }
+
+  taskENTER_CRITICAL(&slots_lock);
+
+  if (used_slot_count < OUTBOX_SLOT_COUNT - reserved_slot_counts[message_class])
+  {
+    for (uint8_t i = 0; i < OUTBOX_SLOT_COUNT; i++)
+    {
+      if (slots[i].state == slot_state_free)
+      {
+        slot = &slots[i];
+        break;
+      }
+    }
+
+    slot->state = slot_state_filling;
+    slot->message_class = message_class;
+    slot->sequence = next_sequence++;
+    slot->message_id = next_message_id;
+    message_id = next_message_id;
+    next_message_id = next_message_id == INT_MAX ? 1 : next_message_id + 1;
+    used_slot_count++;
+  }
+
+  taskEXIT_CRITICAL(&slots_lock);
+
+  if (slot == NULL)
+  {
+    return -1;
+  }
+
+  // Copied without the lock, as the slot is not used by anyone else until it is ready.
+  slot->qos = qos;
+  (void)memcpy(slot->topic, az_span_ptr(topic), az_span_size(topic));
+  slot->topic[az_span_size(topic)] = '\0';
+  (void)memcpy(slot->payload, az_span_ptr(payload), az_span_size(payload));
+  slot->payload_length = az_span_size(payload);
+
+  taskENTER_CRITICAL(&slots_lock);
+  slot->state = slot_state_ready;
+  taskEXIT_CRITICAL(&slots_lock);
+
+  notify_publish_task();
+
+  // Not read from the slot: once ready, it can be published, freed and reused before we get here.
+  return message_id;
+}
+
+bool outbox_has_room(outbox_class_t message_class)
+{
+  bool has_room;
+
+  taskENTER_CRITICAL(&slots_lock);
+  has_room = used_slot_count < OUTBOX_SLOT_COUNT - reserved_slot_counts[message_class];
+  taskEXIT_CRITICAL(&slots_lock);
+
+  return has_room;
+}
+
+uint8_t outbox_get_count(outbox_class_t message_class)
+{
+  uint8_t count = 0;
+
+  taskENTER_CRITICAL(&slots_lock);
+
+  for (uint8_t i = 0; i < OUTBOX_SLOT_COUNT; i++)
+  {
+    if (slots[i].state != slot_state_free && slots[i].message_class == message_class)
+    {
+      count++;
+    }
+  }
+
+  taskEXIT_CRITICAL(&slots_lock);
+
+  return count;
+}
+
+void outbox_acknowledge(int packet_id)
+{
+  uint32_t position = ack_write_position.load(std::memory_order_relaxed);
+
+  if (position - ack_read_position.load(std::memory_order_acquire) == ACK_RING_SIZE)
+  {
+    // Not reported in time, the message is then taken as not delivered by whoever tracks it.
+    return;
+  }
+
+  acknowledged_packet_ids[position & ACK_RING_INDEX_MASK] = packet_id;
+  ack_write_position.store(position + 1, std::memory_order_release);
+
+  notify_publish_task();
+}
+
+void outbox_set_connected(bool is_connected)
+{
+  is_client_connected.store(is_connected, std::memory_order_release);
+
+  if (is_connected)
+  {
+    notify_publish_task();
+  }
+}
+
+/*
+ * @brief    Takes the ready message of the highest class posted first, or returns NULL if there is
+ *           none.
+ */
+static outbox_slot_t* take_next_slot()
+{
+  outbox_slot_t* next = NULL;
+
+  taskENTER_CRITICAL(&slots_lock);
+
+  for (uint8_t i = 0; i < OUTBOX_SLOT_COUNT; i++)
+  {
+    outbox_slot_t* slot = &slots[i];
+
+    if (slot->state == slot_state_ready
+        && (next == NULL || slot->message_class < next->message_class
+            || (slot->message_class == next->message_class
+                && (int32_t)(slot->sequence - next->sequence) < 0)))
+    {
+      next = slot;
+    }
+  }
+
+  if (next != NULL)
+  {
+    next->state = slot_state_publishing;
+  }
+
+  taskEXIT_CRITICAL(&slots_lock);
+
+  return next;
+}
+
+/*
+ * @brief    Gets the state of a slot whose message will not be published: telemetry is returned,
+ *           anything else dropped.
+ */
+static slot_state_t get_unpublished_slot_state(const outbox_slot_t* slot)
+{
+  return slot->message_class == outbox_class_telemetry ? slot_state_returned : slot_state_free;
+}
+
+static void set_slot_state(outbox_slot_t* slot, slot_state_t state)
+{
+  taskENTER_CRITICAL(&slots_lock);
+
+  if (state == slot_state_free)
+  {
+    used_slot_count--;
+  }
+
+  slot->state = state;
+
+  taskEXIT_CRITICAL(&slots_lock);
+}
+
+/*
+ * @brief    Reports the PUBACKs received to the `completed_function`, by message ID.
+ * @remark   Called with `client_mutex` taken.
+ */
+static void report_acknowledgements()
+{
+  uint32_t read_position = ack_read_position.load(std::memory_order_relaxed);
+  uint32_t write_position = ack_write_position.load(std::memory_order_acquire);
+
+  for (; read_position != write_position; read_position++)
+  {
+    int packet_id = acknowledged_packet_ids[read_position & ACK_RING_INDEX_MASK];
+
+    for (uint8_t i = 0; i < PUBLISHED_MESSAGE_COUNT; i++)
+    {
+      published_message_t* message = &published_messages[i];
+
+      if (message->message_id != 0 && message->packet_id == packet_id)
+      {
+        int message_id = message->message_id;
+
+        message->message_id = 0;
+
+        if (completed_function != NULL)
+        {
+          completed_function(message_id);
+        }
+
+        break;
+      }
+    }
+  }
+
+  ack_read_position.store(read_position, std::memory_order_release);
+}
+
+/*
+ * @brief    Publishes the next message, if any.
+ * @remark   Called with `client_mutex` taken.
+ *
+ * @return   int    0 if a message was published (or failed), non-zero if there was none or the
+ *                  client got disconnected.
+ */
+static int publish_next_message()
+{
+  outbox_slot_t* slot;
+  int packet_id;
+
+  if (!is_client_connected.load(std::memory_order_acquire) || (slot = take_next_slot()) == NULL)
+  {
+    return 1;
+  }
+
+  packet_id = publish_function(
+      slot->topic, az_span_create(slot->payload, slot->payload_length), slot->qos);
+
+  if (packet_id < 0)
+  {
+    if (!is_client_connected.load(std::memory_order_acquire))
+    {
+      // Published once connected again.
+      set_slot_state(slot, slot_state_ready);
+      return 1;
+    }
+
+    LogError("Failed publishing message %d to '%s'.", slot->message_id, slot->topic);
+    set_slot_state(slot, get_unpublished_slot_state(slot));
+    return 0;
+  }
+  else if (slot->qos > 0)
+  {
+    published_messages[next_published_message].packet_id = packet_id;
+    published_messages[next_published_message].message_id = slot->message_id;
+    next_published_message = (next_published_message + 1) % PUBLISHED_MESSAGE_COUNT;
+  }
+
+  set_slot_state(slot, slot_state_free);
+
+  return 0;
+}
+
+static void publish_task(void* parameters)
+{
+  (void)parameters;
+
+  while (true)
+  {
+    (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    do
+    {
+      (void)xSemaphoreTake(client_mutex, portMAX_DELAY);
+      report_acknowledgements();
+      int result = publish_next_message();
+      (void)xSemaphoreGive(client_mutex);
+
+      if (result != 0)
+      {
+        break;
+      }
+    } while (true);
+  }
+}
+
+void outbox_release_client()
+{
+  (void)xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+  // Packet IDs start over with the next MQTT client.
+  (void)memset(published_messages, 0, sizeof(published_messages));
+  ack_read_position.store(
+      ack_write_position.load(std::memory_order_acquire), std::memory_order_release);
+
+  (void)xSemaphoreGive(client_mutex);
+}
+
+void outbox_clear()
+{
+  uint8_t dropped_count = 0;
+  uint8_t returned_count = 0;
+
+  taskENTER_CRITICAL(&slots_lock);
+
+  for (uint8_t i = 0; i < OUTBOX_SLOT_COUNT; i++)
+  {
+    if (slots[i].state == slot_state_ready)
+    {
+      slots[i].state = get_unpublished_slot_state(&slots[i]);
+
+      if (slots[i].state == slot_state_free)
+      {
+        used_slot_count--;
+        dropped_count++;
+      }
+      else
+      {
+        returned_count++;
+      }
+    }
+  }
+
+  taskEXIT_CRITICAL(&slots_lock);
+
+  if (dropped_count > 0 || returned_count > 0)
+  {
+    LogInfo(
+        "Outbox cleared, %u messages dropped and %u telemetry messages returned.",
+        dropped_count,
+        returned_count);
+  }
+}
+
+int outbox_take_returned(outbox_returned_t on_returned)
+{
+  int returned_count = 0;
+
+  while (true)
+  {
+    outbox_slot_t* oldest = NULL;
+
+    taskENTER_CRITICAL(&slots_lock);
+
+    for (uint8_t i = 0; i < OUTBOX_SLOT_COUNT; i++)
+    {
+      if (slots[i].state == slot_state_returned
+          && (oldest == NULL || (int32_t)(slots[i].sequence - oldest->sequence) < 0))
+      {
+        oldest = &slots[i];
+      }
+    }
+
+    taskEXIT_CRITICAL(&slots_lock);
+
+    if (oldest == NULL)
+    {
+      return returned_count;
+    }
+
+    // Read without the lock, as returned slots are only used by this function.
+    on_returned(
+        oldest->topic, az_span_create(oldest->payload, oldest->payload_length), oldest->qos);
+    set_slot_state(oldest, slot_state_free);
+    returned_count++;
+  }
+}
+
+int outbox_init(outbox_publish_t publish, outbox_completed_t on_completed)
+{
+  publish_function = publish;
+  completed_function = on_completed;
+  client_mutex = xSemaphoreCreateMutex();
+
+  if (client_mutex == NULL
+      || xTaskCreate(
+             publish_task,
+             "outbox",
+             PUBLISH_TASK_STACK_SIZE,
+             NULL,
+             PUBLISH_TASK_PRIORITY,
+             &publish_task_handle)
+          != pdPASS)
+  {
+    LogError("Failed creating the outbox publishing task.");
+    return 1;
+  }
+
+  return 0;
+}
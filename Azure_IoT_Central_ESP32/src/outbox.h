@@ -0,0 +1,146 @@
+/*
+ * outbox decouples producing MQTT messages from publishing them, so the task that generates a
+ * message never waits for the MQTT client (its lock, buffering or socket writes).
+ *
+ * Posting a message copies it into one of OUTBOX_SLOT_COUNT preallocated slots, and a dedicated
+ * task publishes the messages: alarms first, then telemetry, then diagnostics, and in the order
+ * they were posted within a class. Lower classes can not take the last slots, which are kept for
+ * the higher ones, so a backlog of diagnostics never holds back an alarm. When a class has no slot
+ * left, posting fails, which producers take as backpressure (e.g., telemetry then goes to the
+ * telemetry queue on the SD card); `outbox_has_room` tells them beforehand.
+ *
+ * Messages are only published while the MQTT client is connected, and are held meanwhile, also
+ * across MQTT clients (e.g., when reconnecting with a new SAS token) unless `outbox_clear` is called.
+ * Telemetry is never dropped, though: the telemetry messages cleared, or whose publishing failed,
+ * are returned to the producer by `outbox_take_returned` (e.g., to store them in the telemetry
+ * queue), and keep their slot until then.
+ *
+ * As the MQTT packet ID of a message is only known once it is published, posting returns an outbox
+ * message ID instead. PUBACKs are recorded with `outbox_acknowledge` (on the MQTT client task) and
+ * reported, with the message ID, by the publishing task.
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <az_core.h>
+
+/* Messages held at a time. */
+#ifndef OUTBOX_SLOT_COUNT
+#define OUTBOX_SLOT_COUNT 6
+#endif
+
+/* Topic (with the null-terminator) and payload sizes a slot can hold. */
+#define OUTBOX_TOPIC_MAX_SIZE 256
+#define OUTBOX_PAYLOAD_MAX_SIZE 4096
+
+#if OUTBOX_SLOT_COUNT < 3
+#error "OUTBOX_SLOT_COUNT must be at least 3."
+#endif
+
+/*
+ * @brief    Classes of messages, from the most to the least urgent.
+ */
+typedef enum outbox_class_t_enum
+{
+  outbox_class_alarm,
+  outbox_class_telemetry,
+  outbox_class_diagnostics
+} outbox_class_t;
+
+/*
+ * @brief        Publishes a message with the MQTT client.
+ *
+ * @return       int    The MQTT packet ID, or negative if the message could not be published.
+ */
+typedef int (*outbox_publish_t)(const char* topic, az_span payload, int qos);
+
+/*
+ * @brief        Reports the PUBACK of a message published with QoS 1.
+ *
+ * @param[in]    message_id    The ID returned by `outbox_post` for the message.
+ */
+typedef void (*outbox_completed_t)(int message_id);
+
+/*
+ * @brief        Takes back a telemetry message that was not published.
+ *
+ * @param[in]    topic      Topic of the message, null-terminated.
+ * @param[in]    payload    Payload of the message.
+ * @param[in]    qos        MQTT QoS the message was to be published with.
+ */
+typedef void (*outbox_returned_t)(const char* topic, az_span payload, int qos);
+
+/*
+ * @brief        Starts the publishing task.
+ *
+ * @param[in]    publish         Function publishing the messages.
+ * @param[in]    on_completed    Function called (on the publishing task) for every PUBACK.
+ *
+ * @return       int             0 on success, non-zero if the task could not be created.
+ */
+int outbox_init(outbox_publish_t publish, outbox_completed_t on_completed);
+
+/*
+ * @brief        Copies a message into the outbox, to be published by the publishing task.
+ * @remark       Can be called from any task.
+ *
+ * @param[in]    message_class    Class of the message.
+ * @param[in]    topic            Topic of the message, with the null-terminator.
+ * @param[in]    payload          Payload of the message.
+ * @param[in]    qos              MQTT QoS to publish the message with.
+ *
+ * @return       int              The ID of the message (positive), or negative if there is no slot
+ *                                left for its class or the message does not fit in a slot.
+ */
+int outbox_post(outbox_class_t message_class, az_span topic, az_span payload, int qos);
+
+/*
+ * @brief        Checks if a message of `message_class` can be posted.
+ */
+bool outbox_has_room(outbox_class_t message_class);
+
+/*
+ * @brief        Gets the number of messages of `message_class` in the outbox, i.e. not handed to
+ *               the MQTT client yet (including the ones returned but not taken back).
+ */
+uint8_t outbox_get_count(outbox_class_t message_class);
+
+/*
+ * @brief        Records the PUBACK of a packet. Meant to be called from the MQTT client task.
+ */
+void outbox_acknowledge(int packet_id);
+
+/*
+ * @brief        Tells whether the MQTT client is connected, so messages can be published.
+ */
+void outbox_set_connected(bool is_connected);
+
+/*
+ * @brief        Waits for the message being published (if any) and forgets the packet IDs of the
+ *               messages published, so the MQTT client can be destroyed.
+ * @remark       Call `outbox_set_connected(false)` first.
+ */
+void outbox_release_client();
+
+/*
+ * @brief        Drops every message not published yet, except telemetry, which is returned (see
+ *               `outbox_take_returned`).
+ */
+void outbox_clear();
+
+/*
+ * @brief        Hands the telemetry messages that were not published back, oldest first, and frees
+ *               their slots.
+ * @remark       Meant to be called from the task producing the telemetry.
+ *
+ * @param[in]    on_returned    Function called for each message returned.
+ *
+ * @return       int            The number of messages returned.
+ */
+int outbox_take_returned(outbox_returned_t on_returned);
+
+#endif // OUTBOX_H
@@ -0,0 +1,161 @@
+#include "publishWindow.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+#include "../AzureIoT.h"
+
+// PUBACKs received and not yet matched. Must be a power of two.
+#define ACK_RING_SIZE (2 * PUBLISH_WINDOW_MAX_SIZE)
+#define ACK_RING_INDEX_MASK (ACK_RING_SIZE - 1)
+
+// Messages acknowledged between two logs of the window statistics.
+#define STATS_MESSAGE_INTERVAL 100
+
+typedef struct window_entry_t_struct
+{
+  int packet_id;
+  uint32_t queue_end;
+  unsigned long publish_time;
+  bool is_acknowledged;
+} window_entry_t;
+
+// Oldest message first, `entry_count` entries from `first_entry`.
+static window_entry_t entries[PUBLISH_WINDOW_SIZE];
+static uint8_t first_entry = 0;
+static uint8_t entry_count = 0;
+
+// Written by the task reporting PUBACKs only, read by the publishing task only.
+static int acknowledged_packet_ids[ACK_RING_SIZE];
+static std::atomic<uint32_t> ack_write_position(0);
+static std::atomic<uint32_t> ack_read_position(0);
+
+static uint32_t stats_message_count = 0;
+static unsigned long stats_start_time = 0;
+static unsigned long stats_total_latency_ms = 0;
+static unsigned long stats_max_latency_ms = 0;
+
+bool publish_window_is_full() { return entry_count == PUBLISH_WINDOW_SIZE; }
+
+uint8_t publish_window_get_count() { return entry_count; }
+
+int publish_window_add(int packet_id, uint32_t queue_end)
+{
+  window_entry_t* entry;
+
+  if (publish_window_is_full())
+  {
+    return 1;
+  }
+
+  entry = &entries[(first_entry + entry_count) % PUBLISH_WINDOW_SIZE];
+  entry->packet_id = packet_id;
+  entry->queue_end = queue_end;
+  entry->publish_time = millis();
+  entry->is_acknowledged = false;
+  entry_count++;
+
+  if (stats_message_count == 0 && stats_start_time == 0)
+  {
+    stats_start_time = entry->publish_time;
+  }
+
+  return 0;
+}
+
+void publish_window_acknowledge(int packet_id)
+{
+  uint32_t position = ack_write_position.load(std::memory_order_relaxed);
+
+  if (position - ack_read_position.load(std::memory_order_acquire) == ACK_RING_SIZE)
+  {
+    // Not matched in time, the message will be published again once its PUBACK is overdue.
+    return;
+  }
+
+  acknowledged_packet_ids[position & ACK_RING_INDEX_MASK] = packet_id;
+  ack_write_position.store(position + 1, std::memory_order_release);
+}
+
+static void record_latency(const window_entry_t* entry)
+{
+  unsigned long now = millis();
+  unsigned long latency = now - entry->publish_time;
+
+  stats_message_count++;
+  stats_total_latency_ms += latency;
+
+  if (latency > stats_max_latency_ms)
+  {
+    stats_max_latency_ms = latency;
+  }
+
+  if (stats_message_count == STATS_MESSAGE_INTERVAL)
+  {
+    unsigned long elapsed = now - stats_start_time;
+
+    LogInfo(
+        "QoS 1 window of %u: %u messages acknowledged in %lu ms (%lu per minute), PUBACK avg %lu "
+        "ms, max %lu ms.",
+        PUBLISH_WINDOW_SIZE,
+        stats_message_count,
+        elapsed,
+        elapsed > 0 ? stats_message_count * 60000UL / elapsed : 0,
+        stats_total_latency_ms / stats_message_count,
+        stats_max_latency_ms);
+
+    stats_message_count = 0;
+    stats_start_time = now;
+    stats_total_latency_ms = 0;
+    stats_max_latency_ms = 0;
+  }
+}
+
+int publish_window_release(uint32_t* queue_end)
+{
+  uint32_t read_position = ack_read_position.load(std::memory_order_relaxed);
+  uint32_t write_position = ack_write_position.load(std::memory_order_acquire);
+  bool is_released = false;
+
+  for (; read_position != write_position; read_position++)
+  {
+    int packet_id = acknowledged_packet_ids[read_position & ACK_RING_INDEX_MASK];
+
+    for (uint8_t i = 0; i < entry_count; i++)
+    {
+      window_entry_t* entry = &entries[(first_entry + i) % PUBLISH_WINDOW_SIZE];
+
+      if (entry->packet_id == packet_id && !entry->is_acknowledged)
+      {
+        entry->is_acknowledged = true;
+        record_latency(entry);
+        break;
+      }
+    }
+  }
+
+  ack_read_position.store(read_position, std::memory_order_release);
+
+  while (entry_count > 0 && entries[first_entry].is_acknowledged)
+  {
+    *queue_end = entries[first_entry].queue_end;
+    first_entry = (first_entry + 1) % PUBLISH_WINDOW_SIZE;
+    entry_count--;
+    is_released = true;
+  }
+
+  return is_released ? 0 : 1;
+}
+
+unsigned long publish_window_get_oldest_age()
+{
+  return entry_count == 0 ? 0 : millis() - entries[first_entry].publish_time;
+}
+
+void publish_window_reset()
+{
+  first_entry = 0;
+  entry_count = 0;
+  ack_read_position.store(
+      ack_write_position.load(std::memory_order_acquire), std::memory_order_release);
+}
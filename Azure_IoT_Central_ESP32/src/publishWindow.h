@@ -0,0 +1,79 @@
+/*
+ * publishWindow tracks the telemetry messages published with QoS 1 (at least once) that are still
+ * waiting for their PUBACK, so messages are only released from the telemetry queue once delivered.
+ *
+ * At most `PUBLISH_WINDOW_SIZE` messages are in flight at a time. Each is tracked by the ID it was
+ * published with (the outbox message ID, see src/outbox.h), along with the offset in the telemetry
+ * queue where the message ends. PUBACKs are reported on another task, so they are only recorded (in
+ * a lock-free ring) there, and matched to the in-flight messages by `publish_window_release` on the
+ * task that publishes.
+ *
+ * Messages are released in the order they were published: the queue offset released is the one of
+ * the newest message whose PUBACK (and the PUBACKs of every message before it) has arrived.
+ */
+
+#ifndef PUBLISH_WINDOW_H
+#define PUBLISH_WINDOW_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Number of messages that can be waiting for their PUBACK at a time. */
+#ifndef PUBLISH_WINDOW_SIZE
+#define PUBLISH_WINDOW_SIZE 4
+#endif
+
+#define PUBLISH_WINDOW_MAX_SIZE 16
+
+#if PUBLISH_WINDOW_SIZE < 1 || PUBLISH_WINDOW_SIZE > PUBLISH_WINDOW_MAX_SIZE
+#error "PUBLISH_WINDOW_SIZE must be between 1 and PUBLISH_WINDOW_MAX_SIZE."
+#endif
+
+/*
+ * @brief        Checks if no more messages can be published until some are acknowledged.
+ */
+bool publish_window_is_full();
+
+/*
+ * @brief        Gets the number of messages waiting for their PUBACK.
+ */
+uint8_t publish_window_get_count();
+
+/*
+ * @brief        Adds a message just published to the window.
+ *
+ * @param[in]    packet_id    MQTT packet ID of the PUBLISH.
+ * @param[in]    queue_end    Offset in the telemetry queue right after the message.
+ *
+ * @return       int          0 on success, non-zero if the window is full.
+ */
+int publish_window_add(int packet_id, uint32_t queue_end);
+
+/*
+ * @brief        Records the PUBACK of a message. Can be called from any task.
+ */
+void publish_window_acknowledge(int packet_id);
+
+/*
+ * @brief        Matches the PUBACKs received to the messages in the window, and removes the oldest
+ *               messages already acknowledged.
+ *
+ * @param[out]   queue_end    Offset in the telemetry queue up to which messages can be released.
+ *
+ * @return       int          0 if messages were removed, non-zero otherwise.
+ */
+int publish_window_release(uint32_t* queue_end);
+
+/*
+ * @brief        Gets how long, in milliseconds, the oldest message in the window has been waiting
+ *               for its PUBACK, or 0 if the window is empty.
+ */
+unsigned long publish_window_get_oldest_age();
+
+/*
+ * @brief        Forgets every message in the window, so they are published again (e.g., after a
+ *               reconnection, as PUBACKs of the previous connection never come).
+ */
+void publish_window_reset();
+
+#endif // PUBLISH_WINDOW_H
@@ -0,0 +1,98 @@
+#include "reconnectBackoff.h"
+
+#include <Arduino.h>
+
+#include "../AzureIoT.h"
+
+// Each delay is at most this many times the previous one.
+#define DELAY_GROWTH_FACTOR 3
+
+/*
+ * @brief    Gets the phase offset of this device, below `base_delay_in_ms`.
+ */
+static uint32_t get_phase_offset(uint32_t base_delay_in_ms)
+{
+  uint64_t mac = ESP.getEfuseMac();
+  uint32_t hash = (uint32_t)(mac ^ (mac >> 32)) * 2654435761u; // Knuth's multiplicative hash.
+
+  return base_delay_in_ms == 0 ? 0 : (hash >> 8) % base_delay_in_ms;
+}
+
+void reconnect_backoff_init(
+    reconnect_backoff_t* backoff,
+    const char* name,
+    uint32_t base_delay_in_ms,
+    uint32_t max_delay_in_ms,
+    uint32_t stable_time_in_ms)
+{
+  backoff->name = name;
+  backoff->base_delay_in_ms = base_delay_in_ms;
+  backoff->max_delay_in_ms = max(max_delay_in_ms, base_delay_in_ms);
+  backoff->stable_time_in_ms = stable_time_in_ms;
+  backoff->delay_in_ms = 0;
+  backoff->attempt_count = 0;
+  backoff->is_connected = false;
+  reconnect_backoff_set_connected(backoff);
+}
+
+bool reconnect_backoff_is_due(reconnect_backoff_t* backoff)
+{
+  if (backoff->is_connected)
+  {
+    unsigned long connected_duration = millis() - backoff->connected_time;
+
+    backoff->is_connected = false;
+
+    if (connected_duration >= backoff->stable_time_in_ms)
+    {
+      backoff->delay_in_ms = 0;
+      backoff->attempt_count = 0;
+    }
+
+    if (backoff->attempt_count == 0)
+    {
+      backoff->next_attempt_time = millis() + get_phase_offset(backoff->base_delay_in_ms);
+    }
+    else
+    {
+      // Dropped before it was stable, so the attempts carry on from where they were.
+      backoff->next_attempt_time = millis() + backoff->delay_in_ms;
+
+      LogInfo(
+          "%s connection lost after %lu ms, next attempt in %u ms.",
+          backoff->name,
+          connected_duration,
+          backoff->delay_in_ms);
+    }
+  }
+
+  return (long)(millis() - backoff->next_attempt_time) >= 0;
+}
+
+void reconnect_backoff_attempted(reconnect_backoff_t* backoff)
+{
+  uint64_t previous_delay = max(backoff->delay_in_ms, backoff->base_delay_in_ms);
+  uint64_t upper_bound
+      = min(previous_delay * DELAY_GROWTH_FACTOR, (uint64_t)backoff->max_delay_in_ms);
+
+  // Decorrelated jitter: random between the base delay and the upper bound.
+  backoff->delay_in_ms = backoff->base_delay_in_ms
+      + esp_random() % (uint32_t)(upper_bound - backoff->base_delay_in_ms + 1);
+  backoff->next_attempt_time = millis() + backoff->delay_in_ms;
+  backoff->attempt_count++;
+
+  LogInfo(
+      "%s reconnection attempt %u, next one in %u ms if it fails.",
+      backoff->name,
+      backoff->attempt_count,
+      backoff->delay_in_ms);
+}
+
+void reconnect_backoff_set_connected(reconnect_backoff_t* backoff)
+{
+  if (!backoff->is_connected)
+  {
+    backoff->connected_time = millis();
+    backoff->is_connected = true;
+  }
+}
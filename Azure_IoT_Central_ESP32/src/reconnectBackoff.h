@@ -0,0 +1,78 @@
+/*
+ * reconnectBackoff spaces out the attempts to reconnect (to the WiFi access point, and to Azure
+ * IoT through DPS and MQTT), so that devices that lose their connection at the same time, e.g.
+ * when the access point reboots, do not all retry in lockstep and overload it when it comes back.
+ *
+ * Delays grow exponentially with "decorrelated jitter": each one is a random time between the base
+ * delay and three times the previous delay, capped to a maximum. The first attempt after the
+ * connection is lost is delayed by a phase offset (below the base delay) unique to the device, as
+ * it is derived from its MAC address, so even the first attempts of a fleet are spread.
+ *
+ * Attempts only start over from the base delay once a connection has stayed up for a while, so a
+ * service that accepts connections and drops them right away (e.g., a throttling IoT Hub) is not
+ * hit again at the base delay by every device after each drop.
+ */
+
+#ifndef RECONNECT_BACKOFF_H
+#define RECONNECT_BACKOFF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * @brief    State of the reconnection attempts to one service.
+ */
+typedef struct reconnect_backoff_t_struct
+{
+  const char* name; // For the logs.
+  uint32_t base_delay_in_ms;
+  uint32_t max_delay_in_ms;
+  uint32_t stable_time_in_ms;
+  uint32_t delay_in_ms; // Before the next attempt, zero once the connection is stable.
+  unsigned long next_attempt_time;
+  unsigned long connected_time;
+  uint32_t attempt_count;
+  bool is_connected;
+} reconnect_backoff_t;
+
+/*
+ * @brief        Initializes a reconnect backoff, as connected.
+ *
+ * @param[in]    backoff              A pointer to the `reconnect_backoff_t` instance to initialize.
+ * @param[in]    name                 Name of the service, for the logs.
+ * @param[in]    base_delay_in_ms     Shortest delay between attempts.
+ * @param[in]    max_delay_in_ms      Longest delay between attempts.
+ * @param[in]    stable_time_in_ms    How long a connection must stay up for the attempts to start
+ *                                    over from the base delay once it is lost.
+ */
+void reconnect_backoff_init(
+    reconnect_backoff_t* backoff,
+    const char* name,
+    uint32_t base_delay_in_ms,
+    uint32_t max_delay_in_ms,
+    uint32_t stable_time_in_ms);
+
+/*
+ * @brief        Checks if it is time to attempt to reconnect.
+ * @remark       The first call after the connection was lost (i.e., after init or
+ *               `reconnect_backoff_set_connected`) schedules the first attempt after the phase
+ *               offset of the device if the connection was stable, or after the delay the attempts
+ *               had reached otherwise.
+ */
+bool reconnect_backoff_is_due(reconnect_backoff_t* backoff);
+
+/*
+ * @brief        Records that an attempt was just made, and schedules the next one.
+ */
+void reconnect_backoff_attempted(reconnect_backoff_t* backoff);
+
+/*
+ * @brief        Records that the connection is up. If it is still up `stable_time_in_ms` later, the
+ *               attempts start over from the base delay (after the phase offset) the next time it
+ *               is lost.
+ * @remark       Can be called on every pass while connected, the connection counts from the first
+ *               call.
+ */
+void reconnect_backoff_set_connected(reconnect_backoff_t* backoff);
+
+#endif // RECONNECT_BACKOFF_H
@@ -0,0 +1,527 @@
+#include "sampleLog.h"
+
+#include <Arduino.h>
+#include <SD.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+#include "crc32.h"
+
+#define SAMPLE_LOG_DIRECTORY "/sampleLog"
+#define SAMPLE_LOG_PATH_SIZE 32
+
+#define RECORDS_PER_SECTOR (SAMPLE_LOG_SECTOR_SIZE / SAMPLE_LOG_RECORD_SIZE)
+
+typedef struct index_entry_t_struct
+{
+  uint32_t timestamp;
+  uint32_t record_index;
+} index_entry_t;
+
+/*
+ * @brief    Index of a segment, exactly one sector. Generations increase every time a segment is
+ *           started, so the newest segment is the one with the highest generation.
+ */
+typedef struct segment_index_t_struct
+{
+  uint32_t generation;
+  uint32_t reserved;
+  index_entry_t entries[SAMPLE_LOG_INDEX_ENTRY_COUNT];
+} segment_index_t;
+
+static_assert(sizeof(segment_index_t) == SAMPLE_LOG_SECTOR_SIZE, "Unexpected index size.");
+
+static bool is_initialized = false;
+
+// Generation (zero if unused) and time of the first record of every segment in the ring.
+static uint32_t segment_generations[SAMPLE_LOG_SEGMENT_COUNT];
+static uint32_t segment_first_timestamps[SAMPLE_LOG_SEGMENT_COUNT];
+
+static uint32_t current_segment = SAMPLE_LOG_SEGMENT_COUNT - 1;
+static uint32_t current_generation = 0;
+static uint32_t record_count = SAMPLE_LOG_RECORDS_PER_SEGMENT; // So the first append starts one.
+static segment_index_t current_index;
+static uint8_t sector_buffer[SAMPLE_LOG_SECTOR_SIZE];
+
+// Replays read a sector at a time, keeping the segment file open between records.
+static File replay_file;
+static int32_t replay_file_segment = -1;
+static int32_t replay_sector_number = -1;
+static uint8_t replay_sector[SAMPLE_LOG_SECTOR_SIZE];
+static int32_t replay_counted_segment = -1;
+static uint32_t replay_counted_generation;
+static uint32_t replay_counted_record_count;
+static uint32_t replay_record_count;
+static unsigned long replay_start_time;
+
+static uint32_t append_count = 0;
+static unsigned long append_total_time_us = 0;
+static unsigned long append_max_time_us = 0;
+
+static void get_segment_path(uint32_t segment, const char* extension, char* path)
+{
+  snprintf(path, SAMPLE_LOG_PATH_SIZE, SAMPLE_LOG_DIRECTORY "/%03u.%s", segment, extension);
+}
+
+static uint32_t get_record_crc(const sample_log_record_t* record)
+{
+  return crc32_update(
+      CRC32_INITIAL_VALUE, (const uint8_t*)record, offsetof(sample_log_record_t, crc));
+}
+
+static int write_sector(const char* path, uint32_t sector_number, const void* sector, bool create)
+{
+  File file = SD.open(path, create ? FILE_WRITE : "r+");
+
+  if (!file)
+  {
+    LogError("Failed opening %s.", path);
+    return 1;
+  }
+
+  bool written = file.seek(sector_number * SAMPLE_LOG_SECTOR_SIZE)
+      && file.write((const uint8_t*)sector, SAMPLE_LOG_SECTOR_SIZE) == SAMPLE_LOG_SECTOR_SIZE;
+
+  file.close();
+
+  if (!written)
+  {
+    LogError("Failed writing %s.", path);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Reads a sector, which may be cut short after `minimum_size` bytes by a power cut.
+ */
+static int read_sector(const char* path, uint32_t sector_number, void* sector, size_t minimum_size)
+{
+  File file = SD.open(path, FILE_READ);
+  bool read;
+
+  if (!file)
+  {
+    return 1;
+  }
+
+  (void)memset(sector, 0, SAMPLE_LOG_SECTOR_SIZE);
+  read = file.seek(sector_number * SAMPLE_LOG_SECTOR_SIZE)
+      && file.read((uint8_t*)sector, SAMPLE_LOG_SECTOR_SIZE) >= (int)minimum_size;
+  file.close();
+
+  return read ? 0 : 1;
+}
+
+static size_t get_record_end(uint32_t record_index)
+{
+  return (record_index % RECORDS_PER_SECTOR + 1) * SAMPLE_LOG_RECORD_SIZE;
+}
+
+/*
+ * @brief    Counts the records of a segment file, ignoring a last record torn by a power cut.
+ */
+static uint32_t count_segment_records(uint32_t segment)
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+  uint8_t sector[SAMPLE_LOG_SECTOR_SIZE];
+  uint32_t count;
+  File file;
+
+  get_segment_path(segment, "bin", path);
+  file = SD.open(path, FILE_READ);
+
+  if (!file)
+  {
+    return 0;
+  }
+
+  count = file.size() / SAMPLE_LOG_RECORD_SIZE;
+  file.close();
+
+  if (count > SAMPLE_LOG_RECORDS_PER_SEGMENT)
+  {
+    count = SAMPLE_LOG_RECORDS_PER_SEGMENT;
+  }
+
+  // The last sector may have an unused (zeroed) or torn second half.
+  while (count > 0
+         && read_sector(path, (count - 1) / RECORDS_PER_SECTOR, sector, get_record_end(count - 1))
+             == 0)
+  {
+    sample_log_record_t* record
+        = (sample_log_record_t*)(sector + ((count - 1) % RECORDS_PER_SECTOR) * SAMPLE_LOG_RECORD_SIZE);
+
+    if (record->crc == get_record_crc(record))
+    {
+      break;
+    }
+
+    count--;
+  }
+
+  return count;
+}
+
+static uint32_t get_segment_record_count(uint32_t segment)
+{
+  return segment == current_segment ? record_count : count_segment_records(segment);
+}
+
+/*
+ * @brief    Gets the record count of a segment being replayed. Segments other than the current one
+ *           no longer change (until overwritten), so theirs is only counted once.
+ */
+static uint32_t get_replay_segment_record_count(uint32_t segment)
+{
+  if (segment == current_segment)
+  {
+    return record_count;
+  }
+
+  if (replay_counted_segment != (int32_t)segment
+      || replay_counted_generation != segment_generations[segment])
+  {
+    replay_counted_record_count = count_segment_records(segment);
+    replay_counted_segment = segment;
+    replay_counted_generation = segment_generations[segment];
+  }
+
+  return replay_counted_record_count;
+}
+
+static void close_replay_file()
+{
+  if (replay_file_segment >= 0)
+  {
+    replay_file.close();
+    replay_file_segment = -1;
+    replay_sector_number = -1;
+  }
+}
+
+static int start_next_segment()
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+
+  current_segment = (current_segment + 1) % SAMPLE_LOG_SEGMENT_COUNT;
+  current_generation++;
+  record_count = 0;
+
+  if (replay_file_segment == (int32_t)current_segment)
+  {
+    close_replay_file();
+  }
+
+  // The segment is only considered in use once its first record is written.
+  segment_generations[current_segment] = 0;
+  get_segment_path(current_segment, "bin", path);
+  (void)SD.remove(path);
+  get_segment_path(current_segment, "idx", path);
+  (void)SD.remove(path);
+
+  memset(&current_index, 0, sizeof(current_index));
+  current_index.generation = current_generation;
+
+  return 0;
+}
+
+/*
+ * @brief    Finds the segment with the lowest generation above `generation`.
+ */
+static int32_t find_next_segment(uint32_t generation)
+{
+  int32_t next = -1;
+
+  for (uint32_t segment = 0; segment < SAMPLE_LOG_SEGMENT_COUNT; segment++)
+  {
+    if (segment_generations[segment] > generation
+        && (next < 0 || segment_generations[segment] < segment_generations[next]))
+    {
+      next = segment;
+    }
+  }
+
+  return next;
+}
+
+int sample_log_init()
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+  segment_index_t index;
+
+  if (SD.cardType() == CARD_NONE)
+  {
+    LogError("No SD card for the sample log.");
+    return 1;
+  }
+
+  if (!SD.exists(SAMPLE_LOG_DIRECTORY) && !SD.mkdir(SAMPLE_LOG_DIRECTORY))
+  {
+    LogError("Failed creating %s.", SAMPLE_LOG_DIRECTORY);
+    return 1;
+  }
+
+  for (uint32_t segment = 0; segment < SAMPLE_LOG_SEGMENT_COUNT; segment++)
+  {
+    get_segment_path(segment, "idx", path);
+
+    if (read_sector(path, 0, &index, SAMPLE_LOG_SECTOR_SIZE) == 0 && index.generation > 0)
+    {
+      segment_generations[segment] = index.generation;
+      segment_first_timestamps[segment] = index.entries[0].timestamp;
+
+      if (index.generation > current_generation)
+      {
+        current_generation = index.generation;
+        current_segment = segment;
+        current_index = index;
+      }
+    }
+  }
+
+  if (current_generation > 0)
+  {
+    record_count = count_segment_records(current_segment);
+
+    if (record_count % RECORDS_PER_SECTOR != 0)
+    {
+      get_segment_path(current_segment, "bin", path);
+      (void)read_sector(
+          path, record_count / RECORDS_PER_SECTOR, sector_buffer, SAMPLE_LOG_RECORD_SIZE);
+    }
+
+    LogInfo(
+        "Sample log at segment %u (generation %u) with %u records.",
+        current_segment,
+        current_generation,
+        record_count);
+  }
+
+  is_initialized = true;
+
+  return 0;
+}
+
+int sample_log_append(sample_log_record_t* record)
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+  unsigned long start_time = micros();
+  unsigned long elapsed_time;
+
+  if (!is_initialized)
+  {
+    return 1;
+  }
+
+  if (record_count >= SAMPLE_LOG_RECORDS_PER_SEGMENT)
+  {
+    if (append_count > 0)
+    {
+      LogInfo(
+          "Sample log segment full, append latency avg %lu us, max %lu us.",
+          append_total_time_us / append_count,
+          append_max_time_us);
+    }
+
+    (void)start_next_segment();
+  }
+
+  record->crc = get_record_crc(record);
+
+  if (record_count % RECORDS_PER_SECTOR == 0)
+  {
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+  }
+
+  memcpy(
+      sector_buffer + (record_count % RECORDS_PER_SECTOR) * SAMPLE_LOG_RECORD_SIZE,
+      record,
+      SAMPLE_LOG_RECORD_SIZE);
+
+  // The whole sector is rewritten for its second record, so writes are always sector-aligned.
+  get_segment_path(current_segment, "bin", path);
+
+  if (write_sector(path, record_count / RECORDS_PER_SECTOR, sector_buffer, record_count == 0) != 0)
+  {
+    return 1;
+  }
+
+  if (record_count % SAMPLE_LOG_INDEX_INTERVAL == 0)
+  {
+    index_entry_t* entry = &current_index.entries[record_count / SAMPLE_LOG_INDEX_INTERVAL];
+
+    entry->timestamp = record->timestamp;
+    entry->record_index = record_count;
+
+    get_segment_path(current_segment, "idx", path);
+
+    if (write_sector(path, 0, &current_index, record_count == 0) != 0)
+    {
+      return 1;
+    }
+
+    if (record_count == 0)
+    {
+      segment_generations[current_segment] = current_generation;
+      segment_first_timestamps[current_segment] = record->timestamp;
+    }
+  }
+
+  record_count++;
+
+  elapsed_time = micros() - start_time;
+  append_count++;
+  append_total_time_us += elapsed_time;
+
+  if (elapsed_time > append_max_time_us)
+  {
+    append_max_time_us = elapsed_time;
+  }
+
+  return 0;
+}
+
+int sample_log_replay_begin(sample_log_cursor_t* cursor, time_t from)
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+  segment_index_t index;
+  int32_t start_segment = -1;
+  uint32_t entry_count;
+
+  if (!is_initialized)
+  {
+    return 1;
+  }
+
+  // The newest segment starting at or before `from`, or else the oldest one.
+  for (uint32_t segment = 0; segment < SAMPLE_LOG_SEGMENT_COUNT; segment++)
+  {
+    if (segment_generations[segment] > 0 && segment_first_timestamps[segment] <= (uint32_t)from
+        && (start_segment < 0
+            || segment_generations[segment] > segment_generations[start_segment]))
+    {
+      start_segment = segment;
+    }
+  }
+
+  if (start_segment < 0 && (start_segment = find_next_segment(0)) < 0)
+  {
+    return 1;
+  }
+
+  cursor->generation = segment_generations[start_segment];
+  cursor->record_index = 0;
+  cursor->from_timestamp = (uint32_t)from;
+
+  get_segment_path(start_segment, "idx", path);
+  entry_count = (get_segment_record_count(start_segment) + SAMPLE_LOG_INDEX_INTERVAL - 1)
+      / SAMPLE_LOG_INDEX_INTERVAL;
+
+  if (read_sector(path, 0, &index, SAMPLE_LOG_SECTOR_SIZE) == 0)
+  {
+    for (uint32_t i = 1; i < entry_count && index.entries[i].timestamp <= (uint32_t)from; i++)
+    {
+      cursor->record_index = index.entries[i].record_index;
+    }
+  }
+
+  replay_counted_segment = -1;
+  replay_record_count = 0;
+  replay_start_time = millis();
+
+  return 0;
+}
+
+int sample_log_replay_next(sample_log_cursor_t* cursor, sample_log_record_t* record)
+{
+  char path[SAMPLE_LOG_PATH_SIZE];
+
+  while (true)
+  {
+    int32_t segment = find_next_segment(cursor->generation - 1);
+
+    if (segment >= 0 && segment_generations[segment] != cursor->generation)
+    {
+      // The segment was overwritten while replaying, so continue with the oldest one left.
+      cursor->generation = segment_generations[segment];
+      cursor->record_index = 0;
+    }
+
+    if (segment < 0)
+    {
+      break;
+    }
+
+    if (cursor->record_index >= get_replay_segment_record_count(segment))
+    {
+      int32_t next_segment = find_next_segment(cursor->generation);
+
+      if (next_segment < 0)
+      {
+        break;
+      }
+
+      cursor->generation = segment_generations[next_segment];
+      cursor->record_index = 0;
+      continue;
+    }
+
+    if (replay_file_segment != segment)
+    {
+      close_replay_file();
+      get_segment_path(segment, "bin", path);
+      replay_file = SD.open(path, FILE_READ);
+
+      if (!replay_file)
+      {
+        LogError("Failed opening %s.", path);
+        break;
+      }
+
+      replay_file_segment = segment;
+    }
+
+    if (replay_sector_number != (int32_t)(cursor->record_index / RECORDS_PER_SECTOR)
+        || segment == (int32_t)current_segment)
+    {
+      replay_sector_number = cursor->record_index / RECORDS_PER_SECTOR;
+
+      if (!replay_file.seek(replay_sector_number * SAMPLE_LOG_SECTOR_SIZE)
+          || replay_file.read(replay_sector, SAMPLE_LOG_SECTOR_SIZE)
+              < (int)get_record_end(cursor->record_index))
+      {
+        LogError("Failed reading sample log segment %d.", segment);
+        break;
+      }
+    }
+
+    memcpy(
+        record,
+        replay_sector + (cursor->record_index % RECORDS_PER_SECTOR) * SAMPLE_LOG_RECORD_SIZE,
+        SAMPLE_LOG_RECORD_SIZE);
+    cursor->record_index++;
+
+    if (record->crc != get_record_crc(record))
+    {
+      LogError("Skipping corrupted sample log record.");
+      continue;
+    }
+
+    if (record->timestamp >= cursor->from_timestamp)
+    {
+      replay_record_count++;
+      return 0;
+    }
+  }
+
+  close_replay_file();
+  LogInfo(
+      "Sample log replayed %u records in %lu ms.",
+      replay_record_count,
+      millis() - replay_start_time);
+
+  return 1;
+}
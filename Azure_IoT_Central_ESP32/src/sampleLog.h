@@ -0,0 +1,90 @@
+/*
+ * sampleLog keeps every telemetry sample on the SD card as a fixed-size binary record, so samples
+ * can be replayed from any point in time without parsing text.
+ *
+ * Records are 256 bytes (two per 512-byte SD sector) and protected by a CRC-32. Every write is of
+ * a whole sector at a sector-aligned offset, so SD latency stays predictable. Records are stored
+ * in a ring of SAMPLE_LOG_SEGMENT_COUNT segment files of SAMPLE_LOG_RECORDS_PER_SEGMENT records;
+ * once all are used, the oldest segment is overwritten. Each segment has a one-sector index with
+ * the time of every SAMPLE_LOG_INDEX_INTERVAL-th record, so replaying from a given time is a seek
+ * rather than a scan.
+ *
+ * The SD card must be mounted before `sample_log_init` is called.
+ */
+
+#ifndef SAMPLE_LOG_H
+#define SAMPLE_LOG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "telemetryFields.h"
+
+#define SAMPLE_LOG_SECTOR_SIZE 512
+#define SAMPLE_LOG_RECORD_SIZE 256
+#define SAMPLE_LOG_INDEX_INTERVAL 64
+#define SAMPLE_LOG_INDEX_ENTRY_COUNT 63 // What fits in a sector after the index header.
+#define SAMPLE_LOG_RECORDS_PER_SEGMENT (SAMPLE_LOG_INDEX_INTERVAL * SAMPLE_LOG_INDEX_ENTRY_COUNT)
+
+#ifndef SAMPLE_LOG_SEGMENT_COUNT
+#define SAMPLE_LOG_SEGMENT_COUNT 128 // About 130 MB, a year of samples taken once a minute.
+#endif
+
+/*
+ * @brief    A sample as stored in the log, with the values of all the telemetry fields (in the
+ *           order of `telemetry_fields`), even the ones not being sent.
+ */
+typedef struct sample_log_record_t_struct
+{
+  uint32_t timestamp;
+  uint32_t sequence;
+  uint8_t com_status;
+  uint8_t field_groups;
+  uint16_t reserved;
+  float values[TELEMETRY_FIELD_COUNT];
+  uint32_t crc;
+} sample_log_record_t;
+
+static_assert(sizeof(sample_log_record_t) == SAMPLE_LOG_RECORD_SIZE, "Unexpected record size.");
+
+/*
+ * @brief    Position of a replay in the sample log.
+ */
+typedef struct sample_log_cursor_t_struct
+{
+  uint32_t generation;
+  uint32_t record_index;
+  uint32_t from_timestamp;
+} sample_log_cursor_t;
+
+/*
+ * @brief        Recovers the sample log state from the SD card.
+ *
+ * @return       int       0 on success, non-zero if the SD card can not be used.
+ */
+int sample_log_init();
+
+/*
+ * @brief        Appends a record to the log.
+ * @remark       The CRC of the record is set by this function.
+ *
+ * @return       int       0 on success, non-zero otherwise.
+ */
+int sample_log_append(sample_log_record_t* record);
+
+/*
+ * @brief        Starts replaying the log from the first record taken at or after `from`.
+ *
+ * @return       int       0 on success, non-zero if the log is empty.
+ */
+int sample_log_replay_begin(sample_log_cursor_t* cursor, time_t from);
+
+/*
+ * @brief        Reads the next record of a replay. Corrupted records are skipped.
+ *
+ * @return       int       0 on success, non-zero when there are no more records.
+ */
+int sample_log_replay_next(sample_log_cursor_t* cursor, sample_log_record_t* record);
+
+#endif // SAMPLE_LOG_H
@@ -63,6 +63,15 @@
 #define TELEMETRY_PROP_NAME_POWER_FACTOR_L3N "powerFactorL3N"
 #define TELEMETRY_PROP_NAME_POWER_FACTOR_TOTAL "powerFactorTotal"
 #define TELEMETRY_PROP_NAME_COM_STATUS "comState"
+#define TELEMETRY_PROP_NAME_MESSAGE_UNITS_TODAY "messageUnitsToday"
+#define TELEMETRY_PROP_NAME_SEQUENCE "seq"
+#define TELEMETRY_PROP_NAME_KEYFRAME "keyframe"
+#define TELEMETRY_PROP_NAME_PART "part"
+#define TELEMETRY_PROP_NAME_LAST_PART "lastPart"
 #define TELEMETRY_PROP_NAME_TIMESTAMP "timestamp"
+#define TELEMETRY_PROP_NAME_FLIGHT_RECORDER "flightRecorder"
+#define TELEMETRY_PROP_NAME_RESET_REASON "resetReason"
+#define TELEMETRY_PROP_NAME_BOOT_COUNT "bootCount"
+#define TELEMETRY_PROP_NAME_EVENTS "events"
 
 #endif
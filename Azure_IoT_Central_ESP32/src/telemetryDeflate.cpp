@@ -0,0 +1,236 @@
+#include "telemetryDeflate.h"
+
+#include <string.h>
+
+#define MIN_MATCH_LENGTH 3
+#define MAX_MATCH_LENGTH 258
+#define MAX_INPUT_SIZE 65535 // Positions are kept in the hash table as uint16_t.
+
+#define END_OF_BLOCK_SYMBOL 256
+#define FIRST_LENGTH_SYMBOL 257
+
+#define ZLIB_COMPRESSION_METHOD_DEFLATE 8
+#define ZLIB_WINDOW_SIZE_LOG2 12 // log2(TELEMETRY_DEFLATE_WINDOW_SIZE)
+#define ADLER32_MODULO 65521
+
+typedef struct bit_writer_t_struct
+{
+  uint8_t* buffer;
+  size_t size;
+  size_t length;
+  uint32_t bits;
+  uint32_t bit_count;
+  bool overflow;
+} bit_writer_t;
+
+static const uint16_t length_base[] = { 3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                                        15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                                        67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra_bits[]
+    = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+static const uint16_t distance_base[]
+    = { 1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+        193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distance_extra_bits[] = { 0, 0, 0, 0, 1, 1, 2,  2,  3,  3,  4,  4,  5,  5,  6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Last position (plus one, zero meaning none) where each 3-byte hash was seen.
+static uint16_t hash_table[TELEMETRY_DEFLATE_HASH_SIZE];
+
+static void put_bits(bit_writer_t* writer, uint32_t value, uint32_t count)
+{
+  writer->bits |= value << writer->bit_count;
+  writer->bit_count += count;
+
+  while (writer->bit_count >= 8)
+  {
+    if (writer->length < writer->size)
+    {
+      writer->buffer[writer->length++] = (uint8_t)writer->bits;
+    }
+    else
+    {
+      writer->overflow = true;
+    }
+
+    writer->bits >>= 8;
+    writer->bit_count -= 8;
+  }
+}
+
+// Huffman codes are defined MSB-first, while the deflate bit stream is packed LSB-first.
+static void put_huffman_code(bit_writer_t* writer, uint32_t code, uint32_t length)
+{
+  uint32_t reversed = 0;
+
+  for (uint32_t i = 0; i < length; i++)
+  {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+
+  put_bits(writer, reversed, length);
+}
+
+static void put_literal_length_symbol(bit_writer_t* writer, uint32_t symbol)
+{
+  if (symbol <= 143)
+  {
+    put_huffman_code(writer, 0x30 + symbol, 8);
+  }
+  else if (symbol <= 255)
+  {
+    put_huffman_code(writer, 0x190 + (symbol - 144), 9);
+  }
+  else if (symbol <= 279)
+  {
+    put_huffman_code(writer, symbol - 256, 7);
+  }
+  else
+  {
+    put_huffman_code(writer, 0xC0 + (symbol - 280), 8);
+  }
+}
+
+static void put_match(bit_writer_t* writer, uint32_t length, uint32_t distance)
+{
+  int index;
+
+  for (index = sizeof(length_base) / sizeof(length_base[0]) - 1; length_base[index] > length;
+       index--)
+    ;
+
+  put_literal_length_symbol(writer, FIRST_LENGTH_SYMBOL + index);
+  put_bits(writer, length - length_base[index], length_extra_bits[index]);
+
+  for (index = sizeof(distance_base) / sizeof(distance_base[0]) - 1;
+       distance_base[index] > distance;
+       index--)
+    ;
+
+  put_huffman_code(writer, index, 5);
+  put_bits(writer, distance - distance_base[index], distance_extra_bits[index]);
+}
+
+static uint32_t hash_at(const uint8_t* data)
+{
+  uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+  return (value * 2654435761u) >> (32 - TELEMETRY_DEFLATE_HASH_BITS);
+}
+
+static uint32_t adler32(const uint8_t* data, size_t size)
+{
+  uint32_t a = 1, b = 0;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    a = (a + data[i]) % ADLER32_MODULO;
+    b = (b + a) % ADLER32_MODULO;
+  }
+
+  return (b << 16) | a;
+}
+
+int telemetry_deflate(az_span input, az_span output, size_t* output_length)
+{
+  const uint8_t* data = az_span_ptr(input);
+  size_t size = (size_t)az_span_size(input);
+  size_t position = 0;
+  uint32_t header, checksum;
+  bit_writer_t writer;
+
+  if (size > MAX_INPUT_SIZE)
+  {
+    return 1;
+  }
+
+  writer.buffer = az_span_ptr(output);
+  writer.size = (size_t)az_span_size(output);
+  writer.length = 0;
+  writer.bits = 0;
+  writer.bit_count = 0;
+  writer.overflow = false;
+
+  (void)memset(hash_table, 0, sizeof(hash_table));
+
+  // zlib header (CMF and FLG, the latter made so the 16-bit header is a multiple of 31).
+  header = (((ZLIB_WINDOW_SIZE_LOG2 - 8) << 4) | ZLIB_COMPRESSION_METHOD_DEFLATE) << 8;
+  header += 31 - (header % 31);
+  put_bits(&writer, header >> 8, 8);
+  put_bits(&writer, header & 0xFF, 8);
+
+  // A single final block with fixed Huffman codes.
+  put_bits(&writer, 1, 1);
+  put_bits(&writer, 1, 2);
+
+  while (position < size && !writer.overflow)
+  {
+    uint32_t match_length = 0;
+    uint32_t match_distance = 0;
+
+    if (position + MIN_MATCH_LENGTH <= size)
+    {
+      uint32_t hash = hash_at(data + position);
+      size_t candidate = hash_table[hash];
+
+      hash_table[hash] = (uint16_t)(position + 1);
+
+      if (candidate != 0 && position - (candidate - 1) <= TELEMETRY_DEFLATE_WINDOW_SIZE)
+      {
+        const uint8_t* match = data + candidate - 1;
+        size_t max_length = size - position;
+
+        if (max_length > MAX_MATCH_LENGTH)
+        {
+          max_length = MAX_MATCH_LENGTH;
+        }
+
+        while (match_length < max_length && match[match_length] == data[position + match_length])
+        {
+          match_length++;
+        }
+
+        match_distance = position - (candidate - 1);
+      }
+    }
+
+    if (match_length >= MIN_MATCH_LENGTH)
+    {
+      put_match(&writer, match_length, match_distance);
+
+      // Positions inside the match are still worth referencing later on.
+      for (size_t i = position + 1; i < position + match_length; i++)
+      {
+        if (i + MIN_MATCH_LENGTH <= size)
+        {
+          hash_table[hash_at(data + i)] = (uint16_t)(i + 1);
+        }
+      }
+
+      position += match_length;
+    }
+    else
+    {
+      put_literal_length_symbol(&writer, data[position]);
+      position++;
+    }
+  }
+
+  put_literal_length_symbol(&writer, END_OF_BLOCK_SYMBOL);
+  put_bits(&writer, 0, (8 - writer.bit_count) % 8);
+
+  checksum = adler32(data, size);
+  put_bits(&writer, (checksum >> 24) & 0xFF, 8);
+  put_bits(&writer, (checksum >> 16) & 0xFF, 8);
+  put_bits(&writer, (checksum >> 8) & 0xFF, 8);
+  put_bits(&writer, checksum & 0xFF, 8);
+
+  if (writer.overflow)
+  {
+    return 1;
+  }
+
+  *output_length = writer.length;
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * telemetryDeflate compresses telemetry messages with the deflate algorithm (RFC 1951) in the zlib
+ * format (RFC 1950), which is what the "deflate" content encoding stands for.
+ *
+ * It is meant for the ESP32 RAM budget: it uses fixed Huffman codes (so no code tables are built),
+ * the input message itself as the LZ77 window and a single hash table of
+ * TELEMETRY_DEFLATE_HASH_SIZE entries as its only state. Output is written in one pass as the input
+ * is consumed.
+ */
+
+#ifndef TELEMETRY_DEFLATE_H
+#define TELEMETRY_DEFLATE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <az_core.h>
+
+/*
+ * Furthest back (in bytes) a repeated string can be referenced. Batched samples repeat their keys
+ * once per sample, so the window should hold at least one whole sample.
+ */
+#define TELEMETRY_DEFLATE_WINDOW_SIZE 4096
+
+#define TELEMETRY_DEFLATE_HASH_BITS 10
+#define TELEMETRY_DEFLATE_HASH_SIZE (1 << TELEMETRY_DEFLATE_HASH_BITS)
+
+#define TELEMETRY_DEFLATE_CONTENT_ENCODING "deflate"
+
+/*
+ * @brief        Compresses `input` into `output` in the zlib format.
+ *
+ * @param[in]    input            The data to be compressed.
+ * @param[in]    output           Buffer where to write the compressed data.
+ * @param[out]   output_length    Length of the compressed data written in `output`.
+ *
+ * @return       int              0 on success, non-zero if `output` is too small for the result.
+ */
+int telemetry_deflate(az_span input, az_span output, size_t* output_length);
+
+#endif // TELEMETRY_DEFLATE_H
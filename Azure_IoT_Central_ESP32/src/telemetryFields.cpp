@@ -0,0 +1,167 @@
+#include "telemetryFields.h"
+
+#include "telemetryDefinitions.h"
+#include "telemetryGlobalVariables.h"
+
+#define FIELD_GROUP_NAME_SEPARATOR ","
+
+typedef struct telemetry_field_group_name_t_struct
+{
+  az_span name;
+  uint8_t groups;
+} telemetry_field_group_name_t;
+
+// "all" goes first, so it is the name used for all the groups together.
+static const telemetry_field_group_name_t telemetry_field_group_names[] = {
+  { AZ_SPAN_LITERAL_FROM_STR("all"), TELEMETRY_FIELD_GROUP_ALL },
+  { AZ_SPAN_LITERAL_FROM_STR("basic"), TELEMETRY_FIELD_GROUP_BASIC },
+  { AZ_SPAN_LITERAL_FROM_STR("powerQuality"), TELEMETRY_FIELD_GROUP_POWER_QUALITY },
+  { AZ_SPAN_LITERAL_FROM_STR("energy"), TELEMETRY_FIELD_GROUP_ENERGY },
+};
+
+#define TELEMETRY_FIELD_GROUP_NAME_COUNT \
+  (sizeof(telemetry_field_group_names) / sizeof(telemetry_field_group_names[0]))
+
+#define TELEMETRY_FIELD(name, variable, decimal_places, group) \
+  { AZ_SPAN_LITERAL_FROM_STR(name), &variable, decimal_places, TELEMETRY_FIELD_GROUP_##group }
+
+// Same order as the fields are sent in the telemetry payload. Its size is checked against the
+// declaration in the header, so TELEMETRY_FIELD_COUNT must be updated along with it.
+const telemetry_field_t telemetry_fields[] = {
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L1N, voltageL1N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L2N, voltageL2N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L3N, voltageL3N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_VOLTAGE_LN, avgVoltageLN, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L1L2, voltageL1L2, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L2L3, voltageL2L3, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_VOLTAGE_L1L3, voltageL1L3, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_VOLTAGE_LL, avgVoltageLL, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_CURRENT_L1, currentL1, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_CURRENT_L2, currentL2, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_CURRENT_L3, currentL3, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_CURRENT_NEUTRAL, currentNeutral, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_CURRENTL, avgCurrentL, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_CURRENT_TOTAL, currentTotal, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_POWER_L1N, realPowerL1N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_POWER_L2N, realPowerL2N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_POWER_L3N, realPowerL3N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_POWER_TOTAL, realPowerTotal, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_POWER_L1N, apparentPowerL1N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_POWER_L2N, apparentPowerL2N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_POWER_L3N, apparentPowerL3N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_POWER_TOTAL, apparentPowerTotal, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_POWER_L1N, reactivePowerL1N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_POWER_L2N, reactivePowerL2N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_POWER_L3N, reactivePowerL3N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_POWER_TOTAL, reactivePowerTotal, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_COS_PHI_L1, cosPhiL1, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_COS_PHI_L2, cosPhiL2, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_COS_PHI_L3, cosPhiL3, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_COS_PHI, avgCosPhi, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_FREQUENCY, frequency, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_ROT_FIELD, rotField, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_ENERGY_L1N, realEnergyL1N, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_ENERGY_L2N, realEnergyL2N, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_ENERGY_L3N, realEnergyL3N, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REAL_ENERGY_TOTAL, realEnergyTotal, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L1, apparentEnergyL1, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L2, apparentEnergyL2, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_ENERGY_L3, apparentEnergyL3, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_APPARENT_ENERGY_TOTAL, apparentEnergyTotal, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L1, reactiveEnergyL1, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L2, reactiveEnergyL2, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_L3, reactiveEnergyL3, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_REACTIVE_ENERGY_TOTAL, reactiveEnergyTotal, 3, ENERGY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L1N, THDVoltsL1N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L2N, THDVoltsL2N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L3N, THDVoltsL3N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_THD_VOLTS_LN, avgTHDVoltsLN, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_CURRENT_L1N, THDCurrentL1N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_CURRENT_L2N, THDCurrentL2N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_CURRENT_L3N, THDCurrentL3N, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_THD_CURRENT_LN, avgTHDCurrentLN, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L1L2, THDVoltsL1L2, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L2L3, THDVoltsL2L3, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_THD_VOLTS_L1L3, THDVoltsL1L3, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_AVG_THD_VOLTS_LL, avgTHDVoltsLL, 2, POWER_QUALITY),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_POWER_FACTOR_L1N, powerFactorL1N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_POWER_FACTOR_L2N, powerFactorL2N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_POWER_FACTOR_L3N, powerFactorL3N, 2, BASIC),
+  TELEMETRY_FIELD(TELEMETRY_PROP_NAME_POWER_FACTOR_TOTAL, powerFactorTotal, 2, BASIC),
+};
+
+int telemetry_field_find(az_span name, uint8_t* field)
+{
+  for (uint8_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    if (az_span_is_content_equal(name, telemetry_fields[i].name))
+    {
+      *field = i;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int telemetry_field_groups_parse(az_span names, uint8_t* groups)
+{
+  *groups = 0;
+
+  while (az_span_size(names) > 0)
+  {
+    int32_t separator = az_span_find(names, AZ_SPAN_FROM_STR(FIELD_GROUP_NAME_SEPARATOR));
+    az_span name = separator < 0 ? names : az_span_slice(names, 0, separator);
+    size_t i;
+
+    for (i = 0; i < TELEMETRY_FIELD_GROUP_NAME_COUNT; i++)
+    {
+      if (az_span_is_content_equal(name, telemetry_field_group_names[i].name))
+      {
+        *groups |= telemetry_field_group_names[i].groups;
+        break;
+      }
+    }
+
+    if (i == TELEMETRY_FIELD_GROUP_NAME_COUNT)
+    {
+      return 1;
+    }
+
+    names = separator < 0 ? AZ_SPAN_EMPTY : az_span_slice_to_end(names, separator + 1);
+  }
+
+  return *groups == 0 ? 1 : 0;
+}
+
+int telemetry_field_groups_to_string(uint8_t groups, az_span buffer, az_span* out_names)
+{
+  az_span remainder = buffer;
+
+  for (size_t i = 0; i < TELEMETRY_FIELD_GROUP_NAME_COUNT && groups != 0; i++)
+  {
+    const telemetry_field_group_name_t* group_name = &telemetry_field_group_names[i];
+
+    if ((groups & group_name->groups) != group_name->groups)
+    {
+      continue;
+    }
+
+    if (az_span_size(remainder) < az_span_size(group_name->name) + 1)
+    {
+      return 1;
+    }
+
+    if (az_span_size(remainder) < az_span_size(buffer))
+    {
+      remainder = az_span_copy(remainder, AZ_SPAN_FROM_STR(FIELD_GROUP_NAME_SEPARATOR));
+    }
+
+    remainder = az_span_copy(remainder, group_name->name);
+    groups &= ~group_name->groups;
+  }
+
+  *out_names = az_span_slice(buffer, 0, az_span_size(buffer) - az_span_size(remainder));
+
+  return 0;
+}
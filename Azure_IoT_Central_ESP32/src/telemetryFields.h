@@ -0,0 +1,78 @@
+/*
+ * telemetryFields describes the energy meter telemetry fields, so the telemetry payload (and
+ * anything else dealing with every field) can be built by walking a table instead of repeating
+ * the same code for each field.
+ */
+
+#ifndef TELEMETRY_FIELDS_H
+#define TELEMETRY_FIELDS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <az_core.h>
+
+/*
+ * Fields are organized in groups, so only some of them can be read and sent (e.g., a dense "basic"
+ * stream on most assets, with THD only where harmonics are being investigated).
+ */
+#define TELEMETRY_FIELD_GROUP_BASIC 0x01
+#define TELEMETRY_FIELD_GROUP_POWER_QUALITY 0x02
+#define TELEMETRY_FIELD_GROUP_ENERGY 0x04
+#define TELEMETRY_FIELD_GROUP_ALL \
+  (TELEMETRY_FIELD_GROUP_BASIC | TELEMETRY_FIELD_GROUP_POWER_QUALITY | TELEMETRY_FIELD_GROUP_ENERGY)
+
+// Longest text produced by `telemetry_field_groups_to_string`.
+#define TELEMETRY_FIELD_GROUPS_STRING_MAX_SIZE 32
+
+/*
+ * @brief    Description of a single telemetry field.
+ */
+typedef struct telemetry_field_t_struct
+{
+  az_span name;
+  float* value;
+  int8_t decimal_places;
+  uint8_t group;
+} telemetry_field_t;
+
+#define TELEMETRY_FIELD_COUNT 60
+
+// Longest field name, plus room to spare.
+#define TELEMETRY_FIELD_NAME_MAX_SIZE 32
+
+extern const telemetry_field_t telemetry_fields[TELEMETRY_FIELD_COUNT];
+
+/*
+ * @brief        Finds a field by its name.
+ *
+ * @param[in]    name      The name of the field, as sent in the telemetry payload.
+ * @param[out]   field     Index of the field in `telemetry_fields`.
+ *
+ * @return       int       0 on success, non-zero if there is no field with that name.
+ */
+int telemetry_field_find(az_span name, uint8_t* field);
+
+/*
+ * @brief        Parses a comma-separated list of field group names ("basic", "powerQuality",
+ *               "energy" or "all").
+ *
+ * @param[in]    names     The list of group names.
+ * @param[out]   groups    The `TELEMETRY_FIELD_GROUP_*` flags of the groups in the list.
+ *
+ * @return       int       0 on success, non-zero if a name is not known or the list is empty.
+ */
+int telemetry_field_groups_parse(az_span names, uint8_t* groups);
+
+/*
+ * @brief        Writes the comma-separated list of names of the field groups in `groups`.
+ *
+ * @param[in]    groups       `TELEMETRY_FIELD_GROUP_*` flags.
+ * @param[in]    buffer       Where to write the list.
+ * @param[out]   out_names    The part of `buffer` with the list.
+ *
+ * @return       int          0 on success, non-zero if `buffer` is too small.
+ */
+int telemetry_field_groups_to_string(uint8_t groups, az_span buffer, az_span* out_names);
+
+#endif // TELEMETRY_FIELDS_H
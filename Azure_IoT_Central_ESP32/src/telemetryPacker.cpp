@@ -0,0 +1,178 @@
+#include "telemetryPacker.h"
+
+#include <string.h>
+
+#include "../AzureIoT.h"
+
+#define SECONDS_IN_A_DAY 86400
+
+#define PACKED_MESSAGE_BEGIN '['
+#define PACKED_MESSAGE_SEPARATOR ','
+#define PACKED_MESSAGE_END ']'
+
+static uint32_t message_units_daily_quota = 0;
+static uint32_t message_units_today = 0;
+static time_t message_units_day = 0;
+static bool message_units_quota_exceeded_logged = false;
+
+void telemetry_packer_init(telemetry_packer_t* packer, az_span buffer, size_t limit)
+{
+  packer->buffer = buffer;
+  packer->limit = (size_t)az_span_size(buffer) - 1; // Space for a null-terminator.
+
+  if (limit < packer->limit)
+  {
+    packer->limit = limit;
+  }
+
+  telemetry_packer_reset(packer);
+}
+
+void telemetry_packer_reset(telemetry_packer_t* packer)
+{
+  packer->length = 1; // Opening bracket.
+  packer->sample_count = 0;
+  packer->first_sample_time = INDEFINITE_TIME;
+  az_span_ptr(packer->buffer)[0] = PACKED_MESSAGE_BEGIN;
+}
+
+bool telemetry_packer_fits(telemetry_packer_t* packer, az_span sample)
+{
+  // A separator (if not the first sample) plus the closing bracket.
+  size_t required = (size_t)az_span_size(sample) + (packer->sample_count > 0 ? 1 : 0) + 1;
+
+  return packer->length + required <= packer->limit;
+}
+
+int telemetry_packer_add(telemetry_packer_t* packer, az_span sample, time_t now)
+{
+  if (!telemetry_packer_fits(packer, sample))
+  {
+    return 1;
+  }
+
+  uint8_t* destination = az_span_ptr(packer->buffer);
+
+  packer->previous_length = packer->length;
+
+  if (packer->sample_count > 0)
+  {
+    destination[packer->length++] = PACKED_MESSAGE_SEPARATOR;
+  }
+  else
+  {
+    packer->first_sample_time = now;
+  }
+
+  (void)memcpy(destination + packer->length, az_span_ptr(sample), az_span_size(sample));
+  packer->length += az_span_size(sample);
+  packer->last_sample_size = az_span_size(sample);
+  packer->sample_count++;
+
+  return 0;
+}
+
+void telemetry_packer_remove_last(telemetry_packer_t* packer)
+{
+  if (packer->sample_count == 0)
+  {
+    return;
+  }
+
+  packer->length = packer->previous_length;
+  packer->sample_count--;
+
+  if (packer->sample_count == 0)
+  {
+    packer->first_sample_time = INDEFINITE_TIME;
+  }
+}
+
+bool telemetry_packer_is_due(telemetry_packer_t* packer, time_t now, uint32_t max_age_in_seconds)
+{
+  if (packer->sample_count == 0)
+  {
+    return false;
+  }
+
+  // If another sample like the last one no longer fits, waiting for it only adds latency.
+  if (packer->length + packer->last_sample_size + 2 > packer->limit)
+  {
+    return true;
+  }
+
+  return difftime(now, packer->first_sample_time) >= max_age_in_seconds;
+}
+
+uint32_t telemetry_packer_get_sample_count(telemetry_packer_t* packer)
+{
+  return packer->sample_count;
+}
+
+time_t telemetry_packer_get_first_sample_time(telemetry_packer_t* packer)
+{
+  return packer->first_sample_time;
+}
+
+az_span telemetry_packer_get_message(telemetry_packer_t* packer)
+{
+  uint8_t* buffer = az_span_ptr(packer->buffer);
+
+  if (packer->sample_count == 0)
+  {
+    return AZ_SPAN_EMPTY;
+  }
+  else if (packer->sample_count == 1)
+  {
+    // A single sample goes out without the array around it.
+    buffer[packer->length] = null_terminator;
+    return az_span_create(buffer + 1, packer->length - 1);
+  }
+  else
+  {
+    buffer[packer->length] = PACKED_MESSAGE_END;
+    buffer[packer->length + 1] = null_terminator;
+    return az_span_create(buffer, packer->length + 1);
+  }
+}
+
+void message_units_set_daily_quota(uint32_t daily_quota)
+{
+  message_units_daily_quota = daily_quota;
+}
+
+uint32_t message_units_get_today(time_t now)
+{
+  if (now / SECONDS_IN_A_DAY != message_units_day)
+  {
+    message_units_day = now / SECONDS_IN_A_DAY;
+    message_units_today = 0;
+    message_units_quota_exceeded_logged = false;
+  }
+
+  return message_units_today;
+}
+
+uint32_t message_units_record(size_t message_size, time_t now)
+{
+  uint32_t units = (message_size + IOT_HUB_MESSAGE_UNIT_SIZE - 1) / IOT_HUB_MESSAGE_UNIT_SIZE;
+
+  if (units == 0)
+  {
+    units = 1;
+  }
+
+  message_units_today = message_units_get_today(now) + units;
+
+  if (message_units_daily_quota > 0 && message_units_today > message_units_daily_quota
+      && !message_units_quota_exceeded_logged)
+  {
+    LogError(
+        "Daily quota of message units exceeded (%u of %u).",
+        message_units_today,
+        message_units_daily_quota);
+    message_units_quota_exceeded_logged = true;
+  }
+
+  return units;
+}
@@ -0,0 +1,126 @@
+/*
+ * telemetryPacker packs telemetry samples into messages that use the 4 KB message units in which
+ * Azure IoT Hub (and so Azure IoT Central) bills and throttles device-to-cloud traffic, and keeps
+ * count of how many of those units the device has used on the current day.
+ */
+
+#ifndef TELEMETRY_PACKER_H
+#define TELEMETRY_PACKER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <az_core.h>
+
+/* --- Message Units --- */
+#define IOT_HUB_MESSAGE_UNIT_SIZE 4096
+
+/*
+ * Bytes of each message unit kept aside for the MQTT topic and message properties, which also
+ * count towards the size of a message in Azure IoT Hub.
+ */
+#define IOT_HUB_MESSAGE_UNIT_OVERHEAD 256
+
+/*
+ * @brief    State of a telemetry packer.
+ * @remark   The packed message is a JSON array with all the samples added since the last reset,
+ *           except when a single sample was added, in which case the sample is sent as-is so the
+ *           message looks exactly like it would without the packer.
+ */
+typedef struct telemetry_packer_t_struct
+{
+  az_span buffer;
+  size_t limit;
+  size_t length;
+  size_t previous_length;
+  size_t last_sample_size;
+  uint32_t sample_count;
+  time_t first_sample_time;
+} telemetry_packer_t;
+
+/*
+ * @brief        Initializes a telemetry packer.
+ *
+ * @param[in]    packer    A pointer to the `telemetry_packer_t` instance to initialize.
+ * @param[in]    buffer    Buffer where the packed message is built. It must outlive the packer.
+ * @param[in]    limit     Maximum size of a packed message, in bytes. It is capped to the size of
+ *                         `buffer` minus one byte, reserved for a null-terminator.
+ */
+void telemetry_packer_init(telemetry_packer_t* packer, az_span buffer, size_t limit);
+
+/*
+ * @brief        Discards all the samples in the packer.
+ */
+void telemetry_packer_reset(telemetry_packer_t* packer);
+
+/*
+ * @brief        Checks if `sample` can be added to the packer without the packed message going
+ *               over the packer limit.
+ */
+bool telemetry_packer_fits(telemetry_packer_t* packer, az_span sample);
+
+/*
+ * @brief        Appends a sample (a JSON object) to the packed message.
+ *
+ * @param[in]    packer    A pointer to an initialized `telemetry_packer_t`.
+ * @param[in]    sample    The JSON object with the telemetry sample.
+ * @param[in]    now       Current time, used for controlling for how long samples are held.
+ *
+ * @return       int       0 on success, non-zero if the sample does not fit in the packer.
+ */
+int telemetry_packer_add(telemetry_packer_t* packer, az_span sample, time_t now);
+
+/*
+ * @brief        Takes the last sample added back out of the packed message.
+ * @remark       For when the packed message turns out too large only once the sample is in (e.g.
+ *               once compressed). Valid once after each successful `telemetry_packer_add`.
+ */
+void telemetry_packer_remove_last(telemetry_packer_t* packer);
+
+/*
+ * @brief        Checks if the packed message should be sent now.
+ * @remark       A packed message is due once another sample as large as the last one added would
+ *               no longer fit, or once its oldest sample has been held for `max_age_in_seconds`.
+ */
+bool telemetry_packer_is_due(telemetry_packer_t* packer, time_t now, uint32_t max_age_in_seconds);
+
+/*
+ * @brief        Gets the number of samples currently in the packer.
+ */
+uint32_t telemetry_packer_get_sample_count(telemetry_packer_t* packer);
+
+/*
+ * @brief        Gets when the oldest sample in the packer was added.
+ */
+time_t telemetry_packer_get_first_sample_time(telemetry_packer_t* packer);
+
+/*
+ * @brief        Closes and returns the packed message.
+ * @remark       The message is null-terminated. It remains valid until the packer is reset.
+ *
+ * @return       az_span    The packed message, or AZ_SPAN_EMPTY if the packer has no samples.
+ */
+az_span telemetry_packer_get_message(telemetry_packer_t* packer);
+
+/*
+ * @brief        Sets the daily quota of message units for `message_units_record` to check against.
+ */
+void message_units_set_daily_quota(uint32_t daily_quota);
+
+/*
+ * @brief        Accounts for a message sent to Azure IoT Hub.
+ *
+ * @param[in]    message_size    Size of the message payload, in bytes.
+ * @param[in]    now             Current time, used for resetting the count at UTC midnight.
+ *
+ * @return       uint32_t        Number of message units used by the message.
+ */
+uint32_t message_units_record(size_t message_size, time_t now);
+
+/*
+ * @brief        Gets the number of message units used since the last UTC midnight.
+ */
+uint32_t message_units_get_today(time_t now);
+
+#endif // TELEMETRY_PACKER_H
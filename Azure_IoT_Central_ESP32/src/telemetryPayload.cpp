@@ -0,0 +1,239 @@
+#include "telemetryPayload.h"
+
+#include "telemetryDefinitions.h"
+#include "telemetryFields.h"
+
+#include "../AzureIoT.h"
+
+#define TIMESTAMP_FORMAT "%Y-%m-%dT%H:%M:%S.000Z"
+#define TIMESTAMP_MAX_SIZE 32
+
+static int append_int32_property(az_json_writer* jw, az_span name, int32_t value)
+{
+  if (az_result_failed(az_json_writer_append_property_name(jw, name))
+      || az_result_failed(az_json_writer_append_int32(jw, value)))
+  {
+    LogError(
+        "Failed adding %.*s to telemetry payload.", az_span_size(name), az_span_ptr(name));
+    return 1;
+  }
+
+  return 0;
+}
+
+static int append_bool_property(az_json_writer* jw, az_span name, bool value)
+{
+  if (az_result_failed(az_json_writer_append_property_name(jw, name))
+      || az_result_failed(az_json_writer_append_bool(jw, value)))
+  {
+    LogError(
+        "Failed adding %.*s to telemetry payload.", az_span_size(name), az_span_ptr(name));
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Checks if `required` more bytes can be written to a telemetry payload part and still
+ *           leave room for closing it.
+ */
+static bool part_has_room(az_json_writer* jw, az_span buffer, size_t required)
+{
+  size_t used = (size_t)az_span_size(az_json_writer_get_bytes_used_in_destination(jw));
+
+  return used + required + TELEMETRY_PART_CLOSING_MAX_SIZE <= (size_t)az_span_size(buffer);
+}
+
+/*
+ * @brief    Starts a telemetry payload part with the frame sequence number (and, in the first
+ *           part, whether the frame is a keyframe).
+ */
+static int begin_part(telemetry_payload_writer_t* writer, az_json_writer* jw, az_span buffer)
+{
+  if (az_result_failed(az_json_writer_init(jw, buffer, NULL))
+      || az_result_failed(az_json_writer_append_begin_object(jw)))
+  {
+    LogError("Failed starting telemetry payload part %d.", writer->part);
+    return 1;
+  }
+
+  if (append_int32_property(
+          jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_SEQUENCE), (int32_t)writer->frame->sequence)
+      != 0)
+  {
+    return 1;
+  }
+
+  if (writer->part == 0
+      && append_bool_property(
+             jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_KEYFRAME), writer->frame->is_keyframe)
+          != 0)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Closes a telemetry payload part. Parts of a frame that had to be split are numbered,
+ *           and the last one is flagged so the backend knows when it has the whole frame.
+ */
+static int end_part(
+    telemetry_payload_writer_t* writer,
+    az_json_writer* jw,
+    az_span buffer,
+    bool is_last_part,
+    az_span* out_part)
+{
+  az_span part;
+
+  if (writer->part > 0 || !is_last_part)
+  {
+    if (append_int32_property(jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_PART), writer->part) != 0
+        || append_bool_property(jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_LAST_PART), is_last_part)
+            != 0)
+    {
+      return 1;
+    }
+  }
+
+  if (az_result_failed(az_json_writer_append_end_object(jw)))
+  {
+    LogError("Failed closing telemetry payload part %d.", writer->part);
+    return 1;
+  }
+
+  part = az_json_writer_get_bytes_used_in_destination(jw);
+
+  if (az_span_size(part) >= az_span_size(buffer))
+  {
+    LogError("Insufficient space for telemetry payload null terminator.");
+    return 1;
+  }
+
+  az_span_ptr(buffer)[az_span_size(part)] = null_terminator;
+  *out_part = part;
+
+  if (is_last_part)
+  {
+    writer->is_done = true;
+  }
+  else
+  {
+    writer->part++;
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Writes what goes after the fields, at the end of the last part.
+ */
+static int append_trailer(telemetry_payload_writer_t* writer, az_json_writer* jw)
+{
+  const telemetry_frame_t* frame = writer->frame;
+  char timestamp[TIMESTAMP_MAX_SIZE];
+  struct tm date;
+
+  if (append_int32_property(jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COM_STATUS), frame->com_status)
+          != 0
+      || append_int32_property(
+             jw,
+             AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_MESSAGE_UNITS_TODAY),
+             frame->message_units_today)
+          != 0)
+  {
+    return 1;
+  }
+
+  if (gmtime_r(&frame->timestamp, &date) == NULL
+      || strftime(timestamp, sizeof(timestamp), TIMESTAMP_FORMAT, &date) == 0)
+  {
+    LogError("Failed formatting telemetry timestamp.");
+    return 1;
+  }
+
+  if (az_result_failed(
+          az_json_writer_append_property_name(jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_TIMESTAMP)))
+      || az_result_failed(az_json_writer_append_string(jw, az_span_create_from_str(timestamp))))
+  {
+    LogError("Failed adding timestamp to telemetry payload.");
+    return 1;
+  }
+
+  return 0;
+}
+
+void telemetry_payload_writer_init(
+    telemetry_payload_writer_t* writer,
+    const telemetry_frame_t* frame)
+{
+  writer->frame = frame;
+  writer->next_field = 0;
+  writer->part = 0;
+  writer->is_done = false;
+}
+
+int telemetry_payload_write_part(
+    telemetry_payload_writer_t* writer,
+    az_span buffer,
+    az_span* out_part)
+{
+  az_json_writer jw;
+
+  if (writer->is_done || az_span_size(buffer) < TELEMETRY_PART_MIN_SIZE)
+  {
+    LogError("Cannot write telemetry payload part %d.", writer->part);
+    return 1;
+  }
+
+  if (begin_part(writer, &jw, buffer) != 0)
+  {
+    return 1;
+  }
+
+  for (; writer->next_field < TELEMETRY_FIELD_COUNT; writer->next_field++)
+  {
+    const telemetry_field_t* field = &telemetry_fields[writer->next_field];
+
+    if ((writer->frame->fields & (1ULL << writer->next_field)) == 0)
+    {
+      continue;
+    }
+
+    if (!part_has_room(&jw, buffer, az_span_size(field->name) + TELEMETRY_FIELD_MAX_SIZE))
+    {
+      return end_part(writer, &jw, buffer, false, out_part);
+    }
+
+    if (az_result_failed(az_json_writer_append_property_name(&jw, field->name))
+        || az_result_failed(
+            az_json_writer_append_double(&jw, *field->value, field->decimal_places)))
+    {
+      LogError(
+          "Failed adding %.*s to telemetry payload.",
+          az_span_size(field->name),
+          az_span_ptr(field->name));
+      return 1;
+    }
+  }
+
+  if (!part_has_room(&jw, buffer, TELEMETRY_TRAILER_MAX_SIZE))
+  {
+    return end_part(writer, &jw, buffer, false, out_part);
+  }
+
+  if (append_trailer(writer, &jw) != 0)
+  {
+    return 1;
+  }
+
+  return end_part(writer, &jw, buffer, true, out_part);
+}
+
+bool telemetry_payload_is_done(telemetry_payload_writer_t* writer)
+{
+  return writer->is_done;
+}
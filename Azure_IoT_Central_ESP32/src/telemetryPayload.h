@@ -0,0 +1,85 @@
+/*
+ * telemetryPayload writes telemetry frames as JSON payloads, in as many parts as needed to keep
+ * each one within a given size (see TELEMETRY_PART_MAX_SIZE in Azure_IoT_PnP_Template.cpp).
+ */
+
+#ifndef TELEMETRY_PAYLOAD_H
+#define TELEMETRY_PAYLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <az_core.h>
+
+// Worst case sizes of what is written to a telemetry payload part, used for splitting it in time.
+#define TELEMETRY_FIELD_MAX_SIZE 32 // ,"":-9007199254740991.000
+#define TELEMETRY_TRAILER_MAX_SIZE 128 // comStatus, messageUnitsToday and timestamp.
+#define TELEMETRY_PART_CLOSING_MAX_SIZE 32 // ,"part":65535,"lastPart":false} and null-terminator.
+#define TELEMETRY_PART_MIN_SIZE 256
+
+/*
+ * @brief    Contents of a telemetry frame.
+ * @remark   Field values are read from `telemetry_fields` (see telemetryFields.h) as each part is
+ *           written.
+ */
+typedef struct telemetry_frame_t_struct
+{
+  uint32_t sequence;
+  bool is_keyframe;
+  uint64_t fields; // A bit per entry of `telemetry_fields`, set for the fields to write.
+  int32_t com_status;
+  int32_t message_units_today;
+  time_t timestamp;
+} telemetry_frame_t;
+
+/*
+ * @brief    State of the writing of a telemetry frame, part after part.
+ */
+typedef struct telemetry_payload_writer_t_struct
+{
+  const telemetry_frame_t* frame;
+  size_t next_field;
+  uint16_t part;
+  bool is_done;
+} telemetry_payload_writer_t;
+
+/*
+ * @brief        Starts writing a telemetry frame.
+ *
+ * @param[out]   writer    The writer to start.
+ * @param[in]    frame     The frame to write. Must be kept until the last part is written.
+ */
+void telemetry_payload_writer_init(
+    telemetry_payload_writer_t* writer,
+    const telemetry_frame_t* frame);
+
+/*
+ * @brief        Writes the next part of the telemetry frame.
+ * @remark       Every part is a JSON object with the frame "seq". The first part also has
+ *               "keyframe", and if the frame needs more than one part they are numbered ("part")
+ *               and the last one is flagged ("lastPart").
+ *
+ * @param[in]    writer    The writer of the frame.
+ * @param[in]    buffer    Where to write the part, at least TELEMETRY_PART_MIN_SIZE bytes. The part
+ *                         is null-terminated.
+ * @param[out]   out_part  The part written, within `buffer` (without the null-terminator).
+ *
+ * @return       int       0 on success, non-zero if the part could not be written.
+ */
+int telemetry_payload_write_part(
+    telemetry_payload_writer_t* writer,
+    az_span buffer,
+    az_span* out_part);
+
+/*
+ * @brief        Tells whether the last part of the telemetry frame was written.
+ *
+ * @param[in]    writer    The writer of the frame.
+ *
+ * @return       bool      True once the whole frame was written, false otherwise.
+ */
+bool telemetry_payload_is_done(telemetry_payload_writer_t* writer);
+
+#endif // TELEMETRY_PAYLOAD_H
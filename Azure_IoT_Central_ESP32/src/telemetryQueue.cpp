@@ -0,0 +1,386 @@
+#include "telemetryQueue.h"
+
+#include <SD.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+#include "crc32.h"
+
+#define TELEMETRY_QUEUE_DIRECTORY "/telemetryQueue"
+#define TELEMETRY_QUEUE_DATA_FILE TELEMETRY_QUEUE_DIRECTORY "/queue.bin"
+#define TELEMETRY_QUEUE_HEAD_FILE TELEMETRY_QUEUE_DIRECTORY "/head.bin"
+
+#define RECORD_MARKER 0x51E7
+#define RESYNC_CHUNK_SIZE 64
+
+typedef struct record_header_t_struct
+{
+  uint16_t marker;
+  uint16_t length;
+  uint32_t crc;
+} record_header_t;
+
+typedef struct head_slot_t_struct
+{
+  uint32_t sequence;
+  uint32_t offset;
+  uint32_t crc;
+} head_slot_t;
+
+static bool is_initialized = false;
+static uint32_t head_offset = 0;
+static uint32_t head_sequence = 0;
+static uint32_t data_size = 0;
+static uint32_t peeked_record_end = 0;
+static uint32_t read_offset = 0;
+
+static uint32_t head_slot_crc(const head_slot_t* slot)
+{
+  return crc32_update(CRC32_INITIAL_VALUE, (const uint8_t*)slot, offsetof(head_slot_t, crc));
+}
+
+static int write_head(uint32_t offset)
+{
+  head_slot_t slot;
+  File file;
+
+  if (!SD.exists(TELEMETRY_QUEUE_HEAD_FILE))
+  {
+    file = SD.open(TELEMETRY_QUEUE_HEAD_FILE, FILE_WRITE);
+  }
+  else
+  {
+    file = SD.open(TELEMETRY_QUEUE_HEAD_FILE, "r+");
+  }
+
+  if (!file)
+  {
+    LogError("Failed opening %s.", TELEMETRY_QUEUE_HEAD_FILE);
+    return 1;
+  }
+
+  slot.sequence = head_sequence + 1;
+  slot.offset = offset;
+  slot.crc = head_slot_crc(&slot);
+
+  // Slots are written alternately, so the one with the previous head is never overwritten.
+  if (!file.seek((slot.sequence % 2) * sizeof(slot))
+      || file.write((const uint8_t*)&slot, sizeof(slot)) != sizeof(slot))
+  {
+    LogError("Failed writing %s.", TELEMETRY_QUEUE_HEAD_FILE);
+    file.close();
+    return 1;
+  }
+
+  file.close();
+
+  head_sequence = slot.sequence;
+  head_offset = offset;
+
+  return 0;
+}
+
+static void read_head()
+{
+  head_slot_t slots[2];
+  File file = SD.open(TELEMETRY_QUEUE_HEAD_FILE, FILE_READ);
+
+  head_offset = 0;
+  head_sequence = 0;
+
+  if (!file)
+  {
+    return;
+  }
+
+  memset(slots, 0, sizeof(slots));
+  (void)file.read((uint8_t*)slots, sizeof(slots));
+  file.close();
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (slots[i].crc == head_slot_crc(&slots[i]) && slots[i].sequence >= head_sequence
+        && slots[i].offset <= data_size)
+    {
+      head_sequence = slots[i].sequence;
+      head_offset = slots[i].offset;
+    }
+  }
+}
+
+/*
+ * @brief    Removes both files once every message has been forwarded, so the data file does not
+ *           grow forever.
+ */
+static void reset_queue()
+{
+  (void)SD.remove(TELEMETRY_QUEUE_DATA_FILE);
+  (void)SD.remove(TELEMETRY_QUEUE_HEAD_FILE);
+  head_offset = 0;
+  head_sequence = 0;
+  data_size = 0;
+  peeked_record_end = 0;
+  read_offset = 0;
+}
+
+/*
+ * @brief    Finds the next record marker after `offset`, for resuming after a corrupted record.
+ */
+static uint32_t find_next_record(File* file, uint32_t offset)
+{
+  uint8_t chunk[RESYNC_CHUNK_SIZE];
+  uint16_t marker = RECORD_MARKER;
+  const uint8_t* marker_bytes = (const uint8_t*)&marker;
+
+  for (offset = offset + 1; offset + sizeof(record_header_t) <= data_size;
+       offset += RESYNC_CHUNK_SIZE - 1)
+  {
+    int length;
+
+    if (!file->seek(offset) || (length = file->read(chunk, sizeof(chunk))) < 2)
+    {
+      break;
+    }
+
+    for (int i = 0; i + 1 < length; i++)
+    {
+      if (chunk[i] == marker_bytes[0] && chunk[i + 1] == marker_bytes[1])
+      {
+        return offset + i;
+      }
+    }
+  }
+
+  return data_size;
+}
+
+int telemetry_queue_init()
+{
+  if (SD.cardType() == CARD_NONE)
+  {
+    LogError("No SD card for the telemetry queue.");
+    return 1;
+  }
+
+  if (!SD.exists(TELEMETRY_QUEUE_DIRECTORY) && !SD.mkdir(TELEMETRY_QUEUE_DIRECTORY))
+  {
+    LogError("Failed creating %s.", TELEMETRY_QUEUE_DIRECTORY);
+    return 1;
+  }
+
+  File file = SD.open(TELEMETRY_QUEUE_DATA_FILE, FILE_READ);
+  data_size = file ? file.size() : 0;
+
+  if (file)
+  {
+    file.close();
+  }
+
+  read_head();
+  peeked_record_end = head_offset;
+  read_offset = head_offset;
+  is_initialized = true;
+
+  if (data_size > head_offset)
+  {
+    LogInfo("Telemetry queue has %u bytes pending.", data_size - head_offset);
+  }
+  else
+  {
+    reset_queue();
+  }
+
+  return 0;
+}
+
+int telemetry_queue_push(az_span message)
+{
+  return telemetry_queue_push_with_prefix(AZ_SPAN_EMPTY, message);
+}
+
+int telemetry_queue_push_with_prefix(az_span prefix, az_span message)
+{
+  record_header_t header;
+  File file;
+
+  if (!is_initialized || az_span_size(prefix) + az_span_size(message) > UINT16_MAX)
+  {
+    return 1;
+  }
+
+  header.marker = RECORD_MARKER;
+  header.length = (uint16_t)(az_span_size(prefix) + az_span_size(message));
+  header.crc = crc32_update(CRC32_INITIAL_VALUE, az_span_ptr(prefix), az_span_size(prefix));
+  header.crc = crc32_update(header.crc, az_span_ptr(message), az_span_size(message));
+
+  file = SD.open(TELEMETRY_QUEUE_DATA_FILE, FILE_APPEND);
+
+  if (!file)
+  {
+    LogError("Failed opening %s.", TELEMETRY_QUEUE_DATA_FILE);
+    return 1;
+  }
+
+  bool written = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header)
+      && file.write(az_span_ptr(prefix), az_span_size(prefix)) == (size_t)az_span_size(prefix)
+      && file.write(az_span_ptr(message), az_span_size(message)) == (size_t)az_span_size(message);
+
+  data_size = file.size();
+  file.close();
+
+  if (!written)
+  {
+    LogError("Failed writing %s.", TELEMETRY_QUEUE_DATA_FILE);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * @brief    Reads the first valid record at or after `offset`, skipping corrupted ones.
+ *
+ * @param[out]   out_end    Offset right after the record, or the end of the data if there is no
+ *                          valid record left.
+ */
+static int read_record(uint32_t offset, az_span buffer, az_span* out_message, uint32_t* out_end)
+{
+  record_header_t header;
+  File file = SD.open(TELEMETRY_QUEUE_DATA_FILE, FILE_READ);
+
+  if (!file)
+  {
+    LogError("Failed opening %s.", TELEMETRY_QUEUE_DATA_FILE);
+    *out_end = offset;
+    return 1;
+  }
+
+  while (offset + sizeof(header) <= data_size)
+  {
+    if (file.seek(offset) && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header)
+        && header.marker == RECORD_MARKER && header.length <= az_span_size(buffer)
+        && offset + sizeof(header) + header.length <= data_size
+        && file.read(az_span_ptr(buffer), header.length) == header.length
+        && crc32_update(CRC32_INITIAL_VALUE, az_span_ptr(buffer), header.length) == header.crc)
+    {
+      file.close();
+      *out_message = az_span_slice(buffer, 0, header.length);
+      *out_end = offset + sizeof(header) + header.length;
+      return 0;
+    }
+
+    LogError("Skipping corrupted telemetry queue record at offset %u.", offset);
+    offset = find_next_record(&file, offset);
+  }
+
+  file.close();
+  *out_end = data_size;
+
+  return 1;
+}
+
+int telemetry_queue_peek(az_span buffer, az_span* out_message)
+{
+  uint32_t end;
+
+  if (telemetry_queue_is_empty())
+  {
+    return 1;
+  }
+
+  if (read_record(head_offset, buffer, out_message, &end) != 0)
+  {
+    if (end == data_size)
+    {
+      // Only corrupted data was left.
+      peeked_record_end = data_size;
+      (void)telemetry_queue_pop();
+    }
+
+    return 1;
+  }
+
+  peeked_record_end = end;
+
+  return 0;
+}
+
+int telemetry_queue_pop()
+{
+  if (peeked_record_end <= head_offset)
+  {
+    return 1;
+  }
+
+  if (peeked_record_end >= data_size)
+  {
+    reset_queue();
+    return 0;
+  }
+
+  return write_head(peeked_record_end);
+}
+
+int telemetry_queue_read(az_span buffer, az_span* out_message)
+{
+  uint32_t end;
+
+  if (!telemetry_queue_has_unread())
+  {
+    return 1;
+  }
+
+  if (read_offset < head_offset)
+  {
+    read_offset = head_offset;
+  }
+
+  if (read_record(read_offset, buffer, out_message, &end) != 0)
+  {
+    if (end == data_size && read_offset == head_offset)
+    {
+      // Only corrupted data was left, and no message before it is waiting to be released.
+      reset_queue();
+    }
+    else
+    {
+      read_offset = end;
+    }
+
+    return 1;
+  }
+
+  read_offset = end;
+
+  return 0;
+}
+
+uint32_t telemetry_queue_get_read_offset() { return read_offset; }
+
+int telemetry_queue_release(uint32_t offset)
+{
+  if (offset <= head_offset || offset > data_size)
+  {
+    return 1;
+  }
+
+  if (offset == data_size)
+  {
+    reset_queue();
+    return 0;
+  }
+
+  return write_head(offset);
+}
+
+void telemetry_queue_rewind() { read_offset = head_offset; }
+
+bool telemetry_queue_has_unread() { return is_initialized && read_offset < data_size; }
+
+bool telemetry_queue_is_empty() { return !is_initialized || head_offset >= data_size; }
+
+uint32_t telemetry_queue_get_pending_size()
+{
+  return telemetry_queue_is_empty() ? 0 : data_size - head_offset;
+}
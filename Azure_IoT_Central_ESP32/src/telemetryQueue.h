@@ -0,0 +1,115 @@
+/*
+ * telemetryQueue is a persistent, append-only queue of telemetry messages on the SD card, for
+ * storing messages while the uplink is down (or publishing fails) and forwarding them, in order,
+ * once it is back.
+ *
+ * Messages are appended as records with a header (marker, length and CRC-32 of the message) to a
+ * single data file, and a small head file keeps the offset of the oldest message not yet
+ * forwarded. The head file has two slots that are written alternately, so a power cut while
+ * updating it leaves the other slot intact. A record torn by a power cut is detected by its CRC
+ * and skipped, so at most that one record is lost.
+ *
+ * Messages are either forwarded one at a time (peek, then pop once sent) or, to keep several in
+ * flight, read ahead of the oldest one and released once delivered (read, then release).
+ *
+ * The SD card must be mounted before `telemetry_queue_init` is called.
+ */
+
+#ifndef TELEMETRY_QUEUE_H
+#define TELEMETRY_QUEUE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <az_core.h>
+
+/*
+ * @brief        Recovers the queue state from the SD card.
+ *
+ * @return       int       0 on success, non-zero if the SD card can not be used.
+ */
+int telemetry_queue_init();
+
+/*
+ * @brief        Appends a message to the end of the queue.
+ * @remark       The message is flushed to the SD card before this function returns.
+ *
+ * @return       int       0 on success, non-zero if the message could not be stored.
+ */
+int telemetry_queue_push(az_span message);
+
+/*
+ * @brief        Appends `prefix` followed by `message` to the end of the queue, as one message.
+ * @remark       Saves copying both into a single buffer first (e.g., for metadata kept with the
+ *               message). The message is flushed to the SD card before this function returns.
+ *
+ * @return       int       0 on success, non-zero if the message could not be stored.
+ */
+int telemetry_queue_push_with_prefix(az_span prefix, az_span message);
+
+/*
+ * @brief        Reads the oldest message in the queue, without removing it.
+ *
+ * @param[in]    buffer         Where to read the message into.
+ * @param[out]   out_message    The part of `buffer` with the message.
+ *
+ * @return       int            0 on success, non-zero if the queue is empty or can not be read.
+ */
+int telemetry_queue_peek(az_span buffer, az_span* out_message);
+
+/*
+ * @brief        Removes the message last returned by `telemetry_queue_peek` from the queue.
+ *
+ * @return       int       0 on success, non-zero otherwise.
+ */
+int telemetry_queue_pop();
+
+/*
+ * @brief        Reads the next message after the ones already read, without removing it, so
+ *               several messages can be in flight at a time.
+ * @remark       Reading starts at the oldest message, and again from it after
+ *               `telemetry_queue_rewind`.
+ *
+ * @param[in]    buffer         Where to read the message into.
+ * @param[out]   out_message    The part of `buffer` with the message.
+ *
+ * @return       int            0 on success, non-zero if there are no more messages or they can
+ *                              not be read.
+ */
+int telemetry_queue_read(az_span buffer, az_span* out_message);
+
+/*
+ * @brief        Gets the offset right after the message last returned by `telemetry_queue_read`,
+ *               to release the queue up to it with `telemetry_queue_release`.
+ */
+uint32_t telemetry_queue_get_read_offset();
+
+/*
+ * @brief        Removes the messages before `offset` (as returned by
+ *               `telemetry_queue_get_read_offset`) from the queue.
+ *
+ * @return       int       0 on success, non-zero otherwise.
+ */
+int telemetry_queue_release(uint32_t offset);
+
+/*
+ * @brief        Makes `telemetry_queue_read` start again from the oldest message.
+ */
+void telemetry_queue_rewind();
+
+/*
+ * @brief        Checks if there are messages not yet returned by `telemetry_queue_read`.
+ */
+bool telemetry_queue_has_unread();
+
+/*
+ * @brief        Checks if there are messages in the queue.
+ */
+bool telemetry_queue_is_empty();
+
+/*
+ * @brief        Gets how many bytes of the data file (records not yet forwarded) are pending.
+ */
+uint32_t telemetry_queue_get_pending_size();
+
+#endif // TELEMETRY_QUEUE_H
@@ -0,0 +1,202 @@
+#include "tokenizedLog.h"
+
+#include <string.h>
+#include <time.h>
+
+typedef struct record_writer_t_struct
+{
+  uint8_t* buffer;
+  size_t length;
+  bool truncated;
+} record_writer_t;
+
+static void put_bytes(record_writer_t* writer, const void* data, size_t size)
+{
+  if (writer->length + size > TOKENIZED_LOG_RECORD_MAX_SIZE)
+  {
+    writer->truncated = true;
+    return;
+  }
+
+  (void)memcpy(writer->buffer + writer->length, data, size);
+  writer->length += size;
+}
+
+static void put_uint32(record_writer_t* writer, uint32_t value)
+{
+  put_bytes(writer, &value, sizeof(value));
+}
+
+static void put_string(record_writer_t* writer, const char* value, int precision)
+{
+  size_t length = 0;
+  uint8_t size;
+
+  if (value == NULL)
+  {
+    value = "(null)";
+  }
+
+  while (value[length] != '\0' && (precision < 0 || length < (size_t)precision))
+  {
+    length++;
+  }
+
+  // Strings are cut to what fits (and to 255 characters) rather than dropped.
+  if (writer->length + 1 + length > TOKENIZED_LOG_RECORD_MAX_SIZE)
+  {
+    writer->truncated = true;
+
+    if (writer->length + 1 >= TOKENIZED_LOG_RECORD_MAX_SIZE)
+    {
+      return;
+    }
+
+    length = TOKENIZED_LOG_RECORD_MAX_SIZE - writer->length - 1;
+  }
+
+  size = length > UINT8_MAX ? UINT8_MAX : (uint8_t)length;
+  put_bytes(writer, &size, sizeof(size));
+  put_bytes(writer, value, size);
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/*
+ * @brief    Copies the arguments of `format` into the record, walking the format string the same
+ *           way printf does but without converting anything to text.
+ */
+static void put_arguments(record_writer_t* writer, const char* format, va_list args)
+{
+  const char* c = format;
+
+  while (*c != '\0')
+  {
+    int precision = -1;
+    int long_count = 0;
+
+    if (*c++ != '%')
+    {
+      continue;
+    }
+
+    if (*c == '%')
+    {
+      c++;
+      continue;
+    }
+
+    while (*c == '-' || *c == '+' || *c == ' ' || *c == '#' || *c == '0')
+    {
+      c++;
+    }
+
+    if (*c == '*')
+    {
+      put_uint32(writer, (uint32_t)va_arg(args, int));
+      c++;
+    }
+
+    while (is_digit(*c))
+    {
+      c++;
+    }
+
+    if (*c == '.')
+    {
+      c++;
+      precision = 0;
+
+      if (*c == '*')
+      {
+        precision = va_arg(args, int);
+        put_uint32(writer, (uint32_t)precision);
+        c++;
+      }
+
+      while (is_digit(*c))
+      {
+        precision = precision * 10 + (*c++ - '0');
+      }
+    }
+
+    while (*c == 'l' || *c == 'h' || *c == 'z' || *c == 'j' || *c == 't')
+    {
+      long_count += (*c == 'l') ? 1 : (*c == 'j') ? 2 : 0;
+      c++;
+    }
+
+    switch (*c)
+    {
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+      case 'c':
+        if (long_count >= 2)
+        {
+          uint64_t value = (uint64_t)va_arg(args, long long);
+          put_bytes(writer, &value, sizeof(value));
+        }
+        else if (long_count == 1)
+        {
+          put_uint32(writer, (uint32_t)va_arg(args, long));
+        }
+        else
+        {
+          put_uint32(writer, (uint32_t)va_arg(args, int));
+        }
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+      {
+        double value = va_arg(args, double);
+        put_bytes(writer, &value, sizeof(value));
+        break;
+      }
+      case 's':
+        put_string(writer, va_arg(args, const char*), precision);
+        break;
+      case 'p':
+        put_uint32(writer, (uint32_t)(uintptr_t)va_arg(args, void*));
+        break;
+      case '\0':
+        return;
+      default:
+        // Not supported (%n): the rest of the arguments can not be located.
+        writer->truncated = true;
+        return;
+    }
+
+    c++;
+  }
+}
+
+int tokenized_log_v(async_log_file_t* file, uint8_t level, const char* format, va_list args)
+{
+  uint8_t record[TOKENIZED_LOG_RECORD_MAX_SIZE];
+  tokenized_log_header_t* header = (tokenized_log_header_t*)record;
+  record_writer_t writer;
+
+  writer.buffer = record;
+  writer.length = sizeof(tokenized_log_header_t);
+  writer.truncated = false;
+
+  put_arguments(&writer, format, args);
+
+  header->marker = TOKENIZED_LOG_RECORD_MARKER;
+  header->level = level | (writer.truncated ? TOKENIZED_LOG_TRUNCATED : 0);
+  header->arguments_size = (uint8_t)(writer.length - sizeof(tokenized_log_header_t));
+  header->timestamp = (uint32_t)time(NULL);
+  header->format = (uint32_t)(uintptr_t)format;
+
+  return async_log_record(file, record, writer.length);
+}
@@ -0,0 +1,59 @@
+/*
+ * tokenizedLog logs messages without formatting them on the device. Each message is stored as a
+ * small binary record with the address of its format string, the time and the raw values of its
+ * arguments; tools/decode_tokenized_log.py renders the records back into text, taking the format
+ * strings from the ELF file of the same firmware build.
+ *
+ * Format strings must be string literals (so they live in flash at a fixed address), as with
+ * LogInfo and LogError. Supported conversions are those of printf except %n; `l`, `ll`, `h`, `hh`,
+ * `z`, `j` and `t` length modifiers are accepted. Strings are copied into the record, truncated if
+ * the record would be larger than TOKENIZED_LOG_RECORD_MAX_SIZE.
+ *
+ * Record layout (little endian), back to back in the log file:
+ *   uint16_t marker          TOKENIZED_LOG_RECORD_MARKER
+ *   uint8_t  level           Log level, with TOKENIZED_LOG_TRUNCATED set if arguments are missing.
+ *   uint8_t  arguments_size  Bytes of arguments following the header.
+ *   uint32_t timestamp       Seconds since the Unix epoch.
+ *   uint32_t format          Address of the format string.
+ *   Arguments, in order: 4 bytes for integers, characters and pointers, 8 bytes for `ll`/`j`
+ *   integers and for floating point values, and a 1-byte length followed by the characters for
+ *   strings.
+ */
+
+#ifndef TOKENIZED_LOG_H
+#define TOKENIZED_LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "asyncLog.h"
+
+#define TOKENIZED_LOG_RECORD_MARKER 0x4C54
+#define TOKENIZED_LOG_TRUNCATED 0x80
+#define TOKENIZED_LOG_RECORD_MAX_SIZE ASYNC_LOG_MESSAGE_MAX_SIZE
+
+typedef struct tokenized_log_header_t_struct
+{
+  uint16_t marker;
+  uint8_t level;
+  uint8_t arguments_size;
+  uint32_t timestamp;
+  uint32_t format;
+} tokenized_log_header_t;
+
+static_assert(sizeof(tokenized_log_header_t) == 12, "Unexpected tokenized log header size.");
+
+/*
+ * @brief        Logs a message to `file` as a tokenized record.
+ *
+ * @param[in]    file      The file to log to, declared with `ASYNC_LOG_FILE`.
+ * @param[in]    level     The level of the message (a `log_level_t` value), below 0x80.
+ * @param[in]    format    printf-like format string literal.
+ * @param[in]    args      The format arguments.
+ *
+ * @return       int       0 on success, non-zero if the log ring is full.
+ */
+int tokenized_log_v(async_log_file_t* file, uint8_t level, const char* format, va_list args);
+
+#endif // TOKENIZED_LOG_H
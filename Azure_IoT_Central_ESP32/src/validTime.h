@@ -0,0 +1,12 @@
+/*
+ * validTime tells a clock set by SNTP from one still counting from the epoch after a reset, for the
+ * SD card stores that name or stamp their records with the time.
+ */
+
+#ifndef VALID_TIME_H
+#define VALID_TIME_H
+
+// 2020-01-01, before which the clock is taken as not set yet.
+#define MIN_VALID_TIME 1577836800
+
+#endif // VALID_TIME_H
@@ -1,12 +1,17 @@
 #ifndef WEIDOS_TASKS_H
 #define WEIDOS_TASKS_H
 
+#include <stdint.h>
+
 
 void weidosSetup();
-void getData();
-void assignDataToGlobalVariables();
-void assignDataToGlobalVariables2();
-void assignDataToGlobalVariables3();
+void getData(uint8_t fieldGroups);  // TELEMETRY_FIELD_GROUP_* flags of the fields to read.
+void assignInstantaneousData();
+void assignEnergyData();
+void assignTHDLNData();
+void assignPowerFactorData();
+void assignTHDLLData();
+void assignNeutralCurrentData();
 void computeData();
 float getNextData();
 
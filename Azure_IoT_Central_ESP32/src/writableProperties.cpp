@@ -0,0 +1,269 @@
+#include "writableProperties.h"
+
+#include <Preferences.h>
+#include <string.h>
+
+#include "../AzureIoT.h"
+
+#define VERSION_KEY "version"
+
+#define NO_PROPERTY 0xFF
+
+static const writable_property_t* registered_properties = NULL;
+static size_t registered_property_count = 0;
+
+// Index in `registered_properties` of the property of each slot, or NO_PROPERTY.
+static uint8_t slot_properties[WRITABLE_PROPERTY_SLOT_COUNT];
+
+static uint32_t hash_name(az_span name)
+{
+  uint32_t hash = WRITABLE_PROPERTY_FNV_OFFSET_BASIS;
+  uint8_t* bytes = az_span_ptr(name);
+
+  for (int32_t i = 0; i < az_span_size(name); i++)
+  {
+    hash = (hash ^ bytes[i]) * WRITABLE_PROPERTY_FNV_PRIME;
+  }
+
+  return hash;
+}
+
+int writable_properties_init(const writable_property_t* properties, size_t count)
+{
+  (void)memset(slot_properties, NO_PROPERTY, sizeof(slot_properties));
+  registered_properties = properties;
+  registered_property_count = 0;
+
+  if (count > WRITABLE_PROPERTY_SLOT_COUNT)
+  {
+    LogError("Too many writable properties (%d).", count);
+    return 1;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    uint32_t slot = writable_property_slot(properties[i].name_hash);
+
+    if (slot_properties[slot] != NO_PROPERTY)
+    {
+      LogError(
+          "Writable properties %s and %s share a slot.",
+          properties[slot_properties[slot]].name,
+          properties[i].name);
+      return 1;
+    }
+
+    slot_properties[slot] = (uint8_t)i;
+  }
+
+  registered_property_count = count;
+
+  return 0;
+}
+
+const writable_property_t* writable_properties_find(az_json_token* name_token)
+{
+  uint8_t index = slot_properties[writable_property_slot(hash_name(name_token->slice))];
+
+  if (index == NO_PROPERTY || index >= registered_property_count)
+  {
+    return NULL;
+  }
+
+  const writable_property_t* property = &registered_properties[index];
+
+  return az_json_token_is_text_equal(name_token, az_span_create_from_str((char*)property->name))
+      ? property
+      : NULL;
+}
+
+/*
+ * @brief    Reads the value of `property` from `value_token`.
+ *
+ * @return   int    0 if the token has a value of the type and range of the property, non-zero
+ *                  otherwise.
+ */
+static int read_value(
+    const writable_property_t* property,
+    az_json_token* value_token,
+    int32_t* value)
+{
+  switch (property->type)
+  {
+    case writable_property_type_int32:
+      if (value_token->kind != AZ_JSON_TOKEN_NUMBER
+          || az_result_failed(az_json_token_get_int32(value_token, value)))
+      {
+        return 1;
+      }
+      break;
+
+    case writable_property_type_bool:
+    {
+      bool boolean;
+
+      if (az_result_failed(az_json_token_get_boolean(value_token, &boolean)))
+      {
+        return 1;
+      }
+
+      *value = boolean ? 1 : 0;
+      break;
+    }
+
+    case writable_property_type_string:
+    {
+      char text[WRITABLE_PROPERTY_STRING_MAX_SIZE];
+      int32_t text_length;
+
+      if (value_token->kind != AZ_JSON_TOKEN_STRING
+          || az_result_failed(
+              az_json_token_get_string(value_token, text, sizeof(text), &text_length))
+          || property->parse(az_span_create((uint8_t*)text, text_length), value) != 0)
+      {
+        return 1;
+      }
+      break;
+    }
+
+    default:
+      return 1;
+  }
+
+  return *value < property->min_value || *value > property->max_value ? 1 : 0;
+}
+
+bool writable_property_apply(const writable_property_t* property, az_json_token* value_token)
+{
+  int32_t value;
+
+  if (read_value(property, value_token, &value) != 0)
+  {
+    LogError("Invalid value received for writable property %s.", property->name);
+    return false;
+  }
+
+  // A properties document has every property, changed or not.
+  if (value != property->get())
+  {
+    property->apply(value);
+  }
+
+  return true;
+}
+
+int writable_property_get_json(
+    const writable_property_t* property,
+    az_span buffer,
+    az_span* out_json)
+{
+  int32_t value = property->get();
+  az_span remainder;
+  az_span text;
+
+  switch (property->type)
+  {
+    case writable_property_type_int32:
+      if (az_result_failed(az_span_i32toa(buffer, value, &remainder)))
+      {
+        return 1;
+      }
+      *out_json = az_span_slice(buffer, 0, az_span_size(buffer) - az_span_size(remainder));
+      return 0;
+
+    case writable_property_type_bool:
+      text = value != 0 ? AZ_SPAN_FROM_STR("true") : AZ_SPAN_FROM_STR("false");
+      if (az_span_size(buffer) < az_span_size(text))
+      {
+        return 1;
+      }
+      (void)az_span_copy(buffer, text);
+      *out_json = az_span_slice(buffer, 0, az_span_size(text));
+      return 0;
+
+    case writable_property_type_string:
+      // With quotes around the text.
+      if (az_span_size(buffer) < 2
+          || property->format(value, az_span_slice(buffer, 1, az_span_size(buffer) - 1), &text)
+              != 0)
+      {
+        return 1;
+      }
+      az_span_ptr(buffer)[0] = '"';
+      az_span_ptr(buffer)[az_span_size(text) + 1] = '"';
+      *out_json = az_span_slice(buffer, 0, az_span_size(text) + 2);
+      return 0;
+
+    default:
+      return 1;
+  }
+}
+
+int32_t writable_properties_restore()
+{
+  Preferences preferences;
+  int32_t version;
+
+  if (!preferences.begin(WRITABLE_PROPERTIES_NAMESPACE, true))
+  {
+    return WRITABLE_PROPERTIES_VERSION_NONE;
+  }
+
+  version = preferences.getInt(VERSION_KEY, WRITABLE_PROPERTIES_VERSION_NONE);
+
+  for (size_t i = 0; i < registered_property_count && version != WRITABLE_PROPERTIES_VERSION_NONE;
+       i++)
+  {
+    const writable_property_t* property = &registered_properties[i];
+
+    if (property->nvs_key == NULL || !preferences.isKey(property->nvs_key))
+    {
+      continue;
+    }
+
+    int32_t value = preferences.getInt(property->nvs_key, property->get());
+
+    if (value >= property->min_value && value <= property->max_value && value != property->get())
+    {
+      property->apply(value);
+    }
+  }
+
+  preferences.end();
+
+  return version;
+}
+
+int writable_properties_save(int32_t version)
+{
+  Preferences preferences;
+  bool is_saved = true;
+
+  if (!preferences.begin(WRITABLE_PROPERTIES_NAMESPACE, false))
+  {
+    LogError("Failed opening NVS for saving the writable properties.");
+    return 1;
+  }
+
+  for (size_t i = 0; i < registered_property_count && is_saved; i++)
+  {
+    const writable_property_t* property = &registered_properties[i];
+
+    if (property->nvs_key != NULL)
+    {
+      is_saved = preferences.putInt(property->nvs_key, property->get()) > 0;
+    }
+  }
+
+  is_saved = is_saved && preferences.putInt(VERSION_KEY, version) > 0;
+
+  preferences.end();
+
+  if (!is_saved)
+  {
+    LogError("Failed saving the writable properties.");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * writableProperties is the registry of the writable properties of the device. Each property
+ * declares its JSON type, the range of values it accepts, the functions applying and reading back
+ * its value, and the NVS key it is persisted with (if any), so adding a tunable is adding an entry
+ * to the table given to `writable_properties_init`.
+ *
+ * Values are kept as int32_t. Properties that are not a number or a boolean in JSON (e.g., a list
+ * of names) are a string converted to and from such a value by a parse and a format function.
+ *
+ * Names are looked up by their FNV-1a hash, computed at compile time for the table and once per
+ * name received, and then confirmed with a single compare. A static_assert on
+ * `writable_properties_are_perfectly_hashed` checks that no two properties of a table share a slot
+ * of the lookup table.
+ */
+
+#ifndef WRITABLE_PROPERTIES_H
+#define WRITABLE_PROPERTIES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <az_core.h>
+
+/* Slots of the lookup table, a power of two. Up to this many properties can be registered. */
+#ifndef WRITABLE_PROPERTY_SLOT_COUNT
+#define WRITABLE_PROPERTY_SLOT_COUNT 16
+#endif
+
+/* Longest string value (without the quotes) of a string property. */
+#ifndef WRITABLE_PROPERTY_STRING_MAX_SIZE
+#define WRITABLE_PROPERTY_STRING_MAX_SIZE 64
+#endif
+
+/* NVS namespace the properties are persisted in. */
+#ifndef WRITABLE_PROPERTIES_NAMESPACE
+#define WRITABLE_PROPERTIES_NAMESPACE "writableProps"
+#endif
+
+/* Returned by `writable_properties_restore` when nothing was persisted. */
+#define WRITABLE_PROPERTIES_VERSION_NONE -1
+
+#if (WRITABLE_PROPERTY_SLOT_COUNT & (WRITABLE_PROPERTY_SLOT_COUNT - 1)) != 0
+#error "WRITABLE_PROPERTY_SLOT_COUNT must be a power of two."
+#endif
+
+#define WRITABLE_PROPERTY_FNV_OFFSET_BASIS 2166136261u
+#define WRITABLE_PROPERTY_FNV_PRIME 16777619u
+
+typedef enum writable_property_type_t_enum
+{
+  writable_property_type_int32,
+  writable_property_type_bool,
+  writable_property_type_string
+} writable_property_type_t;
+
+/*
+ * @brief        Converts the text of a string property into its value.
+ *
+ * @return       int    0 if the text is valid, non-zero otherwise.
+ */
+typedef int (*writable_property_parse_t)(az_span text, int32_t* value);
+
+/*
+ * @brief        Writes the text of a string property for its value, which must need no escaping.
+ *
+ * @return       int    0 on success, non-zero if `buffer` is too small.
+ */
+typedef int (*writable_property_format_t)(int32_t value, az_span buffer, az_span* out_text);
+
+/*
+ * @brief        Applies a new value of a property. Only called with valid values that differ from
+ *               the current one.
+ */
+typedef void (*writable_property_apply_t)(int32_t value);
+
+/*
+ * @brief        Gets the current value of a property.
+ */
+typedef int32_t (*writable_property_get_t)();
+
+/*
+ * @brief    A writable property. Declared with the WRITABLE_PROPERTY_* macros below.
+ */
+typedef struct writable_property_t_struct
+{
+  const char* name;
+  uint32_t name_hash;
+  writable_property_type_t type;
+  int32_t min_value;
+  int32_t max_value;
+  writable_property_parse_t parse; // String properties only.
+  writable_property_format_t format; // String properties only.
+  writable_property_apply_t apply;
+  writable_property_get_t get;
+  const char* nvs_key; // NULL if not persisted. At most 15 characters.
+} writable_property_t;
+
+/*
+ * @brief    Hashes a property name with FNV-1a (32 bits), at compile time for constant names.
+ */
+constexpr uint32_t writable_property_name_hash(
+    const char* name,
+    uint32_t hash = WRITABLE_PROPERTY_FNV_OFFSET_BASIS)
+{
+  return *name == '\0' ? hash
+                       : writable_property_name_hash(
+                           name + 1, (hash ^ (uint8_t)*name) * WRITABLE_PROPERTY_FNV_PRIME);
+}
+
+/*
+ * @brief    Gets the lookup table slot of a name hash, xor-folding its high bits into the low ones
+ *           (as the low bits of FNV-1a alone are poorly distributed).
+ */
+constexpr uint32_t writable_property_slot(uint32_t name_hash)
+{
+  return (name_hash ^ (name_hash >> 16)) & (WRITABLE_PROPERTY_SLOT_COUNT - 1);
+}
+
+/*
+ * @brief    Checks that every property of `properties` has a slot of its own.
+ * @remark   Meant for a static_assert on a constexpr table; `i` and `j` are for the recursion.
+ */
+constexpr bool writable_properties_are_perfectly_hashed(
+    const writable_property_t* properties,
+    size_t count,
+    size_t i = 0,
+    size_t j = 1)
+{
+  // A single return statement, for C++11.
+  return i + 1 >= count
+      ? count <= WRITABLE_PROPERTY_SLOT_COUNT
+      : j >= count
+      ? writable_properties_are_perfectly_hashed(properties, count, i + 1, i + 2)
+      : writable_property_slot(properties[i].name_hash)
+              != writable_property_slot(properties[j].name_hash)
+          && writable_properties_are_perfectly_hashed(properties, count, i, j + 1);
+}
+
+// The name must be a string literal.
+#define WRITABLE_PROPERTY_INT32(name, min_value, max_value, apply, get, nvs_key) \
+  { name,                                                                        \
+    writable_property_name_hash(name),                                           \
+    writable_property_type_int32,                                                \
+    min_value,                                                                   \
+    max_value,                                                                   \
+    NULL,                                                                        \
+    NULL,                                                                        \
+    apply,                                                                       \
+    get,                                                                         \
+    nvs_key }
+
+#define WRITABLE_PROPERTY_BOOL(name, apply, get, nvs_key) \
+  { name,                                                 \
+    writable_property_name_hash(name),                    \
+    writable_property_type_bool,                          \
+    0,                                                    \
+    1,                                                    \
+    NULL,                                                 \
+    NULL,                                                 \
+    apply,                                                \
+    get,                                                  \
+    nvs_key }
+
+#define WRITABLE_PROPERTY_STRING(name, parse, format, apply, get, nvs_key) \
+  { name,                                                                  \
+    writable_property_name_hash(name),                                     \
+    writable_property_type_string,                                         \
+    INT32_MIN,                                                             \
+    INT32_MAX,                                                             \
+    parse,                                                                 \
+    format,                                                                \
+    apply,                                                                 \
+    get,                                                                   \
+    nvs_key }
+
+/*
+ * @brief        Registers the writable properties of the device.
+ *
+ * @param[in]    properties    The properties, which must outlive the registry.
+ * @param[in]    count         Number of properties.
+ *
+ * @return       int           0 on success, non-zero if two properties share a slot (see
+ *                             `writable_properties_are_perfectly_hashed`).
+ */
+int writable_properties_init(const writable_property_t* properties, size_t count);
+
+/*
+ * @brief        Finds the property a JSON property name token refers to.
+ * @remark       Names with escaped characters are not found.
+ *
+ * @return       const writable_property_t*    The property, or NULL if there is none of that name.
+ */
+const writable_property_t* writable_properties_find(az_json_token* name_token);
+
+/*
+ * @brief        Validates the value of a property received, and applies it if it changed.
+ *
+ * @param[in]    property       The property.
+ * @param[in]    value_token    The JSON token of the value received.
+ *
+ * @return       bool           True if the value is valid (applied or not), false otherwise.
+ */
+bool writable_property_apply(const writable_property_t* property, az_json_token* value_token);
+
+/*
+ * @brief        Writes the current value of a property as JSON text (e.g., for its ack).
+ *
+ * @param[in]    property    The property.
+ * @param[in]    buffer      Where to write the value, at least
+ *                           WRITABLE_PROPERTY_STRING_MAX_SIZE + 2 bytes long.
+ * @param[out]   out_json    The part of `buffer` written.
+ *
+ * @return       int         0 on success, non-zero otherwise.
+ */
+int writable_property_get_json(
+    const writable_property_t* property,
+    az_span buffer,
+    az_span* out_json);
+
+/*
+ * @brief        Applies the values persisted by `writable_properties_save`, if any.
+ *
+ * @return       int32_t    The version of the desired properties saved with the values, or
+ *                          WRITABLE_PROPERTIES_VERSION_NONE if nothing was persisted.
+ */
+int32_t writable_properties_restore();
+
+/*
+ * @brief        Persists the current value of every property with an NVS key, and `version`.
+ * @remark       The version is written last, so values saved partially are not taken as those of
+ *               `version` on restore.
+ *
+ * @return       int    0 on success, non-zero otherwise.
+ */
+int writable_properties_save(int32_t version);
+
+#endif // WRITABLE_PROPERTIES_H
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Decodes historian field files (see Azure_IoT_Central_ESP32/src/historian.h) to CSV.
+
+    python3 decode_historian.py historian/202403/f00.bin [historian/202403/f01.bin ...] > f00.csv
+
+Writes "field,timestamp,value" lines to the standard output, and the number of blocks, samples
+and bytes of each file, with the compression ratio against raw (4-byte timestamp, 4-byte float)
+samples, to the standard error. Only the Python standard library is needed.
+"""
+
+import datetime
+import struct
+import sys
+import zlib
+
+BLOCK_SIZE = 256
+BLOCK_MARKER = 0x4853
+HEADER = struct.Struct("<HBBHHIIfffI")
+PAYLOAD_SIZE = BLOCK_SIZE - HEADER.size
+RAW_SAMPLE_SIZE = 8
+
+
+class BitReader:
+    """Reads bits, most significant first, as the historian writes them."""
+
+    def __init__(self, data):
+        self.data = data
+        self.position = 0
+
+    def read(self, count):
+        value = 0
+
+        for _ in range(count):
+            byte = self.data[self.position >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.position & 7))) & 1)
+            self.position += 1
+
+        return value
+
+
+def signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def decode_block(header, payload):
+    """Yields the (timestamp, value) samples of a block."""
+    _, _, _, sample_count, _, first_timestamp, _, _, _, _, _ = header
+    bits = BitReader(payload)
+    timestamp = first_timestamp
+    delta = 0
+    value_bits = bits.read(32)
+    leading_zeros, trailing_zeros = 32, 0
+
+    for i in range(sample_count):
+        if i > 0:
+            if bits.read(1) == 0:
+                delta_of_delta = 0
+            elif bits.read(1) == 0:
+                delta_of_delta = bits.read(7) - 63
+            elif bits.read(1) == 0:
+                delta_of_delta = bits.read(9) - 255
+            elif bits.read(1) == 0:
+                delta_of_delta = bits.read(12) - 2047
+            else:
+                delta_of_delta = signed(bits.read(32))
+
+            delta += delta_of_delta
+            timestamp = (timestamp + delta) & 0xFFFFFFFF
+
+            if bits.read(1) == 1:
+                if bits.read(1) == 1:
+                    leading_zeros = bits.read(5)
+                    trailing_zeros = 32 - leading_zeros - (bits.read(5) + 1)
+
+                value_bits ^= bits.read(32 - leading_zeros - trailing_zeros) << trailing_zeros
+
+        yield timestamp, struct.unpack("<f", struct.pack("<I", value_bits))[0]
+
+
+def decode(path, output):
+    with open(path, "rb") as file:
+        data = file.read()
+
+    block_count = 0
+    sample_count = 0
+
+    for offset in range(0, len(data) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        block = data[offset:offset + BLOCK_SIZE]
+        header = HEADER.unpack_from(block)
+        marker, field = header[0], header[1]
+        crc = header[-1]
+
+        unsigned = block[:HEADER.size - 4] + b"\0\0\0\0" + block[HEADER.size:]
+
+        if marker != BLOCK_MARKER or zlib.crc32(unsigned) != crc:
+            sys.stderr.write("%s: skipping corrupted block at offset %d\n" % (path, offset))
+            continue
+
+        block_count += 1
+
+        for timestamp, value in decode_block(header, block[HEADER.size:]):
+            time = datetime.datetime.fromtimestamp(timestamp, datetime.timezone.utc)
+            output.write("%d,%s,%.9g\n" % (field, time.strftime("%Y-%m-%dT%H:%M:%SZ"), value))
+            sample_count += 1
+
+    if sample_count > 0:
+        sys.stderr.write("%s: %d blocks, %d samples, %d bytes, %.2f bytes per sample, %.1fx "
+                         "compression\n" % (
+                             path, block_count, sample_count, block_count * BLOCK_SIZE,
+                             block_count * BLOCK_SIZE / sample_count,
+                             sample_count * RAW_SAMPLE_SIZE / (block_count * BLOCK_SIZE)))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write("usage: %s FIELD_FILE...\n" % sys.argv[0])
+        return 1
+
+    sys.stdout.write("field,timestamp,value\n")
+
+    for path in sys.argv[1:]:
+        decode(path, sys.stdout)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Renders a tokenized log file (see Azure_IoT_Central_ESP32/src/tokenizedLog.h) as text.
+
+The format strings are read from the ELF file of the firmware build that wrote the log:
+
+    python3 decode_tokenized_log.py Azure_IoT_Central_ESP32.ino.elf main.bin
+
+Only the Python standard library is needed.
+"""
+
+import datetime
+import re
+import struct
+import sys
+
+RECORD_MARKER = 0x4C54
+TRUNCATED = 0x80
+HEADER = struct.Struct("<HBBII")
+LEVELS = {0: "INFO", 1: "ERROR"}
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|z|j|t)?([diuxXocfFeEgGaAsp%])")
+
+
+class ElfStrings:
+    """Reads null-terminated strings at virtual addresses of an ELF32 little endian file."""
+
+    def __init__(self, path):
+        with open(path, "rb") as elf:
+            self.data = elf.read()
+
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1 or self.data[5] != 1:
+            raise ValueError("%s is not a 32-bit little endian ELF file" % path)
+
+        section_offset, = struct.unpack_from("<I", self.data, 0x20)
+        section_size, section_count = struct.unpack_from("<HH", self.data, 0x2E)
+        self.sections = []
+
+        for i in range(section_count):
+            _, kind, _, address, offset, size = struct.unpack_from(
+                "<IIIIII", self.data, section_offset + i * section_size)
+
+            if kind == 1 and address != 0:  # SHT_PROGBITS, loaded.
+                self.sections.append((address, offset, size))
+
+    def string_at(self, address):
+        for section_address, offset, size in self.sections:
+            if section_address <= address < section_address + size:
+                start = offset + address - section_address
+                end = self.data.index(b"\0", start)
+                return self.data[start:end].decode("utf-8", "replace")
+
+        return None
+
+
+def render(format_string, arguments):
+    """Formats `format_string` with the raw `arguments` of a record, the way printf would."""
+    position = 0
+    missing = False
+
+    def take(size):
+        nonlocal position, missing
+
+        if position + size > len(arguments):
+            missing = True
+            return None
+
+        value = arguments[position:position + size]
+        position += size
+        return value
+
+    def take_int32():
+        value = take(4)
+        return None if value is None else struct.unpack("<i", value)[0]
+
+    def convert(match):
+        flags, width, precision, length, conversion = match.groups()
+
+        if conversion == "%":
+            return "%"
+
+        if width == "*":
+            width = take_int32()
+
+        if precision == "*":
+            precision = take_int32()
+
+        if conversion in "diuxXoc":
+            if length in ("ll", "j"):
+                raw = take(8)
+                value = None if raw is None else struct.unpack("<q", raw)[0]
+            else:
+                value = take_int32()
+
+            if value is not None and conversion in "uxXo":
+                value &= 0xFFFFFFFFFFFFFFFF if length in ("ll", "j") else 0xFFFFFFFF
+        elif conversion in "fFeEgGaA":
+            raw = take(8)
+            value = None if raw is None else struct.unpack("<d", raw)[0]
+            conversion = {"a": "e", "A": "E", "F": "f"}.get(conversion, conversion)
+        elif conversion == "s":
+            size = take(1)
+            raw = None if size is None else take(size[0])
+            value = None if raw is None else raw.decode("utf-8", "replace")
+            precision = None
+        else:  # %p
+            value = take_int32()
+            return "<missing>" if value is None else "0x%08x" % (value & 0xFFFFFFFF)
+
+        if value is None:
+            return "<missing>"
+
+        specification = "%" + flags
+        specification += "" if width is None else str(width)
+        specification += "" if precision in (None, "") else "." + str(precision)
+        return (specification + ("d" if conversion in "iu" else conversion)) % value
+
+    text = CONVERSION.sub(convert, format_string)
+    return text + (" <truncated>" if missing else "")
+
+
+def decode(elf, log, output):
+    offset = 0
+
+    while offset + HEADER.size <= len(log):
+        marker, level, arguments_size, timestamp, format_address = HEADER.unpack_from(log, offset)
+
+        if marker != RECORD_MARKER:
+            # Torn record, resync on the next marker.
+            offset += 1
+            continue
+
+        arguments = log[offset + HEADER.size:offset + HEADER.size + arguments_size]
+        offset += HEADER.size + arguments_size
+
+        format_string = elf.string_at(format_address)
+        time = datetime.datetime.fromtimestamp(timestamp, datetime.timezone.utc)
+
+        if format_string is None:
+            text = "<unknown format 0x%08x, wrong ELF file?>" % format_address
+        else:
+            text = render(format_string, arguments)
+
+            if level & TRUNCATED and not text.endswith("<truncated>"):
+                text += " <truncated>"
+
+        output.write("%s [%s] %s\n" % (
+            time.strftime("%Y/%m/%d %H:%M:%S"), LEVELS.get(level & ~TRUNCATED, "?"), text))
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write("usage: %s FIRMWARE_ELF TOKENIZED_LOG\n" % sys.argv[0])
+        return 1
+
+    with open(sys.argv[2], "rb") as log:
+        decode(ElfStrings(sys.argv[1]), log.read(), sys.stdout)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
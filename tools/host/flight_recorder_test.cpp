@@ -0,0 +1,202 @@
+/*
+ * Checks the flight recorder (src/flightRecorder.h) built for a host, where the retained memory is
+ * emulated with FLIGHT_RECORDER_HOST_FILE: a run records events and crashes, and the next run must
+ * get them back from the file as its report, oldest first, and dump them.
+ *
+ * Each run is a child process, so nothing but the file survives from one to the next:
+ * 1. First boot (no file): no report. Records more events than the ring holds, then aborts.
+ * 2. Must report the last FLIGHT_RECORDER_ENTRY_COUNT events of run 1. Records a few, then exits.
+ * 3. Must report its own boot event and the few events of run 2, with the boot count of run 2.
+ * 4. After the file is overwritten with garbage, as RTC memory after a power cut: no report.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/flight_recorder_test tools/host/flight_recorder_test.cpp \
+ *         Azure_IoT_Central_ESP32/src/flightRecorder.cpp
+ *     /tmp/flight_recorder_test
+ *
+ * Exits with 0 if every check passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "../../Azure_IoT_Central_ESP32/src/flightRecorder.h"
+
+#define FIRST_RUN_EVENT_COUNT (FLIGHT_RECORDER_ENTRY_COUNT * 3 / 2)
+#define SECOND_RUN_EVENT_COUNT 5
+
+/*
+ * @brief    Runs `run` in a child process, as a boot of the gateway. Returns its exit code, or -1
+ *           if it crashed.
+ */
+static int boot(int (*run)())
+{
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  pid = fork();
+
+  if (pid == 0)
+  {
+    // The trace dumped by `flight_recorder_init` is printed to the standard output.
+    int result = run();
+
+    fflush(stdout);
+    _exit(result);
+  }
+
+  if (pid < 0 || waitpid(pid, &status, 0) != pid)
+  {
+    return 1;
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool is_entry(
+    const flight_recorder_entry_t* entry,
+    flight_recorder_event_t event,
+    uint8_t a,
+    uint16_t b,
+    int32_t value)
+{
+  return entry->event == event && entry->a == a && entry->b == b && entry->value == value;
+}
+
+static int first_run()
+{
+  flight_recorder_init();
+
+  if (flight_recorder_get_report() != NULL)
+  {
+    fprintf(stderr, "FAILED: a report on the first boot.\n");
+    return 1;
+  }
+
+  for (int32_t i = 0; i < FIRST_RUN_EVENT_COUNT; i++)
+  {
+    flight_recorder_record(flight_recorder_event_modbus_read, 1, 2, i);
+  }
+
+  fflush(stdout);
+  abort();
+}
+
+static int second_run()
+{
+  const flight_recorder_report_t* report;
+
+  flight_recorder_init();
+  report = flight_recorder_get_report();
+
+  if (report == NULL || report->entry_count != FLIGHT_RECORDER_ENTRY_COUNT
+      || report->boot_count != 1)
+  {
+    fprintf(stderr, "FAILED: no report, or not of the whole ring of boot 1.\n");
+    return 1;
+  }
+
+  // The boot event and the first events were overwritten, the last ones must be there in order.
+  for (uint32_t i = 0; i < report->entry_count; i++)
+  {
+    int32_t expected = FIRST_RUN_EVENT_COUNT - FLIGHT_RECORDER_ENTRY_COUNT + (int32_t)i;
+
+    if (!is_entry(&report->entries[i], flight_recorder_event_modbus_read, 1, 2, expected))
+    {
+      fprintf(stderr, "FAILED: entry %u is not Modbus read %d.\n", i, expected);
+      return 1;
+    }
+  }
+
+  flight_recorder_clear_report();
+
+  if (flight_recorder_get_report() != NULL)
+  {
+    fprintf(stderr, "FAILED: a report once cleared.\n");
+    return 1;
+  }
+
+  for (int32_t i = 0; i < SECOND_RUN_EVENT_COUNT; i++)
+  {
+    flight_recorder_record(flight_recorder_event_telemetry_publish, 1, 100, i);
+  }
+
+  return 0;
+}
+
+static int third_run()
+{
+  const flight_recorder_report_t* report;
+
+  flight_recorder_init();
+  report = flight_recorder_get_report();
+
+  if (report == NULL || report->entry_count != SECOND_RUN_EVENT_COUNT + 1
+      || report->boot_count != 2
+      || !is_entry(&report->entries[0], flight_recorder_event_boot, 0, 0, 2))
+  {
+    fprintf(stderr, "FAILED: no report of boot 2, or not starting with its boot event.\n");
+    return 1;
+  }
+
+  for (uint32_t i = 1; i < report->entry_count; i++)
+  {
+    if (!is_entry(
+            &report->entries[i], flight_recorder_event_telemetry_publish, 1, 100, (int32_t)i - 1))
+    {
+      fprintf(stderr, "FAILED: entry %u is not publish %u.\n", i, i - 1);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int run_after_power_cut()
+{
+  flight_recorder_init();
+
+  if (flight_recorder_get_report() != NULL)
+  {
+    fprintf(stderr, "FAILED: a report after a power cut.\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int main()
+{
+  char root[] = "/tmp/flight_recorder_test_XXXXXX";
+  int failure_count = 0;
+  FILE* file;
+
+  if (mkdtemp(root) == NULL || chdir(root) != 0)
+  {
+    perror(root);
+    return 1;
+  }
+
+  failure_count += boot(first_run) == -1 ? 0 : 1;
+  failure_count += boot(second_run) == 0 ? 0 : 1;
+  failure_count += boot(third_run) == 0 ? 0 : 1;
+
+  if ((file = fopen(FLIGHT_RECORDER_HOST_FILE, "r+b")) != NULL)
+  {
+    fputs("power cut", file);
+    fclose(file);
+  }
+
+  failure_count += boot(run_after_power_cut) == 0 ? 0 : 1;
+
+  (void)system((std::string("rm -rf ") + root).c_str());
+
+  printf("flight recorder: %d failures.\n", failure_count);
+
+  return failure_count == 0 ? 0 : 1;
+}
@@ -0,0 +1,434 @@
+/*
+ * Measures the historian (src/historian.h) on a card backed by a host directory: the compression
+ * ratio of each field group and the ingest rate of `historian_append`, with the SD card operations
+ * it takes.
+ *
+ * Samples come from recorded meter data, in the CSV that tools/decode_historian.py writes for the
+ * historian field files of a device (every field file decoded into the same CSV, the last value of
+ * each field carried over to the timestamps where it was not recorded), or from a synthetic meter:
+ * values drifting around plant-like levels and energy counters that only go up, one sample every
+ * TELEMETRY_FREQUENCY_IN_SECONDS. Every field is then queried back, and must return each sample
+ * appended, bit for bit, and the same sample count and sum when summarized by the hour.
+ *
+ * The compression ratio is against raw samples (a 4-byte timestamp and a 4-byte float, as
+ * decode_historian.py reports it) and only counts the blocks written to the card, headers
+ * included; the blocks still being filled in RAM are left out.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/historian_benchmark tools/host/historian_benchmark.cpp \
+ *         Azure_IoT_Central_ESP32/src/historian.cpp Azure_IoT_Central_ESP32/src/crc32.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryFields.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryGlobalVariables.cpp
+ *     /tmp/historian_benchmark [samples | historian.csv]
+ *
+ * Defaults: 43200 synthetic samples (a day). Exits with 0 if every query returned what was
+ * appended.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/historian.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryFields.h"
+
+// As in iot_configs.h.
+#define TELEMETRY_FREQUENCY_IN_SECONDS 2
+
+#define SYNTHETIC_START_TIME 1709251200 // 2024-03-01T00:00:00Z
+#define SECONDS_IN_AN_HOUR 3600
+
+// A timestamp and a float.
+#define RAW_SAMPLE_SIZE 8
+
+typedef struct meter_sample_t_struct
+{
+  uint32_t timestamp;
+  std::vector<float> values;
+} meter_sample_t;
+
+static double get_time_in_us()
+{
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint32_t float_to_bits(float value)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static bool read_recorded_samples(const char* path, std::vector<meter_sample_t>* samples)
+{
+  std::map<time_t, std::map<int, float>> points;
+  std::vector<float> values(TELEMETRY_FIELD_COUNT, 0);
+  FILE* file = fopen(path, "r");
+  char line[128];
+
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    int field;
+    struct tm date;
+    float value;
+
+    memset(&date, 0, sizeof(date));
+
+    if (sscanf(
+            line,
+            "%d,%d-%d-%dT%d:%d:%dZ,%f",
+            &field,
+            &date.tm_year,
+            &date.tm_mon,
+            &date.tm_mday,
+            &date.tm_hour,
+            &date.tm_min,
+            &date.tm_sec,
+            &value)
+            != 8
+        || field < 0 || field >= TELEMETRY_FIELD_COUNT)
+    {
+      continue;
+    }
+
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    points[timegm(&date)][field] = value;
+  }
+
+  fclose(file);
+
+  for (const auto& point : points)
+  {
+    for (const auto& field : point.second)
+    {
+      values[field.first] = field.second;
+    }
+
+    samples->push_back({ (uint32_t)point.first, values });
+  }
+
+  return !samples->empty();
+}
+
+static void generate_synthetic_samples(uint32_t count, std::vector<meter_sample_t>* samples)
+{
+  std::vector<float> values(TELEMETRY_FIELD_COUNT);
+  std::vector<float> levels(TELEMETRY_FIELD_COUNT);
+
+  for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    switch (telemetry_fields[i].group)
+    {
+      case TELEMETRY_FIELD_GROUP_BASIC:
+        levels[i] = 10.0f + (float)(esp_random() % 400);
+        break;
+      case TELEMETRY_FIELD_GROUP_POWER_QUALITY:
+        levels[i] = 1.0f + (float)(esp_random() % 8);
+        break;
+      default:
+        levels[i] = (float)(esp_random() % 100000);
+        break;
+    }
+
+    values[i] = levels[i];
+  }
+
+  for (uint32_t sample = 0; sample < count; sample++)
+  {
+    for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+    {
+      float noise = ((int32_t)(esp_random() % 2001) - 1000) / 1000.0f;
+      float scale = powf(10, telemetry_fields[i].decimal_places);
+
+      if (telemetry_fields[i].group == TELEMETRY_FIELD_GROUP_ENERGY)
+      {
+        // Counters.
+        values[i] += 0.01f + 0.01f * fabsf(noise);
+      }
+      else
+      {
+        // Drifts around its level, about 1% a sample.
+        values[i] += levels[i] * 0.01f * noise + (levels[i] - values[i]) * 0.1f;
+      }
+
+      // Read from the meter registers with the decimal places of the field.
+      values[i] = roundf(values[i] * scale) / scale;
+    }
+
+    samples->push_back({ SYNTHETIC_START_TIME + sample * TELEMETRY_FREQUENCY_IN_SECONDS, values });
+  }
+}
+
+/*
+ * Adds up the samples and bytes of the blocks written to the card for each field group.
+ */
+static void print_compression(const std::string& root)
+{
+  std::map<uint8_t, uint64_t> group_samples;
+  std::map<uint8_t, uint64_t> group_blocks;
+  std::map<uint8_t, uint64_t> group_payload_bits;
+  uint64_t total_samples = 0;
+  uint64_t total_blocks = 0;
+
+  for (const auto& entry : std::filesystem::recursive_directory_iterator(root + "/historian"))
+  {
+    if (!entry.is_regular_file())
+    {
+      continue;
+    }
+
+    FILE* file = fopen(entry.path().c_str(), "rb");
+    historian_block_header_t header;
+
+    if (file == NULL)
+    {
+      continue;
+    }
+
+    for (long offset = 0; fseek(file, offset, SEEK_SET) == 0
+         && fread(&header, sizeof(header), 1, file) == 1;
+         offset += HISTORIAN_BLOCK_SIZE)
+    {
+      if (header.field >= TELEMETRY_FIELD_COUNT)
+      {
+        continue;
+      }
+
+      uint8_t group = telemetry_fields[header.field].group;
+
+      group_samples[group] += header.sample_count;
+      group_blocks[group]++;
+      group_payload_bits[group] += header.bit_count;
+      total_samples += header.sample_count;
+      total_blocks++;
+    }
+
+    fclose(file);
+  }
+
+  for (const auto& group : group_blocks)
+  {
+    char names[TELEMETRY_FIELD_GROUPS_STRING_MAX_SIZE];
+    az_span names_span;
+    uint64_t samples = group_samples[group.first];
+    uint64_t bytes = group.second * HISTORIAN_BLOCK_SIZE;
+
+    if (telemetry_field_groups_to_string(group.first, AZ_SPAN_FROM_BUFFER(names), &names_span)
+        != 0)
+    {
+      names_span = AZ_SPAN_FROM_STR("?");
+    }
+
+    printf(
+        "  %-13.*s %7lu samples in %5lu blocks: %.2f bytes per sample (%.1fx raw), %.2f bits "
+        "per sample compressed, blocks %.0f%% full\n",
+        (int)az_span_size(names_span),
+        (char*)az_span_ptr(names_span),
+        (unsigned long)samples,
+        (unsigned long)group.second,
+        samples > 0 ? (double)bytes / samples : 0.0,
+        bytes > 0 ? (double)samples * RAW_SAMPLE_SIZE / bytes : 0.0,
+        samples > 0 ? (double)group_payload_bits[group.first] / samples : 0.0,
+        100.0 * group_payload_bits[group.first] / 8
+            / (group.second * HISTORIAN_BLOCK_PAYLOAD_SIZE));
+  }
+
+  printf(
+      "  all           %7lu samples in %5lu blocks: %.2f bytes per sample (%.1fx raw)\n",
+      (unsigned long)total_samples,
+      (unsigned long)total_blocks,
+      total_samples > 0 ? (double)total_blocks * HISTORIAN_BLOCK_SIZE / total_samples : 0.0,
+      total_blocks > 0
+          ? (double)total_samples * RAW_SAMPLE_SIZE / (total_blocks * HISTORIAN_BLOCK_SIZE)
+          : 0.0);
+}
+
+/*
+ * Queries a field over the whole range, sample by sample and then by the hour, against the samples
+ * appended.
+ */
+static bool check_field(uint8_t field, const std::vector<meter_sample_t>& samples)
+{
+  historian_query_t query;
+  historian_point_t point;
+  size_t index = 0;
+  uint64_t hourly_count = 0;
+  double hourly_sum = 0;
+  double sum = 0;
+  time_t from = samples.front().timestamp;
+  time_t to = samples.back().timestamp;
+
+  if (historian_query_begin(&query, field, from, to, 0) != 0)
+  {
+    return false;
+  }
+
+  while (historian_query_next(&query, &point) == 0)
+  {
+    if (index >= samples.size() || point.first_timestamp != samples[index].timestamp
+        || float_to_bits(point.min) != float_to_bits(samples[index].values[field]))
+    {
+      printf(
+          "  FAILED: field %u, sample %zu is %u %f instead of %u %f.\n",
+          field,
+          index,
+          point.first_timestamp,
+          point.min,
+          index < samples.size() ? samples[index].timestamp : 0,
+          index < samples.size() ? samples[index].values[field] : 0.0f);
+      historian_query_end(&query);
+      return false;
+    }
+
+    sum += point.sum;
+    index++;
+  }
+
+  if (index != samples.size())
+  {
+    printf("  FAILED: field %u returned %zu of %zu samples.\n", field, index, samples.size());
+    return false;
+  }
+
+  if (historian_query_begin(&query, field, from, to, SECONDS_IN_AN_HOUR) != 0)
+  {
+    return false;
+  }
+
+  while (historian_query_next(&query, &point) == 0)
+  {
+    hourly_count += point.count;
+    hourly_sum += point.sum;
+  }
+
+  if (hourly_count != samples.size() || fabs(hourly_sum - sum) > fabs(sum) * 1e-5 + 1e-3)
+  {
+    printf(
+        "  FAILED: field %u summarized by the hour is %lu samples, sum %f, instead of %zu, %f.\n",
+        field,
+        (unsigned long)hourly_count,
+        hourly_sum,
+        samples.size(),
+        sum);
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  const char* source = argc > 1 ? argv[1] : "43200";
+  bool is_recorded = strspn(source, "0123456789") != strlen(source);
+  std::vector<meter_sample_t> samples;
+  std::vector<double> latencies;
+  char root[] = "/tmp/historian_benchmark_XXXXXX";
+  HostSdStats before;
+  double total = 0;
+  uint32_t append_failure_count = 0;
+  uint32_t field_failure_count = 0;
+
+  if (!is_recorded)
+  {
+    generate_synthetic_samples((uint32_t)atol(source), &samples);
+  }
+  else if (!read_recorded_samples(source, &samples))
+  {
+    fprintf(stderr, "No samples in %s.\n", source);
+    return 1;
+  }
+
+  if (mkdtemp(root) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  host_sd_root = root;
+
+  if (historian_init() != 0)
+  {
+    return 1;
+  }
+
+  before = host_sd_stats;
+
+  for (const meter_sample_t& sample : samples)
+  {
+    for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+    {
+      *telemetry_fields[i].value = sample.values[i];
+    }
+
+    double start = get_time_in_us();
+
+    if (historian_append(sample.timestamp, TELEMETRY_FIELD_GROUP_ALL) != 0)
+    {
+      printf("Failed appending the sample at %u.\n", sample.timestamp);
+      append_failure_count++;
+    }
+
+    latencies.push_back(get_time_in_us() - start);
+    total += latencies.back();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  printf(
+      "%s: %zu samples of %u fields, %.1f hours\n",
+      is_recorded ? source : "synthetic meter",
+      samples.size(),
+      (uint32_t)TELEMETRY_FIELD_COUNT,
+      (samples.back().timestamp - samples.front().timestamp) / (double)SECONDS_IN_AN_HOUR);
+  printf(
+      "ingest: latency avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us, %.0f field samples/s\n",
+      total / latencies.size(),
+      latencies[latencies.size() / 2],
+      latencies[latencies.size() * 99 / 100],
+      latencies.back(),
+      total > 0 ? latencies.size() * (double)TELEMETRY_FIELD_COUNT * 1e6 / total : 0.0);
+  printf(
+      "  SD per 1000 appends: %.1f opens, %.1f writes (%.0f bytes), %.1f flushes\n",
+      (host_sd_stats.open_count - before.open_count) * 1000.0 / samples.size(),
+      (host_sd_stats.write_count - before.write_count) * 1000.0 / samples.size(),
+      (host_sd_stats.write_bytes - before.write_bytes) * 1000.0 / samples.size(),
+      (host_sd_stats.flush_count - before.flush_count) * 1000.0 / samples.size());
+  printf("compression (blocks written to the card):\n");
+  print_compression(root);
+
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+  {
+    field_failure_count += check_field(field, samples) ? 0 : 1;
+  }
+
+  printf(
+      "query: %u of %u fields returned every sample appended.\n",
+      TELEMETRY_FIELD_COUNT - field_failure_count,
+      (uint32_t)TELEMETRY_FIELD_COUNT);
+
+  (void)system((std::string("rm -rf ") + root).c_str());
+
+  return append_failure_count == 0 && field_failure_count == 0 ? 0 : 1;
+}
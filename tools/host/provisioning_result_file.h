@@ -0,0 +1,136 @@
+/*
+ * A stand-in, backed by a host file, for the NVS functions that keep the device-provisioning result
+ * in Azure_IoT_Central_ESP32.ino (`load_provisioning_result` and `save_provisioning_result`). They
+ * have the signatures of `provisioning_result_load_function_t` and
+ * `provisioning_result_save_function_t` (AzureIoT.h), and behave as the NVS ones do:
+ *
+ * - The result is kept along with the ID scope and registration ID it was provisioned with
+ *   (`host_dps_id_scope` and `host_registration_id`, DPS_ID_SCOPE and IOT_CONFIG_DEVICE_ID in the
+ *   sketch), and is not loaded once those change.
+ * - Saving empty spans erases it.
+ * - Loading fails, instead of truncating, when a value does not fit in the span given.
+ *
+ * The file ("idScope\nregistrationId\niotHubFqdn\ndeviceId\n") is written to a temporary file and
+ * renamed over the previous one, so a reset while saving leaves either result, as an NVS commit.
+ */
+
+#ifndef PROVISIONING_RESULT_FILE_H
+#define PROVISIONING_RESULT_FILE_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include <az_core.h>
+
+inline std::string host_provisioning_result_path = "/tmp/host_provisioning_result.txt";
+inline std::string host_dps_id_scope = "0ne00000000";
+inline std::string host_registration_id = "device-1";
+
+#define HOST_PROVISIONING_RESULT_LINE_COUNT 4
+#define HOST_PROVISIONING_RESULT_LINE_MAX_SIZE 256
+
+/*
+ * @brief    Reads a line without its line end. Fails if there is none or it is too long.
+ */
+inline bool host_read_provisioning_result_line(FILE* file, std::string* line)
+{
+  char buffer[HOST_PROVISIONING_RESULT_LINE_MAX_SIZE];
+  size_t length;
+
+  if (fgets(buffer, sizeof(buffer), file) == NULL)
+  {
+    return false;
+  }
+
+  length = strlen(buffer);
+
+  if (length == 0 || buffer[length - 1] != '\n')
+  {
+    return false;
+  }
+
+  line->assign(buffer, length - 1);
+  return true;
+}
+
+/*
+ * @brief    Copies `value` to the start of `*span` and narrows `*span` to it.
+ */
+inline void host_copy_provisioning_result_value(const std::string& value, az_span* span)
+{
+  memcpy(az_span_ptr(*span), value.data(), value.size());
+  *span = az_span_slice(*span, 0, (int32_t)value.size());
+}
+
+inline int host_load_provisioning_result(az_span* iot_hub_fqdn, az_span* device_id)
+{
+  std::string lines[HOST_PROVISIONING_RESULT_LINE_COUNT];
+  FILE* file = fopen(host_provisioning_result_path.c_str(), "r");
+  bool is_loaded = file != NULL;
+
+  for (int i = 0; is_loaded && i < HOST_PROVISIONING_RESULT_LINE_COUNT; i++)
+  {
+    is_loaded = host_read_provisioning_result_line(file, &lines[i]);
+  }
+
+  if (file != NULL)
+  {
+    fclose(file);
+  }
+
+  if (!is_loaded || lines[0] != host_dps_id_scope || lines[1] != host_registration_id)
+  {
+    return 1;
+  }
+
+  // Both are checked before either is copied, so a failure leaves the spans as they were given.
+  if (lines[2].empty() || lines[2].size() > (size_t)az_span_size(*iot_hub_fqdn)
+      || lines[3].empty() || lines[3].size() > (size_t)az_span_size(*device_id))
+  {
+    return 1;
+  }
+
+  host_copy_provisioning_result_value(lines[2], iot_hub_fqdn);
+  host_copy_provisioning_result_value(lines[3], device_id);
+
+  return 0;
+}
+
+inline int host_save_provisioning_result(az_span iot_hub_fqdn, az_span device_id)
+{
+  std::string temporary_path = host_provisioning_result_path + ".tmp";
+  FILE* file;
+  bool is_saved;
+
+  if (az_span_size(iot_hub_fqdn) == 0 || az_span_size(device_id) == 0)
+  {
+    return remove(host_provisioning_result_path.c_str()) == 0 || errno == ENOENT ? 0 : 1;
+  }
+
+  if ((file = fopen(temporary_path.c_str(), "w")) == NULL)
+  {
+    return 1;
+  }
+
+  is_saved = fprintf(
+                 file,
+                 "%s\n%s\n%.*s\n%.*s\n",
+                 host_dps_id_scope.c_str(),
+                 host_registration_id.c_str(),
+                 (int)az_span_size(iot_hub_fqdn),
+                 (const char*)az_span_ptr(iot_hub_fqdn),
+                 (int)az_span_size(device_id),
+                 (const char*)az_span_ptr(device_id))
+          > 0
+      && fflush(file) == 0;
+  is_saved = fclose(file) == 0 && is_saved;
+
+  return is_saved && rename(temporary_path.c_str(), host_provisioning_result_path.c_str()) == 0
+      ? 0
+      : 1;
+}
+
+#endif // PROVISIONING_RESULT_FILE_H
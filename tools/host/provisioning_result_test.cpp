@@ -0,0 +1,155 @@
+/*
+ * Checks the file-backed stand-in of the device-provisioning result cache
+ * (tools/host/provisioning_result_file.h) through the boots Azure IoT client goes through with
+ * PROVISIONING_RESULT_CACHE_ENABLED: nothing saved on the first boot, the hub saved once
+ * device-provisioning completes, loaded on the next boots, erased once the hub refuses the device,
+ * and discarded when the ID scope or registration ID change. Results cut short, or too long for
+ * the buffers of Azure IoT client, must not load.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/provisioning_result_test tools/host/provisioning_result_test.cpp
+ *     /tmp/provisioning_result_test
+ *
+ * Exits with 0 if every check passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include <az_core.h>
+
+#include "provisioning_result_file.h"
+
+// As in AzureIoT.cpp.
+#define PROVISIONING_RESULT_FIELD_MAX_SIZE 128
+
+#define IOT_HUB_FQDN "iotc-1a430cf3-6f05-4b84-965d-cb1385077966.azure-devices.net"
+#define OTHER_IOT_HUB_FQDN "iotc-7e2a1f5c-95b4-4c0e-8a0d-2b9d7e6f3c11.azure-devices.net"
+#define DEVICE_ID "device-1"
+
+static uint32_t failure_count = 0;
+
+#define CHECK(condition, ...)                  \
+  do                                           \
+  {                                            \
+    if (!(condition))                          \
+    {                                          \
+      failure_count++;                         \
+      fprintf(stderr, "FAILED: " __VA_ARGS__); \
+      fputc('\n', stderr);                     \
+    }                                          \
+  } while (0)
+
+// The signatures of provisioning_result_load_function_t and provisioning_result_save_function_t.
+static int (*const load)(az_span*, az_span*) = host_load_provisioning_result;
+static int (*const save)(az_span, az_span) = host_save_provisioning_result;
+
+/*
+ * @brief    Loads into buffers as large as those of Azure IoT client (or `buffer_size`), as on
+ *           boot. Returns the "fqdn device-id" loaded, or an empty string if nothing was.
+ */
+static std::string boot(int32_t buffer_size = PROVISIONING_RESULT_FIELD_MAX_SIZE)
+{
+  uint8_t iot_hub_fqdn_buffer[PROVISIONING_RESULT_FIELD_MAX_SIZE];
+  uint8_t device_id_buffer[PROVISIONING_RESULT_FIELD_MAX_SIZE];
+  az_span iot_hub_fqdn = az_span_create(iot_hub_fqdn_buffer, buffer_size);
+  az_span device_id = az_span_create(device_id_buffer, buffer_size);
+
+  if (load(&iot_hub_fqdn, &device_id) != 0)
+  {
+    CHECK(
+        az_span_size(iot_hub_fqdn) == buffer_size && az_span_size(device_id) == buffer_size,
+        "a failed load changed the spans.");
+    return "";
+  }
+
+  return std::string((char*)az_span_ptr(iot_hub_fqdn), az_span_size(iot_hub_fqdn)) + " "
+      + std::string((char*)az_span_ptr(device_id), az_span_size(device_id));
+}
+
+static void write_file(const std::string& path, const char* content)
+{
+  FILE* file = fopen(path.c_str(), "w");
+
+  if (file != NULL)
+  {
+    fputs(content, file);
+    fclose(file);
+  }
+}
+
+int main()
+{
+  char root[] = "/tmp/provisioning_result_test_XXXXXX";
+  std::string result;
+
+  if (mkdtemp(root) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  host_provisioning_result_path = std::string(root) + "/provisioning.txt";
+
+  // First boot, nothing saved: device-provisioning.
+  CHECK(boot() == "", "something loaded before anything was saved.");
+
+  // Device-provisioning completed.
+  CHECK(save(AZ_SPAN_FROM_STR(IOT_HUB_FQDN), AZ_SPAN_FROM_STR(DEVICE_ID)) == 0, "save failed.");
+
+  // Next boots go straight to the hub.
+  for (int i = 0; i < 3; i++)
+  {
+    result = boot();
+    CHECK(result == IOT_HUB_FQDN " " DEVICE_ID, "boot %d loaded \"%s\".", i, result.c_str());
+  }
+
+  // The result does not fit: not loaded, rather than loaded truncated.
+  CHECK(boot(16) == "", "a result longer than the buffers loaded.");
+
+  // A temporary file left by a reset while saving another hub is ignored.
+  write_file(host_provisioning_result_path + ".tmp", "0ne00000000\ndevice-1\niotc-7e2a");
+  result = boot();
+  CHECK(
+      result == IOT_HUB_FQDN " " DEVICE_ID,
+      "loaded \"%s\" after a reset while saving.",
+      result.c_str());
+
+  // Saving another hub replaces the result.
+  CHECK(
+      save(AZ_SPAN_FROM_STR(OTHER_IOT_HUB_FQDN), AZ_SPAN_FROM_STR(DEVICE_ID)) == 0,
+      "save of another hub failed.");
+  result = boot();
+  CHECK(result == OTHER_IOT_HUB_FQDN " " DEVICE_ID, "loaded \"%s\".", result.c_str());
+
+  // The hub refused the device: erased, device-provisioning on the next boot.
+  CHECK(save(AZ_SPAN_EMPTY, AZ_SPAN_EMPTY) == 0, "erase failed.");
+  CHECK(boot() == "", "loaded after being erased.");
+  CHECK(save(AZ_SPAN_EMPTY, AZ_SPAN_EMPTY) == 0, "erasing nothing failed.");
+
+  // A result provisioned with another ID scope or registration ID is not used.
+  CHECK(save(AZ_SPAN_FROM_STR(IOT_HUB_FQDN), AZ_SPAN_FROM_STR(DEVICE_ID)) == 0, "save failed.");
+  host_dps_id_scope = "0ne11111111";
+  CHECK(boot() == "", "loaded for another ID scope.");
+  host_dps_id_scope = "0ne00000000";
+  host_registration_id = "device-2";
+  CHECK(boot() == "", "loaded for another registration ID.");
+  host_registration_id = "device-1";
+  CHECK(boot() != "", "not loaded once the ID scope and registration ID are back.");
+
+  // Files cut short (as a save without the temporary file would leave them) or with an empty
+  // value.
+  write_file(host_provisioning_result_path, "0ne00000000\ndevice-1\n" IOT_HUB_FQDN "\ndevice-1");
+  CHECK(boot() == "", "a file without its last line end loaded.");
+  write_file(host_provisioning_result_path, "0ne00000000\ndevice-1\n\ndevice-1\n");
+  CHECK(boot() == "", "a file with an empty hub loaded.");
+
+  (void)system((std::string("rm -rf ") + root).c_str());
+
+  printf("provisioning result file: %u failures.\n", failure_count);
+
+  return failure_count == 0 ? 0 : 1;
+}
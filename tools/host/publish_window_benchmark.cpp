@@ -0,0 +1,117 @@
+/*
+ * Measures how fast a backlog of QoS 1 telemetry drains for a given PUBLISH_WINDOW_SIZE (see
+ * Azure_IoT_Central_ESP32/src/publishWindow.h), against a broker stand-in: a link of a given
+ * bandwidth and round trip time, which loses a given fraction of the PUBACKs.
+ *
+ * The loop of forward_queued_telemetry (Azure_IoT_PnP_Template.cpp) runs on a simulated clock, one
+ * pass per millisecond: release what was acknowledged, send the window again once its oldest
+ * PUBACK is overdue, then publish until the window is full.
+ *
+ *     for size in 1 2 4 8 16; do
+ *       g++ -std=c++17 -O2 -DPUBLISH_WINDOW_SIZE=$size -Itools/host/stubs \
+ *           -include tools/host/stubs/host.h -o /tmp/window_$size \
+ *           tools/host/publish_window_benchmark.cpp Azure_IoT_Central_ESP32/src/publishWindow.cpp
+ *       /tmp/window_$size [messages] [message_bytes] [rtt_ms] [kbit_per_s] [puback_loss_percent]
+ *     done
+ *
+ * Defaults: 2000 messages of 3840 bytes, 300 ms round trip, 1000 kbit/s, no PUBACK lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <deque>
+
+#include <Arduino.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/publishWindow.h"
+
+// As in iot_configs.h.
+#define TELEMETRY_PUBACK_TIMEOUT_IN_MS 30000
+
+// Gives up if the backlog is not drained in this much simulated time.
+#define SIMULATION_LIMIT_IN_MS (24UL * 3600UL * 1000UL)
+
+typedef struct puback_t_struct
+{
+  unsigned long arrival_time;
+  int packet_id;
+} puback_t;
+
+int main(int argc, char** argv)
+{
+  uint32_t message_count = argc > 1 ? (uint32_t)atol(argv[1]) : 2000;
+  uint32_t message_size = argc > 2 ? (uint32_t)atol(argv[2]) : 3840;
+  unsigned long round_trip_ms = argc > 3 ? (unsigned long)atol(argv[3]) : 300;
+  double bytes_per_ms = (argc > 4 ? atof(argv[4]) : 1000.0) / 8.0;
+  uint32_t loss_percent = argc > 5 ? (uint32_t)atol(argv[5]) : 0;
+
+  std::deque<puback_t> pubacks;
+  uint32_t released = 0; // Messages released from the queue, i.e. delivered.
+  uint32_t next_message = 0; // Like the queue read offset, in messages.
+  uint32_t published = 0;
+  uint32_t resends = 0;
+  int next_packet_id = 1;
+  double link_free_time = 0; // When the link has sent everything published so far.
+  unsigned long total_delivery_ms = 0;
+
+  host_millis = 1;
+
+  while (released < message_count && host_millis < SIMULATION_LIMIT_IN_MS)
+  {
+    uint32_t queue_end;
+
+    while (!pubacks.empty() && pubacks.front().arrival_time <= host_millis)
+    {
+      publish_window_acknowledge(pubacks.front().packet_id);
+      pubacks.pop_front();
+    }
+
+    if (publish_window_release(&queue_end) == 0)
+    {
+      // Every message of the backlog was queued at time 0.
+      total_delivery_ms += (unsigned long)(queue_end - released) * host_millis;
+      released = queue_end;
+    }
+
+    if (publish_window_get_oldest_age() > TELEMETRY_PUBACK_TIMEOUT_IN_MS)
+    {
+      resends += next_message - released;
+      publish_window_reset();
+      next_message = released;
+    }
+
+    while (!publish_window_is_full() && next_message < message_count)
+    {
+      int packet_id = next_packet_id++;
+
+      link_free_time = (link_free_time > host_millis ? link_free_time : host_millis)
+          + message_size / bytes_per_ms;
+
+      if (esp_random() % 100 >= loss_percent)
+      {
+        pubacks.push_back({ (unsigned long)link_free_time + round_trip_ms, packet_id });
+      }
+
+      next_message++;
+      published++;
+      (void)publish_window_add(packet_id, next_message);
+    }
+
+    host_millis++;
+  }
+
+  printf(
+      "window %2d: %u of %u messages in %.1f s, %lu per minute, delivery avg %lu ms, %u published "
+      "(%u sent again)\n",
+      PUBLISH_WINDOW_SIZE,
+      released,
+      message_count,
+      host_millis / 1000.0,
+      host_millis > 0 ? (unsigned long)((uint64_t)released * 60000UL / host_millis) : 0,
+      released > 0 ? total_delivery_ms / released : 0,
+      published,
+      resends);
+
+  return released == message_count ? 0 : 1;
+}
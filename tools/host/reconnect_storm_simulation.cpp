@@ -0,0 +1,197 @@
+/*
+ * Simulates a fleet of devices reconnecting to Azure IoT with src/reconnectBackoff.h, after an
+ * outage that drops all of them at once, to see how hard they hit the service when it comes back.
+ *
+ * Each device has its own MAC address (so its own phase offset) and follows the loop of
+ * Azure_IoT_Central_ESP32.ino: while disconnected, an attempt whenever the backoff says it is due;
+ * while connected, `reconnect_backoff_set_connected` on every pass. The service refuses every
+ * attempt during the outage, then accepts a given number of connections per second. For a while
+ * after the outage it also drops the connections it accepted after FLAP_CONNECTION_TIME_IN_MS, as
+ * a throttling IoT Hub would. A stable time of 0 gives the attempts starting over after every
+ * connection, however short.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/reconnect_storm_simulation tools/host/reconnect_storm_simulation.cpp \
+ *         Azure_IoT_Central_ESP32/src/reconnectBackoff.cpp
+ *     /tmp/reconnect_storm_simulation [devices] [outage_s] [accepted_per_s] [flapping_s] \
+ *         [stable_time_ms]
+ *
+ * Defaults: 1000 devices, a 10 minute outage, 20 connections accepted per second, connections
+ * dropped for 5 minutes after the outage, and the stable time of the sketch (60 s).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <Arduino.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/reconnectBackoff.h"
+
+// As in Azure_IoT_Central_ESP32.ino.
+#define AZURE_IOT_RECONNECT_BASE_DELAY_IN_MS 2000
+#define AZURE_IOT_RECONNECT_MAX_DELAY_IN_MS (5 * 60 * 1000)
+#define RECONNECT_STABLE_TIME_IN_MS (60 * 1000)
+
+#define PASS_DURATION_IN_MS 100
+#define FLAP_CONNECTION_TIME_IN_MS (10 * 1000)
+
+// Devices were connected this long before the outage.
+#define OUTAGE_START_TIME_IN_MS (60 * 60 * 1000UL)
+
+// Gives up if the fleet is not back this long after the outage.
+#define SIMULATION_LIMIT_IN_MS (6 * 60 * 60 * 1000UL)
+
+typedef struct device_t_struct
+{
+  uint64_t mac;
+  reconnect_backoff_t backoff;
+  bool is_connected;
+  bool is_dropping; // Connected while the service drops connections.
+  unsigned long connected_time;
+} device_t;
+
+int main(int argc, char** argv)
+{
+  uint32_t device_count = argc > 1 ? (uint32_t)atol(argv[1]) : 1000;
+  unsigned long outage_in_ms = (argc > 2 ? (unsigned long)atol(argv[2]) : 600) * 1000UL;
+  uint32_t accepted_per_second = argc > 3 ? (uint32_t)atol(argv[3]) : 20;
+  unsigned long flapping_in_ms = (argc > 4 ? (unsigned long)atol(argv[4]) : 300) * 1000UL;
+  uint32_t stable_time_in_ms = argc > 5 ? (uint32_t)atol(argv[5]) : RECONNECT_STABLE_TIME_IN_MS;
+
+  unsigned long outage_end = OUTAGE_START_TIME_IN_MS + outage_in_ms;
+  unsigned long flapping_end = outage_end + flapping_in_ms;
+  std::vector<device_t> devices(device_count);
+  std::vector<uint32_t> attempts_per_second;
+  uint32_t connected_count = 0;
+  uint32_t attempt_count = 0;
+  uint32_t outage_attempt_count = 0;
+  uint32_t flapping_attempt_count = 0;
+  uint32_t refused_count = 0;
+  uint32_t accepted_this_second = 0;
+  uint32_t peak_attempts_per_second = 0;
+  unsigned long back_time = 0;
+
+  for (device_t& device : devices)
+  {
+    device.mac = ((uint64_t)esp_random() << 16 | (esp_random() & 0xFFFF)) & 0xFFFFFFFFFFFFULL;
+    device.is_connected = false;
+    device.is_dropping = false;
+    host_efuse_mac = device.mac;
+    reconnect_backoff_init(
+        &device.backoff,
+        "Azure IoT",
+        AZURE_IOT_RECONNECT_BASE_DELAY_IN_MS,
+        AZURE_IOT_RECONNECT_MAX_DELAY_IN_MS,
+        stable_time_in_ms);
+  }
+
+  // Every device, connected since the start, drops at the start of the outage.
+  host_millis = OUTAGE_START_TIME_IN_MS;
+
+  while (host_millis < OUTAGE_START_TIME_IN_MS + SIMULATION_LIMIT_IN_MS)
+  {
+    uint32_t second = (uint32_t)((host_millis - OUTAGE_START_TIME_IN_MS) / 1000);
+
+    if (second >= attempts_per_second.size())
+    {
+      attempts_per_second.push_back(0);
+      accepted_this_second = 0;
+    }
+
+    for (device_t& device : devices)
+    {
+      host_efuse_mac = device.mac;
+
+      if (device.is_connected && device.is_dropping
+          && host_millis - device.connected_time >= FLAP_CONNECTION_TIME_IN_MS)
+      {
+        device.is_connected = false;
+        connected_count--;
+      }
+
+      if (device.is_connected)
+      {
+        reconnect_backoff_set_connected(&device.backoff);
+        continue;
+      }
+
+      if (!reconnect_backoff_is_due(&device.backoff))
+      {
+        continue;
+      }
+
+      reconnect_backoff_attempted(&device.backoff);
+      attempt_count++;
+      attempts_per_second[second]++;
+
+      if (host_millis < outage_end)
+      {
+        outage_attempt_count++;
+        continue;
+      }
+
+      if (host_millis < flapping_end)
+      {
+        flapping_attempt_count++;
+      }
+
+      if (accepted_this_second >= accepted_per_second)
+      {
+        refused_count++;
+        continue;
+      }
+
+      accepted_this_second++;
+      device.is_connected = true;
+      device.is_dropping = host_millis < flapping_end;
+      device.connected_time = host_millis;
+      connected_count++;
+      reconnect_backoff_set_connected(&device.backoff);
+    }
+
+    peak_attempts_per_second = max(peak_attempts_per_second, attempts_per_second[second]);
+
+    if (connected_count == device_count && host_millis >= flapping_end + FLAP_CONNECTION_TIME_IN_MS)
+    {
+      back_time = host_millis;
+      break;
+    }
+
+    host_millis += PASS_DURATION_IN_MS;
+  }
+
+  printf(
+      "%u devices, %lu s outage, %u connections accepted per second, %lu s dropping them, stable "
+      "time %u ms:\n",
+      device_count,
+      outage_in_ms / 1000,
+      accepted_per_second,
+      flapping_in_ms / 1000,
+      stable_time_in_ms);
+  printf(
+      "  %u attempts (%u during the outage, %.0f per minute while dropping, %u refused), peak %u "
+      "per second\n",
+      attempt_count,
+      outage_attempt_count,
+      flapping_in_ms > 0 ? flapping_attempt_count * 60000.0 / flapping_in_ms : 0.0,
+      refused_count,
+      peak_attempts_per_second);
+
+  if (back_time == 0)
+  {
+    printf(
+        "  %u of %u devices connected when the simulation gave up.\n",
+        connected_count,
+        device_count);
+    return 1;
+  }
+
+  printf(
+      "  all connected %lu s after the outage (%lu s after the service stopped dropping).\n",
+      (back_time - outage_end) / 1000,
+      (back_time - flapping_end) / 1000);
+
+  return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Measures the sample log (src/sampleLog.h) on a card backed by a host directory: the latency of
+ * each append and the throughput of replays, with the SD card operations each one takes (what
+ * costs time on a real card: every open, seek and flush, and the bytes moved).
+ *
+ * Records are appended as generate_telemetry_payload (Azure_IoT_PnP_Template.cpp) does, one per
+ * TELEMETRY_FREQUENCY_IN_SECONDS of simulated time, then replayed from the start, from the middle
+ * and from the last hour. Replays must return every record still in the log, in order.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/sample_log_benchmark tools/host/sample_log_benchmark.cpp \
+ *         Azure_IoT_Central_ESP32/src/sampleLog.cpp Azure_IoT_Central_ESP32/src/crc32.cpp
+ *     /tmp/sample_log_benchmark [records]
+ *
+ * Defaults: 20000 records (about 5 segments). Building with a small -DSAMPLE_LOG_SEGMENT_COUNT
+ * (e.g. 4) makes the log wrap around. Exits with 0 if every replay was complete.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/sampleLog.h"
+
+// As in iot_configs.h.
+#define TELEMETRY_FREQUENCY_IN_SECONDS 2
+
+#define START_TIME 1709251200 // 2024-03-01T00:00:00Z
+#define SECONDS_IN_AN_HOUR 3600
+
+static double get_time_in_us()
+{
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void print_sd_operations(const char* what, const HostSdStats* before, uint32_t count)
+{
+  double divisor = count > 0 ? count : 1;
+
+  printf(
+      "  SD per %s: %.2f opens, %.2f seeks, %.2f reads (%.0f bytes), %.2f writes (%.0f bytes), "
+      "%.2f flushes\n",
+      what,
+      (host_sd_stats.open_count - before->open_count) / divisor,
+      (host_sd_stats.seek_count - before->seek_count) / divisor,
+      (host_sd_stats.read_count - before->read_count) / divisor,
+      (host_sd_stats.read_bytes - before->read_bytes) / divisor,
+      (host_sd_stats.write_count - before->write_count) / divisor,
+      (host_sd_stats.write_bytes - before->write_bytes) / divisor,
+      (host_sd_stats.flush_count - before->flush_count) / divisor);
+}
+
+/*
+ * Replays from `from` to the end, checking that the records are consecutive up to the last one
+ * appended.
+ */
+static bool replay(const char* name, time_t from, uint32_t expected_first, uint32_t record_count)
+{
+  sample_log_cursor_t cursor;
+  sample_log_record_t record;
+  HostSdStats before = host_sd_stats;
+  double start = get_time_in_us();
+  double first_record_time = 0;
+  uint32_t count = 0;
+  uint32_t next_sequence = expected_first;
+  bool is_in_order = true;
+
+  if (sample_log_replay_begin(&cursor, from) != 0)
+  {
+    printf("replay %s: log empty\n", name);
+    return false;
+  }
+
+  while (sample_log_replay_next(&cursor, &record) == 0)
+  {
+    if (count == 0)
+    {
+      first_record_time = get_time_in_us() - start;
+    }
+
+    is_in_order = is_in_order && record.sequence == next_sequence;
+    next_sequence = record.sequence + 1;
+    count++;
+  }
+
+  double elapsed = get_time_in_us() - start;
+
+  printf(
+      "replay %s: %u records in %.1f ms, %.0f records/s (%.1f MB/s), first record after %.0f us\n",
+      name,
+      count,
+      elapsed / 1000,
+      elapsed > 0 ? count * 1e6 / elapsed : 0.0,
+      elapsed > 0 ? count * (double)SAMPLE_LOG_RECORD_SIZE / elapsed : 0.0,
+      first_record_time);
+  print_sd_operations("record", &before, count);
+
+  if (!is_in_order || count != record_count - expected_first)
+  {
+    printf(
+        "  FAILED: expected records %u to %u in order.\n", expected_first, record_count - 1);
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t record_count = argc > 1 ? (uint32_t)atol(argv[1]) : 20000;
+  uint32_t capacity = SAMPLE_LOG_SEGMENT_COUNT * SAMPLE_LOG_RECORDS_PER_SEGMENT;
+  char root[] = "/tmp/sample_log_benchmark_XXXXXX";
+  std::vector<double> latencies;
+  HostSdStats before;
+  double total = 0;
+  uint32_t oldest;
+  uint32_t middle;
+  uint32_t last_hour;
+  bool is_complete = true;
+
+  if (mkdtemp(root) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  host_sd_root = root;
+
+  if (sample_log_init() != 0)
+  {
+    return 1;
+  }
+
+  before = host_sd_stats;
+
+  for (uint32_t i = 0; i < record_count; i++)
+  {
+    sample_log_record_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = START_TIME + i * TELEMETRY_FREQUENCY_IN_SECONDS;
+    record.sequence = i;
+    record.field_groups = 0x07;
+
+    for (size_t field = 0; field < TELEMETRY_FIELD_COUNT; field++)
+    {
+      record.values[field] = (float)(esp_random() % 100000) / 100.0f;
+    }
+
+    double start = get_time_in_us();
+
+    if (sample_log_append(&record) != 0)
+    {
+      printf("Failed appending record %u.\n", i);
+      is_complete = false;
+      break;
+    }
+
+    latencies.push_back(get_time_in_us() - start);
+    total += latencies.back();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  printf(
+      "append: %zu records (%u segments of %u records), latency avg %.1f us, p50 %.1f us, p99 "
+      "%.1f us, max %.1f us\n",
+      latencies.size(),
+      (uint32_t)SAMPLE_LOG_SEGMENT_COUNT,
+      (uint32_t)SAMPLE_LOG_RECORDS_PER_SEGMENT,
+      latencies.empty() ? 0.0 : total / latencies.size(),
+      latencies.empty() ? 0.0 : latencies[latencies.size() / 2],
+      latencies.empty() ? 0.0 : latencies[latencies.size() * 99 / 100],
+      latencies.empty() ? 0.0 : latencies.back());
+  print_sd_operations("append", &before, (uint32_t)latencies.size());
+
+  // The oldest record still in the ring, whose oldest segment may be partly overwritten.
+  oldest = record_count > capacity
+      ? (record_count - capacity + SAMPLE_LOG_RECORDS_PER_SEGMENT - 1)
+          / SAMPLE_LOG_RECORDS_PER_SEGMENT * SAMPLE_LOG_RECORDS_PER_SEGMENT
+      : 0;
+  middle = oldest + (record_count - oldest) / 2;
+  last_hour = record_count > SECONDS_IN_AN_HOUR / TELEMETRY_FREQUENCY_IN_SECONDS
+      ? record_count - SECONDS_IN_AN_HOUR / TELEMETRY_FREQUENCY_IN_SECONDS
+      : 0;
+  last_hour = max(last_hour, oldest);
+
+  // Recovering the state, as after a reboot.
+  before = host_sd_stats;
+  double start = get_time_in_us();
+
+  if (sample_log_init() != 0)
+  {
+    return 1;
+  }
+
+  printf("init (recovery): %.0f us\n", get_time_in_us() - start);
+  print_sd_operations("init", &before, 1);
+
+  is_complete = replay("from the start", 0, oldest, record_count) && is_complete;
+  is_complete = replay(
+                    "from the middle",
+                    START_TIME + (time_t)middle * TELEMETRY_FREQUENCY_IN_SECONDS,
+                    middle,
+                    record_count)
+      && is_complete;
+  is_complete = replay(
+                    "from the last hour",
+                    START_TIME + (time_t)last_hour * TELEMETRY_FREQUENCY_IN_SECONDS,
+                    last_hour,
+                    record_count)
+      && is_complete;
+
+  (void)system((std::string("rm -rf ") + root).c_str());
+
+  return is_complete ? 0 : 1;
+}
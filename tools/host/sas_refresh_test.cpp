@@ -0,0 +1,235 @@
+/*
+ * Checks that no telemetry sample is lost across reconnections when SAS tokens expire quickly, with
+ * the outbox (src/outbox.h) and the telemetry queue (src/telemetryQueue.h, on a host directory).
+ *
+ * The main loop does what Azure_IoT_PnP_Template.cpp does with QoS 0 telemetry: one sample per
+ * pass, posted to the outbox if connected and it has room (stored in the queue otherwise), then the
+ * telemetry the outbox returns stored in the queue, then one queued message forwarded. Reconnecting
+ * follows mqtt_client_deinit_function (Azure_IoT_Central_ESP32.ino): the outbox is only cleared
+ * when the connection dropped, not when refreshing the SAS token. The MQTT client stand-in also
+ * fails some publishes while connected.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/sas_refresh_test tools/host/sas_refresh_test.cpp \
+ *         Azure_IoT_Central_ESP32/src/outbox.cpp Azure_IoT_Central_ESP32/src/telemetryQueue.cpp \
+ *         Azure_IoT_Central_ESP32/src/crc32.cpp -lpthread
+ *     /tmp/sas_refresh_test [samples] [token_lifetime_passes]
+ *
+ * Defaults: 3000 samples, a SAS token lasting 40 passes. Exits with 0 if every sample arrived.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/outbox.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryQueue.h"
+
+#define PASS_DURATION_IN_MS 10
+#define RECONNECTION_PASSES 5
+#define REFRESH_THRESHOLD_PASSES 3
+#define CONNECTION_DROP_INTERVAL 4 // Every this many reconnections is a dropped connection.
+#define PUBLISH_FAILURE_PERCENT 2
+#define DRAIN_PASS_LIMIT 100000
+
+#define TELEMETRY_TOPIC "devices/sas-refresh-test/messages/events/"
+
+static std::atomic<bool> is_client_connected(false);
+static std::mutex received_mutex;
+static std::vector<uint32_t> received_counts;
+static uint32_t returned_count = 0;
+
+static int publish(const char* topic, az_span payload, int qos)
+{
+  char text[32];
+  unsigned long sequence;
+
+  (void)topic;
+  (void)qos;
+
+  if (!is_client_connected.load() || esp_random() % 100 < PUBLISH_FAILURE_PERCENT)
+  {
+    return -1;
+  }
+
+  snprintf(text, sizeof(text), "%.*s", (int)az_span_size(payload), (char*)az_span_ptr(payload));
+
+  if (sscanf(text, "{\"seq\":%lu}", &sequence) == 1)
+  {
+    std::lock_guard<std::mutex> lock(received_mutex);
+
+    if (sequence < received_counts.size())
+    {
+      received_counts[sequence]++;
+    }
+  }
+
+  return 0;
+}
+
+static void on_returned(const char* topic, az_span payload, int qos)
+{
+  (void)topic;
+  (void)qos;
+
+  returned_count++;
+
+  if (telemetry_queue_push(payload) != 0)
+  {
+    fprintf(stderr, "Failed storing returned telemetry.\n");
+  }
+}
+
+static void send_sample(uint32_t sequence, bool is_connected)
+{
+  char text[32];
+  int length = snprintf(text, sizeof(text), "{\"seq\":%u}", sequence);
+  az_span payload = az_span_create((uint8_t*)text, length);
+
+  if (is_connected && outbox_has_room(outbox_class_telemetry)
+      && outbox_post(outbox_class_telemetry, AZ_SPAN_FROM_STR(TELEMETRY_TOPIC), payload, 0) > 0)
+  {
+    return;
+  }
+
+  if (telemetry_queue_push(payload) != 0)
+  {
+    fprintf(stderr, "Failed storing telemetry %u.\n", sequence);
+  }
+}
+
+static void forward_queued_sample()
+{
+  uint8_t buffer[64];
+  az_span message;
+
+  if (telemetry_queue_is_empty() || !outbox_has_room(outbox_class_telemetry)
+      || telemetry_queue_peek(AZ_SPAN_FROM_BUFFER(buffer), &message) != 0)
+  {
+    return;
+  }
+
+  if (outbox_post(outbox_class_telemetry, AZ_SPAN_FROM_STR(TELEMETRY_TOPIC), message, 0) > 0)
+  {
+    (void)telemetry_queue_pop();
+  }
+}
+
+static uint32_t get_received_sample_count()
+{
+  std::lock_guard<std::mutex> lock(received_mutex);
+  uint32_t count = 0;
+
+  for (uint32_t received : received_counts)
+  {
+    count += received > 0 ? 1 : 0;
+  }
+
+  return count;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t sample_count = argc > 1 ? (uint32_t)atol(argv[1]) : 3000;
+  uint32_t token_lifetime = argc > 2 ? (uint32_t)atol(argv[2]) : 40;
+  char root[] = "/tmp/sas_refresh_test_XXXXXX";
+  bool is_connected = false;
+  uint32_t token_expiration = 0;
+  uint32_t reconnection_pass = 0;
+  uint32_t reconnection_count = 0;
+  uint32_t pass = 0;
+  uint32_t lost_count = 0;
+  uint32_t duplicate_count = 0;
+
+  if (mkdtemp(root) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  host_sd_root = root;
+  received_counts.assign(sample_count, 0);
+
+  if (telemetry_queue_init() != 0 || outbox_init(publish, NULL) != 0)
+  {
+    return 1;
+  }
+
+  for (pass = 0; pass < sample_count + DRAIN_PASS_LIMIT; pass++)
+  {
+    host_millis += PASS_DURATION_IN_MS;
+
+    if (!is_connected && pass >= reconnection_pass)
+    {
+      is_client_connected.store(true);
+      outbox_set_connected(true);
+      is_connected = true;
+      token_expiration = pass + token_lifetime;
+    }
+    else if (is_connected && pass >= token_expiration - REFRESH_THRESHOLD_PASSES)
+    {
+      bool is_dropped = ++reconnection_count % CONNECTION_DROP_INTERVAL == 0;
+
+      // As mqtt_client_deinit_function does, the client stopping meanwhile.
+      is_client_connected.store(false);
+      outbox_set_connected(false);
+      outbox_release_client();
+
+      if (is_dropped)
+      {
+        outbox_clear();
+      }
+
+      is_connected = false;
+      reconnection_pass = pass + RECONNECTION_PASSES;
+    }
+
+    if (pass < sample_count)
+    {
+      send_sample(pass, is_connected);
+    }
+
+    (void)outbox_take_returned(on_returned);
+
+    if (is_connected)
+    {
+      forward_queued_sample();
+    }
+
+    // Lets the publishing task run.
+    vTaskDelay(1);
+
+    if (pass >= sample_count && get_received_sample_count() == sample_count)
+    {
+      break;
+    }
+  }
+
+  for (uint32_t i = 0; i < sample_count; i++)
+  {
+    lost_count += received_counts[i] == 0 ? 1 : 0;
+    duplicate_count += received_counts[i] > 1 ? received_counts[i] - 1 : 0;
+  }
+
+  printf(
+      "%u samples, %u reconnections (every %u passes), %u returned by the outbox: %u lost, %u "
+      "duplicated, %u still queued.\n",
+      sample_count,
+      reconnection_count,
+      token_lifetime,
+      returned_count,
+      lost_count,
+      duplicate_count,
+      telemetry_queue_get_pending_size());
+
+  (void)system((std::string("rm -rf ") + root).c_str());
+
+  return lost_count == 0 ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+/*
+ * The part of the Arduino ESP32 core (and of FreeRTOS) used by the modules in src/.
+ *
+ * Time is simulated: `millis` and `micros` return `host_millis`, which the harness advances. Tasks
+ * are threads, and critical sections and mutexes are std::mutex.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <type_traits>
+
+inline unsigned long host_millis = 0;
+
+inline unsigned long millis() { return host_millis; }
+inline unsigned long micros() { return host_millis * 1000UL; }
+
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type min(T a, U b)
+{
+  return a < b ? a : b;
+}
+
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type max(T a, U b)
+{
+  return a > b ? a : b;
+}
+
+inline std::mt19937 host_random(1);
+
+inline uint32_t esp_random() { return (uint32_t)host_random(); }
+
+// What `ESP.getEfuseMac()` returns, set by simulations of several devices before each call.
+inline uint64_t host_efuse_mac = 0x0000A1B2C3D4E5F6ULL;
+
+struct HostEspClass
+{
+  uint64_t getEfuseMac() { return host_efuse_mac; }
+};
+
+inline HostEspClass ESP;
+
+/* --- FreeRTOS --- */
+
+typedef struct
+{
+  std::recursive_mutex mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED \
+  {                                  \
+  }
+#define taskENTER_CRITICAL(mux) (mux)->mutex.lock()
+#define taskEXIT_CRITICAL(mux) (mux)->mutex.unlock()
+
+#define tskIDLE_PRIORITY 0
+#define portMAX_DELAY 0xFFFFFFFFu
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) (ms)
+
+typedef uint32_t TickType_t;
+
+struct HostTask
+{
+  std::mutex mutex;
+  std::condition_variable notified;
+  uint32_t notification_count = 0;
+};
+
+typedef HostTask* TaskHandle_t;
+typedef std::recursive_mutex* SemaphoreHandle_t;
+
+inline thread_local HostTask* host_current_task = NULL;
+
+inline int xTaskCreate(
+    void (*function)(void*),
+    const char* name,
+    uint32_t stack_size,
+    void* parameters,
+    int priority,
+    TaskHandle_t* handle)
+{
+  HostTask* task = new HostTask();
+
+  (void)name;
+  (void)stack_size;
+  (void)priority;
+
+  if (handle != NULL)
+  {
+    *handle = task;
+  }
+
+  std::thread([=]() {
+    host_current_task = task;
+    function(parameters);
+  }).detach();
+
+  return pdPASS;
+}
+
+inline void xTaskNotifyGive(TaskHandle_t task)
+{
+  std::lock_guard<std::mutex> lock(task->mutex);
+  task->notification_count++;
+  task->notified.notify_one();
+}
+
+inline uint32_t ulTaskNotifyTake(int clear_on_exit, TickType_t timeout)
+{
+  HostTask* task = host_current_task;
+  std::unique_lock<std::mutex> lock(task->mutex);
+  uint32_t count;
+
+  if (timeout == portMAX_DELAY)
+  {
+    task->notified.wait(lock, [task]() { return task->notification_count > 0; });
+  }
+  else
+  {
+    task->notified.wait_for(lock, std::chrono::milliseconds(timeout), [task]() {
+      return task->notification_count > 0;
+    });
+  }
+
+  count = task->notification_count;
+
+  if (count > 0)
+  {
+    task->notification_count = clear_on_exit ? 0 : count - 1;
+  }
+
+  return count;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::recursive_mutex(); }
+
+inline int xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout)
+{
+  (void)timeout;
+  semaphore->lock();
+  return pdTRUE;
+}
+
+inline int xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  semaphore->unlock();
+  return pdTRUE;
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,153 @@
+/*
+ * The part of the Arduino ESP32 SD library used by the modules in src/, backed by the files of a
+ * host directory, `host_sd_root`, standing for the root of the card.
+ *
+ * Opening modes are those of the ESP32 core (FILE_WRITE truncates, FILE_APPEND always writes at
+ * the end). Every operation is counted in `host_sd_stats`.
+ */
+
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+#define CARD_NONE 0
+#define CARD_SD 2
+
+inline std::string host_sd_root = "/tmp/host_sd";
+
+// Set to false to simulate a card missing.
+inline bool host_sd_card_present = true;
+
+struct HostSdStats
+{
+  uint32_t open_count;
+  uint32_t seek_count;
+  uint32_t read_count;
+  uint64_t read_bytes;
+  uint32_t write_count;
+  uint64_t write_bytes;
+  uint32_t flush_count;
+};
+
+inline HostSdStats host_sd_stats = {};
+
+class File
+{
+public:
+  File() {}
+  explicit File(FILE* file) : file(file, fclose) {}
+
+  operator bool() const { return file != nullptr; }
+
+  bool seek(uint32_t position)
+  {
+    host_sd_stats.seek_count++;
+    return fseek(file.get(), (long)position, SEEK_SET) == 0;
+  }
+
+  size_t position() { return (size_t)ftell(file.get()); }
+
+  size_t size()
+  {
+    long position = ftell(file.get());
+    long size;
+
+    fseek(file.get(), 0, SEEK_END);
+    size = ftell(file.get());
+    fseek(file.get(), position, SEEK_SET);
+
+    return (size_t)size;
+  }
+
+  int read(uint8_t* buffer, size_t size)
+  {
+    size_t read = fread(buffer, 1, size, file.get());
+
+    host_sd_stats.read_count++;
+    host_sd_stats.read_bytes += read;
+
+    // Switching from reading to writing needs a positioning call.
+    fseek(file.get(), 0, SEEK_CUR);
+
+    return (int)read;
+  }
+
+  size_t write(const uint8_t* buffer, size_t size)
+  {
+    size_t written = fwrite(buffer, 1, size, file.get());
+
+    host_sd_stats.write_count++;
+    host_sd_stats.write_bytes += written;
+    fseek(file.get(), 0, SEEK_CUR);
+
+    return written;
+  }
+
+  size_t write(uint8_t byte) { return write(&byte, 1); }
+
+  size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+
+  void flush()
+  {
+    host_sd_stats.flush_count++;
+    fflush(file.get());
+  }
+
+  void close() { file.reset(); }
+
+private:
+  std::shared_ptr<FILE> file;
+};
+
+class HostSdClass
+{
+public:
+  uint8_t cardType() { return host_sd_card_present ? CARD_SD : CARD_NONE; }
+
+  bool exists(const char* path)
+  {
+    struct stat status;
+    return stat(host_path(path).c_str(), &status) == 0;
+  }
+
+  bool mkdir(const char* path) { return ::mkdir(host_path(path).c_str(), 0777) == 0; }
+
+  bool remove(const char* path) { return ::remove(host_path(path).c_str()) == 0; }
+
+  bool rmdir(const char* path) { return ::rmdir(host_path(path).c_str()) == 0; }
+
+  File open(const char* path, const char* mode = FILE_READ)
+  {
+    std::string binary_mode = std::string(mode) + "b";
+
+    host_sd_stats.open_count++;
+
+    if (!host_sd_card_present)
+    {
+      return File();
+    }
+
+    FILE* file = fopen(host_path(path).c_str(), binary_mode.c_str());
+
+    return file != NULL ? File(file) : File();
+  }
+
+private:
+  static std::string host_path(const char* path) { return host_sd_root + path; }
+};
+
+inline HostSdClass SD;
+
+#endif // HOST_SD_H
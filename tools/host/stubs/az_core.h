@@ -0,0 +1,270 @@
+/*
+ * The part of az_core.h (Azure SDK for C) used by the modules in src/, with the same semantics for
+ * valid arguments (the SDK's precondition checks are left out).
+ */
+
+#ifndef HOST_AZ_CORE_H
+#define HOST_AZ_CORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef int32_t az_result;
+
+#define AZ_OK 0
+#define AZ_ERROR_ARG ((az_result)0x80000001)
+#define AZ_ERROR_NOT_ENOUGH_SPACE ((az_result)0x80000005)
+
+inline bool az_result_failed(az_result result) { return result < 0; }
+inline bool az_result_succeeded(az_result result) { return result >= 0; }
+
+typedef struct
+{
+  struct
+  {
+    uint8_t* ptr;
+    int32_t size;
+  } _internal;
+} az_span;
+
+#define AZ_SPAN_EMPTY      \
+  (az_span)                \
+  {                        \
+    {                      \
+      NULL, 0              \
+    }                      \
+  }
+#define AZ_SPAN_LITERAL_FROM_STR(STRING_LITERAL)                         \
+  {                                                                      \
+    {                                                                    \
+      (uint8_t*)(STRING_LITERAL), (int32_t)(sizeof(STRING_LITERAL) - 1) \
+    }                                                                    \
+  }
+#define AZ_SPAN_FROM_STR(STRING_LITERAL) (az_span) AZ_SPAN_LITERAL_FROM_STR(STRING_LITERAL)
+#define AZ_SPAN_FROM_BUFFER(BYTE_BUFFER) \
+  az_span_create((uint8_t*)(BYTE_BUFFER), (int32_t)sizeof(BYTE_BUFFER))
+
+inline uint8_t* az_span_ptr(az_span span) { return span._internal.ptr; }
+inline int32_t az_span_size(az_span span) { return span._internal.size; }
+
+inline az_span az_span_create(uint8_t* ptr, int32_t size)
+{
+  az_span span = { { ptr, size } };
+  return span;
+}
+
+inline az_span az_span_create_from_str(char* str)
+{
+  return az_span_create((uint8_t*)str, (int32_t)strlen(str));
+}
+
+inline az_span az_span_slice(az_span span, int32_t start_index, int32_t end_index)
+{
+  return az_span_create(az_span_ptr(span) + start_index, end_index - start_index);
+}
+
+inline az_span az_span_slice_to_end(az_span span, int32_t start_index)
+{
+  return az_span_slice(span, start_index, az_span_size(span));
+}
+
+inline az_span az_span_copy(az_span destination, az_span source)
+{
+  if (az_span_size(source) > 0)
+  {
+    memmove(az_span_ptr(destination), az_span_ptr(source), (size_t)az_span_size(source));
+  }
+
+  return az_span_slice_to_end(destination, az_span_size(source));
+}
+
+inline az_span az_span_copy_u8(az_span destination, uint8_t byte)
+{
+  az_span_ptr(destination)[0] = byte;
+  return az_span_slice_to_end(destination, 1);
+}
+
+inline bool az_span_is_content_equal(az_span span1, az_span span2)
+{
+  return az_span_size(span1) == az_span_size(span2)
+      && (az_span_size(span1) == 0
+          || memcmp(az_span_ptr(span1), az_span_ptr(span2), (size_t)az_span_size(span1)) == 0);
+}
+
+inline int32_t az_span_find(az_span source, az_span target)
+{
+  for (int32_t i = 0; i + az_span_size(target) <= az_span_size(source); i++)
+  {
+    if (az_span_is_content_equal(
+            az_span_slice(source, i, i + az_span_size(target)), target))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+inline az_result az_span_i32toa(az_span destination, int32_t source, az_span* out_span)
+{
+  char text[12];
+  int length = snprintf(text, sizeof(text), "%ld", (long)source);
+
+  if (length > az_span_size(destination))
+  {
+    return AZ_ERROR_NOT_ENOUGH_SPACE;
+  }
+
+  *out_span = az_span_copy(destination, az_span_create((uint8_t*)text, length));
+  return AZ_OK;
+}
+
+/*
+ * JSON writer, for the single-chunk destinations the modules use. Like the SDK, nothing is written
+ * for a token that does not fit, and numbers out of its range are refused.
+ */
+typedef struct
+{
+  bool unused;
+} az_json_writer_options;
+
+typedef struct
+{
+  struct
+  {
+    az_span destination;
+    int32_t bytes_written;
+    bool need_comma;
+  } _internal;
+} az_json_writer;
+
+inline az_result az_json_writer_init(
+    az_json_writer* writer,
+    az_span destination,
+    az_json_writer_options const* options)
+{
+  (void)options;
+  writer->_internal.destination = destination;
+  writer->_internal.bytes_written = 0;
+  writer->_internal.need_comma = false;
+  return AZ_OK;
+}
+
+inline az_span az_json_writer_get_bytes_used_in_destination(az_json_writer const* writer)
+{
+  return az_span_slice(writer->_internal.destination, 0, writer->_internal.bytes_written);
+}
+
+// Writes `text`, after a comma if it is a value following another one.
+inline az_result _az_json_writer_append(
+    az_json_writer* writer,
+    const char* text,
+    int32_t length,
+    bool is_value,
+    bool need_comma_after)
+{
+  bool comma = is_value && writer->_internal.need_comma;
+  int32_t required = length + (comma ? 1 : 0);
+  uint8_t* destination = az_span_ptr(writer->_internal.destination);
+
+  if (writer->_internal.bytes_written + required > az_span_size(writer->_internal.destination))
+  {
+    return AZ_ERROR_NOT_ENOUGH_SPACE;
+  }
+
+  if (comma)
+  {
+    destination[writer->_internal.bytes_written++] = ',';
+  }
+
+  memcpy(destination + writer->_internal.bytes_written, text, length);
+  writer->_internal.bytes_written += length;
+  writer->_internal.need_comma = need_comma_after;
+  return AZ_OK;
+}
+
+inline az_result az_json_writer_append_begin_object(az_json_writer* writer)
+{
+  return _az_json_writer_append(writer, "{", 1, true, false);
+}
+
+inline az_result az_json_writer_append_end_object(az_json_writer* writer)
+{
+  return _az_json_writer_append(writer, "}", 1, false, true);
+}
+
+inline az_result az_json_writer_append_property_name(az_json_writer* writer, az_span name)
+{
+  char text[256];
+  int length = snprintf(
+      text, sizeof(text), "\"%.*s\":", (int)az_span_size(name), (char*)az_span_ptr(name));
+
+  return length < (int)sizeof(text) ? _az_json_writer_append(writer, text, length, true, false)
+                                    : AZ_ERROR_NOT_ENOUGH_SPACE;
+}
+
+inline az_result az_json_writer_append_string(az_json_writer* writer, az_span value)
+{
+  char text[256];
+  int length = snprintf(
+      text, sizeof(text), "\"%.*s\"", (int)az_span_size(value), (char*)az_span_ptr(value));
+
+  return length < (int)sizeof(text) ? _az_json_writer_append(writer, text, length, true, true)
+                                    : AZ_ERROR_NOT_ENOUGH_SPACE;
+}
+
+inline az_result az_json_writer_append_int32(az_json_writer* writer, int32_t value)
+{
+  char text[12];
+  int length = snprintf(text, sizeof(text), "%ld", (long)value);
+
+  return _az_json_writer_append(writer, text, length, true, true);
+}
+
+inline az_result az_json_writer_append_bool(az_json_writer* writer, bool value)
+{
+  return value ? _az_json_writer_append(writer, "true", 4, true, true)
+               : _az_json_writer_append(writer, "false", 5, true, true);
+}
+
+// Trailing zeros of the fractional digits are left out, as az_span_dtoa does.
+inline az_result az_json_writer_append_double(
+    az_json_writer* writer,
+    double value,
+    int32_t fractional_digits)
+{
+  char text[64];
+  int length;
+
+  // The SDK only takes finite values within the range where doubles are exact integers.
+  if (value != value || value > 9007199254740991.0 || value < -9007199254740991.0)
+  {
+    return AZ_ERROR_ARG;
+  }
+
+  length = snprintf(text, sizeof(text), "%.*f", (int)fractional_digits, value);
+
+  if (length >= (int)sizeof(text))
+  {
+    return AZ_ERROR_NOT_ENOUGH_SPACE;
+  }
+
+  if (strchr(text, '.') != NULL)
+  {
+    while (text[length - 1] == '0')
+    {
+      length--;
+    }
+
+    if (text[length - 1] == '.')
+    {
+      length--;
+    }
+  }
+
+  return _az_json_writer_append(writer, text, length, true, true);
+}
+
+#endif // HOST_AZ_CORE_H
@@ -0,0 +1,43 @@
+/*
+ * Forced into every translation unit of the host harnesses (g++ -include), in place of the
+ * sketch's AzureIoT.h: the modules in src/ only need its logging macros (and a couple of
+ * constants), while the real header pulls in the Azure SDK for C.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// AzureIoT.h (included by the modules as "../AzureIoT.h") then has nothing left to declare.
+#define AZURE_IOT_H
+
+static const uint8_t null_terminator = '\0';
+#define INDEFINITE_TIME ((time_t)-1)
+
+// Logs of the modules go to the standard error, so they do not mix with the harness results.
+inline bool host_log_enabled = false;
+
+#define LogInfo(...)                                \
+  do                                                \
+  {                                                 \
+    if (host_log_enabled)                           \
+    {                                               \
+      fprintf(stderr, "INFO: " __VA_ARGS__);        \
+      fputc('\n', stderr);                          \
+    }                                               \
+  } while (0)
+
+#define LogError(...)                               \
+  do                                                \
+  {                                                 \
+    if (host_log_enabled)                           \
+    {                                               \
+      fprintf(stderr, "ERROR: " __VA_ARGS__);       \
+      fputc('\n', stderr);                          \
+    }                                               \
+  } while (0)
+
+#endif // HOST_H
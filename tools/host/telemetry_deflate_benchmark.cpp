@@ -0,0 +1,538 @@
+/*
+ * Measures telemetry_deflate (src/telemetryDeflate.h) on packed telemetry messages: compression
+ * ratio, CPU time and peak heap, next to zlib at its default settings and at a 4 KB window.
+ *
+ * Samples are written and packed as Azure_IoT_PnP_Template.cpp does (src/telemetryPayload.h and
+ * src/telemetryPacker.h): with TELEMETRY_COMPRESSION_ENABLED (packing "compressed", the default)
+ * for as long as the message compresses with telemetry_deflate to a message unit less its
+ * overhead, otherwise (packing "raw") up to that size uncompressed. They come from recorded
+ * meter data, in the CSV that tools/decode_historian.py writes for the historian field files of a
+ * device (every field file of a month decoded into the same CSV), or from a synthetic meter: values
+ * drifting around plant-like levels and energy counters that only go up. Every message is inflated
+ * back with zlib and compared.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free \
+ *         -o /tmp/telemetry_deflate_benchmark tools/host/telemetry_deflate_benchmark.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryDeflate.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryPacker.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryPayload.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryFields.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryGlobalVariables.cpp -lz
+ *     /tmp/telemetry_deflate_benchmark [samples | historian.csv] [keyframe_interval] [raw]
+ *
+ * Defaults: 5000 synthetic samples, every frame a keyframe (TELEMETRY_KEYFRAME_INTERVAL 1), packed
+ * until compressed to a message unit.
+ * Exits with 0 if every message inflated back to the original.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include <zlib.h>
+
+#include <Arduino.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/telemetryDeflate.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryFields.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryPacker.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryPayload.h"
+
+// As in Azure_IoT_PnP_Template.cpp and iot_configs.h.
+#define TELEMETRY_MESSAGE_MAX_SIZE (IOT_HUB_MESSAGE_UNIT_SIZE - IOT_HUB_MESSAGE_UNIT_OVERHEAD)
+#define TELEMETRY_PART_MAX_SIZE TELEMETRY_MESSAGE_MAX_SIZE
+#define TELEMETRY_PACKER_BUFFER_SIZE (3 * IOT_HUB_MESSAGE_UNIT_SIZE)
+#define TELEMETRY_FREQUENCY_IN_SECONDS 2
+
+// Each compression is timed this many times over, for the CPU clock resolution.
+#define TIMING_REPEAT_COUNT 20
+
+#define SYNTHETIC_START_TIME 1709251200 // 2024-03-01T00:00:00Z
+
+/*
+ * Heap use of the code linked in (telemetryDeflate.cpp included), through the --wrap of the
+ * allocation functions. zlib, a shared library, is counted through its own allocation functions.
+ */
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __real_calloc(size_t count, size_t size);
+extern "C" void* __real_realloc(void* pointer, size_t size);
+extern "C" void __real_free(void* pointer);
+
+typedef struct heap_counter_t_struct
+{
+  size_t current;
+  size_t peak;
+  bool is_enabled;
+} heap_counter_t;
+
+static heap_counter_t wrapped_heap = { 0, 0, false };
+static heap_counter_t zlib_heap = { 0, 0, true };
+
+// Every block is preceded by its size, so freeing it can be counted.
+#define BLOCK_HEADER_SIZE 16
+
+static void* count_allocation(heap_counter_t* counter, void* block, size_t size)
+{
+  if (block == NULL)
+  {
+    return NULL;
+  }
+
+  *(size_t*)block = size;
+  counter->current += size;
+
+  if (counter->current > counter->peak)
+  {
+    counter->peak = counter->current;
+  }
+
+  return (uint8_t*)block + BLOCK_HEADER_SIZE;
+}
+
+static void count_free(heap_counter_t* counter, void* pointer)
+{
+  uint8_t* block = (uint8_t*)pointer - BLOCK_HEADER_SIZE;
+
+  counter->current -= *(size_t*)block;
+  __real_free(block);
+}
+
+extern "C" void* __wrap_malloc(size_t size)
+{
+  return wrapped_heap.is_enabled
+      ? count_allocation(&wrapped_heap, __real_malloc(size + BLOCK_HEADER_SIZE), size)
+      : __real_malloc(size);
+}
+
+extern "C" void* __wrap_calloc(size_t count, size_t size)
+{
+  return wrapped_heap.is_enabled
+      ? count_allocation(
+          &wrapped_heap, __real_calloc(1, count * size + BLOCK_HEADER_SIZE), count * size)
+      : __real_calloc(count, size);
+}
+
+extern "C" void* __wrap_realloc(void* pointer, size_t size)
+{
+  // Only used outside of the measurements (by the C++ library).
+  return __real_realloc(pointer, size);
+}
+
+extern "C" void __wrap_free(void* pointer)
+{
+  if (pointer != NULL && wrapped_heap.is_enabled)
+  {
+    count_free(&wrapped_heap, pointer);
+  }
+  else
+  {
+    __real_free(pointer);
+  }
+}
+
+static voidpf zlib_alloc(voidpf opaque, uInt count, uInt size)
+{
+  return count_allocation(
+      (heap_counter_t*)opaque, malloc(count * size + BLOCK_HEADER_SIZE), count * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf pointer)
+{
+  count_free((heap_counter_t*)opaque, pointer);
+}
+
+typedef struct compressor_result_t_struct
+{
+  const char* name;
+  uint64_t compressed_bytes;
+  double cpu_time_in_us;
+  size_t peak_heap;
+  uint32_t failure_count;
+} compressor_result_t;
+
+static double get_cpu_time_in_us()
+{
+  struct timespec time;
+
+  (void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+static bool inflates_to(const uint8_t* compressed, size_t compressed_length, az_span message)
+{
+  std::vector<uint8_t> inflated(az_span_size(message) + 1);
+  uLongf inflated_length = inflated.size();
+
+  return uncompress(inflated.data(), &inflated_length, compressed, compressed_length) == Z_OK
+      && inflated_length == (uLongf)az_span_size(message)
+      && memcmp(inflated.data(), az_span_ptr(message), inflated_length) == 0;
+}
+
+static size_t zlib_deflate(az_span message, uint8_t* output, size_t output_size, int window_bits)
+{
+  z_stream stream;
+  size_t length = 0;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.zalloc = zlib_alloc;
+  stream.zfree = zlib_free;
+  stream.opaque = &zlib_heap;
+
+  // memLevel 1 for the small window, the least RAM zlib can do with.
+  if (deflateInit2(
+          &stream,
+          Z_DEFAULT_COMPRESSION,
+          Z_DEFLATED,
+          window_bits,
+          window_bits < MAX_WBITS ? 1 : 8,
+          Z_DEFAULT_STRATEGY)
+      != Z_OK)
+  {
+    return 0;
+  }
+
+  stream.next_in = az_span_ptr(message);
+  stream.avail_in = az_span_size(message);
+  stream.next_out = output;
+  stream.avail_out = output_size;
+
+  if (deflate(&stream, Z_FINISH) == Z_STREAM_END)
+  {
+    length = stream.total_out;
+  }
+
+  (void)deflateEnd(&stream);
+  return length;
+}
+
+static std::vector<compressor_result_t> results = {
+  { "telemetry_deflate", 0, 0, 0, 0 },
+  { "zlib 32 KB window", 0, 0, 0, 0 },
+  { "zlib 4 KB window", 0, 0, 0, 0 },
+};
+static uint64_t raw_bytes = 0;
+static uint32_t message_count = 0;
+
+static void compress_message(az_span message)
+{
+  uint8_t output[TELEMETRY_PACKER_BUFFER_SIZE];
+
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    compressor_result_t* result = &results[i];
+    size_t length = 0;
+    double start = get_cpu_time_in_us();
+
+    for (int repeat = 0; repeat < TIMING_REPEAT_COUNT; repeat++)
+    {
+      if (i == 0)
+      {
+        wrapped_heap.current = 0;
+        wrapped_heap.peak = 0;
+        wrapped_heap.is_enabled = true;
+
+        if (telemetry_deflate(message, AZ_SPAN_FROM_BUFFER(output), &length) != 0)
+        {
+          length = 0;
+        }
+
+        wrapped_heap.is_enabled = false;
+        result->peak_heap = max(result->peak_heap, wrapped_heap.peak);
+      }
+      else
+      {
+        zlib_heap.current = 0;
+        zlib_heap.peak = 0;
+        length = zlib_deflate(message, output, sizeof(output), i == 1 ? MAX_WBITS : 12);
+        result->peak_heap = max(result->peak_heap, zlib_heap.peak);
+      }
+    }
+
+    result->cpu_time_in_us += (get_cpu_time_in_us() - start) / TIMING_REPEAT_COUNT;
+
+    if (length == 0 || !inflates_to(output, length, message))
+    {
+      result->failure_count++;
+      length = az_span_size(message);
+    }
+
+    result->compressed_bytes += length;
+  }
+
+  raw_bytes += az_span_size(message);
+  message_count++;
+}
+
+/*
+ * As is_packed_telemetry_within_unit in Azure_IoT_PnP_Template.cpp.
+ */
+static bool is_packed_message_within_unit(telemetry_packer_t* packer)
+{
+  static uint8_t compression_buffer[TELEMETRY_MESSAGE_MAX_SIZE];
+  az_span message = telemetry_packer_get_message(packer);
+  size_t compressed_length;
+
+  return az_span_size(message) <= TELEMETRY_MESSAGE_MAX_SIZE
+      || telemetry_deflate(message, AZ_SPAN_FROM_BUFFER(compression_buffer), &compressed_length)
+      == 0;
+}
+
+static void send_packed_message(telemetry_packer_t* packer)
+{
+  az_span message = telemetry_packer_get_message(packer);
+
+  if (az_span_size(message) > 0)
+  {
+    compress_message(message);
+  }
+
+  telemetry_packer_reset(packer);
+}
+
+/*
+ * Samples read from decode_historian.py output ("field,timestamp,value"), the last value of each
+ * field carried over to the samples where it was not recorded.
+ */
+static bool read_recorded_samples(const char* path, std::vector<std::vector<float>>* samples)
+{
+  std::map<time_t, std::map<int, float>> points;
+  std::vector<float> values(TELEMETRY_FIELD_COUNT, 0);
+  FILE* file = fopen(path, "r");
+  char line[128];
+
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    int field;
+    struct tm date;
+    float value;
+
+    memset(&date, 0, sizeof(date));
+
+    if (sscanf(
+            line,
+            "%d,%d-%d-%dT%d:%d:%dZ,%f",
+            &field,
+            &date.tm_year,
+            &date.tm_mon,
+            &date.tm_mday,
+            &date.tm_hour,
+            &date.tm_min,
+            &date.tm_sec,
+            &value)
+            != 8
+        || field < 0 || field >= TELEMETRY_FIELD_COUNT)
+    {
+      continue;
+    }
+
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    points[timegm(&date)][field] = value;
+  }
+
+  fclose(file);
+
+  for (const auto& point : points)
+  {
+    for (const auto& field : point.second)
+    {
+      values[field.first] = field.second;
+    }
+
+    samples->push_back(values);
+  }
+
+  return !samples->empty();
+}
+
+static void generate_synthetic_samples(uint32_t count, std::vector<std::vector<float>>* samples)
+{
+  std::vector<float> values(TELEMETRY_FIELD_COUNT);
+  std::vector<float> levels(TELEMETRY_FIELD_COUNT);
+
+  for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    switch (telemetry_fields[i].group)
+    {
+      case TELEMETRY_FIELD_GROUP_BASIC:
+        levels[i] = 10.0f + (float)(esp_random() % 400);
+        break;
+      case TELEMETRY_FIELD_GROUP_POWER_QUALITY:
+        levels[i] = 1.0f + (float)(esp_random() % 8);
+        break;
+      default:
+        levels[i] = (float)(esp_random() % 100000);
+        break;
+    }
+
+    values[i] = levels[i];
+  }
+
+  for (uint32_t sample = 0; sample < count; sample++)
+  {
+    for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+    {
+      float noise = ((int32_t)(esp_random() % 2001) - 1000) / 1000.0f;
+
+      if (telemetry_fields[i].group == TELEMETRY_FIELD_GROUP_ENERGY)
+      {
+        // Counters, kWh with 3 decimal places.
+        values[i] += 0.01f + 0.01f * fabsf(noise);
+      }
+      else
+      {
+        // Drifts around its level, about 1% a sample.
+        values[i] += levels[i] * 0.01f * noise + (levels[i] - values[i]) * 0.1f;
+      }
+    }
+
+    samples->push_back(values);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* source = argc > 1 ? argv[1] : "5000";
+  uint32_t keyframe_interval = argc > 2 ? (uint32_t)atol(argv[2]) : 1;
+  bool is_packed_compressed = argc <= 3 || strcmp(argv[3], "raw") != 0;
+  bool is_recorded = strspn(source, "0123456789") != strlen(source);
+  std::vector<std::vector<float>> samples;
+  std::vector<float> reference(TELEMETRY_FIELD_COUNT, NAN);
+  static uint8_t packer_buffer[TELEMETRY_PACKER_BUFFER_SIZE];
+  static uint8_t part_buffer[TELEMETRY_PART_MAX_SIZE];
+  telemetry_packer_t packer;
+
+  if (!is_recorded)
+  {
+    generate_synthetic_samples((uint32_t)atol(source), &samples);
+  }
+  else if (!read_recorded_samples(source, &samples))
+  {
+    fprintf(stderr, "No samples in %s.\n", source);
+    return 1;
+  }
+
+  telemetry_packer_init(
+      &packer,
+      AZ_SPAN_FROM_BUFFER(packer_buffer),
+      is_packed_compressed ? sizeof(packer_buffer) - 1 : TELEMETRY_MESSAGE_MAX_SIZE);
+
+  for (size_t sample = 0; sample < samples.size(); sample++)
+  {
+    telemetry_frame_t frame;
+    telemetry_payload_writer_t writer;
+    time_t now = SYNTHETIC_START_TIME + (time_t)sample * TELEMETRY_FREQUENCY_IN_SECONDS;
+
+    frame.sequence = (uint32_t)sample;
+    frame.is_keyframe = sample % keyframe_interval == 0;
+    frame.fields = 0;
+    frame.com_status = 0;
+    frame.message_units_today = (int32_t)message_count;
+    frame.timestamp = now;
+
+    // As generate_telemetry_payload, values only count as changed if the payload shows it.
+    for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+    {
+      double scale = pow(10, telemetry_fields[i].decimal_places);
+      float value = (float)(round(samples[sample][i] * scale) / scale);
+
+      *telemetry_fields[i].value = samples[sample][i];
+
+      if (frame.is_keyframe || value != reference[i])
+      {
+        frame.fields |= 1ULL << i;
+      }
+
+      reference[i] = value;
+    }
+
+    telemetry_payload_writer_init(&writer, &frame);
+
+    while (!telemetry_payload_is_done(&writer))
+    {
+      az_span part;
+
+      if (telemetry_payload_write_part(&writer, AZ_SPAN_FROM_BUFFER(part_buffer), &part) != 0)
+      {
+        fprintf(stderr, "Failed writing sample %zu.\n", sample);
+        return 1;
+      }
+
+      if (!telemetry_packer_fits(&packer, part))
+      {
+        send_packed_message(&packer);
+      }
+
+      (void)telemetry_packer_add(&packer, part, now);
+
+      if (is_packed_compressed && telemetry_packer_get_sample_count(&packer) > 1
+          && !is_packed_message_within_unit(&packer))
+      {
+        telemetry_packer_remove_last(&packer);
+        send_packed_message(&packer);
+        (void)telemetry_packer_add(&packer, part, now);
+      }
+    }
+  }
+
+  send_packed_message(&packer);
+
+  printf(
+      "%zu %s samples (keyframe every %u, packed %s), %u messages of %.0f bytes on average, %llu "
+      "bytes.\n",
+      samples.size(),
+      is_recorded ? "recorded" : "synthetic",
+      keyframe_interval,
+      is_packed_compressed ? "compressed" : "raw",
+      message_count,
+      message_count > 0 ? (double)raw_bytes / message_count : 0.0,
+      (unsigned long long)raw_bytes);
+
+  for (const compressor_result_t& result : results)
+  {
+    printf(
+        "%-18s: %5.1f%% of the size (%.2fx), %6.1f us CPU per message (%5.1f us per KB), peak "
+        "heap %zu bytes, %u failed\n",
+        result.name,
+        raw_bytes > 0 ? result.compressed_bytes * 100.0 / raw_bytes : 0.0,
+        result.compressed_bytes > 0 ? (double)raw_bytes / result.compressed_bytes : 0.0,
+        message_count > 0 ? result.cpu_time_in_us / message_count : 0.0,
+        raw_bytes > 0 ? result.cpu_time_in_us * 1024 / raw_bytes : 0.0,
+        result.peak_heap,
+        result.failure_count);
+  }
+
+  // Each message uses a message unit, of which the topic and properties take up to the overhead.
+  printf(
+      "telemetry_deflate: %.0f bytes a message on average, %.0f%% of a message unit.\n",
+      message_count > 0 ? (double)results[0].compressed_bytes / message_count : 0.0,
+      message_count > 0
+          ? results[0].compressed_bytes * 100.0 / message_count / IOT_HUB_MESSAGE_UNIT_SIZE
+          : 0.0);
+
+  printf(
+      "telemetry_deflate static state: %zu bytes (hash table).\n",
+      (size_t)TELEMETRY_DEFLATE_HASH_SIZE * sizeof(uint16_t));
+
+  for (const compressor_result_t& result : results)
+  {
+    if (result.failure_count > 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
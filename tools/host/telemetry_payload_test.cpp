@@ -0,0 +1,347 @@
+/*
+ * Checks the telemetry frames written by src/telemetryPayload.h at a given TELEMETRY_PART_MAX_SIZE
+ * (see Azure_IoT_PnP_Template.cpp), small enough that frames have to be split.
+ *
+ * Random frames (fields selected, values, keyframe or not) are written part after part, and every
+ * part parsed back: it must fit in the part size, carry the frame "seq", "keyframe" only in the
+ * first part and "part"/"lastPart" only when the frame is split, in order. Each field selected must
+ * come out exactly once, with its value, and the trailer only once, in the last part.
+ *
+ *     g++ -std=c++17 -O2 -Itools/host/stubs -include tools/host/stubs/host.h \
+ *         -o /tmp/telemetry_payload_test tools/host/telemetry_payload_test.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryPayload.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryFields.cpp \
+ *         Azure_IoT_Central_ESP32/src/telemetryGlobalVariables.cpp
+ *     /tmp/telemetry_payload_test [frames] [part_size...]
+ *
+ * Defaults: 2000 frames at each of 256, 300, 512 and 3840 bytes. Exits with 0 if every check
+ * passed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "../../Azure_IoT_Central_ESP32/src/telemetryDefinitions.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryFields.h"
+#include "../../Azure_IoT_Central_ESP32/src/telemetryPayload.h"
+
+#define PART_MAX_COUNT 64
+
+static uint32_t failure_count = 0;
+
+#define CHECK(condition, ...)                    \
+  do                                             \
+  {                                              \
+    if (!(condition))                            \
+    {                                            \
+      if (failure_count++ < 20)                  \
+      {                                          \
+        fprintf(stderr, "FAILED: " __VA_ARGS__); \
+        fputc('\n', stderr);                     \
+      }                                          \
+    }                                            \
+  } while (0)
+
+/*
+ * Parses a flat JSON object of numbers, booleans and strings without escapes, as the parts are.
+ * Names seen more than once are kept with a "#" suffix, so they can be caught.
+ */
+static bool parse_part(const std::string& text, std::map<std::string, std::string>* properties)
+{
+  size_t i = 1;
+
+  if (text.size() < 2 || text.front() != '{' || text.back() != '}')
+  {
+    return false;
+  }
+
+  while (i < text.size() - 1)
+  {
+    size_t name_end;
+    size_t value_end;
+    std::string name;
+
+    if (text[i] != '"' || (name_end = text.find('"', i + 1)) == std::string::npos
+        || text[name_end + 1] != ':')
+    {
+      return false;
+    }
+
+    name = text.substr(i + 1, name_end - i - 1);
+    i = name_end + 2;
+
+    if (text[i] == '"')
+    {
+      value_end = text.find('"', i + 1) + 1;
+    }
+    else
+    {
+      value_end = text.find_first_of(",}", i);
+    }
+
+    if (value_end == std::string::npos || value_end == 0)
+    {
+      return false;
+    }
+
+    while (properties->count(name) > 0)
+    {
+      name += "#";
+    }
+
+    (*properties)[name] = text.substr(i, value_end - i);
+    i = value_end + (text[value_end] == ',' ? 1 : 0);
+  }
+
+  return true;
+}
+
+static float random_value(int8_t decimal_places)
+{
+  switch (esp_random() % 8)
+  {
+    case 0:
+      // Longest values the SDK writes.
+      return esp_random() % 2 == 0 ? -9.0e15f : 9.0e15f;
+    case 1:
+      return 0;
+    default:
+      return (float)(round(((int32_t)esp_random() % 2000000) / 10.0 * pow(10, decimal_places))
+                     / pow(10, decimal_places));
+  }
+}
+
+static void check_frame(size_t part_size, const telemetry_frame_t* frame)
+{
+  std::vector<uint8_t> buffer(part_size);
+  std::vector<std::map<std::string, std::string>> parts;
+  telemetry_payload_writer_t writer;
+  std::map<std::string, int> field_counts;
+  int trailer_count = 0;
+  char expected[64];
+
+  telemetry_payload_writer_init(&writer, frame);
+
+  while (!telemetry_payload_is_done(&writer) && parts.size() < PART_MAX_COUNT)
+  {
+    az_span part;
+    std::map<std::string, std::string> properties;
+
+    if (telemetry_payload_write_part(
+            &writer, az_span_create(buffer.data(), (int32_t)buffer.size()), &part)
+        != 0)
+    {
+      CHECK(false, "frame %u, part %zu not written.", frame->sequence, parts.size());
+      return;
+    }
+
+    CHECK(
+        az_span_ptr(part) == buffer.data() && (size_t)az_span_size(part) < part_size
+            && buffer[az_span_size(part)] == '\0',
+        "frame %u, part %zu is %d bytes, not null-terminated within %zu.",
+        frame->sequence,
+        parts.size(),
+        (int)az_span_size(part),
+        part_size);
+
+    std::string text((char*)az_span_ptr(part), az_span_size(part));
+
+    if (!parse_part(text, &properties))
+    {
+      CHECK(
+          false,
+          "frame %u, part %zu is not valid: %s",
+          frame->sequence,
+          parts.size(),
+          text.c_str());
+      return;
+    }
+
+    parts.push_back(properties);
+  }
+
+  CHECK(telemetry_payload_is_done(&writer), "frame %u never ends.", frame->sequence);
+
+  snprintf(expected, sizeof(expected), "%u", frame->sequence);
+
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    std::map<std::string, std::string>& properties = parts[i];
+    bool is_last_part = i == parts.size() - 1;
+
+    CHECK(
+        properties[TELEMETRY_PROP_NAME_SEQUENCE] == expected,
+        "frame %u, part %zu has seq %s.",
+        frame->sequence,
+        i,
+        properties[TELEMETRY_PROP_NAME_SEQUENCE].c_str());
+    properties.erase(TELEMETRY_PROP_NAME_SEQUENCE);
+
+    if (i == 0)
+    {
+      CHECK(
+          properties[TELEMETRY_PROP_NAME_KEYFRAME] == (frame->is_keyframe ? "true" : "false"),
+          "frame %u has keyframe %s.",
+          frame->sequence,
+          properties[TELEMETRY_PROP_NAME_KEYFRAME].c_str());
+    }
+    else
+    {
+      CHECK(
+          properties.count(TELEMETRY_PROP_NAME_KEYFRAME) == 0,
+          "frame %u, part %zu has keyframe.",
+          frame->sequence,
+          i);
+    }
+    properties.erase(TELEMETRY_PROP_NAME_KEYFRAME);
+
+    if (parts.size() > 1)
+    {
+      CHECK(
+          properties[TELEMETRY_PROP_NAME_PART] == std::to_string(i)
+              && properties[TELEMETRY_PROP_NAME_LAST_PART] == (is_last_part ? "true" : "false"),
+          "frame %u, part %zu is numbered %s (last %s).",
+          frame->sequence,
+          i,
+          properties[TELEMETRY_PROP_NAME_PART].c_str(),
+          properties[TELEMETRY_PROP_NAME_LAST_PART].c_str());
+    }
+    else
+    {
+      CHECK(
+          properties.count(TELEMETRY_PROP_NAME_PART) == 0
+              && properties.count(TELEMETRY_PROP_NAME_LAST_PART) == 0,
+          "frame %u is numbered while not split.",
+          frame->sequence);
+    }
+    properties.erase(TELEMETRY_PROP_NAME_PART);
+    properties.erase(TELEMETRY_PROP_NAME_LAST_PART);
+
+    if (properties.count(TELEMETRY_PROP_NAME_TIMESTAMP) > 0)
+    {
+      CHECK(is_last_part, "frame %u, part %zu has the trailer.", frame->sequence, i);
+      CHECK(
+          properties[TELEMETRY_PROP_NAME_COM_STATUS] == std::to_string(frame->com_status)
+              && properties[TELEMETRY_PROP_NAME_MESSAGE_UNITS_TODAY]
+                  == std::to_string(frame->message_units_today)
+              && properties[TELEMETRY_PROP_NAME_TIMESTAMP] == "\"2024-02-29T23:59:58.000Z\"",
+          "frame %u has a wrong trailer.",
+          frame->sequence);
+      trailer_count++;
+      properties.erase(TELEMETRY_PROP_NAME_COM_STATUS);
+      properties.erase(TELEMETRY_PROP_NAME_MESSAGE_UNITS_TODAY);
+      properties.erase(TELEMETRY_PROP_NAME_TIMESTAMP);
+    }
+
+    for (const auto& property : properties)
+    {
+      field_counts[property.first]++;
+    }
+  }
+
+  CHECK(trailer_count == 1, "frame %u has %d trailers.", frame->sequence, trailer_count);
+
+  for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+  {
+    const telemetry_field_t* field = &telemetry_fields[i];
+    std::string name((char*)az_span_ptr(field->name), az_span_size(field->name));
+    bool is_selected = (frame->fields & (1ULL << i)) != 0;
+    int count = field_counts[name];
+
+    field_counts.erase(name);
+    CHECK(
+        count == (is_selected ? 1 : 0),
+        "frame %u has %s %d times.",
+        frame->sequence,
+        name.c_str(),
+        count);
+
+    if (is_selected && count == 1)
+    {
+      for (const auto& part : parts)
+      {
+        if (part.count(name) > 0)
+        {
+          double value = atof(part.at(name).c_str());
+
+          CHECK(
+              fabs(value - *field->value) <= 0.5 * pow(10, -field->decimal_places)
+                  || fabs(value - *field->value) <= fabs(*field->value) * 1e-7,
+              "frame %u has %s %s instead of %f.",
+              frame->sequence,
+              name.c_str(),
+              part.at(name).c_str(),
+              *field->value);
+        }
+      }
+    }
+  }
+
+  for (const auto& unknown : field_counts)
+  {
+    CHECK(false, "frame %u has unknown property %s.", frame->sequence, unknown.first.c_str());
+  }
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t frame_count = argc > 1 ? (uint32_t)atol(argv[1]) : 2000;
+  std::vector<size_t> part_sizes = { 256, 300, 512, 3840 };
+
+  if (argc > 2)
+  {
+    part_sizes.clear();
+
+    for (int i = 2; i < argc; i++)
+    {
+      part_sizes.push_back((size_t)atol(argv[i]));
+    }
+  }
+
+  for (size_t part_size : part_sizes)
+  {
+    uint32_t failures_before = failure_count;
+
+    for (uint32_t sequence = 0; sequence < frame_count; sequence++)
+    {
+      telemetry_frame_t frame;
+
+      frame.sequence = sequence;
+      frame.is_keyframe = esp_random() % 4 == 0;
+      frame.com_status = (int32_t)(esp_random() % 3) - 1;
+      frame.message_units_today = (int32_t)(esp_random() % 100000);
+      frame.timestamp = 1709251198; // 2024-02-29T23:59:58Z
+      frame.fields = 0;
+
+      // All the fields, none, or a random selection.
+      for (size_t i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+      {
+        uint32_t selection = sequence % 3;
+
+        if (selection == 0 || (selection == 2 && esp_random() % 2 == 0))
+        {
+          frame.fields |= 1ULL << i;
+        }
+
+        *telemetry_fields[i].value = random_value(telemetry_fields[i].decimal_places);
+      }
+
+      check_frame(part_size, &frame);
+    }
+
+    printf(
+        "part size %4zu: %u frames, %u failures.\n",
+        part_size,
+        frame_count,
+        failure_count - failures_before);
+  }
+
+  return failure_count == 0 ? 0 : 1;
+}